@@ -195,6 +195,24 @@ conf_load_bool (const inifile_record *rec, bool *out,
     }
 }
 
+/* Parse integer option within the specified range
+ */
+static void
+conf_load_int (const inifile_record *rec, int *out, int min, int max)
+{
+    unsigned long l;
+    char          *end;
+
+    l = strtoul(rec->value, &end, 10);
+    if (end == rec->value || *end != '\0' ||
+        l < (unsigned long) min || l > (unsigned long) max) {
+        conf_perror(rec, "usage: %s = %d...%d", rec->variable, min, max);
+        return;
+    }
+
+    *out = (int) l;
+}
+
 /* Parse network address with mask
  */
 static void
@@ -295,6 +313,33 @@ conf_load_from_ini (inifile *ini)
                     if (conf.socket_dir == NULL) {
                         conf_perror(rec, "failed to expand socket_dir path");
                     }
+                } else if (inifile_match_name(rec->variable, "io-threads")) {
+                    conf_load_int(rec, &conf.io_threads,
+                        1, CONF_IO_THREADS_MAX);
+                } else if (inifile_match_name(rec->variable, "warm-devices")) {
+                    conf_load_bool(rec, &conf.warm_devices,
+                        "enable", "disable");
+                } else if (inifile_match_name(rec->variable, "status-cache")) {
+                    conf_load_int(rec, &conf.status_cache, 0, 60000);
+                } else if (inifile_match_name(rec->variable, "preconnect")) {
+                    conf_load_bool(rec, &conf.preconnect, "enable", "disable");
+                } else if (inifile_match_name(rec->variable, "adf-batch")) {
+                    conf_load_int(rec, &conf.adf_batch, 0, 3600);
+                } else if (inifile_match_name(rec->variable,
+                        "emulate-resolutions")) {
+                    conf_load_bool(rec, &conf.emulate_res,
+                        "enable", "disable");
+                } else if (inifile_match_name(rec->variable, "blank-page")) {
+                    conf_load_bool(rec, &conf.blank_skip, "skip", "keep");
+                } else if (inifile_match_name(rec->variable,
+                        "blank-page-ink")) {
+                    conf_load_int(rec, &conf.blank_ink, 0, 10000);
+                } else if (inifile_match_name(rec->variable,
+                        "blank-page-edges")) {
+                    conf_load_int(rec, &conf.blank_edges, 0, 10000);
+                } else if (inifile_match_name(rec->variable,
+                        "blank-page-max-size")) {
+                    conf_load_int(rec, &conf.blank_max_size, 1, 4096);
                 }
             } else if (inifile_match_name(rec->section, "debug")) {
                 if (inifile_match_name(rec->variable, "trace")) {
@@ -307,6 +352,23 @@ conf_load_from_ini (inifile *ini)
                     conf_load_bool(rec, &conf.dbg_enabled, "true", "false");
                 } else if (inifile_match_name(rec->variable, "hexdump")) {
                     conf_load_bool(rec, &conf.dbg_hexdump, "true", "false");
+                } else if (inifile_match_name(rec->variable, "stall")) {
+                    conf_load_int(rec, &conf.dbg_stall, 0, 60000);
+                } else if (inifile_match_name(rec->variable, "clock-warp")) {
+                    conf_load_int(rec, &conf.dbg_clock_warp, 0, 60000);
+                }
+            } else if (inifile_match_name(rec->section, "metrics")) {
+                if (inifile_match_name(rec->variable, "directory")) {
+                    mem_free((char*) conf.metrics_dir);
+                    conf.metrics_dir = conf_expand_path(rec->value);
+                    if (conf.metrics_dir == NULL) {
+                        conf_perror(rec, "failed to expand path");
+                    }
+                } else if (inifile_match_name(rec->variable, "interval")) {
+                    conf_load_int(rec, &conf.metrics_interval, 1, 3600);
+                } else if (inifile_match_name(rec->variable, "sane-option")) {
+                    conf_load_bool(rec, &conf.metrics_option,
+                        "enable", "disable");
                 }
             } else if (inifile_match_name(rec->section, "blacklist")) {
                 conf_blacklist *ent = NULL;
@@ -486,6 +548,7 @@ conf_unload (void)
     conf_blacklist_free();
     mem_free((char*) conf.dbg_trace);
     mem_free((char*) conf.socket_dir);
+    mem_free((char*) conf.metrics_dir);
     conf = conf_init;
 }
 
@@ -0,0 +1,539 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Device capabilities cache ("warm" devices)
+ *
+ * When enabled, capabilities of discovered devices are fetched
+ * in background, one device at a time, and kept here together
+ * with the protocol handler and the endpoint that answered. Then
+ * device_open() takes them from the cache instead of probing the
+ * device over the network. When device is closed, its state is
+ * returned into the cache, so frequently used devices stay warm
+ */
+
+#include "airscan.h"
+
+/* Pause between background probes, in milliseconds
+ */
+#define DEVCACHE_PROBE_PAUSE            1000
+
+/* HTTP timeout of background probe, in milliseconds
+ */
+#define DEVCACHE_PROBE_TIMEOUT          5000
+
+/* Lifetime of the cache entry, in milliseconds
+ */
+#define DEVCACHE_TTL                    (5 * 60 * 1000)
+
+/* devcache_entry represents a cached device state
+ */
+typedef struct {
+    char          *ident;       /* Device ident */
+    ID_PROTO      proto_id;     /* Protocol of the winning endpoint */
+    http_uri      *endpoint;    /* Winning endpoint, as discovered */
+    http_uri      *base_uri;    /* Base URI, after redirects */
+    proto_handler *proto;       /* Protocol handler, with device quirks */
+    devcaps       caps;         /* Parsed device capabilities */
+    timestamp     stored;       /* When entry was stored */
+    ll_node       chain;        /* In devcache_entries */
+} devcache_entry;
+
+/* devcache_pending represents a device, waiting for background probe
+ */
+typedef struct {
+    char    *ident;             /* Device ident */
+    ll_node chain;              /* In devcache_pending_list */
+} devcache_pending;
+
+/* devcache_probe represents a background probe in progress
+ */
+typedef struct {
+    zeroconf_devinfo  *devinfo;  /* Device info */
+    zeroconf_endpoint *endpoint; /* Current endpoint */
+    proto_ctx         ctx;       /* Protocol context */
+    devcaps           caps;      /* Capabilities being decoded */
+} devcache_probe;
+
+/* Static variables
+ *
+ * devcache_entries and statistics are protected by devcache_mutex.
+ * Background probing runs on the primary event loop shard and
+ * its state is protected by the primary shard's mutex
+ */
+static log_ctx         *devcache_log;
+static pthread_mutex_t devcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ll_head         devcache_entries;
+static ll_head         devcache_pending_list;
+static devcache_probe  *devcache_current;
+static eloop_timer     *devcache_timer;
+static http_client     *devcache_http;
+static unsigned int    devcache_hits;
+static unsigned int    devcache_misses;
+static unsigned int    devcache_probes_ok;
+static unsigned int    devcache_probes_failed;
+
+/* Forward declarations
+ */
+static void
+devcache_probe_endpoint (devcache_probe *probe);
+
+static void
+devcache_probe_next (void);
+
+/******************** Cache entries ********************/
+/* Free devcache_entry
+ */
+static void
+devcache_entry_free (devcache_entry *entry)
+{
+    mem_free(entry->ident);
+    http_uri_free(entry->endpoint);
+    http_uri_free(entry->base_uri);
+    if (entry->proto != NULL) {
+        entry->proto->free(entry->proto);
+    }
+    devcaps_cleanup(&entry->caps);
+    mem_free(entry);
+}
+
+/* Lookup entry by ident and unlink it from the cache.
+ * Expired entries are dropped. Must be called under the devcache_mutex
+ */
+static devcache_entry*
+devcache_entry_unlink (const char *ident)
+{
+    ll_node *node;
+
+    for (LL_FOR_EACH(node, &devcache_entries)) {
+        devcache_entry *entry = OUTER_STRUCT(node, devcache_entry, chain);
+
+        if (!strcmp(entry->ident, ident)) {
+            ll_del(&entry->chain);
+
+            if (timestamp_now() - entry->stored > DEVCACHE_TTL) {
+                log_debug(devcache_log, "%s: entry expired", ident);
+                devcache_entry_free(entry);
+                return NULL;
+            }
+
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Check if cache contains a fresh entry for the device
+ */
+static bool
+devcache_entry_fresh (const char *ident)
+{
+    ll_node *node;
+    bool    fresh = false;
+
+    pthread_mutex_lock(&devcache_mutex);
+    for (LL_FOR_EACH(node, &devcache_entries)) {
+        devcache_entry *entry = OUTER_STRUCT(node, devcache_entry, chain);
+
+        if (!strcmp(entry->ident, ident)) {
+            fresh = timestamp_now() - entry->stored <= DEVCACHE_TTL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&devcache_mutex);
+
+    return fresh;
+}
+
+/* Store the device state into the cache
+ *
+ * On success, the cache takes ownership of the protocol handler,
+ * both URIs and content of caps (which will be zeroed) and
+ * returns true. If cache is disabled, nothing happens and false
+ * is returned
+ */
+bool
+devcache_put (const char *ident, ID_PROTO proto_id, proto_handler *proto,
+        const http_uri *endpoint, const http_uri *base_uri, devcaps *caps)
+{
+    devcache_entry *entry, *old;
+
+    if (!conf.warm_devices) {
+        return false;
+    }
+
+    entry = mem_new(devcache_entry, 1);
+    entry->ident = str_dup(ident);
+    entry->proto_id = proto_id;
+    entry->endpoint = http_uri_clone(endpoint);
+    entry->base_uri = http_uri_clone(base_uri);
+    entry->proto = proto;
+    entry->caps = *caps;
+    entry->stored = timestamp_now();
+
+    memset(caps, 0, sizeof(*caps));
+    devcaps_init(caps);
+
+    log_debug(devcache_log, "%s: stored (%s)", ident,
+        http_uri_str(entry->base_uri));
+
+    pthread_mutex_lock(&devcache_mutex);
+    old = devcache_entry_unlink(ident);
+    ll_push_end(&devcache_entries, &entry->chain);
+    pthread_mutex_unlock(&devcache_mutex);
+
+    if (old != NULL) {
+        devcache_entry_free(old);
+    }
+
+    return true;
+}
+
+/* Take the device state from the cache
+ *
+ * On hit, the matching endpoint of the devinfo is returned and
+ * caller becomes owner of the protocol handler, base URI and
+ * capabilities, returned via output parameters. On miss, NULL
+ * is returned
+ */
+zeroconf_endpoint*
+devcache_take (const zeroconf_devinfo *devinfo, proto_handler **proto,
+        http_uri **base_uri, devcaps *caps)
+{
+    devcache_entry    *entry;
+    zeroconf_endpoint *endpoint = NULL;
+    unsigned int      hits, misses;
+
+    if (!conf.warm_devices) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&devcache_mutex);
+    entry = devcache_entry_unlink(devinfo->ident);
+
+    /* Endpoint must still be announced for the device */
+    if (entry != NULL) {
+        for (endpoint = devinfo->endpoints; endpoint != NULL;
+             endpoint = endpoint->next) {
+            if (endpoint->proto == entry->proto_id &&
+                http_uri_equal(endpoint->uri, entry->endpoint)) {
+                break;
+            }
+        }
+    }
+
+    if (endpoint != NULL) {
+        devcache_hits ++;
+    } else {
+        devcache_misses ++;
+    }
+
+    hits = devcache_hits;
+    misses = devcache_misses;
+    pthread_mutex_unlock(&devcache_mutex);
+
+    if (endpoint == NULL) {
+        log_debug(devcache_log, "%s: miss%s (hits=%u misses=%u)",
+            devinfo->ident, entry != NULL ? ", endpoint gone" : "",
+            hits, misses);
+        if (entry != NULL) {
+            devcache_entry_free(entry);
+        }
+        return NULL;
+    }
+
+    log_debug(devcache_log, "%s: hit (hits=%u misses=%u)",
+        devinfo->ident, hits, misses);
+
+    *proto = entry->proto;
+    *base_uri = entry->base_uri;
+    *caps = entry->caps;
+
+    entry->proto = NULL;
+    entry->base_uri = NULL;
+    memset(&entry->caps, 0, sizeof(entry->caps));
+    devcache_entry_free(entry);
+
+    return endpoint;
+}
+
+/******************** Background probing ********************/
+/* Finish the current probe and schedule the next one
+ */
+static void
+devcache_probe_done (bool ok)
+{
+    devcache_probe *probe = devcache_current;
+
+    if (ok) {
+        devcache_probes_ok ++;
+    } else {
+        log_debug(devcache_log, "%s: probe failed", probe->devinfo->ident);
+        devcache_probes_failed ++;
+    }
+
+    if (probe->ctx.proto != NULL) {
+        probe->ctx.proto->free(probe->ctx.proto);
+    }
+    http_uri_free(probe->ctx.base_uri);
+    http_uri_free(probe->ctx.base_uri_nozone);
+    devcaps_cleanup(&probe->caps);
+    zeroconf_devinfo_free(probe->devinfo);
+    mem_free(probe);
+
+    devcache_current = NULL;
+    devcache_probe_next();
+}
+
+/* Background probe HTTP callback
+ */
+static void
+devcache_probe_callback (void *ptr, http_query *q)
+{
+    devcache_probe *probe = devcache_current;
+    error          err;
+
+    (void) ptr;
+
+    probe->ctx.query = q;
+    err = http_query_error(q);
+    if (err == NULL) {
+        err = probe->ctx.proto->devcaps_decode(&probe->ctx, &probe->caps);
+    }
+    probe->ctx.query = NULL;
+
+    /* In a case of redirection, let device_open() to handle it */
+    if (err == NULL &&
+        !http_uri_equal(http_query_uri(q), http_query_real_uri(q))) {
+        err = ERROR("redirected");
+    }
+
+    if (err != NULL) {
+        log_debug(devcache_log, "%s: %s: %s", probe->devinfo->ident,
+            http_uri_str(probe->endpoint->uri), ESTRING(err));
+
+        devcaps_reset(&probe->caps);
+        probe->endpoint = probe->endpoint->next;
+        if (probe->endpoint != NULL) {
+            devcache_probe_endpoint(probe);
+        } else {
+            devcache_probe_done(false);
+        }
+
+        return;
+    }
+
+    if (devcache_put(probe->devinfo->ident, probe->endpoint->proto,
+            probe->ctx.proto, probe->endpoint->uri, probe->ctx.base_uri,
+            &probe->caps)) {
+        probe->ctx.proto = NULL;
+    }
+
+    devcache_probe_done(true);
+}
+
+/* Probe the current endpoint of the probe
+ */
+static void
+devcache_probe_endpoint (devcache_probe *probe)
+{
+    zeroconf_endpoint *endpoint = probe->endpoint;
+    http_query        *q;
+
+    if (probe->ctx.proto != NULL) {
+        probe->ctx.proto->free(probe->ctx.proto);
+    }
+
+    probe->ctx.proto = proto_handler_new(endpoint->proto);
+    log_assert(devcache_log, probe->ctx.proto != NULL);
+
+    http_uri_free(probe->ctx.base_uri);
+    probe->ctx.base_uri = http_uri_clone(endpoint->uri);
+
+    http_uri_free(probe->ctx.base_uri_nozone);
+    probe->ctx.base_uri_nozone = http_uri_clone(endpoint->uri);
+    http_uri_strip_zone_suffux(probe->ctx.base_uri_nozone);
+
+    q = probe->ctx.proto->devcaps_query(&probe->ctx);
+    http_query_timeout(q, DEVCACHE_PROBE_TIMEOUT);
+    http_query_submit(q, devcache_probe_callback);
+}
+
+/* Start probing of the next pending device, if any
+ */
+static void
+devcache_probe_start (void)
+{
+    ll_node          *node;
+    zeroconf_devinfo *devinfo = NULL;
+
+    while (devinfo == NULL &&
+           (node = ll_pop_beg(&devcache_pending_list)) != NULL) {
+        devcache_pending *pending;
+
+        pending = OUTER_STRUCT(node, devcache_pending, chain);
+        if (!devcache_entry_fresh(pending->ident)) {
+            devinfo = zeroconf_devinfo_lookup(pending->ident);
+        }
+
+        mem_free(pending->ident);
+        mem_free(pending);
+    }
+
+    if (devinfo == NULL) {
+        return;
+    }
+
+    log_debug(devcache_log, "%s: probing", devinfo->ident);
+
+    devcache_current = mem_new(devcache_probe, 1);
+    devcache_current->devinfo = devinfo;
+    devcache_current->endpoint = devinfo->endpoints;
+    devcache_current->ctx.log = devcache_log;
+    devcache_current->ctx.http = devcache_http;
+    devcache_current->ctx.devcaps = &devcache_current->caps;
+    devcaps_init(&devcache_current->caps);
+
+    devcache_probe_endpoint(devcache_current);
+}
+
+/* Probe timer callback
+ */
+static void
+devcache_timer_callback (void *unused)
+{
+    (void) unused;
+
+    devcache_timer = NULL;
+    devcache_probe_start();
+}
+
+/* Schedule the next probe, rate-limited
+ */
+static void
+devcache_probe_next (void)
+{
+    if (devcache_current == NULL && devcache_timer == NULL &&
+        !ll_empty(&devcache_pending_list)) {
+        devcache_timer = eloop_timer_new(DEVCACHE_PROBE_PAUSE,
+            devcache_timer_callback, NULL);
+    }
+}
+
+/* Request background probing of the listed devices
+ *
+ * Must be called under the event loop mutex
+ */
+void
+devcache_prewarm (const SANE_Device **dev_list)
+{
+    int i;
+
+    if (!conf.warm_devices || devcache_http == NULL) {
+        return;
+    }
+
+    for (i = 0; dev_list[i] != NULL; i ++) {
+        const char       *ident = dev_list[i]->name;
+        ll_node          *node;
+        devcache_pending *pending;
+
+        for (LL_FOR_EACH(node, &devcache_pending_list)) {
+            pending = OUTER_STRUCT(node, devcache_pending, chain);
+            if (!strcmp(pending->ident, ident)) {
+                break;
+            }
+        }
+
+        if (node == NULL && !devcache_entry_fresh(ident)) {
+            pending = mem_new(devcache_pending, 1);
+            pending->ident = str_dup(ident);
+            ll_push_end(&devcache_pending_list, &pending->chain);
+        }
+    }
+
+    devcache_probe_next();
+}
+
+/* Start/stop background probing. Probing starts on demand,
+ * from devcache_prewarm(), so only stop is handled here
+ */
+static void
+devcache_start_stop (bool start)
+{
+    ll_node *node;
+
+    if (start) {
+        return;
+    }
+
+    if (devcache_timer != NULL) {
+        eloop_timer_cancel(devcache_timer);
+        devcache_timer = NULL;
+    }
+
+    while ((node = ll_pop_beg(&devcache_pending_list)) != NULL) {
+        devcache_pending *pending;
+
+        pending = OUTER_STRUCT(node, devcache_pending, chain);
+        mem_free(pending->ident);
+        mem_free(pending);
+    }
+
+    http_client_cancel(devcache_http);
+    if (devcache_current != NULL) {
+        devcache_probe_done(false);
+    }
+}
+
+/******************** Initialization/cleanup ********************/
+/* Initialize device capabilities cache
+ */
+SANE_Status
+devcache_init (void)
+{
+    ll_init(&devcache_entries);
+    ll_init(&devcache_pending_list);
+
+    if (conf.warm_devices) {
+        devcache_log = log_ctx_new("devcache", NULL);
+        devcache_http = http_client_new(devcache_log, NULL);
+        eloop_add_start_stop_callback(devcache_start_stop);
+    }
+
+    return SANE_STATUS_GOOD;
+}
+
+/* Cleanup device capabilities cache
+ */
+void
+devcache_cleanup (void)
+{
+    ll_node *node;
+
+    if (devcache_log == NULL) {
+        return;
+    }
+
+    log_debug(devcache_log, "hits=%u misses=%u probes: ok=%u failed=%u",
+        devcache_hits, devcache_misses,
+        devcache_probes_ok, devcache_probes_failed);
+
+    while ((node = ll_pop_beg(&devcache_entries)) != NULL) {
+        devcache_entry_free(OUTER_STRUCT(node, devcache_entry, chain));
+    }
+
+    devcache_hits = devcache_misses = 0;
+    devcache_probes_ok = devcache_probes_failed = 0;
+
+    http_client_free(devcache_http);
+    devcache_http = NULL;
+
+    log_ctx_free(devcache_log);
+    devcache_log = NULL;
+}
+
+/* vim:ts=8:sw=4:et
+ */
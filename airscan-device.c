@@ -10,6 +10,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 /******************** Constants ********************/
@@ -28,6 +29,21 @@
  */
 #define DEVICE_HTTP_TIMEOUT_CANCELED_OP 10000
 
+/* In the ADF batch mode, how often to poll device status,
+ * while waiting for ADF reload, in milliseconds
+ */
+#define DEVICE_BATCH_POLL_INTERVAL      1000
+
+/* Size of the image strip, post-processed by the worker pool
+ * as a single task, in bytes
+ */
+#define DEVICE_STRIP_BYTES              (256 * 1024)
+
+/* Images smaller than this are post-processed inline, without
+ * the worker pool, in bytes
+ */
+#define DEVICE_STRIP_MIN_IMAGE          (16 * 1024 * 1024)
+
 /******************** Device management ********************/
 /* Device flags
  */
@@ -70,6 +86,8 @@ enum {
  *     |    |   finished   |     | finished         |          |
  *     |    V              |     |                  |          |
  *     |  CLEANUP          |     |                  |          |
+ *     |    |  ADF batch: job ended with empty ADF; while   |  |
+ *     |    |  waiting for reload, state is SCANNING again  |  |
  *     |    |              |     |                  |          |
  *     |    V              V     V                  V          |
  *     ---DONE<--------------------------------------          |
@@ -93,6 +111,31 @@ typedef enum {
     DEVICE_STM_CLOSED
 } DEVICE_STM_STATE;
 
+/* Lock statistics. Updated while lock is held, so doesn't
+ * need any additional synchronization
+ */
+typedef struct {
+    uint64_t             count;       /* Count of acquisitions */
+    uint64_t             contended;   /* Count of acquisitions with wait */
+    int64_t              wait_ns;     /* Total wait time */
+    int64_t              wait_max_ns; /* Max wait time */
+    int64_t              hold_ns;     /* Total hold time */
+    int64_t              hold_max_ns; /* Max hold time */
+    int64_t              locked_at;   /* When lock was acquired */
+} device_lock_stats;
+
+/* Strip of image lines, decoded in advance and post-processed
+ * (24 to 8 resampling and filters) by the worker pool
+ */
+typedef struct {
+    worker_task          task;        /* Post-processing task */
+    device               *dev;        /* Owning device */
+    SANE_Byte            *buf;        /* Lines, read_strip_stride bytes each */
+    SANE_Int             first;       /* Number of the first line */
+    SANE_Int             lines;       /* Count of lines in the strip */
+    bool                 failed;      /* Decoding failed after lines */
+} device_strip;
+
 /* Device descriptor
  */
 struct device {
@@ -102,6 +145,7 @@ struct device {
     unsigned int         flags;                /* Device flags */
     devopt               opt;                  /* Device options */
     int                  checking_http_status; /* HTTP status before CHECK_STATUS */
+    eloop_shard          *shard;               /* Event loop shard */
 
     /* State machinery */
     DEVICE_STM_STATE     stm_state;         /* Device state */
@@ -110,18 +154,33 @@ struct device {
     http_query           *stm_cancel_query; /* CANCEL query */
     bool                 stm_cancel_sent;   /* Cancel was sent to device */
     eloop_timer          *stm_timer;        /* Delay timer */
-    struct timespec      stm_last_fail_time;/* Last failed sane_start() time */
+    timestamp            stm_last_fail_time;/* Last failed sane_start() time */
+    eloop_timer          *stm_retry_timer;  /* sane_start() retry pause */
+    timestamp            stm_cancel_time;   /* When cancel was requested */
+    timestamp            stm_batch_deadline;/* ADF reload wait deadline */
 
     /* Protocol handling */
     proto_ctx            proto_ctx;        /* Protocol handler context */
 
     /* I/O handling (AVAHI and HTTP) */
     zeroconf_endpoint    *endpoint_current; /* Current endpoint to probe */
+    timestamp            probe_time;        /* When probing was started */
 
     /* Job status */
     SANE_Status          job_status;          /* Job completion status */
     SANE_Word            job_skip_x;          /* How much pixels to skip, */
     SANE_Word            job_skip_y;          /*    from left and top */
+    devopt_region        job_win;             /* Window, requested from
+                                                 the device */
+
+    /* Regions, cut from a single platen scan */
+    SANE_Byte            *regions_page;       /* Decoded bounding box */
+    SANE_Parameters      regions_page_params; /* Its parameters */
+    SANE_Parameters      regions_saved_params;/* Saved dev->opt.params */
+    image_window         regions[DEVOPT_REGIONS_MAX]; /* In pixels */
+    int                  regions_num;         /* Count of regions */
+    int                  regions_next;        /* Next region to return */
+    bool                 regions_cancelled;   /* Cancelled between frames */
 
     /* Image decoders */
     image_decoder        *decoders[NUM_ID_FORMAT]; /* Decoders by format */
@@ -141,7 +200,48 @@ struct device {
     SANE_Int             read_skip_bytes;    /* How many bytes to skip at line
                                                 beginning */
     bool                 read_24_to_8;       /* Resample 24 to 8 bits */
+    filter_downscale     *read_downscale;    /* Emulated resolution scaler */
+    SANE_Byte            *read_src_buf;      /* Downscaler input line */
+    SANE_Int             read_src_skip;      /* Bytes to skip at input
+                                                line beginning */
+    filter_pagestat      *read_pagestat;     /* Page statistics */
+    SANE_Byte            *read_page;         /* Pre-decoded page, if any */
+    device_strip         *read_strips;       /* Ring of strips, if used */
+    int                  read_strips_num;    /* Ring size */
+    int                  read_strips_busy;   /* Count of filled strips */
+    int                  read_strip_head;    /* Strip being consumed */
+    int                  read_strip_pos;     /* Line within head strip */
+    SANE_Int             read_strip_lines;   /* Lines per strip */
+    size_t               read_strip_stride;  /* Bytes per strip line */
+    bool                 read_strip_resample;/* Workers do 24 to 8 */
+    SANE_Int             read_strip_next;    /* Next line to decode */
+    bool                 read_strip_failed;  /* Decoding failed */
     filter               *read_filters;      /* Chain of image filters */
+    timestamp            read_start_time;    /* When sane_start() called */
+    int64_t              read_decode_ns;     /* Time spent for decoding */
+
+    /* Read lock. Protects read_queue and job_status against the
+     * event loop thread, so device_read() doesn't need the shard's
+     * mutex, while images are available in the queue.
+     *
+     * read_image and read_line_XXX are owned by the reader and
+     * not touched by the event loop thread at all
+     *
+     * Lock order: device's shard mutex, then read_lock
+     */
+    pthread_mutex_t      read_lock;          /* The lock */
+    device_lock_stats    read_lock_stats;    /* Its statistics */
+
+    /* Metrics. All NULL, if metrics are disabled */
+    char                 *metric_labels;     /* Labels, identifying device */
+    metric               *metric_pages;      /* Pages received */
+    metric               *metric_bytes;      /* Bytes received */
+    metric               *metric_queue;      /* read_queue depth */
+    metric               *metric_pixels;     /* Pixels decoded */
+    metric               *metric_decode_sec; /* Time spent for decoding */
+    metric               *metric_decode_mpps;/* Last page decode MPixel/s */
+    metric               *metric_cancel;     /* Cancel latency */
+    metric               *metric_probe;      /* Probe time */
 };
 
 /* Static variables
@@ -168,6 +268,12 @@ device_scanner_capabilities_callback (void *ptr, http_query *q);
 static void
 device_probe_endpoint (device *dev, zeroconf_endpoint *endpoint);
 
+static bool
+device_probe_cached (device *dev);
+
+static void
+device_probe_done (device *dev, error err);
+
 static void
 device_job_set_status (device *dev, SANE_Status status);
 
@@ -186,16 +292,115 @@ device_stm_op_callback (void *ptr, http_query *q);
 static void
 device_stm_cancel_event_callback (void *data);
 
+static void
+device_stm_start_scan (device *dev);
+
+static void
+device_job_reset (device *dev);
+
+static void
+device_stm_batch_timer_callback (void *data);
+
 static void
 device_read_filters_setup (device *dev);
 
 static void
 device_read_filters_cleanup (device *dev);
 
+static void
+device_read_lock (device *dev);
+
+static void
+device_read_unlock (device *dev);
+
+static int64_t
+device_read_lock_now (void);
+
+static void
+device_read_lock_stats_dump (device *dev);
+
+static bool
+device_read_queue_empty (device *dev);
+
+static SANE_Status
+device_read_wait (device *dev, http_data **image);
+
+static SANE_Status
+device_read_next (device *dev, http_data *image);
+
+static SANE_Status
+device_read_predecode (device *dev);
+
+static bool
+device_read_page_is_blank (device *dev);
+
+static void
+device_read_image_cleanup (device *dev);
+
+static void
+device_read_strips_setup (device *dev, size_t line_capacity);
+
+static void
+device_read_strips_cleanup (device *dev);
+
+static void
+device_regions_reset (device *dev);
+
 static void
 device_management_start_stop (bool start);
 
 /******************** Device table management ********************/
+/* Create device metrics
+ */
+static void
+device_metrics_init (device *dev)
+{
+    const char *l;
+
+    dev->metric_labels = metric_label(str_new(), "device", dev->devinfo->name);
+    l = dev->metric_labels;
+
+    dev->metric_pages = metric_get(METRIC_COUNTER,
+        "airscan_pages_received_total", "Pages received from device", l);
+    dev->metric_bytes = metric_get(METRIC_COUNTER,
+        "airscan_bytes_received_total", "Image bytes received from device", l);
+    dev->metric_queue = metric_get(METRIC_GAUGE,
+        "airscan_read_queue_depth", "Received images, not read yet", l);
+    dev->metric_pixels = metric_get(METRIC_COUNTER,
+        "airscan_decoded_pixels_total", "Pixels decoded", l);
+    dev->metric_decode_sec = metric_get(METRIC_COUNTER,
+        "airscan_decode_seconds_total", "Time spent for image decoding", l);
+    dev->metric_decode_mpps = metric_get(METRIC_GAUGE,
+        "airscan_decode_mpixels_per_second",
+        "Decoding speed of the last page, MPixel/s", l);
+    dev->metric_cancel = metric_get(METRIC_HISTOGRAM,
+        "airscan_cancel_latency_seconds",
+        "Time from cancel request till the end of job", l);
+    dev->metric_probe = metric_get(METRIC_HISTOGRAM,
+        "airscan_probe_seconds", "Time to probe device capabilities", l);
+}
+
+/* Count HTTP event, related to the protocol operation
+ */
+static void
+device_metric_op_inc (device *dev, const char *name, const char *help,
+        PROTO_OP op)
+{
+    char   *labels;
+    metric *m;
+
+    if (dev->metric_pages == NULL) {
+        return; /* Metrics are disabled */
+    }
+
+    labels = str_dup(dev->metric_labels);
+    labels = metric_label(labels, "op", proto_op_name(op));
+    m = metric_get(METRIC_COUNTER, name, help, labels);
+    mem_free(labels);
+
+    metric_add(m, 1);
+}
+
 /* Create a device.
  *
  * May fail. At this case, NULL will be returned and status will be set
@@ -210,6 +415,7 @@ device_new (zeroconf_devinfo *devinfo)
 
     dev->devinfo = devinfo;
     dev->log = log_ctx_new(dev->devinfo->name, NULL);
+    dev->shard = eloop_shard_pick();
 
     log_debug(dev->log, "device created");
 
@@ -224,6 +430,9 @@ device_new (zeroconf_devinfo *devinfo)
 
     dev->read_pollable = pollable_new();
     dev->read_queue = http_data_queue_new();
+    pthread_mutex_init(&dev->read_lock, NULL);
+
+    device_metrics_init(dev);
 
     /* Add to the table */
     device_table = ptr_array_append(device_table, dev);
@@ -232,17 +441,23 @@ device_new (zeroconf_devinfo *devinfo)
 }
 
 /* Destroy a device
+ *
+ * Must be called without the device's shard mutex held
  */
 static void
 device_free (device *dev, const char *log_msg)
 {
-    int i;
+    eloop_shard *shard = dev->shard;
+    int         i;
 
     /* Remove device from table */
     log_debug(dev->log, "removed from device table");
+    eloop_mutex_lock();
     ptr_array_del(device_table, ptr_array_find(device_table, dev));
+    eloop_mutex_unlock();
 
     /* Stop all pending I/O activity */
+    eloop_shard_lock(shard);
     device_http_cancel(dev);
 
     if (dev->stm_cancel_event != NULL) {
@@ -261,7 +476,7 @@ device_free (device *dev, const char *log_msg)
     http_client_free(dev->proto_ctx.http);
     http_uri_free(dev->proto_ctx.base_uri);
     http_uri_free(dev->proto_ctx.base_uri_nozone);
-    mem_free((char*) dev->proto_ctx.location);
+    arena_free(dev->proto_ctx.arena);
 
     pthread_cond_destroy(&dev->stm_cond);
 
@@ -275,8 +490,12 @@ device_free (device *dev, const char *log_msg)
 
     http_data_queue_free(dev->read_queue);
     pollable_free(dev->read_pollable);
+    mem_free(dev->regions_page);
     device_read_filters_cleanup(dev);
 
+    device_read_lock_stats_dump(dev);
+    pthread_mutex_destroy(&dev->read_lock);
+
     log_debug(dev->log, "device destroyed");
     if (log_msg != NULL) {
         log_debug(dev->log, "%s", log_msg);
@@ -284,7 +503,11 @@ device_free (device *dev, const char *log_msg)
 
     log_ctx_free(dev->log);
     zeroconf_devinfo_free(dev->devinfo);
+    mem_free(dev->metric_labels);
     mem_free(dev);
+
+    eloop_shard_unlock(shard);
+    eloop_shard_release(shard);
 }
 
 /* Start probing. Called via eloop_call
@@ -307,8 +530,13 @@ device_io_start (device *dev)
         return SANE_STATUS_NO_MEM;
     }
 
+    dev->probe_time = timestamp_now();
+    if (device_probe_cached(dev)) {
+        return SANE_STATUS_GOOD;
+    }
+
     device_stm_state_set(dev, DEVICE_STM_PROBING);
-    eloop_call(device_start_probing, dev);
+    eloop_call_shard(dev->shard, device_start_probing, dev);
 
     return SANE_STATUS_GOOD;
 }
@@ -395,6 +623,17 @@ device_proto_devcaps_decode (device *dev, devcaps *caps)
     return dev->proto_ctx.proto->devcaps_decode(&dev->proto_ctx, caps);
 }
 
+/* Establish connection for the next operation in advance,
+ * while the current one is in progress
+ */
+static void
+device_proto_preconnect (device *dev)
+{
+    if (conf.preconnect) {
+        http_client_preconnect(dev->proto_ctx.http, dev->proto_ctx.base_uri);
+    }
+}
+
 /* http_query_onrxhdr() callback
  */
 static void
@@ -404,6 +643,11 @@ device_proto_op_onrxhdr (void *p, http_query *q)
 
     if (dev->proto_ctx.op == PROTO_OP_LOAD && !dev->stm_cancel_sent) {
         http_query_timeout(q, -1);
+
+        /* Image is coming, next LOAD follows it */
+        if (http_query_status(q) == HTTP_STATUS_OK) {
+            device_proto_preconnect(dev);
+        }
     }
 }
 
@@ -453,7 +697,20 @@ device_proto_op_submit (device *dev, PROTO_OP op,
         proto_op_name(op), dev->proto_ctx.failed_attempt);
     dev->proto_ctx.op = op;
 
+    if (op == dev->proto_ctx.failed_op && dev->proto_ctx.failed_attempt > 0) {
+        device_metric_op_inc(dev, "airscan_http_retries_total",
+            "Operations, retried after failure", op);
+    }
+
     q = func(&dev->proto_ctx);
+    if (q == NULL) {
+        /* Protocol handler answers without query (see precheck_query) */
+        log_debug(dev->log, "%s: answered without query", proto_op_name(op));
+        dev->proto_ctx.query = NULL;
+        callback(dev, NULL);
+        return;
+    }
+
     http_query_timeout(q, timeout);
     if (op == PROTO_OP_LOAD) {
         http_query_onrxhdr(q, device_proto_op_onrxhdr);
@@ -461,6 +718,11 @@ device_proto_op_submit (device *dev, PROTO_OP op,
 
     http_query_submit(q, callback);
     dev->proto_ctx.query = q;
+
+    /* PRECHECK is followed by SCAN, and SCAN by LOAD */
+    if (op == PROTO_OP_PRECHECK || op == PROTO_OP_SCAN) {
+        device_proto_preconnect(dev);
+    }
 }
 
 /* Dummy decode for PROTO_OP_CANCEL and PROTO_OP_CLEANUP
@@ -509,6 +771,11 @@ device_proto_op_decode (device *dev, PROTO_OP op)
 
         dev->proto_ctx.failed_op = op;
         dev->proto_ctx.failed_http_status = http_status;
+
+        if (http_status == HTTP_STATUS_SERVICE_UNAVAILABLE) {
+            device_metric_op_inc(dev, "airscan_http_503_total",
+                "Operations, failed with HTTP 503", op);
+        }
     }
 
     if (op == PROTO_OP_CHECK) {
@@ -576,30 +843,15 @@ device_probe_endpoint (device *dev, zeroconf_endpoint *endpoint)
     device_proto_devcaps_submit (dev, device_scanner_capabilities_callback);
 }
 
-/* Scanner capabilities fetch callback
+/* Setup device options and image decoders, once device
+ * capabilities are known
  */
 static void
-device_scanner_capabilities_callback (void *ptr, http_query *q)
+device_caps_setup (device *dev)
 {
-    error        err   = NULL;
-    device       *dev = ptr;
     int          i;
     unsigned int formats;
 
-    /* Check request status */
-    err = http_query_error(q);
-    if (err != NULL) {
-        err = eloop_eprintf("scanner capabilities query: %s", ESTRING(err));
-        goto DONE;
-    }
-
-    /* Parse XML response */
-    err = device_proto_devcaps_decode (dev, &dev->opt.caps);
-    if (err != NULL) {
-        err = eloop_eprintf("scanner capabilities: %s", err);
-        goto DONE;
-    }
-
     devcaps_dump(dev->log, &dev->opt.caps);
     devopt_set_defaults(&dev->opt);
 
@@ -635,6 +887,77 @@ device_scanner_capabilities_callback (void *ptr, http_query *q)
             log_debug(dev->log, "new decoder: %s", id_format_short_name(i));
         }
     }
+}
+
+/* Initialize device from the device capabilities cache, if possible.
+ * Returns true on success
+ */
+static bool
+device_probe_cached (device *dev)
+{
+    zeroconf_endpoint *endpoint;
+    proto_handler     *proto;
+    http_uri          *uri;
+
+    endpoint = devcache_take(dev->devinfo, &proto, &uri, &dev->opt.caps);
+    if (endpoint == NULL) {
+        return false;
+    }
+
+    dev->proto_ctx.proto = proto;
+    dev->endpoint_current = endpoint;
+    device_proto_set_base_uri(dev, uri);
+
+    log_debug(dev->log, "using cached capabilities, protocol \"%s\"",
+        proto->name);
+
+    device_caps_setup(dev);
+    device_probe_done(dev, NULL);
+
+    return true;
+}
+
+/* Return device state into the device capabilities cache,
+ * when device is closed
+ */
+static void
+device_probe_uncache (device *dev)
+{
+    if (dev->proto_ctx.proto == NULL || dev->endpoint_current == NULL ||
+        dev->stm_state == DEVICE_STM_PROBING_FAILED) {
+        return;
+    }
+
+    if (devcache_put(dev->devinfo->ident, dev->endpoint_current->proto,
+            dev->proto_ctx.proto, dev->endpoint_current->uri,
+            dev->proto_ctx.base_uri, &dev->opt.caps)) {
+        dev->proto_ctx.proto = NULL;
+    }
+}
+
+/* Scanner capabilities fetch callback
+ */
+static void
+device_scanner_capabilities_callback (void *ptr, http_query *q)
+{
+    error        err   = NULL;
+    device       *dev = ptr;
+
+    /* Check request status */
+    err = http_query_error(q);
+    if (err != NULL) {
+        err = eloop_eprintf("scanner capabilities query: %s", ESTRING(err));
+        goto DONE;
+    }
+
+    /* Parse XML response */
+    err = device_proto_devcaps_decode (dev, &dev->opt.caps);
+    if (err != NULL) {
+        err = eloop_eprintf("scanner capabilities: %s", err);
+        goto DONE;
+    }
+
+    device_caps_setup(dev);
 
     /* Update endpoint address in case of HTTP redirection */
     if (!http_uri_equal(http_query_uri(q), http_query_real_uri(q))) {
@@ -673,13 +996,27 @@ DONE:
         if (dev->endpoint_current != NULL &&
             dev->endpoint_current->next != NULL) {
             device_probe_endpoint(dev, dev->endpoint_current->next);
-        } else {
-            device_stm_state_set(dev, DEVICE_STM_PROBING_FAILED);
+            return;
         }
+    }
+
+    device_probe_done(dev, err);
+}
+
+/* Finish device probing
+ */
+static void
+device_probe_done (device *dev, error err)
+{
+    if (err != NULL) {
+        device_stm_state_set(dev, DEVICE_STM_PROBING_FAILED);
     } else {
         device_stm_state_set(dev, DEVICE_STM_IDLE);
         http_client_onerror(dev->proto_ctx.http, device_http_onerror);
     }
+
+    metric_observe(dev->metric_probe,
+        (timestamp_now() - dev->probe_time) / 1000.0);
 }
 
 /******************** Scan state machinery ********************/
@@ -740,6 +1077,12 @@ device_stm_state_set (device *dev, DEVICE_STM_STATE state)
 
         if (!device_stm_state_working(dev)) {
             pollable_signal(dev->read_pollable);
+
+            if (dev->stm_cancel_time != 0) {
+                metric_observe(dev->metric_cancel,
+                    (timestamp_now() - dev->stm_cancel_time) / 1000.0);
+                dev->stm_cancel_time = 0;
+            }
         }
     }
 }
@@ -813,6 +1156,16 @@ device_stm_cancel_event_callback (void *data)
     device *dev = data;
 
     log_debug(dev->log, "cancel processing started");
+
+    /* Waiting for ADF reload in the batch mode? Just stop waiting */
+    if (dev->stm_batch_deadline != 0) {
+        device_http_cancel(dev);
+        dev->stm_batch_deadline = 0;
+        device_job_set_status(dev, SANE_STATUS_CANCELLED);
+        device_stm_state_set(dev, DEVICE_STM_DONE);
+        return;
+    }
+
     if (!device_stm_cancel_perform(dev, SANE_STATUS_CANCELLED)) {
         device_stm_state_set(dev, DEVICE_STM_CANCEL_DELAYED);
     }
@@ -830,6 +1183,8 @@ device_stm_cancel_req (device *dev, const char *reason)
         DEVICE_STM_CANCEL_REQ, true, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 
     if (ok) {
+        dev->stm_cancel_time = timestamp_now();
+
         if (reason != NULL) {
             log_debug(dev->log, "cancel requested: %s", reason);
         }
@@ -848,6 +1203,109 @@ device_stm_timer_callback (void *data)
     device_proto_op_submit(dev, dev->proto_ctx.op, device_stm_op_callback);
 }
 
+/* ADF batch mode: status query callback
+ */
+static void
+device_stm_batch_callback (void *ptr, http_query *q)
+{
+    device      *dev = ptr;
+    SANE_Status status;
+
+    (void) q;
+
+    /* Cancel requested? stm_cancel_event callback will finish */
+    if (device_stm_state_get(dev) != DEVICE_STM_SCANNING) {
+        return;
+    }
+
+    status = dev->proto_ctx.proto->adf_status_decode(&dev->proto_ctx);
+    log_debug(dev->log, "ADF batch: ADF status: %s", sane_strstatus(status));
+
+    switch (status) {
+    case SANE_STATUS_GOOD:
+        /* ADF reloaded, start the next job */
+        log_debug(dev->log, "ADF batch: ADF reloaded, starting next job");
+        dev->stm_batch_deadline = 0;
+        device_job_reset(dev);
+        device_stm_start_scan(dev);
+        return;
+
+    case SANE_STATUS_UNSUPPORTED:
+        /* Device can't tell us about ADF reload */
+        dev->stm_batch_deadline = 0;
+        break;
+
+    default:
+        if (timestamp_now() < dev->stm_batch_deadline) {
+            dev->stm_timer = eloop_timer_new(DEVICE_BATCH_POLL_INTERVAL,
+                device_stm_batch_timer_callback, dev);
+            return;
+        }
+
+        log_debug(dev->log, "ADF batch: ADF was not reloaded in time");
+        dev->stm_batch_deadline = 0;
+    }
+
+    device_stm_state_set(dev, DEVICE_STM_DONE);
+}
+
+/* ADF batch mode: poll timer callback
+ */
+static void
+device_stm_batch_timer_callback (void *data)
+{
+    device     *dev = data;
+    http_query *q;
+
+    dev->stm_timer = NULL;
+    if (device_stm_state_get(dev) != DEVICE_STM_SCANNING) {
+        return;
+    }
+
+    dev->proto_ctx.op = PROTO_OP_CHECK;
+
+    q = dev->proto_ctx.proto->status_query(&dev->proto_ctx);
+    http_query_timeout(q, DEVICE_HTTP_TIMEOUT_CHECK);
+    http_query_submit(q, device_stm_batch_callback);
+    dev->proto_ctx.query = q;
+}
+
+/* ADF batch mode: if job has finished due to empty ADF, wait
+ * for ADF reload and continue with the new job, so frontend
+ * sees the continuous stream of pages
+ *
+ * Returns true, if device now waits for ADF reload
+ */
+static bool
+device_stm_batch_wait (device *dev)
+{
+    DEVICE_STM_STATE state = device_stm_state_get(dev);
+
+    if (conf.adf_batch == 0 ||
+        dev->proto_ctx.proto->adf_status_decode == NULL ||
+        dev->proto_ctx.params.src == ID_SOURCE_PLATEN ||
+        dev->proto_ctx.images_received == 0 ||
+        dev->job_status != SANE_STATUS_NO_DOCS ||
+        dev->stm_cancel_sent ||
+        (state != DEVICE_STM_SCANNING && state != DEVICE_STM_CLEANUP)) {
+        return false;
+    }
+
+    log_debug(dev->log, "ADF batch: waiting up to %d s for ADF reload",
+        conf.adf_batch);
+
+    /* The finished job is gone, so there is nothing to cancel */
+    dev->proto_ctx.location = NULL;
+    dev->stm_batch_deadline = timestamp_now() + conf.adf_batch * 1000;
+    device_stm_state_set(dev, DEVICE_STM_SCANNING);
+
+    log_assert(dev->log, dev->stm_timer == NULL);
+    dev->stm_timer = eloop_timer_new(DEVICE_BATCH_POLL_INTERVAL,
+        device_stm_batch_timer_callback, dev);
+
+    return true;
+}
+
 /* Operation callback
  */
 static void
@@ -865,15 +1323,24 @@ device_stm_op_callback (void *ptr, http_query *q)
     /* Save useful result, if any */
     if (dev->proto_ctx.op == PROTO_OP_SCAN) {
         if (result.data.location != NULL) {
-            mem_free((char*) dev->proto_ctx.location); /* Just in case */
             dev->proto_ctx.location = result.data.location;
             dev->proto_ctx.failed_attempt = 0;
             pthread_cond_broadcast(&dev->stm_cond);
         }
     } else if (dev->proto_ctx.op == PROTO_OP_LOAD) {
         if (result.data.image != NULL) {
+            size_t size = result.data.image->size;
+            int    depth;
+
+            device_read_lock(dev);
             http_data_queue_push(dev->read_queue, result.data.image);
+            depth = http_data_queue_len(dev->read_queue);
+            device_read_unlock(dev);
             dev->proto_ctx.images_received ++;
+
+            metric_add(dev->metric_pages, 1);
+            metric_add(dev->metric_bytes, (double) size);
+            metric_set(dev->metric_queue, depth);
             pollable_signal(dev->read_pollable);
 
             dev->proto_ctx.failed_attempt = 0;
@@ -906,7 +1373,7 @@ device_stm_op_callback (void *ptr, http_query *q)
 
         if (device_stm_state_get(dev) == DEVICE_STM_CANCEL_SENT) {
             device_stm_state_set(dev, DEVICE_STM_CANCEL_JOB_DONE);
-        } else {
+        } else if (!device_stm_batch_wait(dev)) {
             device_stm_state_set(dev, DEVICE_STM_DONE);
         }
         return;
@@ -1039,15 +1506,15 @@ device_stm_start_scan (device *dev)
     proto_ctx         *ctx = &dev->proto_ctx;
     proto_scan_params *params = &ctx->params;
     devcaps_source    *src = dev->opt.caps.src[dev->opt.src];
-    SANE_Word         x_resolution = dev->opt.resolution;
-    SANE_Word         y_resolution = dev->opt.resolution;
+    SANE_Word         x_resolution = dev->opt.resolution_real;
+    SANE_Word         y_resolution = dev->opt.resolution_real;
     char              buf[64];
 
     /* Prepare window parameters */
-    geom_x = device_geom_compute(dev->opt.tl_x, dev->opt.br_x,
+    geom_x = device_geom_compute(dev->job_win.tl_x, dev->job_win.br_x,
         src->min_wid_px, src->max_wid_px, x_resolution, dev->opt.caps.units);
 
-    geom_y = device_geom_compute(dev->opt.tl_y, dev->opt.br_y,
+    geom_y = device_geom_compute(dev->job_win.tl_y, dev->job_win.br_y,
         src->min_hei_px, src->max_hei_px, y_resolution, dev->opt.caps.units);
 
     dev->job_skip_x = geom_x.skip;
@@ -1075,13 +1542,13 @@ device_stm_start_scan (device *dev)
     log_trace(dev->log, "  colormode_real: %s",
             id_colormode_sane_name(params->colormode));
     log_trace(dev->log, "  tl_x:           %s mm",
-            math_fmt_mm(dev->opt.tl_x, buf));
+            math_fmt_mm(dev->job_win.tl_x, buf));
     log_trace(dev->log, "  tl_y:           %s mm",
-            math_fmt_mm(dev->opt.tl_y, buf));
+            math_fmt_mm(dev->job_win.tl_y, buf));
     log_trace(dev->log, "  br_x:           %s mm",
-            math_fmt_mm(dev->opt.br_x, buf));
+            math_fmt_mm(dev->job_win.br_x, buf));
     log_trace(dev->log, "  br_y:           %s mm",
-            math_fmt_mm(dev->opt.br_y, buf));
+            math_fmt_mm(dev->job_win.br_y, buf));
     log_trace(dev->log, "  image size:     %dx%d", params->wid, params->hei);
     log_trace(dev->log, "  image X offset: %d", params->x_off);
     log_trace(dev->log, "  image Y offset: %d", params->y_off);
@@ -1146,15 +1613,33 @@ device_job_set_status (device *dev, SANE_Status status)
      */
     if (status != dev->job_status) {
         log_debug(dev->log, "JOB status=%s", sane_strstatus(status));
-        dev->job_status = status;
 
+        device_read_lock(dev);
+        dev->job_status = status;
         if (status == SANE_STATUS_CANCELLED) {
             http_data_queue_purge(dev->read_queue);
         }
+        device_read_unlock(dev);
     }
 }
 
 /******************** API helpers ********************/
+/* Acquire mutex of the device's event loop shard
+ */
+void
+device_lock (device *dev)
+{
+    eloop_shard_lock(dev->shard);
+}
+
+/* Release mutex of the device's event loop shard
+ */
+void
+device_unlock (device *dev)
+{
+    eloop_shard_unlock(dev->shard);
+}
+
 /* Get device's logging context
  */
 log_ctx*
@@ -1180,9 +1665,12 @@ device_open (const char *ident, SANE_Status *status)
         return NULL;
     }
 
+    eloop_mutex_lock();
+
     /* Already opened? */
     dev = device_find_by_ident(ident);
     if (dev) {
+        eloop_mutex_unlock();
         *status = SANE_STATUS_DEVICE_BUSY;
         return NULL;
     }
@@ -1190,6 +1678,7 @@ device_open (const char *ident, SANE_Status *status)
     /* Obtain device endpoints */
     devinfo = zeroconf_devinfo_lookup(ident);
     if (devinfo == NULL) {
+        eloop_mutex_unlock();
         log_debug(NULL, "device_open(%s): device not found", ident);
         *status = SANE_STATUS_INVAL;
         return NULL;
@@ -1197,8 +1686,12 @@ device_open (const char *ident, SANE_Status *status)
 
     /* Create a device */
     dev = device_new(devinfo);
+    eloop_mutex_unlock();
+
+    device_lock(dev);
     *status = device_io_start(dev);
     if (*status != SANE_STATUS_GOOD) {
+        device_unlock(dev);
         device_free(dev, NULL);
         return NULL;
     }
@@ -1208,6 +1701,8 @@ device_open (const char *ident, SANE_Status *status)
         eloop_cond_wait(&dev->stm_cond);
     }
 
+    device_unlock(dev);
+
     if (device_stm_state_get(dev) == DEVICE_STM_PROBING_FAILED) {
         device_free(dev, NULL);
         *status = SANE_STATUS_IO_ERROR;
@@ -1223,13 +1718,21 @@ device_open (const char *ident, SANE_Status *status)
 void
 device_close (device *dev, const char *log_msg)
 {
+    device_lock(dev);
+
     /* Cancel job in progress, if any */
     if (device_stm_state_working(dev)) {
         device_stm_cancel_wait(dev, "device close");
     }
 
+    /* Regions, cut from the last scan, are not returned anymore */
+    device_regions_reset(dev);
+
     /* Close the device */
+    device_probe_uncache(dev);
     device_stm_state_set(dev, DEVICE_STM_CLOSED);
+    device_unlock(dev);
+
     device_free(dev, log_msg);
 }
 
@@ -1265,6 +1768,9 @@ device_set_option (device *dev, SANE_Int option, void *value, SANE_Word *info)
         return SANE_STATUS_INVAL;
     }
 
+    /* Remaining regions of the previous scan become obsolete */
+    device_regions_reset(dev);
+
     status = devopt_set_option(&dev->opt, option, value, info);
     if (status == SANE_STATUS_GOOD && opt_is_enhancement(option)) {
         device_read_filters_setup(dev);
@@ -1321,32 +1827,62 @@ device_start_wait (device *dev)
     }
 }
 
-/* Enforce CONFIG_START_RETRY_INTERVAL
+/* device_start_retry_pause() timer callback
  */
 static void
-device_start_retry_pause (device *dev)
+device_start_retry_pause_callback (void *data)
 {
-    struct timespec now;
-    int64_t         pause_us;
-
-    clock_gettime(CLOCK_MONOTONIC, &now);
+    device *dev = data;
 
-    pause_us = (int64_t) (now.tv_sec - dev->stm_last_fail_time.tv_sec) *
-                    1000000;
-    pause_us += (int64_t) (now.tv_nsec - dev->stm_last_fail_time.tv_nsec) /
-                    1000;
-    pause_us = (int64_t) (CONFIG_START_RETRY_INTERVAL * 1000) - pause_us;
+    dev->stm_retry_timer = NULL;
+    pthread_cond_broadcast(&dev->stm_cond);
+}
 
-    if (pause_us > 1000) {
-        log_debug(dev->log, "sane_start() retried too often; pausing for %d ms",
-                (int) (pause_us / 1000));
+/* Enforce CONFIG_START_RETRY_INTERVAL
+ *
+ * The pause is timed by the event loop timer, so it follows
+ * the event loop clock, which may be warped (see conf.dbg_clock_warp)
+ */
+static void
+device_start_retry_pause (device *dev)
+{
+    timestamp pause;
 
-        eloop_mutex_unlock();
-        usleep((useconds_t) pause_us);
-        eloop_mutex_lock();
+    pause = dev->stm_last_fail_time + CONFIG_START_RETRY_INTERVAL -
+            timestamp_now();
+
+    if (pause > 1) {
+        log_debug(dev->log, "sane_start() retried too often; pausing for %d ms",
+                (int) pause);
+
+        dev->stm_retry_timer = eloop_timer_new((int) pause,
+            device_start_retry_pause_callback, dev);
+
+        while (dev->stm_retry_timer != NULL) {
+            eloop_cond_wait(&dev->stm_cond);
+        }
     }
 }
 
+/* Reset job state before starting the new job
+ */
+static void
+device_job_reset (device *dev)
+{
+    dev->stm_cancel_sent = false;
+
+    device_read_lock(dev);
+    dev->job_status = SANE_STATUS_GOOD;
+    device_read_unlock(dev);
+
+    arena_free(dev->proto_ctx.arena);
+    dev->proto_ctx.arena = arena_new();
+    dev->proto_ctx.location = NULL;
+    dev->proto_ctx.failed_op = PROTO_OP_NONE;
+    dev->proto_ctx.failed_attempt = 0;
+    dev->proto_ctx.images_received = 0;
+}
+
 /* Start new scanning job
  */
 static SANE_Status
@@ -1354,17 +1890,14 @@ device_start_new_job (device *dev)
 {
     SANE_Status status;
 
+    /* Connect to the device, while preparing the job */
+    device_proto_preconnect(dev);
+
     device_start_retry_pause(dev);
 
-    dev->stm_cancel_sent = false;
-    dev->job_status = SANE_STATUS_GOOD;
-    mem_free((char*) dev->proto_ctx.location);
-    dev->proto_ctx.location = NULL;
-    dev->proto_ctx.failed_op = PROTO_OP_NONE;
-    dev->proto_ctx.failed_attempt = 0;
-    dev->proto_ctx.images_received = 0;
+    device_job_reset(dev);
 
-    eloop_call(device_start_do, dev);
+    eloop_call_shard(dev->shard, device_start_do, dev);
 
     log_debug(dev->log, "device_start_wait: waiting");
     status = device_start_wait(dev);
@@ -1373,11 +1906,11 @@ device_start_new_job (device *dev)
     switch (status) {
     case SANE_STATUS_GOOD:
     case SANE_STATUS_CANCELLED:
-        memset(&dev->stm_last_fail_time, 0, sizeof(dev->stm_last_fail_time));
+        dev->stm_last_fail_time = 0;
         break;
 
     default:
-        clock_gettime(CLOCK_MONOTONIC, &dev->stm_last_fail_time);
+        dev->stm_last_fail_time = timestamp_now();
     }
 
     if (status == SANE_STATUS_GOOD) {
@@ -1392,10 +1925,10 @@ device_start_new_job (device *dev)
     return status;
 }
 
-/* Start scanning operation
+/* Start the next page of the scan job
  */
-SANE_Status
-device_start (device *dev)
+static SANE_Status
+device_start_page (device *dev)
 {
     /* Already scanning? */
     if ((dev->flags & DEVICE_SCANNING) != 0) {
@@ -1413,6 +1946,8 @@ device_start (device *dev)
     dev->flags |= DEVICE_SCANNING;
     pollable_reset(dev->read_pollable);
     dev->read_non_blocking = SANE_FALSE;
+    dev->read_start_time = timestamp_now();
+    dev->read_decode_ns = 0;
 
     /* Scanner idle? Start new job */
     if (device_stm_state_get(dev) == DEVICE_STM_IDLE) {
@@ -1421,8 +1956,7 @@ device_start (device *dev)
 
     /* Previous job still running. Synchronize with it
      */
-    while (device_stm_state_working(dev)
-        && http_data_queue_len(dev->read_queue) == 0) {
+    while (device_stm_state_working(dev) && device_read_queue_empty(dev)) {
         log_debug(dev->log, "device_start: waiting for background scan job");
         eloop_cond_wait(&dev->stm_cond);
     }
@@ -1430,7 +1964,7 @@ device_start (device *dev)
     /* If we have more buffered images, just start
      * decoding the next one
      */
-    if (http_data_queue_len(dev->read_queue) > 0) {
+    if (!device_read_queue_empty(dev)) {
         dev->flags |= DEVICE_READING;
         pollable_signal(dev->read_pollable);
         return SANE_STATUS_GOOD;
@@ -1454,11 +1988,322 @@ device_start (device *dev)
     return device_start_new_job(dev);
 }
 
+/* Skip blank pages, before sane_start() returns
+ *
+ * Each page is decoded in advance, to be classified before frontend
+ * sees it. Blank pages are dropped; the first non-blank page remains
+ * decoded and is returned by device_read(). Pages larger than
+ * conf.blank_max_size are not decoded in advance and never skipped
+ *
+ * Called under the device's shard mutex
+ */
+static SANE_Status
+device_start_skip_blank (device *dev)
+{
+    for (;;) {
+        http_data   *image;
+        SANE_Status status = device_read_wait(dev, &image);
+        size_t      size;
+
+        if (status != SANE_STATUS_GOOD) {
+            return status;
+        }
+
+        status = device_read_next(dev, image);
+        if (status != SANE_STATUS_GOOD) {
+            device_job_set_status(dev, SANE_STATUS_IO_ERROR);
+            device_stm_cancel_req(dev, "I/O error");
+            return status;
+        }
+
+        /* Decoded page is held in memory, so check its size */
+        size = (size_t) dev->opt.params.bytes_per_line *
+               (size_t) dev->opt.params.lines;
+        if (size > ((size_t) conf.blank_max_size << 20)) {
+            log_debug(dev->log, "device_start: page too large (%zu bytes), "
+                "blank page check skipped", size);
+            return SANE_STATUS_GOOD;
+        }
+
+        /* Decoding doesn't need the shard mutex */
+        device_unlock(dev);
+        status = device_read_predecode(dev);
+        device_lock(dev);
+
+        if (status != SANE_STATUS_GOOD) {
+            device_job_set_status(dev, SANE_STATUS_IO_ERROR);
+            device_stm_cancel_req(dev, "I/O error");
+            return status;
+        }
+
+        if (!device_read_page_is_blank(dev)) {
+            return SANE_STATUS_GOOD;
+        }
+
+        log_debug(dev->log, "device_start: blank page skipped");
+        device_read_image_cleanup(dev);
+    }
+}
+
+/* Check if regions are cut from a single platen scan
+ */
+static bool
+device_regions_enabled (device *dev)
+{
+    return dev->opt.src == ID_SOURCE_PLATEN && dev->opt.params.depth == 8 &&
+           (dev->opt.regions_auto || dev->opt.regions_num > 0);
+}
+
+/* Drop the decoded bounding box and remaining regions, if any,
+ * and restore scan parameters
+ */
+static void
+device_regions_reset (device *dev)
+{
+    if (dev->regions_page != NULL) {
+        mem_free(dev->regions_page);
+        dev->regions_page = NULL;
+        dev->opt.params = dev->regions_saved_params;
+    }
+
+    dev->regions_num = dev->regions_next = 0;
+    __atomic_store_n(&dev->regions_cancelled, false, __ATOMIC_SEQ_CST);
+}
+
+/* Locate regions within the decoded bounding box
+ */
+static void
+device_regions_locate (device *dev)
+{
+    const SANE_Parameters *params = &dev->regions_page_params;
+    int                   wid = params->pixels_per_line;
+    int                   hei = params->lines;
+    int                   res = dev->opt.resolution;
+    int                   i;
+
+    if (dev->opt.regions_auto) {
+        int bpp = params->format == SANE_FRAME_RGB ? 3 : 1;
+
+        /* Cells are about 2 mm, objects below 10 mm are ignored */
+        dev->regions_num = filter_regions_detect(dev->regions_page,
+            wid, hei, bpp, math_max(1, res / 12), 5,
+            dev->regions, DEVOPT_REGIONS_MAX);
+    } else {
+        for (i = 0; i < dev->opt.regions_num; i ++) {
+            const devopt_region *r = &dev->opt.regions[i];
+            image_window        *win = &dev->regions[i];
+
+            win->x_off = math_mm2px_res(r->tl_x - dev->job_win.tl_x, res);
+            win->y_off = math_mm2px_res(r->tl_y - dev->job_win.tl_y, res);
+            win->wid = math_mm2px_res(r->br_x - r->tl_x, res);
+            win->hei = math_mm2px_res(r->br_y - r->tl_y, res);
+
+            win->x_off = math_min(win->x_off, wid - 1);
+            win->y_off = math_min(win->y_off, hei - 1);
+            win->wid = math_bound(win->wid, 1, wid - win->x_off);
+            win->hei = math_bound(win->hei, 1, hei - win->y_off);
+        }
+
+        dev->regions_num = dev->opt.regions_num;
+    }
+
+    /* Nothing found? Return the whole page */
+    if (dev->regions_num == 0) {
+        log_debug(dev->log, "regions: nothing found, using the whole page");
+        dev->regions[0].x_off = dev->regions[0].y_off = 0;
+        dev->regions[0].wid = wid;
+        dev->regions[0].hei = hei;
+        dev->regions_num = 1;
+    }
+
+    dev->regions_next = 0;
+}
+
+/* Return the next region as if it were the next scanned page
+ */
+static SANE_Status
+device_regions_next (device *dev)
+{
+    const image_window *win;
+    int                bpp, i;
+    size_t             src_bpl, bpl;
+
+    if ((dev->flags & DEVICE_SCANNING) != 0) {
+        log_debug(dev->log, "device_start: already scanning");
+        return SANE_STATUS_INVAL;
+    }
+
+    if (dev->regions_next == dev->regions_num) {
+        device_regions_reset(dev);
+        return SANE_STATUS_NO_DOCS;
+    }
+
+    win = &dev->regions[dev->regions_next ++];
+    bpp = dev->regions_page_params.format == SANE_FRAME_RGB ? 3 : 1;
+    src_bpl = dev->regions_page_params.bytes_per_line;
+    bpl = win->wid * bpp;
+
+    log_debug(dev->log, "region %d of %d: %dx%d at %d,%d",
+        dev->regions_next, dev->regions_num,
+        win->wid, win->hei, win->x_off, win->y_off);
+
+    dev->opt.params = dev->regions_page_params;
+    dev->opt.params.pixels_per_line = win->wid;
+    dev->opt.params.lines = win->hei;
+    dev->opt.params.bytes_per_line = bpl;
+
+    dev->read_page = mem_new(SANE_Byte, bpl * win->hei);
+    for (i = 0; i < win->hei; i ++) {
+        memcpy(dev->read_page + i * bpl, dev->regions_page +
+            (win->y_off + i) * src_bpl + win->x_off * bpp, bpl);
+    }
+
+    dev->read_line_buf = mem_new(SANE_Byte, bpl);
+    dev->read_skip_bytes = 0;
+    dev->read_line_num = 0;
+    dev->read_line_off = bpl;
+
+    dev->flags |= DEVICE_SCANNING | DEVICE_READING;
+    dev->read_non_blocking = SANE_FALSE;
+    dev->read_start_time = timestamp_now();
+    dev->read_decode_ns = 0;
+    pollable_signal(dev->read_pollable);
+
+    return SANE_STATUS_GOOD;
+}
+
+/* Scan the bounding box of all regions and decode it in advance,
+ * so regions can be cut from it
+ *
+ * Called under the device's shard mutex
+ */
+static SANE_Status
+device_regions_start (device *dev)
+{
+    devopt_region *bbox = &dev->job_win;
+    http_data     *image;
+    SANE_Status   status;
+    int           i;
+
+    /* Scan the bounding box of manually defined regions. Automatic
+     * detection needs the whole scan window
+     */
+    if (!dev->opt.regions_auto) {
+        *bbox = dev->opt.regions[0];
+        for (i = 1; i < dev->opt.regions_num; i ++) {
+            const devopt_region *r = &dev->opt.regions[i];
+
+            bbox->tl_x = math_min(bbox->tl_x, r->tl_x);
+            bbox->tl_y = math_min(bbox->tl_y, r->tl_y);
+            bbox->br_x = math_max(bbox->br_x, r->br_x);
+            bbox->br_y = math_max(bbox->br_y, r->br_y);
+        }
+    }
+
+    dev->regions_saved_params = dev->opt.params;
+    devopt_region_params(&dev->opt, bbox, &dev->opt.params);
+
+    status = device_start_page(dev);
+    if (status == SANE_STATUS_GOOD) {
+        status = device_read_wait(dev, &image);
+    }
+
+    if (status == SANE_STATUS_GOOD) {
+        status = device_read_next(dev, image);
+        if (status == SANE_STATUS_GOOD) {
+            /* Decoding doesn't need the shard mutex */
+            device_unlock(dev);
+            status = device_read_predecode(dev);
+            device_lock(dev);
+        }
+
+        if (status != SANE_STATUS_GOOD) {
+            device_job_set_status(dev, SANE_STATUS_IO_ERROR);
+            device_stm_cancel_req(dev, "I/O error");
+        }
+    }
+
+    if (status == SANE_STATUS_GOOD) {
+        dev->regions_page = dev->read_page;
+        dev->regions_page_params = dev->opt.params;
+        dev->read_page = NULL;
+        device_regions_locate(dev);
+    } else {
+        dev->opt.params = dev->regions_saved_params;
+    }
+
+    /* The bounding box is not returned by itself */
+    dev->flags &= ~(DEVICE_SCANNING | DEVICE_READING);
+    device_read_image_cleanup(dev);
+
+    if (device_stm_state_get(dev) == DEVICE_STM_DONE) {
+        device_stm_state_set(dev, DEVICE_STM_IDLE);
+    }
+
+    if (status != SANE_STATUS_GOOD) {
+        return status;
+    }
+
+    return device_regions_next(dev);
+}
+
+/* Start scanning operation
+ */
+SANE_Status
+device_start (device *dev)
+{
+    SANE_Status status;
+
+    /* Return the next region, cut from the previous scan, unless
+     * cancelled. Without regions, the flag is stale
+     */
+    if (__atomic_load_n(&dev->regions_cancelled, __ATOMIC_SEQ_CST)) {
+        device_regions_reset(dev);
+    } else if (dev->regions_page != NULL) {
+        return device_regions_next(dev);
+    }
+
+    dev->job_win.tl_x = dev->opt.tl_x;
+    dev->job_win.tl_y = dev->opt.tl_y;
+    dev->job_win.br_x = dev->opt.br_x;
+    dev->job_win.br_y = dev->opt.br_y;
+
+    if (device_regions_enabled(dev)) {
+        return device_regions_start(dev);
+    }
+
+    status = device_start_page(dev);
+
+    if (status != SANE_STATUS_GOOD || !conf.blank_skip ||
+        dev->opt.src == ID_SOURCE_PLATEN || dev->opt.params.depth != 8) {
+        return status;
+    }
+
+    status = device_start_skip_blank(dev);
+    if (status != SANE_STATUS_GOOD) {
+        dev->flags &= ~(DEVICE_SCANNING | DEVICE_READING);
+        device_read_image_cleanup(dev);
+
+        if (device_stm_state_get(dev) == DEVICE_STM_DONE) {
+            device_stm_state_set(dev, DEVICE_STM_IDLE);
+        }
+    }
+
+    return status;
+}
+
 /* Cancel scanning operation
  */
 void
 device_cancel (device *dev)
 {
+    /* Regions, cut from the previous scan, are dropped by the next
+     * device_start() or device_read(), when they see the flag. We
+     * may be called from signal handler without any lock, so the
+     * flag is all we can touch here
+     */
+    __atomic_store_n(&dev->regions_cancelled, true, __ATOMIC_SEQ_CST);
+
     /* Note, xsane calls sane_cancel() after each successful
      * scan "just in case", which kills scan job running in
      * background. So ignore cancel request, if from the API
@@ -1502,6 +2347,112 @@ device_get_select_fd (device *dev, SANE_Int *fd)
 
 
 /******************** Read machinery ********************/
+/* Get current time, in nanoseconds, for lock instrumentation
+ */
+static int64_t
+device_read_lock_now (void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* Acquire the read lock
+ */
+static void
+device_read_lock (device *dev)
+{
+    device_lock_stats *stats = &dev->read_lock_stats;
+    int64_t           wait = 0;
+
+    if (pthread_mutex_trylock(&dev->read_lock) != 0) {
+        int64_t start = device_read_lock_now();
+        pthread_mutex_lock(&dev->read_lock);
+        wait = device_read_lock_now() - start;
+        stats->contended ++;
+    }
+
+    stats->count ++;
+    stats->wait_ns += wait;
+    if (wait > stats->wait_max_ns) {
+        stats->wait_max_ns = wait;
+    }
+    stats->locked_at = device_read_lock_now();
+}
+
+/* Release the read lock
+ */
+static void
+device_read_unlock (device *dev)
+{
+    device_lock_stats *stats = &dev->read_lock_stats;
+    int64_t           hold = device_read_lock_now() - stats->locked_at;
+
+    stats->hold_ns += hold;
+    if (hold > stats->hold_max_ns) {
+        stats->hold_max_ns = hold;
+    }
+
+    pthread_mutex_unlock(&dev->read_lock);
+}
+
+/* Dump read lock statistics
+ */
+static void
+device_read_lock_stats_dump (device *dev)
+{
+    device_lock_stats *stats = &dev->read_lock_stats;
+    uint64_t          n = stats->count ? stats->count : 1;
+
+    log_debug(dev->log, "read lock: %llu acquired, %llu contended",
+        (unsigned long long) stats->count,
+        (unsigned long long) stats->contended);
+    log_debug(dev->log, "read lock: wait avg=%lld ns max=%lld ns",
+        (long long) (stats->wait_ns / n), (long long) stats->wait_max_ns);
+    log_debug(dev->log, "read lock: hold avg=%lld ns max=%lld ns",
+        (long long) (stats->hold_ns / n), (long long) stats->hold_max_ns);
+}
+
+/* Check if read queue is empty
+ */
+static bool
+device_read_queue_empty (device *dev)
+{
+    bool empty;
+
+    device_read_lock(dev);
+    empty = http_data_queue_empty(dev->read_queue);
+    device_read_unlock(dev);
+
+    return empty;
+}
+
+/* Pull next image from the read queue. Returns NULL, if queue
+ * is empty or job was cancelled
+ *
+ * This function doesn't require the device's shard mutex
+ */
+static http_data*
+device_read_queue_pull (device *dev)
+{
+    http_data *image = NULL;
+    int       depth;
+
+    device_read_lock(dev);
+    if (dev->job_status != SANE_STATUS_CANCELLED) {
+        image = http_data_queue_pull(dev->read_queue);
+    }
+    depth = http_data_queue_len(dev->read_queue);
+    device_read_unlock(dev);
+
+    if (image != NULL) {
+        metric_set(dev->metric_queue, depth);
+    }
+
+    return image;
+}
+
 /* Setup read_filters
  */
 static void
@@ -1521,10 +2472,53 @@ device_read_filters_cleanup (device *dev)
     dev->read_filters = NULL;
 }
 
-/* Pull next image from the read queue and start decoding
+/* Get buffer, the image decoder writes lines to
+ */
+static SANE_Byte*
+device_read_decode_buf (device *dev)
+{
+    return dev->read_downscale ? dev->read_src_buf : dev->read_line_buf;
+}
+
+/* Cleanup emulated resolution downscaler
+ */
+static void
+device_read_downscale_cleanup (device *dev)
+{
+    filter_downscale_free(dev->read_downscale);
+    dev->read_downscale = NULL;
+    mem_free(dev->read_src_buf);
+    dev->read_src_buf = NULL;
+}
+
+/* Release current image and all its decoding state
+ */
+static void
+device_read_image_cleanup (device *dev)
+{
+    image_decoder_reset(dev->decoders[dev->proto_ctx.params.format]);
+
+    if (dev->read_image != NULL) {
+        http_data_unref(dev->read_image);
+        dev->read_image = NULL;
+    }
+
+    mem_free(dev->read_line_buf);
+    dev->read_line_buf = NULL;
+    device_read_downscale_cleanup(dev);
+
+    filter_pagestat_free(dev->read_pagestat);
+    dev->read_pagestat = NULL;
+    mem_free(dev->read_page);
+    dev->read_page = NULL;
+
+    device_read_strips_cleanup(dev);
+}
+
+/* Start decoding of the next image, pulled from the read queue
  */
 static SANE_Status
-device_read_next (device *dev)
+device_read_next (device *dev, http_data *image)
 {
     error           err;
     size_t          line_capacity;
@@ -1535,10 +2529,7 @@ device_read_next (device *dev)
 
     log_assert(dev->log, decoder != NULL);
 
-    dev->read_image = http_data_queue_pull(dev->read_queue);
-    if (dev->read_image == NULL) {
-        return SANE_STATUS_EOF;
-    }
+    dev->read_image = image;
 
     /* Start new image decoding */
     err = image_decoder_begin(decoder,
@@ -1633,6 +2624,8 @@ device_read_next (device *dev)
             skip_lines = dev->job_skip_y - win.y_off;
         }
 
+        dev->read_line_end = hei - dev->job_skip_y;
+
         line_capacity = win.wid;
         if (params.format == SANE_FRAME_RGB) {
             line_capacity *= 3;
@@ -1643,6 +2636,33 @@ device_read_next (device *dev)
 
         line_capacity = math_max(line_capacity, returned_size_and_skip);
         dev->read_line_real_wid = win.wid;
+
+        /* If resolution is emulated, decoded lines are clipped and
+         * downscaled into the line buffer, which now only needs to
+         * fit the downscaled line
+         */
+        if (dev->opt.resolution != dev->opt.resolution_real) {
+            int src_wid = win.wid - (dev->job_skip_x - win.x_off);
+            int dst_wid;
+
+            dev->read_downscale = filter_downscale_new(src_wid, bpp,
+                dev->opt.resolution, dev->opt.resolution_real);
+            dev->read_src_buf = mem_new(SANE_Byte, line_capacity);
+            memset(dev->read_src_buf, 0xff, line_capacity);
+            dev->read_src_skip = dev->read_skip_bytes;
+            dev->read_skip_bytes = 0;
+
+            dev->read_line_end = filter_downscale_lines(dev->read_downscale,
+                dev->read_line_end);
+
+            dst_wid = filter_downscale_wid(dev->read_downscale);
+            line_capacity = math_max(dst_wid * bpp,
+                dev->opt.params.bytes_per_line);
+
+            log_trace(dev->log, "downscaling: %d->%d dpi, %dx%d->%dx%d",
+                dev->opt.resolution_real, dev->opt.resolution,
+                src_wid, hei - dev->job_skip_y, dst_wid, dev->read_line_end);
+        }
     }
 
     /* Initialize image decoding */
@@ -1651,15 +2671,22 @@ device_read_next (device *dev)
 
     dev->read_line_num = 0;
     dev->read_line_off = dev->opt.params.bytes_per_line;
-    dev->read_line_end = hei - skip_lines;
+
+    if ((conf.blank_skip || conf.dbg_enabled) && dev->opt.params.depth == 8) {
+        dev->read_pagestat = filter_pagestat_new(
+            dev->opt.params.pixels_per_line,
+            dev->opt.params.format == SANE_FRAME_RGB ? 3 : 1);
+    }
 
     for (;skip_lines > 0; skip_lines --) {
-        err = image_decoder_read_line(decoder, dev->read_line_buf);
+        err = image_decoder_read_line(decoder, device_read_decode_buf(dev));
         if (err != NULL) {
             goto DONE;
         }
     }
 
+    device_read_strips_setup(dev, line_capacity);
+
     /* Wake up reader */
     pollable_signal(dev->read_pollable);
 
@@ -1677,34 +2704,254 @@ DONE:
 /* Perform 24 to 8 bit image resampling for a single line
  */
 static void
-device_read_24_to_8_resample (device *dev)
+device_read_24_to_8_resample (device *dev, SANE_Byte *buf)
 {
-    int i, len = dev->read_line_real_wid;
-    uint8_t *in = dev->read_line_buf;
-    uint8_t *out = dev->read_line_buf;
+    int len = dev->read_line_real_wid;
 
-    for (i = 0; i < len; i ++) {
-        /* Y = R * 0.299 + G * 0.587 + B * 0.114
-         *
-         * 16777216 == 1 << 24
-         * 16777216 * 0.299 == 5016387.584 ~= 5016387
-         * 16777216 * 0.587 == 9848225.792 ~= 9848226
-         * 16777216 * 0.114 == 1912602.624 ~= 1912603
-         *
-         * 5016387 + 9848226 + 1912603 == 16777216
-         */
-        unsigned long Y;
+    filter_rgb24_to_gray8(buf, len);
 
-        Y = 5016387 * (unsigned long) *in ++;
-        Y += 9848226 * (unsigned long) *in ++;
-        Y += 1912603 * (unsigned long) *in ++;
-        *out ++ = (Y + (1 << 23)) >> 24;
+    if (len < dev->opt.params.bytes_per_line) {
+        memset(buf + len, 0xff, dev->opt.params.bytes_per_line - len);
     }
+}
 
+/* Decode next line of the image into the decoder line buffer
+ */
+static error
+device_read_decode_raw_line (device *dev)
+{
+    image_decoder *decoder = dev->decoders[dev->proto_ctx.params.format];
+    SANE_Byte     *buf = device_read_decode_buf(dev);
+    error         err = image_decoder_read_line(decoder, buf);
+
+    if (err == NULL && dev->read_24_to_8) {
+        device_read_24_to_8_resample(dev, buf);
+    }
+
+    return err;
+}
+
+/* Decode and downscale the next line of the image
+ */
+static error
+device_read_decode_scaled_line (device *dev)
+{
+    SANE_Byte *out = dev->read_line_buf;
+    int       len, bpp;
+    error     err;
+
+    do {
+        err = device_read_decode_raw_line(dev);
+        if (err != NULL) {
+            return err;
+        }
+    } while (!filter_downscale_push(dev->read_downscale,
+            dev->read_src_buf + dev->read_src_skip, out));
+
+    bpp = dev->opt.params.format == SANE_FRAME_RGB ? 3 : 1;
+    len = filter_downscale_wid(dev->read_downscale) * bpp;
     if (len < dev->opt.params.bytes_per_line) {
-        memset(dev->read_line_buf + len, 0xff,
-            dev->opt.params.bytes_per_line - len);
+        memset(out + len, 0xff, dev->opt.params.bytes_per_line - len);
+    }
+
+    return NULL;
+}
+
+/* Post-process lines of the strip. Called by the worker pool
+ */
+static void
+device_read_strip_process (void *data)
+{
+    device_strip *strip = data;
+    device       *dev = strip->dev;
+    size_t       bpl = dev->opt.params.bytes_per_line;
+    SANE_Int     i;
+
+    for (i = 0; i < strip->lines; i ++) {
+        SANE_Byte *line = strip->buf + i * dev->read_strip_stride;
+
+        if (dev->read_strip_resample &&
+            strip->first + i < dev->read_line_end) {
+            device_read_24_to_8_resample(dev, line);
+        }
+
+        filter_chain_apply(dev->read_filters, line, bpl);
+    }
+}
+
+/* Setup ring of strips, if post-processing of the current
+ * image worth to be offloaded to the worker pool
+ *
+ * Downscaler and page statistics are stateful, so if they are
+ * used, preceding 24 to 8 resampling remains in the decoding thread
+ */
+static void
+device_read_strips_setup (device *dev, size_t line_capacity)
+{
+    size_t bpl = dev->opt.params.bytes_per_line;
+    bool   resample;
+    int    i;
+
+    resample = dev->read_24_to_8 && dev->read_downscale == NULL &&
+               dev->read_pagestat == NULL;
+
+    if ((dev->read_filters == NULL && !resample) || workers_count() == 0 ||
+        bpl * dev->opt.params.lines < DEVICE_STRIP_MIN_IMAGE) {
+        return;
+    }
+
+    dev->read_strip_resample = resample;
+
+    dev->read_strips_num = 2 * workers_count();
+    dev->read_strips = mem_new(device_strip, dev->read_strips_num);
+    dev->read_strips_busy = 0;
+    dev->read_strip_head = 0;
+    dev->read_strip_pos = 0;
+    dev->read_strip_stride = line_capacity;
+    dev->read_strip_lines = math_max(1, DEVICE_STRIP_BYTES / line_capacity);
+    dev->read_strip_next = 0;
+    dev->read_strip_failed = false;
+
+    for (i = 0; i < dev->read_strips_num; i ++) {
+        device_strip *strip = &dev->read_strips[i];
+
+        strip->task.func = device_read_strip_process;
+        strip->task.data = strip;
+        strip->dev = dev;
+        strip->buf = mem_new(SANE_Byte,
+            dev->read_strip_lines * line_capacity);
+    }
+
+    log_trace(dev->log, "post-processing: %d strips of %d lines",
+        dev->read_strips_num, dev->read_strip_lines);
+}
+
+/* Cleanup ring of strips
+ */
+static void
+device_read_strips_cleanup (device *dev)
+{
+    int i;
+
+    for (i = 0; i < dev->read_strips_num; i ++) {
+        worker_task_wait(&dev->read_strips[i].task);
+        mem_free(dev->read_strips[i].buf);
+    }
+
+    mem_free(dev->read_strips);
+    dev->read_strips = NULL;
+    dev->read_strips_num = 0;
+}
+
+/* Decode next line of the image into the strip line
+ */
+static error
+device_read_strip_decode (device *dev, SANE_Byte *line)
+{
+    image_decoder *decoder = dev->decoders[dev->proto_ctx.params.format];
+    error         err = NULL;
+
+    if (dev->read_strip_next >= dev->read_line_end) {
+        memset(line + dev->read_skip_bytes, 0xff,
+            dev->opt.params.bytes_per_line);
+    } else if (dev->read_strip_resample) {
+        return image_decoder_read_line(decoder, line);
+    } else {
+        if (dev->read_downscale != NULL) {
+            err = device_read_decode_scaled_line(dev);
+        } else {
+            err = device_read_decode_raw_line(dev);
+        }
+
+        if (err != NULL) {
+            return err;
+        }
+
+        memcpy(line, dev->read_line_buf, dev->read_strip_stride);
+    }
+
+    if (dev->read_pagestat != NULL) {
+        filter_pagestat_push(dev->read_pagestat, line + dev->read_skip_bytes);
+    }
+
+    return NULL;
+}
+
+/* Fill free strips of the ring with decoded lines and submit
+ * them to the worker pool
+ */
+static void
+device_read_strips_fill (device *dev)
+{
+    while (dev->read_strips_busy < dev->read_strips_num &&
+           dev->read_strip_next < dev->opt.params.lines &&
+           !dev->read_strip_failed) {
+        int          i = (dev->read_strip_head + dev->read_strips_busy) %
+                         dev->read_strips_num;
+        device_strip *strip = &dev->read_strips[i];
+        SANE_Int     max = math_min(dev->read_strip_lines,
+            dev->opt.params.lines - dev->read_strip_next);
+
+        strip->first = dev->read_strip_next;
+        strip->failed = false;
+
+        for (strip->lines = 0; strip->lines < max; strip->lines ++) {
+            SANE_Byte *line = strip->buf +
+                              strip->lines * dev->read_strip_stride;
+            error     err = device_read_strip_decode(dev, line);
+
+            if (err != NULL) {
+                log_debug(dev->log, ESTRING(err));
+                strip->failed = dev->read_strip_failed = true;
+                break;
+            }
+
+            dev->read_strip_next ++;
+        }
+
+        worker_task_submit(&strip->task);
+        dev->read_strips_busy ++;
+    }
+}
+
+/* Get next line of the image from the ring of strips
+ */
+static SANE_Status
+device_read_strip_line (device *dev)
+{
+    device_strip *strip = &dev->read_strips[dev->read_strip_head];
+    size_t       bpl = dev->opt.params.bytes_per_line;
+
+    /* Release exhausted strip */
+    if (dev->read_strips_busy > 0 && dev->read_strip_pos == strip->lines) {
+        if (strip->failed) {
+            return SANE_STATUS_IO_ERROR;
+        }
+
+        dev->read_strips_busy --;
+        dev->read_strip_head = (dev->read_strip_head + 1) %
+                               dev->read_strips_num;
+        dev->read_strip_pos = 0;
+        strip = &dev->read_strips[dev->read_strip_head];
     }
+
+    /* Decode ahead, while workers are busy with previous strips */
+    device_read_strips_fill(dev);
+
+    if (dev->read_strip_pos == 0) {
+        worker_task_wait(&strip->task);
+    }
+
+    if (dev->read_strip_pos == strip->lines) {
+        return SANE_STATUS_IO_ERROR;
+    }
+
+    memcpy(dev->read_line_buf + dev->read_skip_bytes,
+        strip->buf + dev->read_strip_pos * dev->read_strip_stride +
+        dev->read_skip_bytes, bpl);
+    dev->read_strip_pos ++;
+
+    return SANE_STATUS_GOOD;
 }
 
 /* Decode next image line
@@ -1726,6 +2973,7 @@ device_read_decode_line (device *dev)
 {
     const SANE_Int n = dev->read_line_num;
     image_decoder  *decoder = dev->decoders[dev->proto_ctx.params.format];
+    int64_t        start = 0;
 
     log_assert(dev->log, decoder != NULL);
 
@@ -1733,32 +2981,185 @@ device_read_decode_line (device *dev)
         return SANE_STATUS_EOF;
     }
 
-    if (n >= dev->read_line_end) {
+    /* Page was decoded in advance? */
+    if (dev->read_page != NULL) {
+        size_t bpl = dev->opt.params.bytes_per_line;
+
+        memcpy(dev->read_line_buf + dev->read_skip_bytes,
+            dev->read_page + n * bpl, bpl);
+
+        dev->read_line_off = 0;
+        dev->read_line_num ++;
+
+        return SANE_STATUS_GOOD;
+    }
+
+    if (dev->metric_pixels != NULL) {
+        start = device_read_lock_now();
+    }
+
+    if (dev->read_strips != NULL) {
+        SANE_Status status = device_read_strip_line(dev);
+        if (status != SANE_STATUS_GOOD) {
+            return status;
+        }
+    } else if (n >= dev->read_line_end) {
         memset(dev->read_line_buf + dev->read_skip_bytes, 0xff,
             dev->opt.params.bytes_per_line);
     } else {
-        error err = image_decoder_read_line(decoder, dev->read_line_buf);
+        error err;
+
+        if (dev->read_downscale != NULL) {
+            err = device_read_decode_scaled_line(dev);
+        } else {
+            err = device_read_decode_raw_line(dev);
+        }
 
         if (err != NULL) {
             log_debug(dev->log, ESTRING(err));
             return SANE_STATUS_IO_ERROR;
         }
+    }
 
-        if (dev->read_24_to_8) {
-            device_read_24_to_8_resample(dev);
+    /* Strips are already post-processed by the worker pool */
+    if (dev->read_strips == NULL) {
+        if (dev->read_pagestat != NULL) {
+            filter_pagestat_push(dev->read_pagestat,
+                dev->read_line_buf + dev->read_skip_bytes);
         }
-    }
 
-    filter_chain_apply(dev->read_filters,
-            dev->read_line_buf, dev->opt.params.bytes_per_line);
+        filter_chain_apply(dev->read_filters,
+                dev->read_line_buf, dev->opt.params.bytes_per_line);
+    }
 
     dev->read_line_off = 0;
     dev->read_line_num ++;
 
+    if (start != 0) {
+        dev->read_decode_ns += device_read_lock_now() - start;
+    }
+
+    return SANE_STATUS_GOOD;
+}
+
+/* Wait until next image is available. Returns SANE_STATUS_GOOD and
+ * NULL image, if I/O is non-blocking and image is not available yet
+ *
+ * Called under the device's shard mutex
+ */
+static SANE_Status
+device_read_wait (device *dev, http_data **image)
+{
+    for (;;) {
+        *image = device_read_queue_pull(dev);
+        if (*image != NULL) {
+            return SANE_STATUS_GOOD;
+        }
+
+        if (!device_stm_state_working(dev) ||
+            dev->job_status == SANE_STATUS_CANCELLED) {
+            break;
+        }
+
+        if (dev->read_non_blocking) {
+            return SANE_STATUS_GOOD;
+        }
+
+        eloop_cond_wait(&dev->stm_cond);
+    }
+
+    if (dev->job_status == SANE_STATUS_CANCELLED) {
+        return SANE_STATUS_CANCELLED;
+    }
+
+    log_assert(dev->log, dev->job_status != SANE_STATUS_GOOD);
+    return dev->job_status;
+}
+
+/* Classify page as blank or not, using statistics accumulated
+ * while page was decoded. Statistics is logged
+ */
+static bool
+device_read_page_is_blank (device *dev)
+{
+    filter_pagestat_result res;
+    bool                   blank;
+
+    if (dev->read_pagestat == NULL) {
+        return false;
+    }
+
+    filter_pagestat_get(dev->read_pagestat, &res);
+    blank = res.ink <= conf.blank_ink && res.edges <= conf.blank_edges;
+
+    log_debug(dev->log, "page stats: ink=%d.%2.2d%% edges=%d.%2.2d%% "
+        "background=%d%s", res.ink / 100, res.ink % 100,
+        res.edges / 100, res.edges % 100, res.background,
+        blank ? " (blank)" : "");
+
+    return blank;
+}
+
+/* Decode the whole current page in advance into dev->read_page,
+ * so its statistics become available before device_read() is called
+ */
+static SANE_Status
+device_read_predecode (device *dev)
+{
+    size_t      bpl = dev->opt.params.bytes_per_line;
+    SANE_Byte   *page = mem_new(SANE_Byte, bpl * dev->opt.params.lines);
+    SANE_Status status;
+
+    while ((status = device_read_decode_line(dev)) == SANE_STATUS_GOOD) {
+        memcpy(page + (dev->read_line_num - 1) * bpl,
+            dev->read_line_buf + dev->read_skip_bytes, bpl);
+    }
+
+    if (status != SANE_STATUS_EOF) {
+        mem_free(page);
+        return status;
+    }
+
+    dev->read_page = page;
+    dev->read_line_num = 0;
+    dev->read_line_off = bpl;
+
     return SANE_STATUS_GOOD;
 }
 
+/* Update statistics when the whole page is read
+ */
+static void
+device_read_page_done (device *dev)
+{
+    double    pixels = (double) dev->opt.params.pixels_per_line *
+                       dev->opt.params.lines;
+    timestamp elapsed = timestamp_now() - dev->read_start_time;
+
+    if (elapsed > 0) {
+        dev->opt.throughput = SANE_FIX(pixels / elapsed / 1000.0);
+    }
+
+    if (dev->read_decode_ns > 0) {
+        double sec = dev->read_decode_ns / 1e9;
+
+        metric_add(dev->metric_pixels, pixels);
+        metric_add(dev->metric_decode_sec, sec);
+        metric_set(dev->metric_decode_mpps, pixels / sec / 1e6);
+    }
+
+    /* If page was decoded in advance, its statistics is already logged */
+    if (dev->read_page == NULL) {
+        device_read_page_is_blank(dev);
+    }
+}
+
 /* Read scanned image
+ *
+ * This function is called without the event loop mutex. The device's
+ * shard mutex is only acquired, when we need to wait for the next image
+ * or to interact with the device state machine. Reading of image, already
+ * received from the device, only needs the per-device read lock
  */
 SANE_Status
 device_read (device *dev, SANE_Byte *data, SANE_Int max_len, SANE_Int *len_out)
@@ -1785,30 +3186,33 @@ device_read (device *dev, SANE_Byte *data, SANE_Int max_len, SANE_Int *len_out)
         return SANE_STATUS_INVAL;
     }
 
+    /* Region cut from the previous scan was cancelled? */
+    if (dev->regions_page != NULL &&
+        __atomic_load_n(&dev->regions_cancelled, __ATOMIC_SEQ_CST)) {
+        status = SANE_STATUS_CANCELLED;
+        goto DONE;
+    }
+
     /* Wait until device is ready */
-    if (dev->read_image == NULL) {
-        while (device_stm_state_working(dev) &&
-               http_data_queue_empty(dev->read_queue)) {
-            if (dev->read_non_blocking) {
+    if (dev->read_image == NULL && dev->read_page == NULL) {
+        http_data *image = device_read_queue_pull(dev);
+
+        if (image == NULL) {
+            device_lock(dev);
+            status = device_read_wait(dev, &image);
+            device_unlock(dev);
+
+            if (status == SANE_STATUS_GOOD && image == NULL) {
                 *len_out = 0;
                 return SANE_STATUS_GOOD;
             }
-
-            eloop_cond_wait(&dev->stm_cond);
-        }
-
-        if (dev->job_status == SANE_STATUS_CANCELLED) {
-            status = SANE_STATUS_CANCELLED;
-            goto DONE;
         }
 
-        if (http_data_queue_empty(dev->read_queue)) {
-            status = dev->job_status;
-            log_assert(dev->log, status != SANE_STATUS_GOOD);
+        if (status != SANE_STATUS_GOOD) {
             goto DONE;
         }
 
-        status = device_read_next(dev);
+        status = device_read_next(dev, image);
         if (status != SANE_STATUS_GOOD) {
             goto DONE;
         }
@@ -1832,8 +3236,10 @@ device_read (device *dev, SANE_Byte *data, SANE_Int max_len, SANE_Int *len_out)
     }
 
     if (status == SANE_STATUS_IO_ERROR) {
+        device_lock(dev);
         device_job_set_status(dev, SANE_STATUS_IO_ERROR);
         device_stm_cancel_req(dev, "I/O error");
+        device_unlock(dev);
     }
 
     /* Cleanup and exit */
@@ -1848,20 +3254,30 @@ DONE:
     }
 
     /* Scan and read finished - cleanup device */
+    if (status == SANE_STATUS_EOF &&
+        (dev->read_image != NULL || dev->read_page != NULL)) {
+        device_read_page_done(dev);
+    }
+
     dev->flags &= ~(DEVICE_SCANNING | DEVICE_READING);
-    image_decoder_reset(decoder);
+    device_read_image_cleanup(dev);
 
-    if (dev->read_image != NULL) {
-        http_data_unref(dev->read_image);
-        dev->read_image = NULL;
+    device_lock(dev);
+
+    /* Drop remaining regions on error, and if cancel request came
+     * while the region was being read, so the flag doesn't outlive
+     * the regions it was set for
+     */
+    if (status != SANE_STATUS_EOF ||
+        __atomic_load_n(&dev->regions_cancelled, __ATOMIC_SEQ_CST)) {
+        device_regions_reset(dev);
     }
-    mem_free(dev->read_line_buf);
-    dev->read_line_buf = NULL;
 
     if (device_stm_state_get(dev) == DEVICE_STM_DONE &&
         (status != SANE_STATUS_EOF || dev->job_status == SANE_STATUS_GOOD)) {
         device_stm_state_set(dev, DEVICE_STM_IDLE);
     }
+    device_unlock(dev);
 
     return status;
 }
@@ -1875,7 +3291,7 @@ device_management_init (void)
     device_table = ptr_array_new(device*);
     eloop_add_start_stop_callback(device_management_start_stop);
 
-    return SANE_STATUS_GOOD;
+    return devcache_init();
 }
 
 /* Cleanup device management
@@ -1888,6 +3304,8 @@ device_management_cleanup (void)
         mem_free(device_table);
         device_table = NULL;
     }
+
+    devcache_cleanup();
 }
 
 /* Start/stop device management
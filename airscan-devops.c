@@ -29,6 +29,16 @@ static const SANE_Range devopt_gamma_range = {
     .max = SANE_FIX(4.0),
 };
 
+/* Resolutions that are emulated by downscaling, if device lacks them
+ * but supports some higher resolution, at most DEVOPT_EMULATED_RES_MAX
+ * times higher
+ */
+static const SANE_Word devopt_emulated_resolutions[] = {
+    75, 100, 150, 200, 300, 400, 600
+};
+
+#define DEVOPT_EMULATED_RES_MAX 4
+
 /* Initialize device options
  */
 void
@@ -39,6 +49,8 @@ devopt_init (devopt *opt)
     opt->colormode_emul = ID_COLORMODE_UNKNOWN;
     opt->colormode_real = ID_COLORMODE_UNKNOWN;
     opt->resolution = CONFIG_DEFAULT_RESOLUTION;
+    opt->resolution_real = CONFIG_DEFAULT_RESOLUTION;
+    opt->resolutions = sane_word_array_new();
     opt->sane_sources = sane_string_array_new();
     opt->sane_colormodes = sane_string_array_new();
 }
@@ -50,6 +62,7 @@ devopt_cleanup (devopt *opt)
 {
     sane_string_array_free(opt->sane_sources);
     sane_string_array_free(opt->sane_colormodes);
+    sane_word_array_free(opt->resolutions);
     devcaps_cleanup(&opt->caps);
 }
 
@@ -132,6 +145,76 @@ devopt_choose_colormode (devopt *opt, ID_COLORMODE wanted)
     return wanted;
 }
 
+/* Choose real resolution, the scanner will use to scan at
+ * the given resolution. Returns 0, if there is no such resolution
+ */
+static SANE_Word
+devopt_real_resolution (const devcaps_source *src, SANE_Word res)
+{
+    SANE_Word real = 0;
+    size_t    i, end;
+
+    if ((src->flags & DEVCAPS_SOURCE_RES_DISCRETE) == 0) {
+        return res;
+    }
+
+    end = sane_word_array_len(src->resolutions) + 1;
+    for (i = 1; i < end; i ++) {
+        SANE_Word res2 = src->resolutions[i];
+
+        if (res2 == res) {
+            return res;
+        }
+
+        if (res2 > res && (real == 0 || res2 < real)) {
+            real = res2;
+        }
+    }
+
+    return real;
+}
+
+/* Rebuild list of discrete resolutions, adding emulated ones
+ * if appropriate
+ */
+static void
+devopt_rebuild_resolutions (devopt *opt)
+{
+    devcaps_source *src = opt->caps.src[opt->src];
+    size_t         i, end;
+
+    sane_word_array_reset(&opt->resolutions);
+    if ((src->flags & DEVCAPS_SOURCE_RES_DISCRETE) == 0) {
+        return;
+    }
+
+    end = sane_word_array_len(src->resolutions) + 1;
+    for (i = 1; i < end; i ++) {
+        opt->resolutions = sane_word_array_append(opt->resolutions,
+            src->resolutions[i]);
+    }
+
+    /* Downscaler handles only 8-bit images */
+    if (!conf.emulate_res || opt->colormode_emul == ID_COLORMODE_BW1) {
+        return;
+    }
+
+    end = sizeof(devopt_emulated_resolutions) /
+          sizeof(devopt_emulated_resolutions[0]);
+
+    for (i = 0; i < end; i ++) {
+        SANE_Word res = devopt_emulated_resolutions[i];
+        SANE_Word real = devopt_real_resolution(src, res);
+
+        if (real != 0 && real != res &&
+            real <= res * DEVOPT_EMULATED_RES_MAX) {
+            opt->resolutions = sane_word_array_append(opt->resolutions, res);
+        }
+    }
+
+    sane_word_array_sort(opt->resolutions);
+}
+
 /* Choose appropriate scanner resolution
  */
 static SANE_Word
@@ -140,12 +223,12 @@ devopt_choose_resolution (devopt *opt, SANE_Word wanted)
     devcaps_source *src = opt->caps.src[opt->src];
 
     if (src->flags & DEVCAPS_SOURCE_RES_DISCRETE) {
-        SANE_Word res = src->resolutions[1];
+        SANE_Word res = opt->resolutions[1];
         SANE_Word delta = (SANE_Word) labs(wanted - res);
-        size_t i, end = sane_word_array_len(src->resolutions) + 1;
+        size_t i, end = sane_word_array_len(opt->resolutions) + 1;
 
         for (i = 2; i < end; i ++) {
-            SANE_Word res2 = src->resolutions[i];
+            SANE_Word res2 = opt->resolutions[i];
             SANE_Word delta2 = (SANE_Word) labs(wanted - res2);
 
             if (delta2 <= delta) {
@@ -219,7 +302,7 @@ devopt_rebuild_opt_desc (devopt *opt)
     desc->unit = SANE_UNIT_DPI;
     if ((src->flags & DEVCAPS_SOURCE_RES_DISCRETE) != 0) {
         desc->constraint_type = SANE_CONSTRAINT_WORD_LIST;
-        desc->constraint.word_list = src->resolutions;
+        desc->constraint.word_list = opt->resolutions;
     } else {
         desc->constraint_type = SANE_CONSTRAINT_RANGE;
         desc->constraint.range = &src->res_range;
@@ -303,6 +386,18 @@ devopt_rebuild_opt_desc (devopt *opt)
     desc->constraint_type = SANE_CONSTRAINT_RANGE;
     desc->constraint.range = &src->win_y_range_mm;
 
+    /* OPT_SCAN_REGIONS */
+    desc = &opt->desc[OPT_SCAN_REGIONS];
+    desc->name = SANE_NAME_SCAN_REGIONS;
+    desc->title = SANE_TITLE_SCAN_REGIONS;
+    desc->desc = SANE_DESC_SCAN_REGIONS;
+    desc->type = SANE_TYPE_STRING;
+    desc->size = DEVOPT_REGIONS_LEN;
+    desc->cap = SANE_CAP_SOFT_SELECT | SANE_CAP_SOFT_DETECT | SANE_CAP_EMULATED;
+    if (opt->src != ID_SOURCE_PLATEN) {
+        desc->cap |= SANE_CAP_INACTIVE;
+    }
+
     /* OPT_GROUP_ENHANCEMENT */
     desc = &opt->desc[OPT_GROUP_ENHANCEMENT];
     desc->name = SANE_NAME_ENHANCEMENT;
@@ -407,39 +502,51 @@ devopt_rebuild_opt_desc (devopt *opt)
 
     s = id_justification_sane_name(opt->caps.justification_y);
     desc->size = (s ? strlen(s) : 0) + 1;
+
+    /* OPT_THROUGHPUT */
+    desc = &opt->desc[OPT_THROUGHPUT];
+    desc->name = SANE_NAME_THROUGHPUT;
+    desc->title = SANE_TITLE_THROUGHPUT;
+    desc->desc = SANE_DESC_THROUGHPUT;
+    desc->type = SANE_TYPE_FIXED;
+    desc->size = sizeof(SANE_Fixed);
+    desc->cap = SANE_CAP_SOFT_DETECT;
+    if (!conf.metrics_option) {
+        desc->cap |= SANE_CAP_INACTIVE;
+    }
 }
 
-/* Update scan parameters, according to the currently set
- * scan options
+/* Compute scan parameters for the given window, using
+ * current resolution and color mode
  */
-static void
-devopt_update_params (devopt *opt)
+void
+devopt_region_params (const devopt *opt, const devopt_region *win,
+        SANE_Parameters *params)
 {
-    SANE_Fixed wid = math_max(0, opt->br_x - opt->tl_x);
-    SANE_Fixed hei = math_max(0, opt->br_y - opt->tl_y);
+    SANE_Fixed wid = math_max(0, win->br_x - win->tl_x);
+    SANE_Fixed hei = math_max(0, win->br_y - win->tl_y);
 
-    opt->params.last_frame = SANE_TRUE;
-    opt->params.pixels_per_line = math_mm2px_res(wid, opt->resolution);
-    opt->params.lines = math_mm2px_res(hei, opt->resolution);
+    params->last_frame = SANE_TRUE;
+    params->pixels_per_line = math_mm2px_res(wid, opt->resolution);
+    params->lines = math_mm2px_res(hei, opt->resolution);
 
     switch (opt->colormode_emul) {
     case ID_COLORMODE_COLOR:
-        opt->params.format = SANE_FRAME_RGB;
-        opt->params.depth = 8;
-        opt->params.bytes_per_line = opt->params.pixels_per_line * 3;
+        params->format = SANE_FRAME_RGB;
+        params->depth = 8;
+        params->bytes_per_line = params->pixels_per_line * 3;
         break;
 
     case ID_COLORMODE_GRAYSCALE:
-        opt->params.format = SANE_FRAME_GRAY;
-        opt->params.depth = 8;
-        opt->params.bytes_per_line = opt->params.pixels_per_line;
+        params->format = SANE_FRAME_GRAY;
+        params->depth = 8;
+        params->bytes_per_line = params->pixels_per_line;
         break;
 
     case ID_COLORMODE_BW1:
-        opt->params.format = SANE_FRAME_GRAY;
-        opt->params.depth = 1;
-        opt->params.bytes_per_line =
-                ((opt->params.pixels_per_line + 7) / 8) * 8;
+        params->format = SANE_FRAME_GRAY;
+        params->depth = 1;
+        params->bytes_per_line = ((params->pixels_per_line + 7) / 8) * 8;
         break;
 
     default:
@@ -447,16 +554,30 @@ devopt_update_params (devopt *opt)
     }
 }
 
+/* Update scan parameters, according to the currently set
+ * scan options
+ */
+static void
+devopt_update_params (devopt *opt)
+{
+    devopt_region win = {opt->tl_x, opt->tl_y, opt->br_x, opt->br_y};
+
+    devopt_region_params(opt, &win, &opt->params);
+}
+
 /* Set current resolution
  */
 static SANE_Status
 devopt_set_resolution (devopt *opt, SANE_Word opt_resolution, SANE_Word *info)
 {
+    devcaps_source *src = opt->caps.src[opt->src];
+
     if (opt->resolution == opt_resolution) {
         return SANE_STATUS_GOOD;
     }
 
     opt->resolution = devopt_choose_resolution(opt, opt_resolution);
+    opt->resolution_real = devopt_real_resolution(src, opt->resolution);
 
     *info |= SANE_INFO_RELOAD_PARAMS;
     if (opt->resolution != opt_resolution) {
@@ -482,6 +603,16 @@ devopt_set_colormode (devopt *opt, ID_COLORMODE id_colormode, SANE_Word *info)
         return SANE_STATUS_INVAL;
     }
 
+    /* Emulated resolutions depend on color mode */
+    if ((opt->colormode_emul == ID_COLORMODE_BW1) !=
+        (id_colormode == ID_COLORMODE_BW1)) {
+        opt->colormode_emul = id_colormode;
+        devopt_rebuild_resolutions(opt);
+        opt->resolution = devopt_choose_resolution(opt, opt->resolution);
+        opt->resolution_real = devopt_real_resolution(src, opt->resolution);
+        *info |= SANE_INFO_RELOAD_OPTIONS;
+    }
+
     opt->colormode_emul = id_colormode;
     opt->colormode_real = devopt_real_colormode(id_colormode, src);
 
@@ -511,7 +642,9 @@ devopt_set_source (devopt *opt, ID_SOURCE id_src, SANE_Word *info)
     opt->colormode_emul = devopt_choose_colormode(opt, opt->colormode_emul);
 
     /* Try to preserve resolution */
+    devopt_rebuild_resolutions(opt);
     opt->resolution = devopt_choose_resolution(opt, opt->resolution);
+    opt->resolution_real = devopt_real_resolution(src, opt->resolution);
 
     /* Reset window to maximum size */
     opt->tl_x = 0;
@@ -573,6 +706,94 @@ devopt_set_geom (devopt *opt, SANE_Int option, SANE_Fixed val, SANE_Word *info)
     return SANE_STATUS_GOOD;
 }
 
+/* Parse the next number of the regions option value. The number
+ * must fit SANE_Fixed; NaN and infinity are rejected
+ */
+static bool
+devopt_parse_regions_num (const char **s, SANE_Fixed *out)
+{
+    char   *end;
+    double v = strtod(*s, &end);
+
+    if (end == *s || !(v >= 0 && v < 32768)) {
+        return false;
+    }
+
+    *out = SANE_FIX(v);
+    for (*s = end; safe_isspace(**s); (*s) ++)
+        ;
+
+    return true;
+}
+
+/* Set regions option. The value is either empty string (regions
+ * disabled), "auto" or list of windows in millimeters:
+ *   tl-x,tl-y,br-x,br-y;tl-x,tl-y,br-x,br-y;...
+ */
+static SANE_Status
+devopt_set_regions (devopt *opt, const char *value)
+{
+    devcaps_source *src = opt->caps.src[opt->src];
+    devopt_region  regions[DEVOPT_REGIONS_MAX];
+    int            num = 0;
+    const char     *s = value;
+
+    if (strlen(value) >= DEVOPT_REGIONS_LEN) {
+        return SANE_STATUS_INVAL;
+    }
+
+    if (!strcasecmp(value, "auto")) {
+        opt->regions_auto = true;
+        opt->regions_num = 0;
+        strcpy(opt->regions_str, value);
+        return SANE_STATUS_GOOD;
+    }
+
+    for (; safe_isspace(*s); s ++)
+        ;
+
+    while (*s != '\0') {
+        devopt_region *r = &regions[num];
+        SANE_Fixed    *v[4] = {&r->tl_x, &r->tl_y, &r->br_x, &r->br_y};
+        int           i;
+
+        if (num == DEVOPT_REGIONS_MAX) {
+            return SANE_STATUS_INVAL;
+        }
+
+        for (i = 0; i < 4; i ++) {
+            if (!devopt_parse_regions_num(&s, v[i])) {
+                return SANE_STATUS_INVAL;
+            }
+
+            if (i < 3 ? *s != ',' : *s != ';' && *s != '\0') {
+                return SANE_STATUS_INVAL;
+            }
+
+            if (*s != '\0') {
+                s ++;
+            }
+        }
+
+        for (; safe_isspace(*s); s ++)
+            ;
+
+        if (r->tl_x >= r->br_x || r->br_x > src->win_x_range_mm.max ||
+            r->tl_y >= r->br_y || r->br_y > src->win_y_range_mm.max) {
+            return SANE_STATUS_INVAL;
+        }
+
+        num ++;
+    }
+
+    opt->regions_auto = false;
+    opt->regions_num = num;
+    memcpy(opt->regions, regions, sizeof(regions));
+    strcpy(opt->regions_str, value);
+
+    return SANE_STATUS_GOOD;
+}
+
 /* Set enhancement option
  */
 static SANE_Status
@@ -632,7 +853,9 @@ devopt_set_defaults (devopt *opt)
 
     opt->colormode_emul = devopt_choose_colormode(opt, ID_COLORMODE_UNKNOWN);
     opt->colormode_real = devopt_real_colormode(opt->colormode_emul, src);
+    devopt_rebuild_resolutions(opt);
     opt->resolution = devopt_choose_resolution(opt, CONFIG_DEFAULT_RESOLUTION);
+    opt->resolution_real = devopt_real_resolution(src, opt->resolution);
 
     opt->tl_x = 0;
     opt->tl_y = 0;
@@ -645,6 +868,10 @@ devopt_set_defaults (devopt *opt)
     opt->highlight = SANE_FIX(100.0);
     opt->gamma = SANE_FIX(1.0);
 
+    opt->regions_str[0] = '\0';
+    opt->regions_auto = false;
+    opt->regions_num = 0;
+
     devopt_rebuild_opt_desc(opt);
     devopt_update_params(opt);
 }
@@ -657,10 +884,10 @@ devopt_set_option (devopt *opt, SANE_Int option, void *value, SANE_Word *info)
     SANE_Status    status = SANE_STATUS_GOOD;
     ID_SOURCE      id_src;
     ID_COLORMODE   id_colormode;
+    SANE_Word      unused;
 
     /* Simplify life of options handlers by ensuring info != NULL  */
     if (info == NULL) {
-        static SANE_Word unused;
         info = &unused;
     }
 
@@ -697,6 +924,10 @@ devopt_set_option (devopt *opt, SANE_Int option, void *value, SANE_Word *info)
         status = devopt_set_geom(opt, option, *(SANE_Fixed*)value, info);
         break;
 
+    case OPT_SCAN_REGIONS:
+        status = devopt_set_regions(opt, value);
+        break;
+
     case OPT_BRIGHTNESS:
     case OPT_CONTRAST:
     case OPT_SHADOW:
@@ -766,6 +997,10 @@ devopt_get_option (devopt *opt, SANE_Int option, void *value)
         *(SANE_Fixed*) value = opt->br_y;
         break;
 
+    case OPT_SCAN_REGIONS:
+        strcpy(value, opt->regions_str);
+        break;
+
     case OPT_BRIGHTNESS:
         *(SANE_Fixed*) value = opt->brightness;
         break;
@@ -800,6 +1035,10 @@ devopt_get_option (devopt *opt, SANE_Int option, void *value)
         strcpy(value, s ? s : "");
         break;
 
+    case OPT_THROUGHPUT:
+        *(SANE_Fixed*) value = opt->throughput;
+        break;
+
     default:
         status = SANE_STATUS_INVAL;
     }
@@ -14,79 +14,369 @@
 #include <errno.h>
 #include <unistd.h>
 
+#ifdef OS_HAVE_EPOLL
+#   include <sys/epoll.h>
+#   include <sys/timerfd.h>
+#endif
+
 /******************** Constants *********************/
 #define ELOOP_START_STOP_CALLBACKS_MAX  8
+#define ELOOP_EPOLL_EVENTS_MAX          64
+#define ELOOP_TIMER_WHEEL_BITS          6
+#define ELOOP_TIMER_WHEEL_SIZE          (1 << ELOOP_TIMER_WHEEL_BITS)
+#define ELOOP_TIMER_WHEEL_LEVELS        5
+#define ELOOP_TIMER_POOL_MAX            256
+#define ELOOP_CALL_CHUNK_SIZE           256
+#define ELOOP_CALL_CHUNKS_MAX           4096
+#define ELOOP_SHARDS_MAX                CONF_IO_THREADS_MAX
+#define ELOOP_STAT_BUCKETS              24
+#define ELOOP_STAT_SITES_MAX            256
+
+/******************** Types *********************/
+/* eloop_call_pending represents a pending eloop_call
+ *
+ * Pending calls are allocated from the table of slots, which
+ * grows by chunks and never shrinks, so slot memory remains
+ * valid until eloop_cleanup(). Slots are never freed, instead
+ * they are returned into the lock-free free list, and the slot
+ * generation is incremented on each reuse.
+ *
+ * The callid, returned by eloop_call(), contains slot index
+ * and generation, so eloop_call_cancel() finds the slot in O(1)
+ * and recognizes a stale callid by generation mismatch. The
+ * generation wraps within 32 bits, as callid keeps only 32 bits
+ * of it, and skips 0, so callid is never 0.
+ *
+ * The slot's generation and state are packed together into
+ * the single word, so slot reuse and cancellation can't race
+ */
+typedef struct eloop_call_pending eloop_call_pending;
+struct eloop_call_pending {
+    eloop_call_pending *next;          /* Next in the queue */
+    uint64_t           tag;            /* Generation and state */
+    uint32_t           index;          /* Slot index */
+    uint32_t           free_next;      /* Next in free list, index + 1 */
+    void               (*func)(void*); /* Function to be called */
+    void               *data;          /* It's argument */
+};
+
+/* eloop_stat_site represents the run time statistics of
+ * the particular callback site, i.e., the callback function
+ *
+ * The histogram bucket N counts calls that took less than
+ * 2^N microseconds; the last bucket counts all slower calls
+ */
+typedef struct {
+    const char *kind;                    /* "fdpoll", "timer", "call"... */
+    void       *func;                    /* Callback function */
+    uint64_t   count;                    /* Count of calls */
+    uint64_t   total_us;                 /* Total run time */
+    uint64_t   max_us;                   /* Max run time */
+    uint32_t   hist[ELOOP_STAT_BUCKETS]; /* Run time histogram */
+} eloop_stat_site;
+
+/* eloop_stat_mark represents the callback being measured
+ *
+ * Marks of nested callbacks are linked into the stack, so the
+ * run time of the inner callback is not accounted twice
+ */
+typedef struct eloop_stat_mark eloop_stat_mark;
+struct eloop_stat_mark {
+    eloop_stat_mark *prev;     /* Mark of the outer callback */
+    void            *func;     /* Callback function */
+    int64_t         start;     /* Start time, in microseconds */
+    int64_t         inner_us;  /* Run time of nested callbacks */
+};
+
+/* eloop_shard represents the event loop thread with everything
+ * it owns: the mutex, the poll backend, the timers and the queue
+ * of pending calls
+ *
+ * The primary shard (eloop_shards[0]) runs discovery and the
+ * start/stop callbacks. Additional shards, if configured, only run
+ * devices, assigned to them by eloop_shard_pick()
+ */
+struct eloop_shard {
+    int                index;           /* Index in eloop_shards[] */
+    pthread_t          thread;          /* Shard's thread */
+    pthread_mutex_t    mutex;           /* Shard's mutex (recursive) */
+    int                lock_depth;      /* Mutex recursion depth */
+    eloop_shard        *lock_prev;      /* Owner's previous current shard */
+    bool               running;         /* Thread is running */
+    int                load;            /* Count of assigned devices */
+
+#ifdef OS_HAVE_EPOLL
+    /* epoll backend */
+    int                epoll_fd;        /* epoll(7) file descriptor */
+    int                timerfd;         /* timerfd(2) for timers */
+    eloop_fdpoll       *timerfd_fdpoll; /* Polls timerfd */
+    eloop_event        *wakeup;         /* Wakes up epoll_wait() */
+    bool               quit;            /* eloop_thread_stop() called */
+    ll_head            fdpoll_garbage;  /* Freed eloop_fdpolls */
+#endif
+
+    /* Timers */
+    ll_head            timer_wheel[ELOOP_TIMER_WHEEL_LEVELS]
+                                  [ELOOP_TIMER_WHEEL_SIZE];
+    uint64_t           timer_wheel_bitmap[ELOOP_TIMER_WHEEL_LEVELS];
+    timestamp          timer_wheel_base; /* First unprocessed ms */
+    timestamp          timer_armed;      /* Backend deadline, -1 if none */
+    ll_head            timer_pool;       /* Pool of free timers */
+    int                timer_pool_len;   /* Length of timer_pool */
+    bool               clock_idle;       /* Idle for conf.dbg_clock_warp */
+    timestamp          clock_next;       /* Next wheel event, when idle */
+
+    /* Pending calls */
+    eloop_call_pending *call_queue_head; /* Producers push here */
+    eloop_call_pending *call_queue_tail; /* Consumer pops here */
+    eloop_call_pending call_queue_stub;  /* Queue stub node */
+    bool               call_wakeup;      /* Wakeup is pending */
+
+    /* Callback statistics */
+    eloop_stat_site    *stat_sites;     /* Per-site stats, NULL if disabled */
+    eloop_stat_mark    *stat_mark;      /* Innermost running callback */
+    void               *stat_func;      /* Its function, for watchdog */
+    int64_t            busy_since;      /* Left poll at, us, 0 if polling */
+    int64_t            watchdog_since;  /* busy_since, seen by watchdog */
+    int64_t            watchdog_report; /* Next stall report, us */
+};
 
 /******************** Static variables *********************/
+#ifdef OS_HAVE_EPOLL
+static const AvahiPoll eloop_avahi_poll;
+#else
 static AvahiSimplePoll *eloop_poll;
-static pthread_t eloop_thread;
-static pthread_mutex_t eloop_mutex;
-static bool eloop_thread_running;
-static ll_head eloop_call_pending_list;
+static AvahiTimeout *eloop_poll_timeout;
 static bool eloop_poll_restart;
+#endif
+static eloop_shard eloop_shards[ELOOP_SHARDS_MAX];
+static int eloop_shards_count;
+static __thread eloop_shard *eloop_shard_current;
+static struct eloop_call_pending *eloop_call_chunks[ELOOP_CALL_CHUNKS_MAX];
+static pthread_mutex_t eloop_call_chunks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t eloop_call_slots_count;
+static uint64_t eloop_call_free;
 
 static __thread char eloop_estring[256];
 static void (*eloop_start_stop_callbacks[ELOOP_START_STOP_CALLBACKS_MAX]) (bool);
 static int eloop_start_stop_callbacks_count;
+static int64_t eloop_stat_threshold;
+static pthread_t eloop_watchdog_thread;
+static pthread_mutex_t eloop_watchdog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t eloop_watchdog_cond;
+static bool eloop_watchdog_running;
+
+/* The primary shard
+ */
+#define ELOOP_SHARD_PRIMARY     (&eloop_shards[0])
+
+/* The virtual clock skew, see timestamp_now()
+ */
+timestamp timestamp_skew;
 
 /******************** Standard errors *********************/
 error ERROR_ENOMEM = (error) "Out of memory";
 
 /******************** Forward declarations *********************/
+#ifdef OS_HAVE_EPOLL
+static SANE_Status
+eloop_epoll_init (eloop_shard *shard);
+
+static void
+eloop_epoll_cleanup (eloop_shard *shard);
+
+static void
+eloop_epoll_run (eloop_shard *shard);
+#else
 static int
 eloop_poll_func (struct pollfd *ufds, unsigned int nfds, int timeout, void *p);
 
 static void
-eloop_call_execute (void);
+eloop_poll_timeout_callback (AvahiTimeout *t, void *data);
+#endif
 
-/* Initialize event loop
+static void
+eloop_call_execute (eloop_shard *shard);
+
+static void
+eloop_call_init (void);
+
+static void
+eloop_call_queue_init (eloop_shard *shard);
+
+static void
+eloop_call_cleanup (void);
+
+static void
+eloop_timer_init (eloop_shard *shard);
+
+static void
+eloop_timer_cleanup (eloop_shard *shard);
+
+static void
+eloop_timer_wheel_expire (eloop_shard *shard);
+
+static void
+eloop_timer_backend_arm (eloop_shard *shard, timestamp deadline);
+
+static eloop_timer*
+eloop_shard_timer_new (eloop_shard *shard, int timeout,
+        void (*callback)(void *), void *data);
+
+static eloop_shard*
+eloop_shard_get_current (void);
+
+static void
+eloop_stat_busy (eloop_shard *shard, bool busy);
+
+static void
+eloop_stat_begin (eloop_shard *shard, eloop_stat_mark *mark, void *func);
+
+static void
+eloop_stat_end (eloop_shard *shard, eloop_stat_mark *mark,
+        const char *kind, void *func);
+
+static void
+eloop_stat_dump (eloop_shard *shard);
+
+static void
+eloop_watchdog_start (void);
+
+static void
+eloop_watchdog_stop (void);
+
+static void
+eloop_clock_warp (eloop_shard *shard);
+
+static void
+eloop_clock_busy (eloop_shard *shard);
+
+/* Initialize the event loop shard
  */
-SANE_Status
-eloop_init (void)
+static SANE_Status
+eloop_shard_init (eloop_shard *shard, int index)
 {
     pthread_mutexattr_t attr;
-    bool                attr_initialized = false;
-    bool                mutex_initialized = false;
     SANE_Status         status = SANE_STATUS_NO_MEM;
 
-    ll_init(&eloop_call_pending_list);
-    eloop_start_stop_callbacks_count = 0;
+    memset(shard, 0, sizeof(*shard));
+    shard->index = index;
 
-    /* Initialize eloop_mutex */
+    /* Initialize shard's mutex */
     if (pthread_mutexattr_init(&attr)) {
-        goto DONE;
+        return SANE_STATUS_NO_MEM;
     }
 
-    attr_initialized = true;
-    if (pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE)) {
-        goto DONE;
+    if (pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE) ||
+        pthread_mutex_init(&shard->mutex, &attr)) {
+        pthread_mutexattr_destroy(&attr);
+        return SANE_STATUS_NO_MEM;
     }
 
-    if (pthread_mutex_init(&eloop_mutex, &attr)) {
-        goto DONE;
+    pthread_mutexattr_destroy(&attr);
+
+    /* Allocate callback statistics, if enabled */
+    if (eloop_stat_threshold > 0) {
+        shard->stat_sites = mem_new(eloop_stat_site, ELOOP_STAT_SITES_MAX);
     }
 
-    mutex_initialized = true;
+    /* Initialize timers and pending calls queue */
+    eloop_timer_init(shard);
+    eloop_call_queue_init(shard);
+
+#ifdef OS_HAVE_EPOLL
+    /* Create epoll and friends. Objects, created here, are bound
+     * to the shard, which mutex is held
+     */
+    eloop_shard_lock(shard);
+    status = eloop_epoll_init(shard);
+    eloop_shard_unlock(shard);
+#else
+    status = SANE_STATUS_GOOD;
+#endif
 
-    /* Create AvahiSimplePoll */
-    eloop_poll = avahi_simple_poll_new();
-    if (eloop_poll == NULL) {
-        goto DONE;
+    if (status != SANE_STATUS_GOOD) {
+        eloop_timer_cleanup(shard);
+        mem_free(shard->stat_sites);
+        pthread_mutex_destroy(&shard->mutex);
     }
 
-    avahi_simple_poll_set_func(eloop_poll, eloop_poll_func, NULL);
+    return status;
+}
 
-    /* Update status */
-    status = SANE_STATUS_GOOD;
+/* Cleanup the event loop shard
+ */
+static void
+eloop_shard_cleanup (eloop_shard *shard)
+{
+#ifdef OS_HAVE_EPOLL
+    eloop_shard_lock(shard);
+    eloop_epoll_cleanup(shard);
+    eloop_shard_unlock(shard);
+#endif
+    eloop_timer_cleanup(shard);
+    eloop_stat_dump(shard);
+    mem_free(shard->stat_sites);
+    pthread_mutex_destroy(&shard->mutex);
+}
 
-    /* Cleanup and exit */
-DONE:
-    if (attr_initialized) {
-        pthread_mutexattr_destroy(&attr);
+/* Initialize event loop
+ */
+SANE_Status
+eloop_init (void)
+{
+    SANE_Status status = SANE_STATUS_GOOD;
+    int         i, count = conf.io_threads;
+
+#ifndef OS_HAVE_EPOLL
+    if (count > 1) {
+        log_debug(NULL, "eloop: multiple I/O threads not supported");
+        count = 1;
+    }
+#endif
+
+    count = math_bound(count, 1, ELOOP_SHARDS_MAX);
+    eloop_stat_threshold = (int64_t) conf.dbg_stall * 1000;
+
+    eloop_call_init();
+    eloop_start_stop_callbacks_count = 0;
+
+    /* Initialize shards */
+    for (i = 0; i < count && status == SANE_STATUS_GOOD; i ++) {
+        status = eloop_shard_init(&eloop_shards[i], i);
+        if (status == SANE_STATUS_GOOD) {
+            eloop_shards_count = i + 1;
+        }
+    }
+
+#ifndef OS_HAVE_EPOLL
+    if (status == SANE_STATUS_GOOD) {
+        /* Create AvahiSimplePoll */
+        eloop_poll = avahi_simple_poll_new();
+        if (eloop_poll == NULL) {
+            status = SANE_STATUS_NO_MEM;
+        }
     }
 
-    if (status != SANE_STATUS_GOOD && mutex_initialized) {
-        pthread_mutex_destroy(&eloop_mutex);
+    if (status == SANE_STATUS_GOOD) {
+        avahi_simple_poll_set_func(eloop_poll, eloop_poll_func, NULL);
+
+        /* Create AvahiTimeout for timers */
+        eloop_poll_timeout = avahi_simple_poll_get(eloop_poll)->timeout_new(
+            avahi_simple_poll_get(eloop_poll), NULL,
+            eloop_poll_timeout_callback, NULL);
+        if (eloop_poll_timeout == NULL) {
+            avahi_simple_poll_free(eloop_poll);
+            eloop_poll = NULL;
+            status = SANE_STATUS_NO_MEM;
+        }
+    }
+#endif
+
+    if (status != SANE_STATUS_GOOD) {
+        eloop_cleanup();
+    } else if (eloop_shards_count > 1) {
+        log_debug(NULL, "eloop: %d I/O threads", eloop_shards_count);
     }
 
     return status;
@@ -97,10 +387,23 @@ DONE:
 void
 eloop_cleanup (void)
 {
+    int i;
+
+#ifndef OS_HAVE_EPOLL
     if (eloop_poll != NULL) {
         avahi_simple_poll_free(eloop_poll);
-        pthread_mutex_destroy(&eloop_mutex);
         eloop_poll = NULL;
+        eloop_poll_timeout = NULL;
+    }
+#endif
+
+    for (i = eloop_shards_count - 1; i >= 0; i --) {
+        eloop_shard_cleanup(&eloop_shards[i]);
+    }
+
+    if (eloop_shards_count > 0) {
+        eloop_call_cleanup();
+        eloop_shards_count = 0;
     }
 }
 
@@ -122,21 +425,35 @@ eloop_add_start_stop_callback (void (*callback) (bool start))
     eloop_start_stop_callbacks_count ++;
 }
 
+#ifndef OS_HAVE_EPOLL
 /* Poll function hook
  */
 static int
 eloop_poll_func (struct pollfd *ufds, unsigned int nfds, int timeout,
         void *userdata)
 {
-    int     rc;
+    int     rc, warp = conf.dbg_clock_warp;
 
     (void) userdata;
 
     eloop_poll_restart = false;
 
-    pthread_mutex_unlock(&eloop_mutex);
-    rc = poll(ufds, nfds, timeout);
-    pthread_mutex_lock(&eloop_mutex);
+    eloop_stat_busy(ELOOP_SHARD_PRIMARY, false);
+    eloop_shard_unlock(ELOOP_SHARD_PRIMARY);
+    if (warp > 0 && (timeout < 0 || timeout > warp)) {
+        rc = poll(ufds, nfds, warp);
+    } else {
+        warp = 0;
+        rc = poll(ufds, nfds, timeout);
+    }
+    eloop_shard_lock(ELOOP_SHARD_PRIMARY);
+    eloop_stat_busy(ELOOP_SHARD_PRIMARY, true);
+
+    if (rc == 0 && warp > 0) {
+        eloop_clock_warp(ELOOP_SHARD_PRIMARY);
+    } else if (rc != 0) {
+        eloop_clock_busy(ELOOP_SHARD_PRIMARY);
+    }
 
     /* Avahi multithreading support is semi-broken. Though new
      * AvahiWatch could be added from a context of any thread
@@ -172,67 +489,221 @@ eloop_poll_func (struct pollfd *ufds, unsigned int nfds, int timeout,
     return rc;
 }
 
+/* eloop_poll_timeout callback
+ */
+static void
+eloop_poll_timeout_callback (AvahiTimeout *t, void *data)
+{
+    (void) t;
+    (void) data;
+
+    eloop_timer_wheel_expire(ELOOP_SHARD_PRIMARY);
+}
+
+/* Arm eloop_poll_timeout to the specified deadline
+ *
+ * This backend supports only the primary shard
+ */
+static void
+eloop_timer_backend_arm (eloop_shard *shard, timestamp deadline)
+{
+    const AvahiPoll *poll = avahi_simple_poll_get(eloop_poll);
+    timestamp       now = timestamp_now();
+    struct timeval  tv;
+
+    (void) shard;
+
+    avahi_elapse_time(&tv, deadline > now ? (unsigned) (deadline - now) : 0, 0);
+    poll->timeout_update(eloop_poll_timeout, &tv);
+
+    /* Timer may be armed from any thread, so make sure event
+     * loop thread will notice the new deadline
+     */
+    avahi_simple_poll_wakeup(eloop_poll);
+}
+#endif
+
 /* Event loop thread main function
  */
 static void*
 eloop_thread_func (void *data)
 {
-    int i;
+    eloop_shard *shard = data;
+    bool        primary = shard == ELOOP_SHARD_PRIMARY;
+    int         i;
 
-    (void) data;
-
-    pthread_mutex_lock(&eloop_mutex);
+    eloop_shard_lock(shard);
+    eloop_stat_busy(shard, true);
 
-    for (i = 0; i < eloop_start_stop_callbacks_count; i ++) {
+    for (i = 0; primary && i < eloop_start_stop_callbacks_count; i ++) {
         eloop_start_stop_callbacks[i](true);
     }
 
-    __atomic_store_n(&eloop_thread_running, true, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&shard->running, true, __ATOMIC_SEQ_CST);
 
+#ifdef OS_HAVE_EPOLL
+    eloop_epoll_run(shard);
+#else
     do {
-        eloop_call_execute();
+        eloop_call_execute(shard);
         i = avahi_simple_poll_iterate(eloop_poll, -1);
     } while (i == 0 || (i < 0 && (errno == EINTR || errno == EBUSY)));
+#endif
 
-    for (i = eloop_start_stop_callbacks_count - 1; i >= 0; i --) {
+    for (i = eloop_start_stop_callbacks_count - 1; primary && i >= 0; i --) {
         eloop_start_stop_callbacks[i](false);
     }
 
-    pthread_mutex_unlock(&eloop_mutex);
+    eloop_stat_busy(shard, false);
+    eloop_shard_unlock(shard);
 
     return NULL;
 }
 
-/* Start event loop thread.
+/* Start the shard's thread
  */
-void
-eloop_thread_start (void)
+static void
+eloop_shard_thread_start (eloop_shard *shard)
 {
     int        rc;
     useconds_t usec = 100;
 
-    rc = pthread_create(&eloop_thread, NULL, eloop_thread_func, NULL);
+    rc = pthread_create(&shard->thread, NULL, eloop_thread_func, shard);
     if (rc != 0) {
         log_panic(NULL, "pthread_create: %s", strerror(rc));
     }
 
     /* Wait until thread is started and all start callbacks are executed */
-    while (!__atomic_load_n(&eloop_thread_running, __ATOMIC_SEQ_CST)) {
+    while (!__atomic_load_n(&shard->running, __ATOMIC_SEQ_CST)) {
         usleep(usec);
         usec += usec;
     }
 }
 
+/* Stop the shard's thread and wait until its termination
+ */
+static void
+eloop_shard_thread_stop (eloop_shard *shard)
+{
+    if (__atomic_load_n(&shard->running, __ATOMIC_SEQ_CST)) {
+#ifdef OS_HAVE_EPOLL
+        __atomic_store_n(&shard->quit, true, __ATOMIC_SEQ_CST);
+        eloop_event_trigger(shard->wakeup);
+#else
+        avahi_simple_poll_quit(eloop_poll);
+#endif
+        pthread_join(shard->thread, NULL);
+        __atomic_store_n(&shard->running, false, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* Start event loop thread.
+ *
+ * Additional shards are started first, so when start callbacks
+ * are called on the primary shard, all shards are ready
+ */
+void
+eloop_thread_start (void)
+{
+    int i;
+
+    for (i = eloop_shards_count - 1; i >= 0; i --) {
+        eloop_shard_thread_start(&eloop_shards[i]);
+    }
+
+    eloop_watchdog_start();
+}
+
 /* Stop event loop thread and wait until its termination
+ *
+ * The primary shard is stopped first, so stop callbacks
+ * may still use other shards
  */
 void
 eloop_thread_stop (void)
 {
-    if (__atomic_load_n(&eloop_thread_running, __ATOMIC_SEQ_CST)) {
-        avahi_simple_poll_quit(eloop_poll);
-        pthread_join(eloop_thread, NULL);
-        __atomic_store_n(&eloop_thread_running, false, __ATOMIC_SEQ_CST);
+    int i;
+
+    eloop_watchdog_stop();
+
+    for (i = 0; i < eloop_shards_count; i ++) {
+        eloop_shard_thread_stop(&eloop_shards[i]);
+    }
+}
+
+/* Get shard, which mutex is held by the current thread, or
+ * the primary shard if there is no such shard
+ */
+static eloop_shard*
+eloop_shard_get_current (void)
+{
+    eloop_shard *shard = eloop_shard_current;
+    return shard != NULL ? shard : ELOOP_SHARD_PRIMARY;
+}
+
+/* Get the primary shard
+ */
+eloop_shard*
+eloop_shard_primary (void)
+{
+    return ELOOP_SHARD_PRIMARY;
+}
+
+/* Pick the least loaded shard for the new device
+ *
+ * The returned shard must be released by eloop_shard_release(),
+ * when device is destroyed
+ */
+eloop_shard*
+eloop_shard_pick (void)
+{
+    eloop_shard *best = ELOOP_SHARD_PRIMARY;
+    int         i;
+
+    for (i = 1; i < eloop_shards_count; i ++) {
+        eloop_shard *shard = &eloop_shards[i];
+        if (__atomic_load_n(&shard->load, __ATOMIC_RELAXED) <
+            __atomic_load_n(&best->load, __ATOMIC_RELAXED)) {
+            best = shard;
+        }
+    }
+
+    __atomic_fetch_add(&best->load, 1, __ATOMIC_RELAXED);
+    return best;
+}
+
+/* Release the shard, returned by eloop_shard_pick()
+ */
+void
+eloop_shard_release (eloop_shard *shard)
+{
+    __atomic_fetch_sub(&shard->load, 1, __ATOMIC_RELAXED);
+}
+
+/* Acquire the shard's mutex
+ *
+ * While the mutex is held, the shard becomes the current shard
+ * of the calling thread
+ */
+void
+eloop_shard_lock (eloop_shard *shard)
+{
+    pthread_mutex_lock(&shard->mutex);
+    if (shard->lock_depth ++ == 0) {
+        shard->lock_prev = eloop_shard_current;
+        eloop_shard_current = shard;
+    }
+}
+
+/* Release the shard's mutex
+ */
+void
+eloop_shard_unlock (eloop_shard *shard)
+{
+    if (-- shard->lock_depth == 0) {
+        eloop_shard_current = shard->lock_prev;
     }
+    pthread_mutex_unlock(&shard->mutex);
 }
 
 /* Acquire event loop mutex
@@ -240,7 +711,7 @@ eloop_thread_stop (void)
 void
 eloop_mutex_lock (void)
 {
-    pthread_mutex_lock(&eloop_mutex);
+    eloop_shard_lock(ELOOP_SHARD_PRIMARY);
 }
 
 /* Release event loop mutex
@@ -248,15 +719,28 @@ eloop_mutex_lock (void)
 void
 eloop_mutex_unlock (void)
 {
-    pthread_mutex_unlock(&eloop_mutex);
+    eloop_shard_unlock(ELOOP_SHARD_PRIMARY);
 }
 
 /* Wait on conditional variable under the event loop mutex
+ *
+ * The mutex of the current shard is used. While waiting, the
+ * mutex may be acquired by other threads, so lock bookkeeping
+ * is saved and restored around the wait
  */
 void
 eloop_cond_wait (pthread_cond_t *cond)
 {
-    pthread_cond_wait(cond, &eloop_mutex);
+    eloop_shard *shard = eloop_shard_get_current();
+    int         depth = shard->lock_depth;
+    eloop_shard *prev = shard->lock_prev;
+
+    shard->lock_depth = 0;
+    pthread_cond_wait(cond, &shard->mutex);
+
+    shard->lock_depth = depth;
+    shard->lock_prev = prev;
+    eloop_shard_current = shard;
 }
 
 /* Get AvahiPoll that runs in event loop thread
@@ -264,120 +748,372 @@ eloop_cond_wait (pthread_cond_t *cond)
 const AvahiPoll*
 eloop_poll_get (void)
 {
+#ifdef OS_HAVE_EPOLL
+    return &eloop_avahi_poll;
+#else
     return avahi_simple_poll_get(eloop_poll);
+#endif
 }
 
-/* eloop_call_pending represents a pending eloop_call
+/* Slot states, kept in the low bits of eloop_call_pending::tag
  */
-typedef struct {
-    void     (*func)(void*); /* Function to be called */
-    void     *data;          /* It's argument */
-    uint64_t callid;         /* For eloop_call_cancel() */
-    ll_node  node;           /* In eloop_call_pending_list */
-} eloop_call_pending;
+enum {
+    ELOOP_CALL_FREE,
+    ELOOP_CALL_PENDING,
+    ELOOP_CALL_CANCELLED
+};
 
-/* Execute function calls deferred by eloop_call()
+#define ELOOP_CALL_TAG(gen,state)       (((gen) << 2) | (state))
+#define ELOOP_CALL_TAG_GEN(tag)         ((tag) >> 2)
+
+/* Get the next slot generation
  */
-static void
-eloop_call_execute (void)
+static inline uint64_t
+eloop_call_gen_next (uint64_t gen)
 {
-    ll_node *node;
+    gen = (gen + 1) & 0xffffffff;
+    return gen != 0 ? gen : 1;
+}
 
-    while ((node = ll_pop_beg(&eloop_call_pending_list)) != NULL) {
-        eloop_call_pending *pending;
+/* Get pending call slot by index. Returns NULL, if
+ * chunk is not allocated yet
+ */
+static eloop_call_pending*
+eloop_call_slot (uint32_t index)
+{
+    eloop_call_pending *chunk;
 
-        pending = OUTER_STRUCT(node, eloop_call_pending, node);
-        pending->func(pending->data);
-        mem_free(pending);
+    chunk = __atomic_load_n(&eloop_call_chunks[index / ELOOP_CALL_CHUNK_SIZE],
+        __ATOMIC_ACQUIRE);
+    if (chunk == NULL) {
+        return NULL;
     }
+
+    return &chunk[index % ELOOP_CALL_CHUNK_SIZE];
 }
 
-/* Call function on a context of event loop thread
- * The returned value can be supplied as a `callid'
- * parameter for the eloop_call_cancel() function
+/* Allocate new slot from the slot table
  */
-uint64_t
-eloop_call (void (*func)(void*), void *data)
+static eloop_call_pending*
+eloop_call_slot_new (void)
 {
-    eloop_call_pending *p = mem_new(eloop_call_pending, 1);
-    static uint64_t    callid;
-    uint64_t           ret;
+    uint32_t           index, chunk;
+    eloop_call_pending *slots;
 
-    p->func = func;
-    p->data = data;
+    index = __atomic_fetch_add(&eloop_call_slots_count, 1, __ATOMIC_SEQ_CST);
+    chunk = index / ELOOP_CALL_CHUNK_SIZE;
+    if (chunk >= ELOOP_CALL_CHUNKS_MAX) {
+        log_panic(NULL, "eloop_call: too many pending calls");
+    }
 
-    pthread_mutex_lock(&eloop_mutex);
-    ret = ++ callid;
-    p->callid = ret;
-    ll_push_end(&eloop_call_pending_list, &p->node);
-    pthread_mutex_unlock(&eloop_mutex);
+    /* Allocate chunk, if needed. It happens rarely, so simple
+     * mutex is good enough here
+     */
+    pthread_mutex_lock(&eloop_call_chunks_mutex);
+    slots = eloop_call_chunks[chunk];
+    if (slots == NULL) {
+        uint32_t i;
+
+        slots = mem_new(eloop_call_pending, ELOOP_CALL_CHUNK_SIZE);
+        for (i = 0; i < ELOOP_CALL_CHUNK_SIZE; i ++) {
+            slots[i].index = chunk * ELOOP_CALL_CHUNK_SIZE + i;
+            slots[i].tag = ELOOP_CALL_TAG(1, ELOOP_CALL_FREE);
+        }
 
-    avahi_simple_poll_wakeup(eloop_poll);
+        __atomic_store_n(&eloop_call_chunks[chunk], slots, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&eloop_call_chunks_mutex);
 
-    return ret;
+    return &slots[index % ELOOP_CALL_CHUNK_SIZE];
 }
 
-/* Cancel pending eloop_call
+/* Get slot from the free list or allocate the new one
  *
- * This is safe to cancel already finished call (at this
- * case nothing will happen)
+ * Free list head contains index + 1 of the first free slot in the
+ * lower 32 bits and modification counter in the upper 32 bits, which
+ * protects against ABA problem
  */
-void
-eloop_call_cancel (uint64_t callid)
+static eloop_call_pending*
+eloop_call_slot_get (void)
 {
-    ll_node *node;
+    uint64_t head = __atomic_load_n(&eloop_call_free, __ATOMIC_ACQUIRE);
+    uint64_t next;
 
-    for (LL_FOR_EACH(node, &eloop_call_pending_list)) {
-        eloop_call_pending *p = OUTER_STRUCT(node, eloop_call_pending, node);
+    do {
+        eloop_call_pending *slot;
+        uint32_t           index = (uint32_t) head;
 
-        if (p->callid == callid) {
-            ll_del(&p->node);
-            mem_free(p);
-            return;
+        if (index == 0) {
+            return eloop_call_slot_new();
         }
-    }
-}
 
-/* Event notifier. Calls user-defined function on a context
- * of event loop thread, when event is triggered. This is
- * safe to trigger the event from a context of any thread
- * or even from a signal handler
- */
-struct eloop_event {
-    pollable     *p;                 /* Underlying pollable event */
-    eloop_fdpoll *fdpoll;            /* Underlying fdpoll */
-    void         (*callback)(void*); /* user-defined callback */
-    void         *data;              /* callback's argument */
-};
+        slot = eloop_call_slot(index - 1);
+        next = ((head >> 32) + 1) << 32;
+        next |= __atomic_load_n(&slot->free_next, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&eloop_call_free, &head, next,
+                true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
 
-/* eloop_event eloop_fdpoll callback
+    return eloop_call_slot((uint32_t) head - 1);
+}
+
+/* Return slot into the free list. Slot generation is incremented
  */
 static void
-eloop_event_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
+eloop_call_slot_put (eloop_call_pending *slot)
 {
-    eloop_event *event = data;
+    uint64_t tag = __atomic_load_n(&slot->tag, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&eloop_call_free, __ATOMIC_RELAXED);
+    uint64_t next;
 
-    (void) fd;
-    (void) mask;
+    tag = ELOOP_CALL_TAG(eloop_call_gen_next(ELOOP_CALL_TAG_GEN(tag)),
+        ELOOP_CALL_FREE);
+    __atomic_store_n(&slot->tag, tag, __ATOMIC_RELEASE);
 
-    pollable_reset(event->p);
-    event->callback(event->data);
+    do {
+        __atomic_store_n(&slot->free_next, (uint32_t) head, __ATOMIC_RELAXED);
+        next = (((head >> 32) + 1) << 32) | (slot->index + 1);
+    } while (!__atomic_compare_exchange_n(&eloop_call_free, &head, next,
+                true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
-/* Create new event notifier. May return NULL
+/* Push slot into the shard's pending calls queue. This is the
+ * intrusive multi-producer, single-consumer queue: any thread may
+ * push, only the shard's event loop thread pops
  */
-eloop_event*
-eloop_event_new (void (*callback)(void *), void *data)
+static void
+eloop_call_queue_push (eloop_shard *shard, eloop_call_pending *slot)
 {
-    eloop_event         *event;
-    pollable            *p;
+    eloop_call_pending *prev;
 
-    p = pollable_new();
-    if (p == NULL) {
-        return NULL;
-    }
+    __atomic_store_n(&slot->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&shard->call_queue_head, slot,
+        __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, slot, __ATOMIC_RELEASE);
+}
 
-    event = mem_new(eloop_event, 1);
+/* Pop slot from the pending calls queue. Returns NULL if queue is
+ * empty or producer is in the middle of push. In the later case
+ * producer will wake up event loop after push completion
+ */
+static eloop_call_pending*
+eloop_call_queue_pop (eloop_shard *shard)
+{
+    eloop_call_pending *stub = &shard->call_queue_stub;
+    eloop_call_pending *tail = shard->call_queue_tail;
+    eloop_call_pending *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+
+        shard->call_queue_tail = tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL) {
+        shard->call_queue_tail = next;
+        return tail;
+    }
+
+    if (tail != __atomic_load_n(&shard->call_queue_head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    eloop_call_queue_push(shard, stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        shard->call_queue_tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+/* Execute function calls deferred by eloop_call()
+ */
+static void
+eloop_call_execute (eloop_shard *shard)
+{
+    eloop_call_pending *slot;
+
+    __atomic_store_n(&shard->call_wakeup, false, __ATOMIC_SEQ_CST);
+
+    while ((slot = eloop_call_queue_pop(shard)) != NULL) {
+        uint64_t tag = __atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE);
+        uint64_t gen = ELOOP_CALL_TAG_GEN(tag);
+
+        tag = ELOOP_CALL_TAG(gen, ELOOP_CALL_PENDING);
+
+        /* Mark slot free before call, so it can't be cancelled
+         * anymore
+         */
+        if (__atomic_compare_exchange_n(&slot->tag, &tag,
+                ELOOP_CALL_TAG(gen, ELOOP_CALL_FREE),
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            eloop_stat_mark mark;
+            void            (*func)(void*) = slot->func;
+
+            eloop_stat_begin(shard, &mark, func);
+            func(slot->data);
+            eloop_stat_end(shard, &mark, "call", func);
+        }
+
+        eloop_call_slot_put(slot);
+    }
+}
+
+/* Call function on a context of the specified shard's thread
+ * The returned value can be supplied as a `callid'
+ * parameter for the eloop_call_cancel() function
+ *
+ * This function doesn't acquire any mutex
+ */
+uint64_t
+eloop_call_shard (eloop_shard *shard, void (*func)(void*), void *data)
+{
+    eloop_call_pending *slot = eloop_call_slot_get();
+    uint64_t           gen;
+
+    slot->func = func;
+    slot->data = data;
+
+    gen = ELOOP_CALL_TAG_GEN(__atomic_load_n(&slot->tag, __ATOMIC_RELAXED));
+    __atomic_store_n(&slot->tag, ELOOP_CALL_TAG(gen, ELOOP_CALL_PENDING),
+        __ATOMIC_RELEASE);
+
+    eloop_call_queue_push(shard, slot);
+
+    /* Wake up event loop thread, unless somebody already did it
+     * and the event loop thread didn't start queue processing yet
+     */
+    if (!__atomic_exchange_n(&shard->call_wakeup, true, __ATOMIC_ACQ_REL)) {
+#ifdef OS_HAVE_EPOLL
+        eloop_event_trigger(shard->wakeup);
+#else
+        avahi_simple_poll_wakeup(eloop_poll);
+#endif
+    }
+
+    return (gen << 32) | slot->index;
+}
+
+/* Call function on a context of event loop thread
+ *
+ * The function is called on the current shard, i.e. the shard,
+ * which mutex is held by the caller, or on the primary shard
+ */
+uint64_t
+eloop_call (void (*func)(void*), void *data)
+{
+    return eloop_call_shard(eloop_shard_get_current(), func, data);
+}
+
+/* Cancel pending eloop_call
+ *
+ * This is safe to cancel already finished call (at this
+ * case nothing will happen)
+ *
+ * Cancelled call remains in the queue until event loop
+ * thread picks it up and drops
+ */
+void
+eloop_call_cancel (uint64_t callid)
+{
+    uint32_t           index = (uint32_t) callid;
+    uint64_t           gen = callid >> 32;
+    uint64_t           tag = ELOOP_CALL_TAG(gen, ELOOP_CALL_PENDING);
+    eloop_call_pending *slot;
+
+    if (index >= __atomic_load_n(&eloop_call_slots_count, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    slot = eloop_call_slot(index);
+    if (slot == NULL) {
+        return;
+    }
+
+    __atomic_compare_exchange_n(&slot->tag, &tag,
+        ELOOP_CALL_TAG(gen, ELOOP_CALL_CANCELLED),
+        false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/* Initialize eloop_call
+ */
+static void
+eloop_call_init (void)
+{
+    eloop_call_free = 0;
+    eloop_call_slots_count = 0;
+    memset(eloop_call_chunks, 0, sizeof(eloop_call_chunks));
+}
+
+/* Initialize the shard's pending calls queue
+ */
+static void
+eloop_call_queue_init (eloop_shard *shard)
+{
+    memset(&shard->call_queue_stub, 0, sizeof(shard->call_queue_stub));
+    shard->call_queue_head = &shard->call_queue_stub;
+    shard->call_queue_tail = &shard->call_queue_stub;
+    shard->call_wakeup = false;
+}
+
+/* Cleanup eloop_call
+ */
+static void
+eloop_call_cleanup (void)
+{
+    int i;
+
+    for (i = 0; i < ELOOP_CALL_CHUNKS_MAX; i ++) {
+        mem_free(eloop_call_chunks[i]);
+        eloop_call_chunks[i] = NULL;
+    }
+}
+
+/* Event notifier. Calls user-defined function on a context
+ * of event loop thread, when event is triggered. This is
+ * safe to trigger the event from a context of any thread
+ * or even from a signal handler
+ */
+struct eloop_event {
+    pollable     *p;                 /* Underlying pollable event */
+    eloop_fdpoll *fdpoll;            /* Underlying fdpoll */
+    void         (*callback)(void*); /* user-defined callback */
+    void         *data;              /* callback's argument */
+};
+
+/* eloop_event eloop_fdpoll callback
+ */
+static void
+eloop_event_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
+{
+    eloop_event *event = data;
+
+    (void) fd;
+    (void) mask;
+
+    pollable_reset(event->p);
+    event->callback(event->data);
+}
+
+/* Create new event notifier. May return NULL
+ */
+eloop_event*
+eloop_event_new (void (*callback)(void *), void *data)
+{
+    eloop_event         *event;
+    pollable            *p;
+
+    p = pollable_new();
+    if (p == NULL) {
+        return NULL;
+    }
+
+    event = mem_new(eloop_event, 1);
     event->p = p;
     event->callback = callback;
     event->data = data;
@@ -409,146 +1145,534 @@ eloop_event_trigger (eloop_event *event)
 
 /* Timer. Calls user-defined function after a specified
  * interval
+ *
+ * Timers are kept in the hierarchical timer wheel. Each level of
+ * the wheel has ELOOP_TIMER_WHEEL_SIZE slots; slot of level 0
+ * covers 1 millisecond, slot of each next level covers the whole
+ * previous level. When time reaches the slot of upper level,
+ * its timers are redistributed (cascaded) into the lower levels.
+ *
+ * This gives O(1) arm and cancel. The per-level bitmaps of
+ * non-empty slots allow to find the next expiration time in
+ * O(ELOOP_TIMER_WHEEL_LEVELS) without scanning timers, and the
+ * event loop sleeps until that time.
  */
 struct eloop_timer {
-    AvahiTimeout *timeout;            /* Underlying AvahiTimeout */
+    timestamp    deadline;            /* Expiration time */
     void         (*callback)(void *); /* User callback */
     void         *data;               /* User data */
+    eloop_shard  *shard;              /* Owning shard */
+    int          level, slot;         /* Position in the wheel */
+    ll_node      chain;               /* In the wheel slot or pool */
 };
 
-/* eloop_timer callback for AvahiTimeout
+/* Get span of the timer wheel slot at the specified level, in ms
  */
-static void
-eloop_timer_callback (AvahiTimeout *t, void *data)
+#define ELOOP_TIMER_WHEEL_SPAN(level)   \
+    (((timestamp) 1) << (ELOOP_TIMER_WHEEL_BITS * (level)))
+
+/* Find the earliest time when the timer wheel needs attention:
+ * either timers expire or the upper level slot needs to be
+ * cascaded. Returns -1 if wheel is empty
+ */
+static timestamp
+eloop_timer_wheel_next (eloop_shard *shard)
 {
-    eloop_timer *timer = data;
+    timestamp next = -1;
+    int       level;
+
+    for (level = 0; level < ELOOP_TIMER_WHEEL_LEVELS; level ++) {
+        uint64_t  bits = shard->timer_wheel_bitmap[level];
+        int       shift = ELOOP_TIMER_WHEEL_BITS * level;
+        int       idx, slot;
+        uint64_t  ahead;
+        timestamp round, t;
+
+        if (bits == 0) {
+            continue;
+        }
 
-    (void) t;
+        /* Wheel base is the first unprocessed millisecond. If it
+         * is at the boundary of the current slot, the slot is due
+         * now, otherwise it was already cascaded and the slot
+         * contains timers for the next round
+         */
+        idx = (int) ((shard->timer_wheel_base >> shift) &
+                     (ELOOP_TIMER_WHEEL_SIZE - 1));
+        if ((shard->timer_wheel_base &
+             (ELOOP_TIMER_WHEEL_SPAN(level) - 1)) != 0) {
+            idx ++;
+        }
+
+        ahead = 0;
+        if (idx < ELOOP_TIMER_WHEEL_SIZE) {
+            ahead = bits & (~(uint64_t) 0 << idx);
+        }
+        round = shard->timer_wheel_base &
+                ~(ELOOP_TIMER_WHEEL_SPAN(level + 1) - 1);
+
+        if (ahead != 0) {
+            slot = __builtin_ctzll(ahead);
+        } else {
+            slot = __builtin_ctzll(bits);
+            round += ELOOP_TIMER_WHEEL_SPAN(level + 1);
+        }
+
+        t = round + ((timestamp) slot << shift);
+        if (next < 0 || t < next) {
+            next = t;
+        }
+    }
 
-    timer->callback(timer->data);
-    eloop_timer_cancel(timer);
+    return next;
 }
 
-/* Create new timer. Timeout is in milliseconds
+/* Insert timer into the wheel
  */
-eloop_timer*
-eloop_timer_new (int timeout, void (*callback)(void *), void *data)
+static void
+eloop_timer_wheel_insert (eloop_timer *timer)
 {
-    const AvahiPoll *poll = eloop_poll_get();
-    eloop_timer     *timer = mem_new(eloop_timer, 1);
-    struct timeval  end;
+    eloop_shard *shard = timer->shard;
+    timestamp   deadline = timer->deadline;
+    timestamp   delta;
+    int         level, slot;
 
-    avahi_elapse_time(&end, timeout, 0);
+    if (deadline < shard->timer_wheel_base) {
+        deadline = timer->deadline = shard->timer_wheel_base;
+    }
 
-    timer->timeout = poll->timeout_new(poll, &end, eloop_timer_callback, timer);
-    timer->callback = callback;
-    timer->data = data;
+    delta = deadline - shard->timer_wheel_base;
+    for (level = 0; level < ELOOP_TIMER_WHEEL_LEVELS - 1; level ++) {
+        if (delta < ELOOP_TIMER_WHEEL_SPAN(level + 1)) {
+            break;
+        }
+    }
 
-    return timer;
+    /* Timers beyond the wheel range are parked at the last
+     * slot of the upper level and re-inserted when cascaded
+     */
+    if (delta >= ELOOP_TIMER_WHEEL_SPAN(level + 1)) {
+        deadline = shard->timer_wheel_base +
+                   ELOOP_TIMER_WHEEL_SPAN(level + 1) - 1;
+    }
+
+    slot = (int) ((deadline >> (ELOOP_TIMER_WHEEL_BITS * level)) &
+                  (ELOOP_TIMER_WHEEL_SIZE - 1));
+
+    timer->level = level;
+    timer->slot = slot;
+    ll_push_end(&shard->timer_wheel[level][slot], &timer->chain);
+    shard->timer_wheel_bitmap[level] |= ((uint64_t) 1) << slot;
 }
 
-/* Cancel a timer
- *
- * Caller SHOULD NOT cancel expired timer (timer with called
- * callback) -- this is done automatically
+/* Remove timer from the wheel
  */
-void
-eloop_timer_cancel (eloop_timer *timer)
+static void
+eloop_timer_wheel_remove (eloop_timer *timer)
 {
-    const AvahiPoll *poll = eloop_poll_get();
+    eloop_shard *shard = timer->shard;
+    ll_head     *head = &shard->timer_wheel[timer->level][timer->slot];
 
-    poll->timeout_free(timer->timeout);
-    mem_free(timer);
+    ll_del(&timer->chain);
+    if (ll_empty(head)) {
+        uint64_t bit = ((uint64_t) 1) << timer->slot;
+        shard->timer_wheel_bitmap[timer->level] &= ~bit;
+    }
 }
 
-/* Convert ELOOP_FDPOLL_MASK to string. Used for logging.
+/* Move all timers from the wheel slot to the list
  */
-const char*
-eloop_fdpoll_mask_str (ELOOP_FDPOLL_MASK mask)
+static void
+eloop_timer_wheel_take (eloop_shard *shard, int level, int slot,
+        ll_head *list)
 {
-    switch (mask & ELOOP_FDPOLL_BOTH) {
-    case 0:                  return "{--}";
-    case ELOOP_FDPOLL_READ:  return "{r-}";
-    case ELOOP_FDPOLL_WRITE: return "{-w}";
-    case ELOOP_FDPOLL_BOTH:  return "{rw}";
-    }
-
-    return "{??}"; /* Should never happen indeed */
+    ll_cat(list, &shard->timer_wheel[level][slot]);
+    shard->timer_wheel_bitmap[level] &= ~(((uint64_t) 1) << slot);
 }
 
-/* eloop_fdpoll notifies user when file becomes
- * readable, writable or both, depending on its
- * event mask
+/* Arm the backend to wake up the event loop at the time
+ * of the next wheel event, if it has been changed
+ *
+ * Note, when timer is cancelled, the backend is left armed,
+ * as spurious wakeup costs less that the extra syscall
  */
-struct eloop_fdpoll {
-    AvahiWatch        *watch;      /* Underlying AvahiWatch */
-    int               fd;          /* Underlying file descriptor */
-    ELOOP_FDPOLL_MASK mask;        /* Mask of active events */
-    void              (*callback)( /* User-defined callback */
-            int, void*, ELOOP_FDPOLL_MASK);
-    void              *data;       /* Callback's data */
-};
+static void
+eloop_timer_wheel_arm (eloop_shard *shard)
+{
+    timestamp next = eloop_timer_wheel_next(shard);
 
-/* eloop_fdpoll callback for AvahiWatch
+    if (next >= 0 && next != shard->timer_armed) {
+        shard->timer_armed = next;
+        eloop_timer_backend_arm(shard, next);
+    }
+}
+
+/* Return timer object into the pool
  */
 static void
-eloop_fdpoll_callback (AvahiWatch *w, int fd, AvahiWatchEvent event,
-        void *data)
+eloop_timer_put (eloop_timer *timer)
 {
-    eloop_fdpoll      *fdpoll = data;
-    ELOOP_FDPOLL_MASK mask = 0;
+    eloop_shard *shard = timer->shard;
 
-    (void) w;
+    if (shard->timer_pool_len < ELOOP_TIMER_POOL_MAX) {
+        ll_push_beg(&shard->timer_pool, &timer->chain);
+        shard->timer_pool_len ++;
+    } else {
+        mem_free(timer);
+    }
+}
 
-    if ((event & AVAHI_WATCH_IN) != 0) {
-        mask |= ELOOP_FDPOLL_READ;
+/* Call all expired timers
+ */
+static void
+eloop_timer_wheel_expire (eloop_shard *shard)
+{
+    timestamp now = timestamp_now();
+    timestamp t;
+
+    while ((t = eloop_timer_wheel_next(shard)) >= 0 && t <= now) {
+        ll_head list;
+        ll_node *node;
+        int     level, slot;
+
+        shard->timer_wheel_base = t;
+
+        /* Cascade upper levels, that reached the slot boundary */
+        for (level = 1; level < ELOOP_TIMER_WHEEL_LEVELS; level ++) {
+            if ((t & (ELOOP_TIMER_WHEEL_SPAN(level) - 1)) != 0) {
+                break;
+            }
+
+            slot = (int) ((t >> (ELOOP_TIMER_WHEEL_BITS * level)) &
+                          (ELOOP_TIMER_WHEEL_SIZE - 1));
+
+            ll_init(&list);
+            eloop_timer_wheel_take(shard, level, slot, &list);
+            while ((node = ll_pop_beg(&list)) != NULL) {
+                eloop_timer_wheel_insert(
+                    OUTER_STRUCT(node, eloop_timer, chain));
+            }
+        }
+
+        /* Collect expired timers. Base is advanced before
+         * callbacks are called, so timers, created by callbacks,
+         * will never get into the slot being processed
+         */
+        ll_init(&list);
+        eloop_timer_wheel_take(shard, 0,
+            (int) (t & (ELOOP_TIMER_WHEEL_SIZE - 1)), &list);
+        shard->timer_wheel_base = t + 1;
+
+        /* Call callbacks. Timer is removed from the list before
+         * callback is called, and callback may cancel other
+         * timers from the same list, so pop them one by one
+         */
+        while ((node = ll_pop_beg(&list)) != NULL) {
+            eloop_timer     *timer = OUTER_STRUCT(node, eloop_timer, chain);
+            eloop_stat_mark mark;
+            void            *func = timer->callback;
+
+            eloop_stat_begin(shard, &mark, func);
+            timer->callback(timer->data);
+            eloop_stat_end(shard, &mark, "timer", func);
+            eloop_timer_put(timer);
+        }
     }
 
-    if ((event & AVAHI_WATCH_OUT) != 0) {
-        mask |= ELOOP_FDPOLL_WRITE;
+    /* Nothing happens till now, so base may jump forward */
+    if (shard->timer_wheel_base <= now) {
+        shard->timer_wheel_base = now + 1;
     }
 
-    fdpoll->callback(fd, fdpoll->data, mask);
+    shard->timer_armed = -1;
+    eloop_timer_wheel_arm(shard);
 }
 
-/* Create eloop_fdpoll
- *
- * Callback will be called, when file will be ready for read/write/both,
- * depending on mask
- *
- * Initial mask value is 0, and it can be changed, using
- * eloop_fdpoll_set_mask() function
+/* Create new timer on the specified shard
  */
-eloop_fdpoll*
-eloop_fdpoll_new (int fd,
-        void (*callback) (int, void*, ELOOP_FDPOLL_MASK), void *data)
+static eloop_timer*
+eloop_shard_timer_new (eloop_shard *shard, int timeout,
+        void (*callback)(void *), void *data)
 {
-    const AvahiPoll *poll = eloop_poll_get();
-    eloop_fdpoll    *fdpoll = mem_new(eloop_fdpoll, 1);
+    eloop_timer *timer;
+    ll_node     *node;
+    timestamp   now = timestamp_now(), next;
+
+    node = ll_pop_beg(&shard->timer_pool);
+    if (node != NULL) {
+        timer = OUTER_STRUCT(node, eloop_timer, chain);
+        shard->timer_pool_len --;
+    } else {
+        timer = mem_new(eloop_timer, 1);
+    }
 
-    fdpoll->fd = fd;
-    fdpoll->callback = callback;
-    fdpoll->data = data;
+    timer->deadline = now + (timeout > 0 ? timeout : 0);
+    timer->callback = callback;
+    timer->data = data;
+    timer->shard = shard;
 
-    eloop_poll_restart = true;
-    fdpoll->watch = poll->watch_new(poll, fd, 0, eloop_fdpoll_callback, fdpoll);
+    /* If event loop was sleeping for a while, move wheel
+     * base forward, if it doesn't skip any wheel events.
+     * It keeps new timers at the lower levels of the wheel
+     */
+    next = eloop_timer_wheel_next(shard);
+    if (shard->timer_wheel_base < now && (next < 0 || next > now)) {
+        shard->timer_wheel_base = now;
+    }
 
-    return fdpoll;
+    eloop_timer_wheel_insert(timer);
+
+    next = eloop_timer_wheel_next(shard);
+    if (shard->timer_armed < 0 || next < shard->timer_armed) {
+        eloop_timer_wheel_arm(shard);
+    }
+
+    return timer;
 }
 
-/* Destroy eloop_fdpoll
+/* Create new timer. Timeout is in milliseconds
+ *
+ * Timer is created on the current shard, i.e. the shard,
+ * which mutex is held by the caller
  */
-void
-eloop_fdpoll_free (eloop_fdpoll *fdpoll)
+eloop_timer*
+eloop_timer_new (int timeout, void (*callback)(void *), void *data)
 {
-    const AvahiPoll *poll = eloop_poll_get();
-
-    poll->watch_free(fdpoll->watch);
-    mem_free(fdpoll);
+    return eloop_shard_timer_new(eloop_shard_get_current(), timeout,
+        callback, data);
 }
 
-/* Set eloop_fdpoll event mask. It returns a previous value of event mask
- */
+/* Cancel a timer
+ *
+ * Caller SHOULD NOT cancel expired timer (timer with called
+ * callback) -- this is done automatically
+ */
+void
+eloop_timer_cancel (eloop_timer *timer)
+{
+    eloop_timer_wheel_remove(timer);
+    eloop_timer_put(timer);
+}
+
+/* eloop_clock_advance() callback. Fires timers, which deadlines
+ * are reached by the advanced clock, and rearms the timer backend
+ */
+static void
+eloop_clock_advance_callback (void *data)
+{
+    eloop_timer_wheel_expire(data);
+}
+
+/* Advance the event loop clock by the specified amount of
+ * milliseconds, without actually waiting. Timers, which
+ * deadlines are reached, fire immediately
+ */
+static void
+eloop_clock_advance (int ms)
+{
+    int i;
+
+    __atomic_add_fetch(&timestamp_skew, ms, __ATOMIC_SEQ_CST);
+
+    /* Timer backends are armed in terms of the real time,
+     * so all shards need to recheck their timers
+     */
+    for (i = 0; i < eloop_shards_count; i ++) {
+        eloop_call_shard(&eloop_shards[i], eloop_clock_advance_callback,
+            &eloop_shards[i]);
+    }
+}
+
+/* Called when shard's event loop was idle for conf.dbg_clock_warp
+ * milliseconds. Jumps the clock forward to the next timer event
+ *
+ * The clock is shared by all shards, and warping it while some
+ * other shard has I/O in progress would expire its timeouts early.
+ * So the clock is warped only when all shards are idle, up to the
+ * earliest of their timer events
+ *
+ * Note, the next wheel event may be the cascade of the upper wheel
+ * level rather than the timer deadline. It costs one more idle
+ * period, but keeps this function trivial
+ */
+static void
+eloop_clock_warp (eloop_shard *shard)
+{
+    timestamp now = timestamp_now();
+    timestamp next = eloop_timer_wheel_next(shard);
+    int       i;
+
+    __atomic_store_n(&shard->clock_next, next, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&shard->clock_idle, true, __ATOMIC_SEQ_CST);
+
+    for (i = 0; i < eloop_shards_count; i ++) {
+        eloop_shard *other = &eloop_shards[i];
+        timestamp   t;
+
+        if (!__atomic_load_n(&other->clock_idle, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+
+        t = __atomic_load_n(&other->clock_next, __ATOMIC_SEQ_CST);
+        if (t >= 0 && (next < 0 || t < next)) {
+            next = t;
+        }
+    }
+
+    if (next > now) {
+        log_debug(NULL, "eloop: shard %d: clock warp %d ms", shard->index,
+            (int) (next - now));
+        eloop_clock_advance((int) (next - now));
+    }
+}
+
+/* Called when shard's event loop has got some events, so
+ * the shard is not idle anymore
+ */
+static void
+eloop_clock_busy (eloop_shard *shard)
+{
+    __atomic_store_n(&shard->clock_idle, false, __ATOMIC_SEQ_CST);
+}
+
+/* Initialize timers
+ */
+static void
+eloop_timer_init (eloop_shard *shard)
+{
+    int level, slot;
+
+    for (level = 0; level < ELOOP_TIMER_WHEEL_LEVELS; level ++) {
+        for (slot = 0; slot < ELOOP_TIMER_WHEEL_SIZE; slot ++) {
+            ll_init(&shard->timer_wheel[level][slot]);
+        }
+        shard->timer_wheel_bitmap[level] = 0;
+    }
+
+    ll_init(&shard->timer_pool);
+    shard->timer_pool_len = 0;
+    shard->timer_wheel_base = timestamp_now();
+    shard->timer_armed = -1;
+    shard->clock_idle = false;
+    shard->clock_next = -1;
+}
+
+/* Cleanup timers
+ */
+static void
+eloop_timer_cleanup (eloop_shard *shard)
+{
+    int     level, slot;
+    ll_node *node;
+
+    for (level = 0; level < ELOOP_TIMER_WHEEL_LEVELS; level ++) {
+        for (slot = 0; slot < ELOOP_TIMER_WHEEL_SIZE; slot ++) {
+            ll_cat(&shard->timer_pool, &shard->timer_wheel[level][slot]);
+        }
+        shard->timer_wheel_bitmap[level] = 0;
+    }
+
+    while ((node = ll_pop_beg(&shard->timer_pool)) != NULL) {
+        mem_free(OUTER_STRUCT(node, eloop_timer, chain));
+    }
+
+    shard->timer_pool_len = 0;
+}
+
+
+/* Convert ELOOP_FDPOLL_MASK to string. Used for logging.
+ */
+const char*
+eloop_fdpoll_mask_str (ELOOP_FDPOLL_MASK mask)
+{
+    switch (mask & ELOOP_FDPOLL_BOTH) {
+    case 0:                  return "{--}";
+    case ELOOP_FDPOLL_READ:  return "{r-}";
+    case ELOOP_FDPOLL_WRITE: return "{-w}";
+    case ELOOP_FDPOLL_BOTH:  return "{rw}";
+    }
+
+    return "{??}"; /* Should never happen indeed */
+}
+
+#ifndef OS_HAVE_EPOLL
+/* eloop_fdpoll notifies user when file becomes
+ * readable, writable or both, depending on its
+ * event mask
+ */
+struct eloop_fdpoll {
+    AvahiWatch        *watch;      /* Underlying AvahiWatch */
+    int               fd;          /* Underlying file descriptor */
+    ELOOP_FDPOLL_MASK mask;        /* Mask of active events */
+    void              (*callback)( /* User-defined callback */
+            int, void*, ELOOP_FDPOLL_MASK);
+    void              *data;       /* Callback's data */
+};
+
+/* eloop_fdpoll callback for AvahiWatch
+ */
+static void
+eloop_fdpoll_callback (AvahiWatch *w, int fd, AvahiWatchEvent event,
+        void *data)
+{
+    eloop_fdpoll      *fdpoll = data;
+    ELOOP_FDPOLL_MASK mask = 0;
+    eloop_stat_mark   mark;
+    void              *func = fdpoll->callback;
+
+    (void) w;
+
+    if ((event & AVAHI_WATCH_IN) != 0) {
+        mask |= ELOOP_FDPOLL_READ;
+    }
+
+    if ((event & AVAHI_WATCH_OUT) != 0) {
+        mask |= ELOOP_FDPOLL_WRITE;
+    }
+
+    eloop_stat_begin(ELOOP_SHARD_PRIMARY, &mark, func);
+    fdpoll->callback(fd, fdpoll->data, mask);
+    eloop_stat_end(ELOOP_SHARD_PRIMARY, &mark, "fdpoll", func);
+}
+
+/* Create eloop_fdpoll
+ *
+ * Callback will be called, when file will be ready for read/write/both,
+ * depending on mask
+ *
+ * Initial mask value is 0, and it can be changed, using
+ * eloop_fdpoll_set_mask() function
+ */
+eloop_fdpoll*
+eloop_fdpoll_new (int fd,
+        void (*callback) (int, void*, ELOOP_FDPOLL_MASK), void *data)
+{
+    const AvahiPoll *poll = eloop_poll_get();
+    eloop_fdpoll    *fdpoll = mem_new(eloop_fdpoll, 1);
+
+    fdpoll->fd = fd;
+    fdpoll->callback = callback;
+    fdpoll->data = data;
+
+    eloop_poll_restart = true;
+    fdpoll->watch = poll->watch_new(poll, fd, 0, eloop_fdpoll_callback, fdpoll);
+
+    return fdpoll;
+}
+
+/* Destroy eloop_fdpoll
+ */
+void
+eloop_fdpoll_free (eloop_fdpoll *fdpoll)
+{
+    const AvahiPoll *poll = eloop_poll_get();
+
+    poll->watch_free(fdpoll->watch);
+    mem_free(fdpoll);
+}
+
+/* Set eloop_fdpoll event mask. It returns a previous value of event mask
+ */
 ELOOP_FDPOLL_MASK
 eloop_fdpoll_set_mask (eloop_fdpoll *fdpoll, ELOOP_FDPOLL_MASK mask)
 {
@@ -572,6 +1696,826 @@ eloop_fdpoll_set_mask (eloop_fdpoll *fdpoll, ELOOP_FDPOLL_MASK mask)
 
     return old_mask;
 }
+#endif
+
+/******************** Callback statistics *********************/
+/* Get monotonic time, in microseconds
+ */
+static int64_t
+eloop_stat_now (void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/* Mark the shard as busy (returned from poll) or idle (about to
+ * enter poll). Used by the watchdog
+ */
+static void
+eloop_stat_busy (eloop_shard *shard, bool busy)
+{
+    if (shard->stat_sites != NULL) {
+        __atomic_store_n(&shard->busy_since, busy ? eloop_stat_now() : 0,
+            __ATOMIC_RELAXED);
+    }
+}
+
+/* Find or create statistics of the callback site
+ *
+ * Returns NULL if table of sites is full
+ */
+static eloop_stat_site*
+eloop_stat_site_lookup (eloop_shard *shard, const char *kind, void *func)
+{
+    unsigned int hash = (unsigned int) ((uintptr_t) func >> 4) * 2654435761u;
+    int          i;
+
+    for (i = 0; i < ELOOP_STAT_SITES_MAX; i ++) {
+        eloop_stat_site *site;
+
+        site = &shard->stat_sites[(hash + i) % ELOOP_STAT_SITES_MAX];
+        if (site->func == NULL) {
+            site->func = func;
+            site->kind = kind;
+            return site;
+        }
+
+        if (site->func == func && !strcmp(site->kind, kind)) {
+            return site;
+        }
+    }
+
+    return NULL;
+}
+
+/* Start measurement of the callback run time
+ *
+ * Called by the shard's thread with the shard's mutex held
+ */
+static void
+eloop_stat_begin (eloop_shard *shard, eloop_stat_mark *mark, void *func)
+{
+    if (shard->stat_sites == NULL) {
+        return;
+    }
+
+    mark->prev = shard->stat_mark;
+    mark->func = func;
+    mark->start = eloop_stat_now();
+    mark->inner_us = 0;
+
+    shard->stat_mark = mark;
+    __atomic_store_n(&shard->stat_func, func, __ATOMIC_RELAXED);
+}
+
+/* Finish measurement of the callback run time, update statistics
+ * of the callback site and complain, if callback was too slow
+ *
+ * Only the own run time of the callback is accounted, time
+ * of nested callbacks is accounted to their own sites
+ */
+static void
+eloop_stat_end (eloop_shard *shard, eloop_stat_mark *mark,
+        const char *kind, void *func)
+{
+    eloop_stat_site *site;
+    int64_t         elapsed, self;
+    int             bucket;
+
+    if (shard->stat_sites == NULL) {
+        return;
+    }
+
+    elapsed = eloop_stat_now() - mark->start;
+    self = elapsed - mark->inner_us;
+
+    shard->stat_mark = mark->prev;
+    if (mark->prev != NULL) {
+        mark->prev->inner_us += elapsed;
+        __atomic_store_n(&shard->stat_func, mark->prev->func,
+            __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&shard->stat_func, NULL, __ATOMIC_RELAXED);
+    }
+
+    /* Update statistics */
+    site = eloop_stat_site_lookup(shard, kind, func);
+    if (site != NULL) {
+        for (bucket = 0; bucket < ELOOP_STAT_BUCKETS - 1; bucket ++) {
+            if (self < ((int64_t) 1 << bucket)) {
+                break;
+            }
+        }
+
+        site->count ++;
+        site->total_us += self;
+        if ((uint64_t) self > site->max_us) {
+            site->max_us = self;
+        }
+        site->hist[bucket] ++;
+    }
+
+    /* Complain, if too slow */
+    if (self >= eloop_stat_threshold) {
+        char name[256];
+
+        os_addr_name(func, name, sizeof(name));
+        log_debug(NULL, "eloop: shard %d: %s callback %s took %d.%3.3d ms",
+            shard->index, kind, name, (int) (self / 1000),
+            (int) (self % 1000));
+    }
+}
+
+/* Dump callback statistics of the shard
+ */
+static void
+eloop_stat_dump (eloop_shard *shard)
+{
+    int i, bucket;
+
+    if (shard->stat_sites == NULL) {
+        return;
+    }
+
+    for (i = 0; i < ELOOP_STAT_SITES_MAX; i ++) {
+        eloop_stat_site *site = &shard->stat_sites[i];
+        char            hist[ELOOP_STAT_BUCKETS * 24] = "";
+        char            name[256];
+        size_t          len = 0;
+
+        if (site->count == 0) {
+            continue;
+        }
+
+        os_addr_name(site->func, name, sizeof(name));
+
+        for (bucket = 0; bucket < ELOOP_STAT_BUCKETS; bucket ++) {
+            bool last = bucket == ELOOP_STAT_BUCKETS - 1;
+
+            if (site->hist[bucket] != 0) {
+                len += snprintf(hist + len, sizeof(hist) - len,
+                    " %s%lldus:%u", last ? ">=" : "<",
+                    1LL << (last ? bucket - 1 : bucket),
+                    site->hist[bucket]);
+            }
+        }
+
+        log_debug(NULL, "eloop: shard %d: %s %s: calls=%llu avg=%llu us"
+            " max=%llu us", shard->index, site->kind, name,
+            (unsigned long long) site->count,
+            (unsigned long long) (site->total_us / site->count),
+            (unsigned long long) site->max_us);
+        log_debug(NULL, "eloop: shard %d: %s %s:%s",
+            shard->index, site->kind, name, hist);
+    }
+}
+
+/* Check the shard for the stall
+ *
+ * The stall is reported when the threshold is reached,
+ * and then each time its duration doubles
+ */
+static void
+eloop_watchdog_check (eloop_shard *shard)
+{
+    int64_t since = __atomic_load_n(&shard->busy_since, __ATOMIC_RELAXED);
+    int64_t stall;
+
+    if (since != shard->watchdog_since) {
+        shard->watchdog_since = since;
+        shard->watchdog_report = eloop_stat_threshold;
+    }
+
+    if (since == 0) {
+        return;
+    }
+
+    stall = eloop_stat_now() - since;
+    if (stall >= shard->watchdog_report) {
+        void *func = __atomic_load_n(&shard->stat_func, __ATOMIC_RELAXED);
+        char name[256] = "?";
+
+        if (func != NULL) {
+            os_addr_name(func, name, sizeof(name));
+        }
+
+        log_debug(NULL, "eloop: shard %d: no return to poll for %d ms,"
+            " running %s", shard->index, (int) (stall / 1000), name);
+        shard->watchdog_report *= 2;
+    }
+}
+
+/* Watchdog thread main function
+ */
+static void*
+eloop_watchdog_func (void *data)
+{
+    int64_t period = eloop_stat_threshold / 2;
+
+    (void) data;
+
+    pthread_mutex_lock(&eloop_watchdog_mutex);
+
+    while (eloop_watchdog_running) {
+        struct timespec t;
+        int             i;
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        t.tv_sec += period / 1000000;
+        t.tv_nsec += (period % 1000000) * 1000;
+        if (t.tv_nsec >= 1000000000) {
+            t.tv_sec ++;
+            t.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(&eloop_watchdog_cond, &eloop_watchdog_mutex,
+            &t);
+
+        for (i = 0; eloop_watchdog_running && i < eloop_shards_count; i ++) {
+            eloop_watchdog_check(&eloop_shards[i]);
+        }
+    }
+
+    pthread_mutex_unlock(&eloop_watchdog_mutex);
+
+    return NULL;
+}
+
+/* Start the watchdog thread, if callback statistics is enabled
+ */
+static void
+eloop_watchdog_start (void)
+{
+    pthread_condattr_t attr;
+    int                rc;
+
+    if (eloop_stat_threshold <= 0) {
+        return;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&eloop_watchdog_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    eloop_watchdog_running = true;
+    rc = pthread_create(&eloop_watchdog_thread, NULL,
+        eloop_watchdog_func, NULL);
+
+    if (rc != 0) {
+        log_debug(NULL, "eloop: watchdog: %s", strerror(rc));
+        eloop_watchdog_running = false;
+        pthread_cond_destroy(&eloop_watchdog_cond);
+    }
+}
+
+/* Stop the watchdog thread
+ */
+static void
+eloop_watchdog_stop (void)
+{
+    if (!eloop_watchdog_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&eloop_watchdog_mutex);
+    eloop_watchdog_running = false;
+    pthread_cond_signal(&eloop_watchdog_cond);
+    pthread_mutex_unlock(&eloop_watchdog_mutex);
+
+    pthread_join(eloop_watchdog_thread, NULL);
+    pthread_cond_destroy(&eloop_watchdog_cond);
+}
+
+#ifdef OS_HAVE_EPOLL
+/******************** epoll backend *********************/
+/* eloop_fdpoll notifies user when file becomes
+ * readable, writable or both, depending on its
+ * event mask
+ */
+struct eloop_fdpoll {
+    int               fd;          /* Underlying file descriptor */
+    ELOOP_FDPOLL_MASK mask;        /* Mask of active events */
+    void              (*callback)( /* User-defined callback */
+            int, void*, ELOOP_FDPOLL_MASK);
+    void              *data;       /* Callback's data */
+    eloop_shard       *shard;      /* Owning shard */
+    bool              registered;  /* fd is added to shard's epoll set */
+    bool              freed;       /* eloop_fdpoll_free() was called */
+    ll_node           chain;       /* In shard's fdpoll_garbage */
+};
+
+/* Shard's timerfd eloop_fdpoll callback
+ */
+static void
+eloop_timerfd_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
+{
+    uint64_t count;
+    ssize_t  rc;
+
+    (void) mask;
+
+    rc = read(fd, &count, sizeof(count));
+    (void) rc;
+
+    eloop_timer_wheel_expire(data);
+}
+
+/* Arm shard's timerfd to the specified deadline
+ */
+static void
+eloop_timer_backend_arm (eloop_shard *shard, timestamp deadline)
+{
+    struct itimerspec its;
+
+    /* Convert deadline from the virtual to the real time */
+    deadline -= __atomic_load_n(&timestamp_skew, __ATOMIC_SEQ_CST);
+    if (deadline < 0) {
+        deadline = 0;
+    }
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / 1000;
+    its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+
+    /* Zero it_value disarms the timer, so make sure
+     * it is never zero
+     */
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+        its.it_value.tv_nsec = 1;
+    }
+
+    timerfd_settime(shard->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Create eloop_fdpoll on the specified shard
+ */
+static eloop_fdpoll*
+eloop_shard_fdpoll_new (eloop_shard *shard, int fd,
+        void (*callback) (int, void*, ELOOP_FDPOLL_MASK), void *data)
+{
+    eloop_fdpoll *fdpoll = mem_new(eloop_fdpoll, 1);
+
+    fdpoll->fd = fd;
+    fdpoll->callback = callback;
+    fdpoll->data = data;
+    fdpoll->shard = shard;
+
+    return fdpoll;
+}
+
+/* Create eloop_fdpoll
+ *
+ * Callback will be called, when file will be ready for read/write/both,
+ * depending on mask
+ *
+ * Initial mask value is 0, and it can be changed, using
+ * eloop_fdpoll_set_mask() function
+ *
+ * The eloop_fdpoll is created on the current shard, i.e. the shard,
+ * which mutex is held by the caller
+ */
+eloop_fdpoll*
+eloop_fdpoll_new (int fd,
+        void (*callback) (int, void*, ELOOP_FDPOLL_MASK), void *data)
+{
+    return eloop_shard_fdpoll_new(eloop_shard_get_current(), fd,
+        callback, data);
+}
+
+/* Destroy eloop_fdpoll
+ *
+ * The epoll_wait() may have already returned events for this
+ * fdpoll, and they may be still pending for dispatching, so
+ * the memory release is deferred until the next event loop
+ * iteration
+ */
+void
+eloop_fdpoll_free (eloop_fdpoll *fdpoll)
+{
+    eloop_fdpoll_set_mask(fdpoll, 0);
+    fdpoll->freed = true;
+    ll_push_end(&fdpoll->shard->fdpoll_garbage, &fdpoll->chain);
+}
+
+/* Set eloop_fdpoll event mask. It returns a previous value of event mask
+ *
+ * The fdpoll with zero mask is removed from the epoll set, so
+ * conditions, like EPOLLHUP, which are reported regardless of
+ * the requested events, will not cause a busy loop
+ */
+ELOOP_FDPOLL_MASK
+eloop_fdpoll_set_mask (eloop_fdpoll *fdpoll, ELOOP_FDPOLL_MASK mask)
+{
+    ELOOP_FDPOLL_MASK  old_mask = fdpoll->mask;
+    int                epoll_fd = fdpoll->shard->epoll_fd;
+    struct epoll_event event;
+    int                rc;
+
+    if (old_mask == mask) {
+        return old_mask;
+    }
+
+    fdpoll->mask = mask;
+
+    memset(&event, 0, sizeof(event));
+    event.data.ptr = fdpoll;
+
+    if ((mask & ELOOP_FDPOLL_READ) != 0) {
+        event.events |= EPOLLIN;
+    }
+
+    if ((mask & ELOOP_FDPOLL_WRITE) != 0) {
+        event.events |= EPOLLOUT;
+    }
+
+    if (mask == 0) {
+        /* Error is ignored here: if file was already closed,
+         * it is removed from the epoll set by kernel
+         */
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fdpoll->fd, &event);
+        fdpoll->registered = false;
+    } else if (fdpoll->registered) {
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fdpoll->fd, &event);
+        log_assert(NULL, rc == 0);
+    } else {
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fdpoll->fd, &event);
+        log_assert(NULL, rc == 0);
+        fdpoll->registered = true;
+    }
+
+    return old_mask;
+}
+
+/* Release memory of freed eloop_fdpolls
+ */
+static void
+eloop_fdpoll_gc (eloop_shard *shard)
+{
+    ll_node *node;
+
+    while ((node = ll_pop_beg(&shard->fdpoll_garbage)) != NULL) {
+        mem_free(OUTER_STRUCT(node, eloop_fdpoll, chain));
+    }
+}
+
+/* Shard's wakeup event callback. Does nothing, it's only purpose is
+ * to return from the epoll_wait()
+ */
+static void
+eloop_wakeup_callback (void *data)
+{
+    (void) data;
+}
+
+/* Run the shard's event loop until eloop_thread_stop() is called
+ *
+ * Called and returns with the shard's mutex held
+ */
+static void
+eloop_epoll_run (eloop_shard *shard)
+{
+    struct epoll_event events[ELOOP_EPOLL_EVENTS_MAX];
+
+    while (!__atomic_load_n(&shard->quit, __ATOMIC_SEQ_CST)) {
+        int i, n, warp;
+
+        eloop_call_execute(shard);
+        eloop_fdpoll_gc(shard);
+
+        warp = conf.dbg_clock_warp;
+
+        eloop_stat_busy(shard, false);
+        eloop_shard_unlock(shard);
+        n = epoll_wait(shard->epoll_fd, events, ELOOP_EPOLL_EVENTS_MAX,
+            warp > 0 ? warp : -1);
+        eloop_shard_lock(shard);
+        eloop_stat_busy(shard, true);
+
+        if (n == 0) {
+            eloop_clock_warp(shard);
+            continue;
+        }
+
+        eloop_clock_busy(shard);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log_debug(NULL, "epoll_wait(): %s", strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < n; i ++) {
+            eloop_fdpoll      *fdpoll = events[i].data.ptr;
+            ELOOP_FDPOLL_MASK mask = 0;
+
+            /* Skip fdpolls, freed or disabled after epoll_wait()
+             * has returned. Note, other threads may do it while
+             * we are waiting for the shard's mutex
+             */
+            if (fdpoll->freed) {
+                continue;
+            }
+
+            if ((events[i].events & EPOLLIN) != 0) {
+                mask |= ELOOP_FDPOLL_READ;
+            }
+
+            if ((events[i].events & EPOLLOUT) != 0) {
+                mask |= ELOOP_FDPOLL_WRITE;
+            }
+
+            /* Errors and hangups are reported as the readiness
+             * for the active events, so callback will see the error,
+             * when attempts to read or write
+             */
+            if ((events[i].events & (EPOLLERR | EPOLLHUP)) != 0) {
+                mask |= fdpoll->mask;
+            }
+
+            mask &= fdpoll->mask;
+            if (mask != 0) {
+                eloop_stat_mark mark;
+                void            *func = fdpoll->callback;
+
+                eloop_stat_begin(shard, &mark, func);
+                fdpoll->callback(fdpoll->fd, fdpoll->data, mask);
+                eloop_stat_end(shard, &mark, "fdpoll", func);
+            }
+        }
+    }
+
+    eloop_call_execute(shard);
+    eloop_fdpoll_gc(shard);
+}
+
+/* Initialize shard's epoll backend
+ *
+ * Called with the shard's mutex held
+ */
+static SANE_Status
+eloop_epoll_init (eloop_shard *shard)
+{
+    ll_init(&shard->fdpoll_garbage);
+    shard->quit = false;
+    shard->timerfd = -1;
+
+    shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (shard->epoll_fd < 0) {
+        goto FAIL;
+    }
+
+    shard->timerfd = timerfd_create(CLOCK_MONOTONIC,
+        TFD_NONBLOCK | TFD_CLOEXEC);
+    if (shard->timerfd < 0) {
+        goto FAIL;
+    }
+
+    shard->timerfd_fdpoll = eloop_shard_fdpoll_new(shard, shard->timerfd,
+        eloop_timerfd_callback, shard);
+    eloop_fdpoll_set_mask(shard->timerfd_fdpoll, ELOOP_FDPOLL_READ);
+
+    shard->wakeup = eloop_event_new(eloop_wakeup_callback, NULL);
+    if (shard->wakeup == NULL) {
+        goto FAIL;
+    }
+
+    return SANE_STATUS_GOOD;
+
+FAIL:
+    eloop_epoll_cleanup(shard);
+    return SANE_STATUS_NO_MEM;
+}
+
+/* Cleanup shard's epoll backend
+ *
+ * Called with the shard's mutex held
+ */
+static void
+eloop_epoll_cleanup (eloop_shard *shard)
+{
+    if (shard->wakeup != NULL) {
+        eloop_event_free(shard->wakeup);
+        shard->wakeup = NULL;
+    }
+
+    if (shard->timerfd_fdpoll != NULL) {
+        eloop_fdpoll_free(shard->timerfd_fdpoll);
+        shard->timerfd_fdpoll = NULL;
+    }
+
+    if (shard->timerfd >= 0) {
+        close(shard->timerfd);
+        shard->timerfd = -1;
+    }
+
+    if (shard->epoll_fd >= 0) {
+        close(shard->epoll_fd);
+        shard->epoll_fd = -1;
+    }
+
+    eloop_fdpoll_gc(shard);
+}
+
+/******************** AvahiPoll adapter *********************/
+/* AvahiWatch, implemented on top of eloop_fdpoll
+ */
+struct AvahiWatch {
+    eloop_fdpoll       *fdpoll;   /* Underlying eloop_fdpoll */
+    AvahiWatchEvent    revents;   /* Events, passed to the last callback */
+    AvahiWatchCallback callback;  /* Avahi callback */
+    void               *userdata; /* Callback's user data */
+};
+
+/* AvahiTimeout, implemented on top of eloop_timer
+ */
+struct AvahiTimeout {
+    eloop_timer          *timer;   /* Underlying timer, NULL if disabled */
+    AvahiTimeoutCallback callback; /* Avahi callback */
+    void                 *userdata; /* Callback's user data */
+};
+
+/* Convert AvahiWatchEvent to ELOOP_FDPOLL_MASK
+ */
+static ELOOP_FDPOLL_MASK
+eloop_avahi_events_to_mask (AvahiWatchEvent events)
+{
+    ELOOP_FDPOLL_MASK mask = 0;
+
+    if ((events & AVAHI_WATCH_IN) != 0) {
+        mask |= ELOOP_FDPOLL_READ;
+    }
+
+    if ((events & AVAHI_WATCH_OUT) != 0) {
+        mask |= ELOOP_FDPOLL_WRITE;
+    }
+
+    return mask;
+}
+
+/* eloop_fdpoll callback for AvahiWatch
+ */
+static void
+eloop_avahi_watch_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
+{
+    AvahiWatch      *w = data;
+    AvahiWatchEvent events = 0;
+    eloop_stat_mark mark;
+    void            *func = w->callback;
+
+    if ((mask & ELOOP_FDPOLL_READ) != 0) {
+        events |= AVAHI_WATCH_IN;
+    }
+
+    if ((mask & ELOOP_FDPOLL_WRITE) != 0) {
+        events |= AVAHI_WATCH_OUT;
+    }
+
+    w->revents = events;
+
+    eloop_stat_begin(ELOOP_SHARD_PRIMARY, &mark, func);
+    w->callback(w, fd, events, w->userdata);
+    eloop_stat_end(ELOOP_SHARD_PRIMARY, &mark, "avahi watch", func);
+}
+
+/* AvahiPoll::watch_new
+ */
+static AvahiWatch*
+eloop_avahi_watch_new (const AvahiPoll *api, int fd, AvahiWatchEvent event,
+        AvahiWatchCallback callback, void *userdata)
+{
+    AvahiWatch *w = mem_new(AvahiWatch, 1);
+
+    (void) api;
+
+    w->callback = callback;
+    w->userdata = userdata;
+    w->fdpoll = eloop_shard_fdpoll_new(ELOOP_SHARD_PRIMARY, fd,
+        eloop_avahi_watch_callback, w);
+    eloop_fdpoll_set_mask(w->fdpoll, eloop_avahi_events_to_mask(event));
+
+    return w;
+}
+
+/* AvahiPoll::watch_update
+ */
+static void
+eloop_avahi_watch_update (AvahiWatch *w, AvahiWatchEvent event)
+{
+    eloop_fdpoll_set_mask(w->fdpoll, eloop_avahi_events_to_mask(event));
+}
+
+/* AvahiPoll::watch_get_events
+ */
+static AvahiWatchEvent
+eloop_avahi_watch_get_events (AvahiWatch *w)
+{
+    return w->revents;
+}
+
+/* AvahiPoll::watch_free
+ */
+static void
+eloop_avahi_watch_free (AvahiWatch *w)
+{
+    eloop_fdpoll_free(w->fdpoll);
+    mem_free(w);
+}
+
+/* eloop_timer callback for AvahiTimeout
+ */
+static void
+eloop_avahi_timeout_callback (void *data)
+{
+    AvahiTimeout    *t = data;
+    eloop_stat_mark mark;
+    void            *func = t->callback;
+
+    t->timer = NULL; /* Expired timer is freed automatically */
+
+    eloop_stat_begin(ELOOP_SHARD_PRIMARY, &mark, func);
+    t->callback(t, t->userdata);
+    eloop_stat_end(ELOOP_SHARD_PRIMARY, &mark, "avahi timeout", func);
+}
+
+/* Arm the AvahiTimeout. Avahi uses absolute wall-clock time,
+ * NULL means disabled timeout
+ */
+static void
+eloop_avahi_timeout_arm (AvahiTimeout *t, const struct timeval *tv)
+{
+    if (t->timer != NULL) {
+        eloop_timer_cancel(t->timer);
+        t->timer = NULL;
+    }
+
+    if (tv != NULL) {
+        AvahiUsec usec = -avahi_age(tv);
+        int       timeout = 0;
+
+        if (usec > 0) {
+            timeout = (int) ((usec + 999) / 1000);
+        }
+
+        t->timer = eloop_shard_timer_new(ELOOP_SHARD_PRIMARY, timeout,
+            eloop_avahi_timeout_callback, t);
+    }
+}
+
+/* AvahiPoll::timeout_new
+ */
+static AvahiTimeout*
+eloop_avahi_timeout_new (const AvahiPoll *api, const struct timeval *tv,
+        AvahiTimeoutCallback callback, void *userdata)
+{
+    AvahiTimeout *t = mem_new(AvahiTimeout, 1);
+
+    (void) api;
+
+    t->callback = callback;
+    t->userdata = userdata;
+    eloop_avahi_timeout_arm(t, tv);
+
+    return t;
+}
+
+/* AvahiPoll::timeout_update
+ */
+static void
+eloop_avahi_timeout_update (AvahiTimeout *t, const struct timeval *tv)
+{
+    eloop_avahi_timeout_arm(t, tv);
+}
+
+/* AvahiPoll::timeout_free
+ */
+static void
+eloop_avahi_timeout_free (AvahiTimeout *t)
+{
+    eloop_avahi_timeout_arm(t, NULL);
+    mem_free(t);
+}
+
+/* AvahiPoll that runs on top of the event loop
+ *
+ * Avahi always runs on the primary shard
+ */
+static const AvahiPoll eloop_avahi_poll = {
+    .userdata = NULL,
+    .watch_new = eloop_avahi_watch_new,
+    .watch_update = eloop_avahi_watch_update,
+    .watch_get_events = eloop_avahi_watch_get_events,
+    .watch_free = eloop_avahi_watch_free,
+    .timeout_new = eloop_avahi_timeout_new,
+    .timeout_update = eloop_avahi_timeout_update,
+    .timeout_free = eloop_avahi_timeout_free
+};
+#endif
 
 /* Format error string, as printf() does and save result
  * in the memory, owned by the event loop
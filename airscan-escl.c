@@ -45,6 +45,13 @@
 #define ESCL_NEXT_LOAD_DELAY           1000
 #define ESCL_NEXT_LOAD_DELAY_MAX       0.5
 
+/* escl_scanner_status represents decoded ScannerStatus response
+ */
+typedef struct {
+    SANE_Status device_status; /* <pwg:State>XXX</pwg:State> */
+    SANE_Status adf_status;    /* <scan:AdfState>YYY</scan:AdfState> */
+} escl_scanner_status;
+
 /* proto_handler_escl represents eSCL protocol handler
  */
 typedef struct {
@@ -54,6 +61,12 @@ typedef struct {
     bool quirk_localhost;            /* Set Host: localhost in ScanJobs rq */
     bool quirk_canon_mf410_series;   /* Canon MF410 Series */
     bool quirk_port_in_host;         /* Always set port in Host: header */
+
+    /* Last received ScannerStatus, reused by PRECHECK
+     * within conf.status_cache milliseconds
+     */
+    escl_scanner_status status;      /* Decoded status */
+    timestamp           status_time; /* When received, 0 if none */
 } proto_handler_escl;
 
 /* XML namespace for XML writer
@@ -65,15 +78,6 @@ static const xml_ns escl_xml_wr_ns[] = {
 };
 
 
-/******************** Miscellaneous types ********************/
-/* escl_scanner_status represents decoded ScannerStatus response
- */
-typedef struct {
-    SANE_Status device_status; /* <pwg:State>XXX</pwg:State> */
-    SANE_Status adf_status;    /* <scan:AdfState>YYY</scan:AdfState> */
-} escl_scanner_status;
-
-
 /******************** Forward declarations ********************/
 static error
 escl_parse_scanner_status (const proto_ctx *ctx,
@@ -640,11 +644,57 @@ escl_devcaps_decode (const proto_ctx *ctx, devcaps *caps)
     return escl_devcaps_parse(escl, caps, data->bytes, data->size);
 }
 
-/* Create pre-scan check query
+/* Forget the cached ScannerStatus. Called on any error, so
+ * the next PRECHECK will query the device
+ */
+static void
+escl_status_forget (const proto_ctx *ctx)
+{
+    proto_handler_escl *escl = (proto_handler_escl*) ctx->proto;
+
+    escl->status_time = 0;
+}
+
+/* Check if cached ScannerStatus is fresh enough and doesn't
+ * indicate any error for the requested scan source
+ */
+static bool
+escl_status_usable (const proto_ctx *ctx)
+{
+    proto_handler_escl *escl = (proto_handler_escl*) ctx->proto;
+    timestamp          age = timestamp_now() - escl->status_time;
+
+    if (conf.status_cache <= 0 || escl->status_time == 0 ||
+        age > conf.status_cache) {
+        return false;
+    }
+
+    if (escl->status.device_status != SANE_STATUS_GOOD) {
+        return false;
+    }
+
+    if (ctx->params.src != ID_SOURCE_PLATEN &&
+        escl->status.adf_status != SANE_STATUS_GOOD &&
+        escl->status.adf_status != SANE_STATUS_UNSUPPORTED) {
+        return false;
+    }
+
+    log_debug(ctx->log, "%s: using ScannerStatus received %d ms ago",
+        proto_op_name(ctx->op), (int) age);
+
+    return true;
+}
+
+/* Create pre-scan check query. Returns NULL, if recently
+ * received ScannerStatus can be used instead
  */
 static http_query*
 escl_precheck_query (const proto_ctx *ctx)
 {
+    if (escl_status_usable(ctx)) {
+        return NULL;
+    }
+
     return escl_http_get(ctx, "ScannerStatus");
 }
 
@@ -664,14 +714,25 @@ escl_precheck_decode (const proto_ctx *ctx)
     result.status = SANE_STATUS_GOOD;
     result.next = PROTO_OP_SCAN;
 
-    /* Decode status */
-    err = http_query_error(ctx->query);
-    if (err == NULL) {
-        http_data *data = http_query_get_response_data(ctx->query);
-        err = escl_parse_scanner_status(ctx, data->bytes, data->size, &sts);
+    /* Decode status, or take cached one */
+    if (ctx->query == NULL) {
+        sts = escl->status;
+    } else {
+        err = http_query_error(ctx->query);
+        if (err == NULL) {
+            http_data *data = http_query_get_response_data(ctx->query);
+            err = escl_parse_scanner_status(ctx, data->bytes, data->size,
+                &sts);
+        }
+
+        if (err == NULL) {
+            escl->status = sts;
+            escl->status_time = timestamp_now();
+        }
     }
 
     if (err != NULL) {
+        escl_status_forget(ctx);
         result.err = err;
         result.status = SANE_STATUS_IO_ERROR;
         result.next = PROTO_OP_FINISH;
@@ -688,6 +749,7 @@ escl_precheck_decode (const proto_ctx *ctx)
             switch (sts.adf_status) {
             case SANE_STATUS_JAMMED:
             case SANE_STATUS_NO_DOCS:
+                escl_status_forget(ctx);
                 result.status = sts.adf_status;
                 result.next = PROTO_OP_FINISH;
 
@@ -815,6 +877,7 @@ escl_scan_decode (const proto_ctx *ctx)
     if (http_query_status(ctx->query) != HTTP_STATUS_CREATED) {
         err = eloop_eprintf("ScanJobs request: unexpected HTTP status %d",
                 http_query_status(ctx->query));
+        escl_status_forget(ctx);
         result.next = PROTO_OP_CHECK;
         result.err = err;
         return result;
@@ -835,7 +898,7 @@ escl_scan_decode (const proto_ctx *ctx)
     }
 
     escl_scan_fix_location(NULL, uri, http_query_uri(ctx->query));
-    result.data.location = str_dup(http_uri_str(uri));
+    result.data.location = arena_strdup(ctx->arena, http_uri_str(uri));
     http_uri_free(uri);
 
     result.next = PROTO_OP_LOAD;
@@ -843,6 +906,7 @@ escl_scan_decode (const proto_ctx *ctx)
     return result;
 
 ERROR:
+    escl_status_forget(ctx);
     result.next = PROTO_OP_FINISH;
     result.status = SANE_STATUS_IO_ERROR;
     result.err = err;
@@ -855,15 +919,11 @@ static http_query*
 escl_load_query (const proto_ctx *ctx)
 {
     char *url, *sep;
-    http_query *q;
 
     sep = str_has_suffix(ctx->location, "/") ? "" : "/";
-    url = str_concat(ctx->location, sep, "NextDocument", NULL);
-
-    q = escl_http_get(ctx, url);
-    mem_free(url);
+    url = arena_printf(ctx->arena, "%s%sNextDocument", ctx->location, sep);
 
-    return q;
+    return escl_http_get(ctx, url);
 }
 
 /* Decode result of image request
@@ -881,6 +941,7 @@ escl_load_decode (const proto_ctx *ctx)
         if (ctx->params.src == ID_SOURCE_PLATEN && ctx->images_received > 0) {
             result.next = PROTO_OP_CLEANUP;
         } else {
+            escl_status_forget(ctx);
             result.next = PROTO_OP_CHECK;
             result.err = eloop_eprintf("HTTP: %s", ESTRING(err));
         }
@@ -1031,6 +1092,11 @@ escl_status_decode (const proto_ctx *ctx)
     SANE_Status  status;
     int          max_attempts;
 
+    /* CHECK follows the failed operation, so PRECHECK of the
+     * next job must query the device again
+     */
+    escl_status_forget(ctx);
+
     /* Decode status */
     err = http_query_error(ctx->query);
     if (err != NULL) {
@@ -1116,6 +1182,33 @@ FAIL:
     return result;
 }
 
+/* Decode ADF state from the ScannerStatus response
+ */
+static SANE_Status
+escl_adf_status_decode (const proto_ctx *ctx)
+{
+    escl_scanner_status sts;
+    error               err;
+
+    err = http_query_error(ctx->query);
+    if (err == NULL) {
+        http_data *data = http_query_get_response_data(ctx->query);
+        err = escl_parse_scanner_status(ctx, data->bytes, data->size, &sts);
+    }
+
+    if (err != NULL) {
+        return SANE_STATUS_IO_ERROR;
+    }
+
+    if (sts.adf_status == SANE_STATUS_UNSUPPORTED ||
+        sts.device_status == SANE_STATUS_GOOD) {
+        return sts.adf_status;
+    }
+
+    return sts.device_status == SANE_STATUS_UNSUPPORTED ?
+        SANE_STATUS_DEVICE_BUSY : sts.device_status;
+}
+
 /* Cancel scan in progress
  */
 static http_query*
@@ -1157,6 +1250,7 @@ proto_handler_escl_new (void)
 
     escl->proto.status_query = escl_status_query;
     escl->proto.status_decode = escl_status_decode;
+    escl->proto.adf_status_decode = escl_adf_status_decode;
 
     escl->proto.cleanup_query = escl_cancel_query;
     escl->proto.cancel_query = escl_cancel_query;
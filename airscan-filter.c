@@ -8,6 +8,8 @@
 
 #include "airscan.h"
 
+#include <stdlib.h>
+
 /******************** Table filter ********************/
 /* Type filter_xlat represents translation table based filter
  */
@@ -171,5 +173,550 @@ filter_chain_apply (filter *chain, uint8_t *line, size_t size)
     }
 }
 
+/* Resample line of RGB24 pixels into Grayscale8, in place.
+ * The first wid bytes of line receive the result
+ */
+void
+filter_rgb24_to_gray8 (uint8_t *line, int wid)
+{
+    const uint8_t *in = line;
+    uint8_t       *out = line;
+    int           i;
+
+    for (i = 0; i < wid; i ++) {
+        /* Y = R * 0.299 + G * 0.587 + B * 0.114
+         *
+         * 16777216 == 1 << 24
+         * 16777216 * 0.299 == 5016387.584 ~= 5016387
+         * 16777216 * 0.587 == 9848225.792 ~= 9848226
+         * 16777216 * 0.114 == 1912602.624 ~= 1912603
+         *
+         * 5016387 + 9848226 + 1912603 == 16777216
+         */
+        unsigned long Y;
+
+        Y = 5016387 * (unsigned long) *in ++;
+        Y += 9848226 * (unsigned long) *in ++;
+        Y += 1912603 * (unsigned long) *in ++;
+        *out ++ = (Y + (1 << 23)) >> 24;
+    }
+}
+
+/******************** Area-average downscaler ********************/
+/* Each input pixel covers num units of output coordinates, and each
+ * output pixel covers den units of input coordinates, in both
+ * directions. As num < den, an input pixel contributes to at most
+ * two output pixels, and an input line contributes to at most two
+ * output lines, with integer weights that sum to den per output pixel.
+ *
+ * Horizontal pass sums weighted input pixels and normalizes the sums
+ * to 8.8 fixed point. Vertical pass accumulates weighted results of
+ * horizontal pass until the output line is complete. Both passes run
+ * over plain arrays of 32-bit integers, so the compiler vectorizes
+ * them
+ */
+struct filter_downscale {
+    int      wid, owid;   /* Input and output width, in pixels */
+    int      bpp;         /* Bytes per pixel */
+    int      num, den;    /* Scale factor */
+    int      factor;      /* den/num, if integer, 0 otherwise */
+    int      used;        /* Input pixels that affect output */
+    int      *hidx;       /* Per input pixel: output pixel index */
+    uint32_t *hwgt;       /* Per input pixel: weight for hidx */
+    uint32_t *hacc;       /* Horizontal pass accumulator */
+    uint32_t *vacc;       /* Vertical pass accumulator */
+    uint32_t hmul;        /* Horizontal normalization multiplier */
+    uint64_t vmul;        /* Vertical normalization multiplier */
+    long long in_line;    /* Index of the next input line */
+};
+
+/* Create new downscaler
+ */
+filter_downscale*
+filter_downscale_new (int wid, int bpp, int num, int den)
+{
+    filter_downscale *ds = mem_new(filter_downscale, 1);
+    int              i, gcd;
+
+    log_assert(NULL, num > 0 && num < den);
+    log_assert(NULL, bpp == 1 || bpp == 3);
+
+    gcd = math_gcd(num, den);
+    num /= gcd;
+    den /= gcd;
+
+    ds->wid = wid;
+    ds->owid = (int) (((long long) wid * num) / den);
+    ds->bpp = bpp;
+    ds->num = num;
+    ds->den = den;
+    ds->factor = den % num == 0 ? den / num : 0;
+    ds->used = (int) math_min(wid,
+        ((long long) ds->owid * den + num - 1) / num);
+
+    ds->hidx = mem_new(int, ds->used);
+    ds->hwgt = mem_new(uint32_t, ds->used);
+    ds->hacc = mem_new(uint32_t, (ds->owid + 1) * bpp);
+    ds->vacc = mem_new(uint32_t, ds->owid * bpp);
+
+    for (i = 0; i < ds->used; i ++) {
+        long long beg = (long long) i * num;
+        int       idx = (int) (beg / den);
+
+        ds->hidx[i] = idx;
+        ds->hwgt[i] = (uint32_t) math_min(num,
+            (idx + 1) * (long long) den - beg);
+    }
+
+    /* Horizontal sums are up to 255*den and multiplied by hmul
+     * to get 8.8 fixed point; vertical sums are up to 65280*den
+     * and multiplied by vmul to get 24.40 fixed point
+     */
+    ds->hmul = (uint32_t) (((1 << 24) + den / 2) / den);
+    ds->vmul = (((uint64_t) 1 << 40) + den * 128) / ((uint64_t) den * 256);
+
+    return ds;
+}
+
+/* Free the downscaler
+ */
+void
+filter_downscale_free (filter_downscale *ds)
+{
+    if (ds != NULL) {
+        mem_free(ds->hidx);
+        mem_free(ds->hwgt);
+        mem_free(ds->hacc);
+        mem_free(ds->vacc);
+        mem_free(ds);
+    }
+}
+
+/* Get width of output lines, in pixels
+ */
+int
+filter_downscale_wid (const filter_downscale *ds)
+{
+    return ds->owid;
+}
+
+/* Get count of output lines, produced from the given count
+ * of input lines
+ */
+int
+filter_downscale_lines (const filter_downscale *ds, int lines)
+{
+    return (int) (((long long) lines * ds->num) / ds->den);
+}
+
+/* Horizontal pass for the integer scale factor
+ */
+static inline void
+filter_downscale_hpass_int (filter_downscale *ds, const uint8_t *in, int bpp)
+{
+    int      i, k, c, factor = ds->factor;
+    uint32_t num = ds->num;
+
+    for (i = 0; i < ds->owid; i ++) {
+        for (c = 0; c < bpp; c ++) {
+            uint32_t sum = 0;
+
+            for (k = 0; k < factor; k ++) {
+                sum += in[k * bpp + c];
+            }
+
+            ds->hacc[i * bpp + c] = sum * num;
+        }
+
+        in += factor * bpp;
+    }
+}
+
+/* Horizontal pass for the fractional scale factor.
+ *
+ * Input pixels are walked in order, and contributions to the current
+ * and the next output pixel are kept in registers, so each output
+ * pixel is stored only once
+ */
+static inline void
+filter_downscale_hpass_frac (filter_downscale *ds, const uint8_t *in, int bpp)
+{
+    int      i, c, cur = 0;
+    uint32_t num = ds->num, acc[3] = {0, 0, 0}, next[3] = {0, 0, 0};
+
+    for (i = 0; i < ds->used; i ++) {
+        uint32_t w = ds->hwgt[i];
+
+        if (ds->hidx[i] != cur) {
+            for (c = 0; c < bpp; c ++) {
+                ds->hacc[cur * bpp + c] = acc[c];
+                acc[c] = next[c];
+                next[c] = 0;
+            }
+            cur ++;
+        }
+
+        for (c = 0; c < bpp; c ++) {
+            uint32_t v = in[i * bpp + c];
+
+            acc[c] += w * v;
+            next[c] += (num - w) * v;
+        }
+    }
+
+    for (c = 0; c < bpp; c ++) {
+        ds->hacc[cur * bpp + c] = acc[c];
+    }
+}
+
+/* Push next input line. Returns true, if the next output line
+ * became ready and was written to out
+ */
+bool
+filter_downscale_push (filter_downscale *ds, const uint8_t *in, uint8_t *out)
+{
+    int       i, n = ds->owid * ds->bpp;
+    long long beg = ds->in_line * ds->num;
+    long long idx = beg / ds->den;
+    uint32_t  w = (uint32_t) math_min(ds->num, (idx + 1) * ds->den - beg);
+    uint32_t  rest = ds->num - w;
+    bool      done;
+
+    ds->in_line ++;
+
+    /* Horizontal pass. The bpp is passed as a constant, so
+     * the per-channel loops are unrolled
+     */
+    if (ds->factor != 0) {
+        if (ds->bpp == 1) {
+            filter_downscale_hpass_int(ds, in, 1);
+        } else {
+            filter_downscale_hpass_int(ds, in, 3);
+        }
+    } else {
+        if (ds->bpp == 1) {
+            filter_downscale_hpass_frac(ds, in, 1);
+        } else {
+            filter_downscale_hpass_frac(ds, in, 3);
+        }
+    }
+
+    /* Vertical pass */
+    for (i = 0; i < n; i ++) {
+        uint32_t h = (ds->hacc[i] * ds->hmul + (1 << 15)) >> 16;
+
+        ds->hacc[i] = h;
+        ds->vacc[i] += w * h;
+    }
+
+    done = rest != 0 || beg + ds->num == (idx + 1) * ds->den;
+    if (!done) {
+        return false;
+    }
+
+    for (i = 0; i < n; i ++) {
+        uint64_t v = ds->vacc[i] * ds->vmul + ((uint64_t) 1 << 39);
+
+        out[i] = (uint8_t) math_min(255, (SANE_Word) (v >> 40));
+        ds->vacc[i] = rest * ds->hacc[i];
+    }
+
+    return true;
+}
+
+/******************** Page statistics ********************/
+/* Pixels that differ from the background by more than this
+ * value are counted as ink
+ */
+#define FILTER_PAGESTAT_INK_DELTA       64
+
+/* Pixels that differ from the left or upper neighbour by more
+ * that this value are counted as edges
+ */
+#define FILTER_PAGESTAT_EDGE_DELTA      48
+
+/* Page statistics accumulator. It keeps the luminance histogram
+ * and count of edge pixels, and the luminance of the previous line
+ * for vertical edges detection
+ */
+struct filter_pagestat {
+    int      wid;         /* Line width, in pixels */
+    int      bpp;         /* Bytes per pixel */
+    uint64_t hist[256];   /* Luminance histogram */
+    uint64_t edges;       /* Count of edge pixels */
+    uint64_t pixels;      /* Count of pixels */
+    uint8_t  *prev;       /* Luminance of the previous line */
+    bool     have_prev;   /* The prev line is valid */
+};
+
+/* Create new page statistics accumulator
+ */
+filter_pagestat*
+filter_pagestat_new (int wid, int bpp)
+{
+    filter_pagestat *ps = mem_new(filter_pagestat, 1);
+
+    log_assert(NULL, bpp == 1 || bpp == 3);
+
+    ps->wid = wid;
+    ps->bpp = bpp;
+    ps->prev = mem_new(uint8_t, wid);
+
+    return ps;
+}
+
+/* Free page statistics accumulator
+ */
+void
+filter_pagestat_free (filter_pagestat *ps)
+{
+    if (ps != NULL) {
+        mem_free(ps->prev);
+        mem_free(ps);
+    }
+}
+
+/* Accumulate statistics of the single line. Luminance is
+ * approximated with 8-bit weights, which is enough for
+ * classification
+ */
+static inline void
+filter_pagestat_line (filter_pagestat *ps, const uint8_t *line, int bpp)
+{
+    uint8_t  *prev = ps->prev;
+    uint64_t edges = 0;
+    int      i, left = -1;
+
+    for (i = 0; i < ps->wid; i ++) {
+        int l, d;
+
+        if (bpp == 1) {
+            l = line[i];
+        } else {
+            const uint8_t *px = line + i * 3;
+            l = (px[0] * 77 + px[1] * 150 + px[2] * 29 + 128) >> 8;
+        }
+
+        ps->hist[l] ++;
+
+        d = left < 0 ? 0 : abs(l - left);
+        if (ps->have_prev) {
+            d = math_max(d, abs(l - prev[i]));
+        }
+
+        edges += d > FILTER_PAGESTAT_EDGE_DELTA;
+        prev[i] = (uint8_t) l;
+        left = l;
+    }
+
+    ps->edges += edges;
+    ps->pixels += ps->wid;
+    ps->have_prev = true;
+}
+
+/* Push next line of the page
+ */
+void
+filter_pagestat_push (filter_pagestat *ps, const uint8_t *line)
+{
+    if (ps->bpp == 1) {
+        filter_pagestat_line(ps, line, 1);
+    } else {
+        filter_pagestat_line(ps, line, 3);
+    }
+}
+
+/* Get statistics of the page, accumulated so far
+ */
+void
+filter_pagestat_get (const filter_pagestat *ps, filter_pagestat_result *res)
+{
+    int      i, bg = 0;
+    uint64_t ink = 0;
+
+    memset(res, 0, sizeof(*res));
+    if (ps->pixels == 0) {
+        return;
+    }
+
+    /* Background is the most frequent luminance */
+    for (i = 1; i < 256; i ++) {
+        if (ps->hist[i] >= ps->hist[bg]) {
+            bg = i;
+        }
+    }
+
+    for (i = 0; i < 256; i ++) {
+        if (abs(i - bg) > FILTER_PAGESTAT_INK_DELTA) {
+            ink += ps->hist[i];
+        }
+    }
+
+    res->background = bg;
+    res->ink = (int) ((ink * 10000 + ps->pixels / 2) / ps->pixels);
+    res->edges = (int) ((ps->edges * 10000 + ps->pixels / 2) / ps->pixels);
+}
+
+/******************** Regions detection ********************/
+/* Pixels that differ from the background by more than this
+ * value belong to objects
+ */
+#define FILTER_REGIONS_DELTA    32
+
+/* Cell belongs to object, if at least 1/FILTER_REGIONS_FILL
+ * of its pixels belong to objects
+ */
+#define FILTER_REGIONS_FILL     8
+
+/* Compare regions in the reading order, for qsort()
+ */
+static int
+filter_regions_cmp (const void *p1, const void *p2)
+{
+    const image_window *r1 = p1, *r2 = p2;
+
+    if (r1->y_off != r2->y_off) {
+        return r1->y_off < r2->y_off ? -1 : 1;
+    }
+
+    return r1->x_off - r2->x_off;
+}
+
+/* Detect separate objects (i.e., photos), placed on a platen, in the
+ * image of wid x hei pixels of bpp (1 or 3) bytes each.
+ *
+ * The image is reduced to the low-resolution map of cells, where each
+ * cell is marked, if enough of its pixels differ from the background.
+ * Background is the most frequent luminance. The map is dilated by one
+ * cell, to bridge small gaps within objects, and its connected
+ * components become regions
+ */
+int
+filter_regions_detect (const uint8_t *image, int wid, int hei, int bpp,
+        int cell, int min_cells, image_window *regions, int max)
+{
+    int      cw = (wid + cell - 1) / cell, ch = (hei + cell - 1) / cell;
+    uint32_t *count = mem_new(uint32_t, cw * ch);
+    uint8_t  *map = mem_new(uint8_t, cw * ch);
+    int      *stack = mem_new(int, cw * ch);
+    uint64_t hist[256];
+    int      x, y, i, bg = 0, found = 0;
+
+    /* Find the background */
+    memset(hist, 0, sizeof(hist));
+    for (i = 0; i < wid * hei; i ++) {
+        const uint8_t *px = image + i * bpp;
+        hist[bpp == 1 ? px[0] :
+            (px[0] * 77 + px[1] * 150 + px[2] * 29 + 128) >> 8] ++;
+    }
+
+    for (i = 1; i < 256; i ++) {
+        if (hist[i] >= hist[bg]) {
+            bg = i;
+        }
+    }
+
+    /* Count object pixels per cell */
+    for (y = 0; y < hei; y ++) {
+        const uint8_t *line = image + (size_t) y * wid * bpp;
+        uint32_t      *row = count + (y / cell) * cw;
+
+        for (x = 0; x < wid; x ++) {
+            const uint8_t *px = line + x * bpp;
+            int           l = bpp == 1 ? px[0] :
+                (px[0] * 77 + px[1] * 150 + px[2] * 29 + 128) >> 8;
+
+            row[x / cell] += abs(l - bg) > FILTER_REGIONS_DELTA;
+        }
+    }
+
+    /* Build the map: bit 0 is set for object cells, bit 1
+     * for object cells and their neighbours
+     */
+    for (y = 0; y < ch; y ++) {
+        for (x = 0; x < cw; x ++) {
+            int cx = math_min(cell, wid - x * cell);
+            int cy = math_min(cell, hei - y * cell);
+            int dx, dy;
+
+            if (count[y * cw + x] * FILTER_REGIONS_FILL <
+                (uint32_t) (cx * cy)) {
+                continue;
+            }
+
+            map[y * cw + x] |= 1;
+            for (dy = math_max(0, y - 1); dy <= math_min(ch - 1, y + 1);
+                 dy ++) {
+                for (dx = math_max(0, x - 1); dx <= math_min(cw - 1, x + 1);
+                     dx ++) {
+                    map[dy * cw + dx] |= 2;
+                }
+            }
+        }
+    }
+
+    /* Collect connected components of dilated map. The region
+     * covers only object cells of the component
+     */
+    for (i = 0; i < cw * ch; i ++) {
+        int sp = 0, x0 = cw, y0 = ch, x1 = -1, y1 = -1;
+
+        if ((map[i] & 2) == 0) {
+            continue;
+        }
+
+        map[i] &= ~2;
+        stack[sp ++] = i;
+
+        while (sp > 0) {
+            int c = stack[-- sp], dx, dy;
+
+            x = c % cw;
+            y = c / cw;
+
+            if ((map[c] & 1) != 0) {
+                x0 = math_min(x0, x);
+                y0 = math_min(y0, y);
+                x1 = math_max(x1, x);
+                y1 = math_max(y1, y);
+            }
+
+            for (dy = math_max(0, y - 1); dy <= math_min(ch - 1, y + 1);
+                 dy ++) {
+                for (dx = math_max(0, x - 1); dx <= math_min(cw - 1, x + 1);
+                     dx ++) {
+                    int n = dy * cw + dx;
+
+                    if ((map[n] & 2) != 0) {
+                        map[n] &= ~2;
+                        stack[sp ++] = n;
+                    }
+                }
+            }
+        }
+
+        if (x1 - x0 + 1 < min_cells || y1 - y0 + 1 < min_cells) {
+            continue;
+        }
+
+        if (found < max) {
+            image_window *r = &regions[found ++];
+
+            r->x_off = x0 * cell;
+            r->y_off = y0 * cell;
+            r->wid = math_min((x1 + 1) * cell, wid) - r->x_off;
+            r->hei = math_min((y1 + 1) * cell, hei) - r->y_off;
+        }
+    }
+
+    qsort(regions, found, sizeof(*regions), filter_regions_cmp);
+
+    mem_free(count);
+    mem_free(map);
+    mem_free(stack);
+
+    return found;
+}
+
 /* vim:ts=8:sw=4:et
  */
@@ -38,11 +38,17 @@
  */
 #define HTTP_QUERY_TIMEOUT      -1
 
+/* Lifetime of unused pre-established connection, milliseconds
+ */
+#define HTTP_PRECONN_TIMEOUT    10000
+
 /******************** Static variables ********************/
 static gnutls_certificate_credentials_t gnutls_cred;
 
 /******************** Forward declarations ********************/
 typedef struct http_multipart http_multipart;
+typedef struct http_preconn http_preconn;
+
 
 static http_data*
 http_data_new(http_data *parent, const char *bytes, size_t size);
@@ -62,6 +68,15 @@ http_query_complete (http_query *q, error err);
 static void
 http_query_connect (http_query *q, error err);
 
+static void
+http_query_connect_next (http_query *q, error err);
+
+static bool
+http_query_preconn_stale (http_query *q, ssize_t rc);
+
+static void
+http_query_preconn_retry (http_query *q);
+
 static void
 http_query_disconnect (http_query *q);
 
@@ -77,6 +92,18 @@ http_query_sock_err (http_query *q, int rc);
 static void
 http_query_cancel (http_query *q);
 
+static bool
+http_query_preconn_take (http_query *q);
+
+static void
+http_query_preconn_claim (http_query *q);
+
+static http_preconn*
+http_preconn_by_ll_node (ll_node *node);
+
+static void
+http_preconn_free (http_preconn *pc);
+
 /******************** HTTP URI ********************/
 /* Type http_uri represents HTTP URI
  */
@@ -1035,6 +1062,7 @@ http_uri_equal (const http_uri *uri1, const http_uri *uri2)
  */
 typedef struct {
     ll_head fields;          /* List of http_hdr_field */
+    arena   *arena;          /* Fields are allocated here */
 } http_hdr;
 
 /* http_hdr_field represents a single HTTP header field
@@ -1045,45 +1073,36 @@ typedef struct {
     ll_node chain;           /* In http_hdr::fields */
 } http_hdr_field;
 
-/* Create http_hdr_field. Name can be NULL
+/* Create http_hdr_field and append it to the header. Name can be NULL
  */
 static http_hdr_field*
-http_hdr_field_new (const char *name)
+http_hdr_field_new (http_hdr *hdr, const char *name)
 {
-    http_hdr_field *field = mem_new(http_hdr_field, 1);
-    field->name = name ? str_dup(name) : str_new();
+    http_hdr_field *field = arena_alloc(hdr->arena, sizeof(http_hdr_field));
+    field->name = arena_strdup(hdr->arena, name ? name : "");
+    ll_push_end(&hdr->fields, &field->chain);
     return field;
 }
 
-/* Destroy http_hdr_field
+/* Initialize http_hdr in place. Header fields will be
+ * allocated from the specified arena and released with it
  */
 static void
-http_hdr_field_free (http_hdr_field *field)
-{
-    mem_free(field->name);
-    mem_free(field->value);
-    mem_free(field);
-}
-
-/* Initialize http_hdr in place
- */
-static void
-http_hdr_init (http_hdr *hdr)
+http_hdr_init (http_hdr *hdr, arena *a)
 {
     ll_init(&hdr->fields);
+    hdr->arena = a;
 }
 
 /* Cleanup http_hdr in place
+ *
+ * Note, memory occupied by fields is not released until
+ * the underlying arena is destroyed
  */
 static void
 http_hdr_cleanup (http_hdr *hdr)
 {
-    ll_node *node;
-
-    while ((node = ll_pop_beg(&hdr->fields)) != NULL) {
-        http_hdr_field *field = OUTER_STRUCT(node, http_hdr_field, chain);
-        http_hdr_field_free(field);
-    }
+    ll_init(&hdr->fields);
 }
 
 /* Write header to string buffer in wire format
@@ -1147,15 +1166,10 @@ http_hdr_set (http_hdr *hdr, const char *name, const char *value)
     http_hdr_field *field = http_hdr_lookup(hdr, name);
 
     if (field == NULL) {
-        field = http_hdr_field_new(name);
-        ll_push_end(&hdr->fields, &field->chain);
+        field = http_hdr_field_new(hdr, name);
     }
 
-    if (field->value == NULL) {
-        field->value = str_dup(value);
-    } else {
-        field->value = str_assign(field->value, value);
-    }
+    field->value = arena_strdup(hdr->arena, value);
 }
 
 /* Del header field
@@ -1167,7 +1181,6 @@ http_hdr_del (http_hdr *hdr, const char *name)
 
     if (field != NULL) {
         ll_del(&field->chain);
-        http_hdr_field_free(field);
     }
 }
 
@@ -1192,12 +1205,11 @@ http_hdr_on_header_field (http_parser *parser,
      * has value, create a new field
      */
     if (field == NULL || field->value != NULL) {
-        field = http_hdr_field_new(NULL);
-        ll_push_end(&hdr->fields, &field->chain);
+        field = http_hdr_field_new(hdr, NULL);
     }
 
     /* Append data to the field name */
-    field->name = str_append_mem(field->name, data, size);
+    field->name = arena_append(hdr->arena, field->name, data, size);
 
     return 0;
 }
@@ -1227,11 +1239,7 @@ http_hdr_on_header_value (http_parser *parser,
     }
 
     /* Append data to field value */
-    if (field->value == NULL) {
-        field->value = str_new();
-    }
-
-    field->value = str_append_mem(field->value, data, size);
+    field->value = arena_append(hdr->arena, field->value, data, size);
 
     return 0;
 }
@@ -1365,11 +1373,9 @@ http_hdr_params_parse (http_hdr *params, const char *name, const char *in)
         case NAME:
             if (!http_hdr_params_chr_isspec(c)) {
                 if (field == NULL) {
-                    field = http_hdr_field_new(NULL);
-                    field->value = str_new();
-                    ll_push_end(&params->fields, &field->chain);
+                    field = http_hdr_field_new(params, NULL);
                 }
-                field->name = str_append_c(field->name, c);
+                field->name = arena_append(params->arena, field->name, &c, 1);
             } else if (c == ';') {
                 state = SP1;
                 field = NULL;
@@ -1381,6 +1387,7 @@ http_hdr_params_parse (http_hdr *params, const char *name, const char *in)
 
         case EQ:
             if (c == '=') {
+                field->value = arena_strdup(params->arena, "");
                 state = SP3;
             } else if (c == ';') {
                 state = SP1;
@@ -1406,18 +1413,20 @@ http_hdr_params_parse (http_hdr *params, const char *name, const char *in)
             } else if (c == '"') {
                 state = SP4;
             } else {
-                field->value = str_append_c(field->value, c);
+                field->value = arena_append(params->arena, field->value,
+                        &c, 1);
             }
             break;
 
         case STRING_BSLASH:
-            field->value = str_append_c(field->value, c);
+            field->value = arena_append(params->arena, field->value, &c, 1);
             state = STRING;
             break;
 
         case TOKEN:
             if (c != ';' && c != '"' && !safe_isspace(c)) {
-                field->value = str_append_c(field->value, c);
+                field->value = arena_append(params->arena, field->value,
+                        &c, 1);
             } else {
                 state = SP4;
                 continue;
@@ -1507,6 +1516,7 @@ static error
 http_multipart_adjust_part (http_data *part)
 {
     const char *split;
+    arena      *a;
     http_hdr   hdr;
     size_t     hdr_len;
     error      err;
@@ -1518,7 +1528,8 @@ http_multipart_adjust_part (http_data *part)
     }
 
     /* Parse headers and obtain content-type */
-    http_hdr_init(&hdr);
+    a = arena_new();
+    http_hdr_init(&hdr, a);
     hdr_len = 4 + split - (char*) part->bytes;
     err = http_hdr_parse(&hdr, part->bytes, hdr_len - 2, true);
 
@@ -1527,7 +1538,7 @@ http_multipart_adjust_part (http_data *part)
         http_data_set_content_type(part, ct);
     }
 
-    http_hdr_cleanup(&hdr);
+    arena_free(a);
     if (err != NULL) {
         return eloop_eprintf("http multipart: %s", ESTRING(err));
     }
@@ -1567,6 +1578,7 @@ http_multipart_parse (http_multipart **out, log_ctx *log,
         http_data *data, const char *content_type)
 {
     http_multipart *mp;
+    arena          *a;
     http_hdr       params;
     const char     *boundary;
     size_t         boundary_len = 0;
@@ -1581,17 +1593,19 @@ http_multipart_parse (http_multipart **out, log_ctx *log,
     }
 
     /* Obtain boundary */
-    http_hdr_init(&params);
+    a = arena_new();
+    http_hdr_init(&params, a);
     err = http_hdr_params_parse(&params, "Content-Type", content_type);
     if (err != NULL) {
-        http_hdr_cleanup(&params);
+        arena_free(a);
         return err;
     }
 
     log_debug(log, "http multipart parameters:");
     for (LL_FOR_EACH(node, &params.fields)) {
         http_hdr_field *field = OUTER_STRUCT(node, http_hdr_field, chain);
-        log_debug(log, "  %s=\"%s\"", field->name, field->value);
+        log_debug(log, "  %s=\"%s\"", field->name,
+            field->value ? field->value : "");
     }
 
     boundary = http_hdr_get(&params, "boundary");
@@ -1606,7 +1620,7 @@ http_multipart_parse (http_multipart **out, log_ctx *log,
         strcpy(s + 2, boundary);
         boundary = s;
     }
-    http_hdr_cleanup(&params);
+    arena_free(a);
 
     if (!boundary) {
         return ERROR("http multipart: missed boundary parameter");
@@ -1862,6 +1876,7 @@ struct http_client {
     void       *ptr;       /* Callback's user data */
     log_ctx    *log;       /* Logging context */
     ll_head    pending;    /* Pending queries */
+    ll_head    preconns;   /* Pre-established connections */
     void       (*onerror)( /* Callback to be called on transport error */
             void *ptr, error err);
 };
@@ -1876,6 +1891,7 @@ http_client_new (log_ctx *log, void *ptr)
     client->ptr = ptr;
     client->log = log;
     ll_init(&client->pending);
+    ll_init(&client->preconns);
 
     return client;
 }
@@ -1885,8 +1901,14 @@ http_client_new (log_ctx *log, void *ptr)
 void
 http_client_free (http_client *client)
 {
+    ll_node *node;
+
     log_assert(client->log, ll_empty(&client->pending));
 
+    while ((node = ll_first(&client->preconns)) != NULL) {
+        http_preconn_free(http_preconn_by_ll_node(node));
+    }
+
     mem_free(client);
 }
 
@@ -1901,7 +1923,8 @@ http_client_onerror (http_client *client,
     client->onerror = onerror;
 }
 
-/* Cancel all pending queries, if any
+/* Cancel all pending queries, if any. Pre-established
+ * connections, if any, are closed as well
  */
 void
 http_client_cancel (http_client *client)
@@ -1913,6 +1936,10 @@ http_client_cancel (http_client *client)
          q = http_query_by_ll_node(node);
          http_query_cancel(q);
     }
+
+    while ((node = ll_first(&client->preconns)) != NULL) {
+        http_preconn_free(http_preconn_by_ll_node(node));
+    }
 }
 
 /* Set timeout of all pending queries, if any. Timeout is in milliseconds
@@ -1961,10 +1988,113 @@ http_client_has_pending (const http_client *client)
     return !ll_empty(&client->pending);
 }
 
+/******************** Address resolution ********************/
+/* Resolve addresses of the URI host
+ *
+ * On success, *addrs receives the list of addresses, and *use_freeaddrinfo
+ * tells how to free it (see http_addrs_free()). On a error, *addrs may
+ * still be set and needs to be freed
+ */
+static error
+http_addrs_resolve (log_ctx *log, const http_uri *uri,
+        struct addrinfo **addrs, bool *use_freeaddrinfo)
+{
+    http_uri_field  field;
+    char            *host, *port;
+    struct addrinfo hints;
+    int             rc;
+
+    *addrs = NULL;
+
+    /* Get host name from the URI */
+    field = http_uri_field_get(uri, UF_HOST);
+    host = alloca(field.len + 1);
+    memcpy(host, field.str, field.len);
+    host[field.len] = '\0';
+    http_uri_unescape_host(host);
+
+    /* Get port name from the URI */
+    if (http_uri_field_nonempty(uri, UF_PORT)) {
+        field = http_uri_field_get(uri, UF_PORT);
+        port = alloca(field.len + 1);
+        memcpy(port, field.str, field.len);
+        port[field.len] = '\0';
+    } else {
+        port = uri->scheme == HTTP_SCHEME_HTTP ? "80" : "443";
+    }
+
+    /* Lookup target addresses */
+    if (uri->scheme != HTTP_SCHEME_UNIX) {
+        log_debug(log, "HTTP resolving %s %s", host, port);
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_flags = AI_ADDRCONFIG;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+
+        *use_freeaddrinfo = true;
+        rc = getaddrinfo(host, port, &hints, addrs);
+        if (rc != 0) {
+            *addrs = NULL;
+            return ERROR(gai_strerror(rc));
+        }
+    } else {
+        struct sockaddr_un *addr;
+        size_t pathlen = strlen(conf.socket_dir) + 1 /* for / */ + strlen(host);
+        char *path = alloca(pathlen + 1);
+        sprintf(path, "%s/%s", conf.socket_dir, host);
+
+        log_debug(log, "connecting to local socket %s", path);
+        *use_freeaddrinfo = false;
+        *addrs = mem_new(struct addrinfo, 1);
+        (*addrs)->ai_family = AF_UNIX;
+        (*addrs)->ai_socktype = SOCK_STREAM;
+        (*addrs)->ai_protocol = 0;
+
+        addr = mem_new(struct sockaddr_un, 1);
+        addr->sun_family = AF_UNIX;
+        strncpy(addr->sun_path, path, sizeof(addr->sun_path)-1);
+        (*addrs)->ai_addrlen = sizeof(struct sockaddr_un);
+        (*addrs)->ai_addr = (struct sockaddr *)addr;
+
+        if (pathlen >= sizeof(addr->sun_path)) {
+            return ERROR("Socket path is too long.");
+        }
+    }
+
+    return NULL;
+}
+
+/* Free addresses, returned by http_addrs_resolve()
+ */
+static void
+http_addrs_free (struct addrinfo *addrs, bool use_freeaddrinfo)
+{
+    if (use_freeaddrinfo) {
+        freeaddrinfo(addrs);
+    } else {
+        mem_free(addrs->ai_addr);
+        mem_free(addrs);
+    }
+}
+
+/* Check that address family is usable for HTTP connection
+ */
+static bool
+http_addr_usable (const struct addrinfo *addr)
+{
+    return addr->ai_family == AF_INET ||
+           addr->ai_family == AF_INET6 ||
+           addr->ai_family == AF_UNIX;
+}
+
 /******************** HTTP request handling ********************/
 /* Type http_query represents HTTP query (both request and response)
  */
 struct http_query {
+    /* Memory allocation */
+    arena             *arena;                   /* Per-query arena */
+
     /* URI and method */
     http_uri          *uri;                     /* Query URI */
     http_uri          *real_uri;                /* Real URI, may be NULL */
@@ -1993,6 +2123,9 @@ struct http_query {
     bool              addrs_freeaddrinfo;       /* Use freeaddrinfo(addrs) */
     struct addrinfo   *addr_next;               /* Next address to try */
     int               sock;                     /* HTTP socket */
+    bool              preconnected;             /* sock is pre-established,
+                                                   nothing received yet */
+    http_preconn      *preconn;                 /* Claimed http_preconn */
     gnutls_session_t  tls;                      /* NULL if not TLS */
     bool              handshake;                /* TLS handshake in progress */
     bool              sending;                  /* We are now sending */
@@ -2013,6 +2146,8 @@ struct http_query {
 
     /* Callbacks and context */
     timestamp         timestamp;                /* Submission timestamp */
+    timestamp         time_connected;           /* Request sending started */
+    timestamp         time_rxfirst;             /* First response byte */
     uintptr_t         uintptr;                  /* User-defined parameter */
     void              (*onerror) (void *ptr,    /* On-error callback */
                                 error err);
@@ -2051,17 +2186,17 @@ http_query_reset (http_query *q)
     http_hdr_cleanup(&q->response_header);
 
     if (q->addrs != NULL) {
-        if (q->addrs_freeaddrinfo) {
-            freeaddrinfo(q->addrs);
-        } else {
-            mem_free(q->addrs->ai_addr);
-            mem_free(q->addrs);
-        }
+        http_addrs_free(q->addrs, q->addrs_freeaddrinfo);
         q->addrs = NULL;
         q->addr_next = NULL;
     }
 
-    q->handshake = q->sending = false;
+    q->handshake = q->sending = q->preconnected = false;
+    q->time_connected = q->time_rxfirst = 0;
+
+    if (q->preconn != NULL) {
+        http_preconn_free(q->preconn);
+    }
 
     http_query_disconnect(q);
 
@@ -2090,13 +2225,12 @@ http_query_free (http_query *q)
     http_uri_free(q->uri);
     http_uri_free(q->real_uri);
     http_uri_free(q->orig_uri);
-    http_hdr_cleanup(&q->request_header);
-
     mem_free(q->rq_buf);
 
     http_data_unref(q->request_data);
 
-    mem_free(q);
+    /* Note, query itself lives in its arena */
+    arena_free(q->arena);
 }
 
 /* Set Host header in HTTP request
@@ -2174,14 +2308,16 @@ http_query*
 http_query_new_len (http_client *client, http_uri *uri, const char *method,
         void *body, size_t body_len, const char *content_type)
 {
-    http_query *q = mem_new(http_query, 1);
+    arena      *a = arena_new();
+    http_query *q = arena_alloc(a, sizeof(http_query));
 
+    q->arena = a;
     q->client = client;
     q->uri = uri;
     q->method = method;
 
-    http_hdr_init(&q->request_header);
-    http_hdr_init(&q->response_header);
+    http_hdr_init(&q->request_header, a);
+    http_hdr_init(&q->response_header, a);
 
     q->sock = -1;
 
@@ -2585,8 +2721,7 @@ http_query_fdpoll_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
 
             /* TLS handshake failed, try another address, if any */
             http_query_disconnect(q);
-            q->addr_next = q->addr_next->ai_next;
-            http_query_connect(q, err);
+            http_query_connect_next(q, err);
 
             return;
         }
@@ -2599,6 +2734,10 @@ http_query_fdpoll_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
         rc = http_query_sock_send(q, q->rq_buf + q->rq_off, len);
 
         if (rc > 0) {
+            if (q->rq_off == 0) {
+                q->time_connected = timestamp_now();
+            }
+
             log_debug(q->client->log, "HTTP %d bytes sent", (int) rc);
             trace_hexdump(log_ctx_trace(q->client->log), '>',
                 q->rq_buf + q->rq_off, rc);
@@ -2614,12 +2753,16 @@ http_query_fdpoll_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
             log_debug(q->client->log, "HTTP %s: send(): %s",
                 q->straddr.text, ESTRING(err));
 
+            if (http_query_preconn_stale(q, rc)) {
+                http_query_preconn_retry(q);
+                return;
+            }
+
             http_query_disconnect(q);
 
             if (q->rq_off == 0) {
                 /* None sent, try another address, if any */
-                q->addr_next = q->addr_next->ai_next;
-                http_query_connect(q, err);
+                http_query_connect_next(q, err);
             } else {
                 /* Sending started and failed */
                 http_query_complete(q, err);
@@ -2640,10 +2783,22 @@ http_query_fdpoll_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
             q->http_parser.data = &q->response_header;
         }
     } else {
-        static char io_buf[HTTP_IOBUF_SIZE];
+        /* Each shard thread runs this callback, so buffer is per-thread */
+        static __thread char io_buf[HTTP_IOBUF_SIZE];
 
         rc = http_query_sock_recv(q, io_buf, sizeof(io_buf));
+        if (http_query_preconn_stale(q, rc)) {
+            http_query_preconn_retry(q);
+            return;
+        }
+
         if (rc > 0) {
+            q->preconnected = false;
+
+            if (q->time_rxfirst == 0) {
+                q->time_rxfirst = timestamp_now();
+            }
+
             log_debug(q->client->log, "HTTP %d bytes received", (int) rc);
             trace_hexdump(log_ctx_trace(q->client->log), '<', io_buf, rc);
         }
@@ -2686,10 +2841,7 @@ http_query_connect (http_query *q, error err)
 
     /* Skip invalid addresses. Check that we have address to try */
 AGAIN:
-    while (q->addr_next != NULL &&
-           q->addr_next->ai_family != AF_INET &&
-           q->addr_next->ai_family != AF_INET6 &&
-           q->addr_next->ai_family != AF_UNIX) {
+    while (q->addr_next != NULL && !http_addr_usable(q->addr_next)) {
         q->addr_next = q->addr_next->ai_next;
     }
 
@@ -2764,6 +2916,68 @@ AGAIN:
     http_query_fdpoll_set_mask(q, ELOOP_FDPOLL_WRITE);
 }
 
+/* Connection attempt failed, try the next address. If connection
+ * was pre-established, it might become stale while waiting, so the
+ * same address is retried with the new connection
+ */
+static void
+http_query_connect_next (http_query *q, error err)
+{
+    if (q->preconnected) {
+        q->preconnected = false;
+    } else {
+        q->addr_next = q->addr_next->ai_next;
+    }
+
+    http_query_connect(q, err);
+}
+
+/* Check if pre-established connection was closed by the device
+ * before any response byte was received. Devices may drop idle
+ * connections, and the request may be resent in this case, if
+ * it wasn't sent yet or it is idempotent. Otherwise, device might
+ * have executed it already (say, POST to ScanJobs would create
+ * a duplicated job)
+ */
+static bool
+http_query_preconn_stale (http_query *q, ssize_t rc)
+{
+    if (!q->preconnected) {
+        return false;
+    }
+
+    if (q->rq_off != 0 && strcmp(q->method, "GET") &&
+        strcmp(q->method, "DELETE")) {
+        return false;
+    }
+
+    if (rc == 0) {
+        return true;
+    }
+
+    if (q->tls == NULL) {
+        return rc == -ECONNRESET || rc == -EPIPE;
+    }
+
+    return rc == GNUTLS_E_PREMATURE_TERMINATION ||
+           rc == GNUTLS_E_PULL_ERROR;
+}
+
+/* Resend the request on a fresh connection, after pre-established
+ * connection has been found stale
+ */
+static void
+http_query_preconn_retry (http_query *q)
+{
+    log_debug(q->client->log,
+        "HTTP %s: pre-established connection closed, reconnecting",
+        q->straddr.text);
+
+    http_query_disconnect(q);
+    q->rq_off = 0;
+    http_query_connect_next(q, ERROR("connection closed by device"));
+}
+
 /* Close connection to the server, if any
  */
 static void
@@ -2881,70 +3095,8 @@ static void
 http_query_start_processing (void *p)
 {
     http_query      *q = (http_query*) p;
-    http_uri_field  field;
-    char            *host, *port;
     const char      *path;
-    struct addrinfo hints;
-    int             rc;
-
-    /* Get host name from the URI */
-    field = http_uri_field_get(q->uri, UF_HOST);
-    host = alloca(field.len + 1);
-    memcpy(host, field.str, field.len);
-    host[field.len] = '\0';
-    http_uri_unescape_host(host);
-
-    /* Get port name from the URI */
-    if (http_uri_field_nonempty(q->uri, UF_PORT)) {
-        field = http_uri_field_get(q->uri, UF_PORT);
-        port = alloca(field.len + 1);
-        memcpy(port, field.str, field.len);
-        port[field.len] = '\0';
-    } else {
-        port = q->uri->scheme == HTTP_SCHEME_HTTP ? "80" : "443";
-    }
-
-    /* Lookup target addresses */
-    if (q->uri->scheme != HTTP_SCHEME_UNIX) {
-        log_debug(q->client->log, "HTTP resolving %s %s", host, port);
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_flags = AI_ADDRCONFIG;
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_STREAM;
-        hints.ai_protocol = IPPROTO_TCP;
-
-        q->addrs_freeaddrinfo = true;
-        rc = getaddrinfo(host, port, &hints, &q->addrs);
-        if (rc != 0) {
-            http_query_complete(q, ERROR(gai_strerror(rc)));
-            return;
-        }
-    } else {
-        struct sockaddr_un *addr;
-        size_t pathlen = strlen(conf.socket_dir) + 1 /* for / */ + strlen(host);
-        char *path = alloca(pathlen + 1);
-        sprintf(path, "%s/%s", conf.socket_dir, host);
-
-        log_debug(q->client->log, "connecting to local socket %s", path);
-        q->addrs_freeaddrinfo = false;
-        q->addrs = mem_new(struct addrinfo, 1);
-        q->addrs->ai_family = AF_UNIX;
-        q->addrs->ai_socktype = SOCK_STREAM;
-        q->addrs->ai_protocol = 0;
-
-        addr = mem_new(struct sockaddr_un, 1);
-        addr->sun_family = AF_UNIX;
-        strncpy(addr->sun_path, path, sizeof(addr->sun_path)-1);
-        q->addrs->ai_addrlen = sizeof(struct sockaddr_un);
-        q->addrs->ai_addr = (struct sockaddr *)addr;
-
-        if (pathlen >= sizeof(addr->sun_path)) {
-            http_query_complete(q, ERROR("Socket path is too long."));
-            return;
-        }
-    }
-
-    q->addr_next = q->addrs;
+    error           err;
 
     /* Set Host: header, if not set by user */
     if (http_hdr_lookup(&q->request_header, "Host") == NULL) {
@@ -2978,6 +3130,21 @@ http_query_start_processing (void *p)
             q->request_data->bytes, q->request_data->size);
     }
 
+    /* Use pre-established connection, if available */
+    if (http_query_preconn_take(q)) {
+        return;
+    }
+
+    /* Lookup target addresses */
+    err = http_addrs_resolve(q->client->log, q->uri,
+        &q->addrs, &q->addrs_freeaddrinfo);
+    if (err != NULL) {
+        http_query_complete(q, err);
+        return;
+    }
+
+    q->addr_next = q->addrs;
+
     /* Connect to the host */
     http_query_connect(q, ERROR("no host addresses available"));
 }
@@ -3007,6 +3174,7 @@ http_query_submit (http_query *q, void (*callback)(void *ptr, http_query *q))
     /* Submit the query */
     log_assert(q->client->log, q->sock == -1);
     ll_push_end(&q->client->pending, &q->chain);
+    http_query_preconn_claim(q);
 
     q->eloop_callid = eloop_call(http_query_start_processing, q);
 }
@@ -3026,6 +3194,404 @@ http_query_cancel (http_query *q)
     http_query_free(q);
 }
 
+/******************** Connection pre-warming ********************/
+/* http_preconn represents a connection, established in advance,
+ * so the next query to the same host doesn't wait for TCP connect
+ * and TLS handshake. Connection is used for a single query only,
+ * as queries are sent with "Connection: close"
+ *
+ * Query claims the connection when submitted and takes it when
+ * its processing starts. Client keeps at most one unclaimed
+ * connection
+ */
+struct http_preconn {
+    http_client      *client;           /* Client that owns the connection */
+    http_query       *query;            /* Query that claimed it, if any */
+    ll_node          chain;             /* In http_client::preconns */
+    http_uri         *uri;              /* Target URI, only origin matters */
+    uint64_t         eloop_callid;      /* For eloop_call_cancel */
+    bool             started;           /* Connection attempt started */
+    struct addrinfo  *addrs;            /* Resolved addresses */
+    bool             addrs_freeaddrinfo;/* Use freeaddrinfo(addrs) */
+    struct addrinfo  *addr;             /* Address being connected */
+    int              sock;              /* Socket, -1 if none */
+    gnutls_session_t tls;               /* NULL if not TLS */
+    bool             connecting;        /* connect() in progress */
+    bool             handshake;         /* TLS handshake in progress */
+    eloop_fdpoll     *fdpoll;           /* Polls sock */
+    eloop_timer      *timer;            /* Lifetime timer */
+    ip_straddr       straddr;           /* sock peer addr, for log */
+};
+
+/* Get http_preconn* by pointer to its http_preconn::chain */
+static http_preconn*
+http_preconn_by_ll_node (ll_node *node)
+{
+     return OUTER_STRUCT(node, http_preconn, chain);
+}
+
+/* Check if pre-established connection leads to the URI's origin
+ */
+static bool
+http_preconn_match (const http_preconn *pc, const http_uri *uri)
+{
+    return pc->uri->scheme == uri->scheme &&
+           http_uri_field_equal(pc->uri, uri, UF_HOST, true) &&
+           http_uri_field_equal(pc->uri, uri, UF_PORT, true);
+}
+
+/* Free http_preconn and detach it from the client
+ */
+static void
+http_preconn_free (http_preconn *pc)
+{
+    ll_del(&pc->chain);
+    if (pc->query != NULL) {
+        pc->query->preconn = NULL;
+    }
+
+    eloop_call_cancel(pc->eloop_callid);
+
+    if (pc->timer != NULL) {
+        eloop_timer_cancel(pc->timer);
+    }
+
+    if (pc->fdpoll != NULL) {
+        eloop_fdpoll_free(pc->fdpoll);
+    }
+
+    if (pc->tls != NULL) {
+        gnutls_deinit(pc->tls);
+    }
+
+    if (pc->sock >= 0) {
+        close(pc->sock);
+    }
+
+    if (pc->addrs != NULL) {
+        http_addrs_free(pc->addrs, pc->addrs_freeaddrinfo);
+    }
+
+    http_uri_free(pc->uri);
+    mem_free(pc);
+}
+
+/* Drop pre-established connection due to error or expiration
+ */
+static void
+http_preconn_drop (http_preconn *pc, error err)
+{
+    log_debug(pc->client->log, "HTTP preconnect %s: %s",
+        pc->straddr.text, ESTRING(err));
+    http_preconn_free(pc);
+}
+
+/* Set http_preconn::fdpoll event mask
+ */
+static void
+http_preconn_fdpoll_set_mask (http_preconn *pc, ELOOP_FDPOLL_MASK mask)
+{
+    ELOOP_FDPOLL_MASK old_mask = eloop_fdpoll_set_mask(pc->fdpoll, mask);
+    log_debug(pc->client->log, "HTTP preconnect fdpoll: %s -> %s",
+        eloop_fdpoll_mask_str(old_mask), eloop_fdpoll_mask_str(mask));
+}
+
+/* Check idle pre-established connection, when it becomes readable.
+ *
+ * Device sends nothing into the idle connection, except TLS 1.3
+ * post-handshake messages (i.e., NewSessionTicket), that are
+ * consumed here. EOF, error or unexpected data drops the connection
+ *
+ * Returns true, if connection is still alive
+ */
+static bool
+http_preconn_check_alive (http_preconn *pc)
+{
+    char    buf[256];
+    ssize_t rc;
+
+    if (pc->tls == NULL) {
+        rc = recv(pc->sock, buf, 1, MSG_PEEK);
+        if (rc < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return true;
+        }
+
+        if (rc < 0) {
+            http_preconn_drop(pc, ERROR(strerror(errno)));
+            return false;
+        }
+    } else {
+        rc = gnutls_record_recv(pc->tls, buf, sizeof(buf));
+        if (rc == GNUTLS_E_AGAIN || rc == GNUTLS_E_INTERRUPTED ||
+            (rc < 0 && !gnutls_error_is_fatal(rc))) {
+            return true;
+        }
+
+        if (rc < 0) {
+            http_preconn_drop(pc, ERROR(gnutls_strerror(rc)));
+            return false;
+        }
+    }
+
+    if (rc == 0) {
+        http_preconn_drop(pc, ERROR("connection closed by device"));
+    } else {
+        http_preconn_drop(pc, ERROR("unexpected data from device"));
+    }
+
+    return false;
+}
+
+/* http_preconn::fdpoll callback
+ */
+static void
+http_preconn_fdpoll_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
+{
+    http_preconn *pc = data;
+
+    (void) mask;
+
+    if (pc->connecting) {
+        int       so_err = 0;
+        socklen_t len = sizeof(so_err);
+
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_err, &len);
+        if (so_err != 0) {
+            http_preconn_drop(pc, ERROR(strerror(so_err)));
+            return;
+        }
+
+        log_debug(pc->client->log, "HTTP preconnect %s: connected",
+            pc->straddr.text);
+
+        pc->connecting = false;
+        pc->handshake = pc->tls != NULL;
+    }
+
+    if (pc->handshake) {
+        int rc = gnutls_handshake(pc->tls);
+
+        if (rc < 0) {
+            if (rc == GNUTLS_E_AGAIN || rc == GNUTLS_E_INTERRUPTED ||
+                !gnutls_error_is_fatal(rc)) {
+                http_preconn_fdpoll_set_mask(pc,
+                    gnutls_record_get_direction(pc->tls) ?
+                        ELOOP_FDPOLL_WRITE : ELOOP_FDPOLL_READ);
+                return;
+            }
+
+            http_preconn_drop(pc, ERROR(gnutls_strerror(rc)));
+            return;
+        }
+
+        log_debug(pc->client->log, "HTTP preconnect %s: done TLS handshake",
+            pc->straddr.text);
+
+        pc->handshake = false;
+    } else if ((mask & ELOOP_FDPOLL_READ) != 0) {
+        if (!http_preconn_check_alive(pc)) {
+            return;
+        }
+    }
+
+    /* Connection is ready. Watch for its closing by device */
+    http_preconn_fdpoll_set_mask(pc, ELOOP_FDPOLL_READ);
+}
+
+/* http_preconn lifetime timer callback
+ */
+static void
+http_preconn_timer_callback (void *data)
+{
+    http_preconn *pc = data;
+
+    pc->timer = NULL;
+    http_preconn_drop(pc, ERROR("unused, closed"));
+}
+
+/* Start connection establishment. Called via eloop_call()
+ *
+ * Only the first usable address is tried. If it fails, the
+ * query will resolve and try all the addresses by itself
+ */
+static void
+http_preconn_start (void *data)
+{
+    http_preconn *pc = data;
+    error        err;
+    int          rc;
+
+    pc->started = true;
+
+    err = http_addrs_resolve(pc->client->log, pc->uri,
+        &pc->addrs, &pc->addrs_freeaddrinfo);
+    if (err != NULL) {
+        http_preconn_drop(pc, err);
+        return;
+    }
+
+    for (pc->addr = pc->addrs; pc->addr != NULL && !http_addr_usable(pc->addr);
+         pc->addr = pc->addr->ai_next)
+        ;
+
+    if (pc->addr == NULL) {
+        http_preconn_drop(pc, ERROR("no host addresses available"));
+        return;
+    }
+
+    pc->straddr = ip_straddr_from_sockaddr(pc->addr->ai_addr, true);
+    log_debug(pc->client->log, "HTTP preconnect %s", pc->straddr.text);
+
+    pc->sock = socket(pc->addr->ai_family,
+        pc->addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+        pc->addr->ai_protocol);
+
+    if (pc->sock == -1) {
+        http_preconn_drop(pc, ERROR(strerror(errno)));
+        return;
+    }
+
+    do {
+        rc = connect(pc->sock, pc->addr->ai_addr, pc->addr->ai_addrlen);
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc < 0 && errno != EINPROGRESS) {
+        http_preconn_drop(pc, ERROR(strerror(errno)));
+        return;
+    }
+
+    /* Setup TLS, if required */
+    if (pc->uri->scheme == HTTP_SCHEME_HTTPS) {
+        rc = gnutls_init(&pc->tls,
+            GNUTLS_CLIENT | GNUTLS_NONBLOCK | GNUTLS_NO_SIGNAL);
+
+        if (rc == GNUTLS_E_SUCCESS) {
+            rc = gnutls_set_default_priority(pc->tls);
+        }
+
+        if (rc == GNUTLS_E_SUCCESS) {
+            rc = gnutls_credentials_set(pc->tls, GNUTLS_CRD_CERTIFICATE,
+                    gnutls_cred);
+        }
+
+        if (rc != GNUTLS_E_SUCCESS) {
+            http_preconn_drop(pc, ERROR(gnutls_strerror(rc)));
+            return;
+        }
+
+        gnutls_transport_set_int(pc->tls, pc->sock);
+    }
+
+    pc->connecting = true;
+    pc->fdpoll = eloop_fdpoll_new(pc->sock, http_preconn_fdpoll_callback, pc);
+    http_preconn_fdpoll_set_mask(pc, ELOOP_FDPOLL_WRITE);
+
+    pc->timer = eloop_timer_new(HTTP_PRECONN_TIMEOUT,
+        http_preconn_timer_callback, pc);
+}
+
+/* Take pre-established connection for the query, if available.
+ * On success, query is ready to send its request
+ */
+static bool
+http_query_preconn_take (http_query *q)
+{
+    http_preconn *pc = q->preconn;
+
+    if (pc == NULL) {
+        return false;
+    }
+
+    if (!pc->started || pc->sock < 0) {
+        http_preconn_free(pc);
+        return false;
+    }
+
+    log_debug(q->client->log, "HTTP %s: using pre-established connection%s",
+        pc->straddr.text, pc->connecting ? " (connecting)" : "");
+
+    /* Move connection from the http_preconn to the query */
+    eloop_fdpoll_free(pc->fdpoll);
+    pc->fdpoll = NULL;
+
+    q->addrs = pc->addrs;
+    q->addrs_freeaddrinfo = pc->addrs_freeaddrinfo;
+    q->addr_next = pc->addr;
+    q->straddr = pc->straddr;
+    q->sock = pc->sock;
+    q->tls = pc->tls;
+    q->handshake = pc->connecting ? q->tls != NULL : pc->handshake;
+    q->preconnected = true;
+
+    pc->addrs = NULL;
+    pc->sock = -1;
+    pc->tls = NULL;
+    http_preconn_free(pc);
+
+    q->fdpoll = eloop_fdpoll_new(q->sock, http_query_fdpoll_callback, q);
+    q->sending = true;
+    http_query_fdpoll_set_mask(q, ELOOP_FDPOLL_WRITE);
+
+    return true;
+}
+
+/* Find unclaimed pre-established connection
+ */
+static http_preconn*
+http_client_preconn_unclaimed (http_client *client)
+{
+    ll_node *node;
+
+    for (LL_FOR_EACH(node, &client->preconns)) {
+        http_preconn *pc = http_preconn_by_ll_node(node);
+        if (pc->query == NULL) {
+            return pc;
+        }
+    }
+
+    return NULL;
+}
+
+/* Claim pre-established connection for the query being submitted
+ */
+static void
+http_query_preconn_claim (http_query *q)
+{
+    http_preconn *pc = http_client_preconn_unclaimed(q->client);
+
+    if (pc != NULL && http_preconn_match(pc, q->uri)) {
+        pc->query = q;
+        q->preconn = pc;
+    }
+}
+
+/* Establish connection to the URI's host in advance, so the
+ * next query to this host will not wait for connect and TLS
+ * handshake. The client keeps at most one such connection;
+ * unused connection is closed after a while
+ */
+void
+http_client_preconnect (http_client *client, const http_uri *uri)
+{
+    http_preconn *pc = http_client_preconn_unclaimed(client);
+
+    if (pc != NULL) {
+        if (http_preconn_match(pc, uri)) {
+            return;
+        }
+
+        http_preconn_free(pc);
+    }
+
+    pc = mem_new(http_preconn, 1);
+    pc->client = client;
+    pc->uri = http_uri_clone(uri);
+    pc->sock = -1;
+    ll_push_end(&client->preconns, &pc->chain);
+
+    pc->eloop_callid = eloop_call(http_preconn_start, pc);
+}
+
 /* Get http_query timestamp. Timestamp is set when query is
  * submitted. And this function should not be called before
  * http_query_submit()
@@ -3036,6 +3602,26 @@ http_query_timestamp (const http_query *q)
     return q->timestamp;
 }
 
+/* Get timestamp, when connection was established and request
+ * sending started. In a case of redirect, the last request counts.
+ * Returns 0, if query was not connected
+ */
+timestamp
+http_query_time_connected (const http_query *q)
+{
+    return q->time_connected;
+}
+
+/* Get timestamp, when the first byte of response was received.
+ * In a case of redirect, the last response counts. Returns 0,
+ * if nothing was received
+ */
+timestamp
+http_query_time_rxfirst (const http_query *q)
+{
+    return q->time_rxfirst;
+}
+
 /* Set uintptr_t parameter, associated with query.
  * Completion callback may later use http_query_get_uintptr()
  * to fetch this value
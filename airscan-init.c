@@ -30,8 +30,15 @@ airscan_init (AIRSCAN_INIT_FLAGS flags, const char *log_msg)
 
     /* Initialize all parts */
     devid_init();
+    xml_init();
 
     status = eloop_init();
+    if (status == SANE_STATUS_GOOD) {
+        status = metrics_init();
+    }
+    if (status == SANE_STATUS_GOOD) {
+        status = workers_init();
+    }
     if (status == SANE_STATUS_GOOD) {
         status = rand_init();
     }
@@ -72,8 +79,12 @@ airscan_cleanup (const char *log_msg)
     netif_cleanup();
     http_cleanup();
     rand_cleanup();
+    workers_cleanup();
+    metrics_cleanup();
     eloop_cleanup();
 
+    mem_stats_dump(NULL);
+
     if (log_msg != NULL) {
         log_debug(NULL, "%s", log_msg);
     }
@@ -6,6 +6,7 @@
  * Memory allocation and strings
  */
 
+#define _GNU_SOURCE
 #include "airscan.h"
 
 #include <assert.h>
@@ -27,9 +28,18 @@
 /* Each memory block allocated from here has the following
  * control record
  */
+#ifdef AIRSCAN_MEM_STATS
+typedef struct mem_site mem_site;
+
+typedef struct {
+    uint32_t len, cap; /* Block length and capacity in bytes */
+    mem_site *site;    /* Allocation site, for statistics */
+} mem_head;
+#else
 typedef struct {
     uint32_t len, cap; /* Block length and capacity in bytes */
 } mem_head;
+#endif
 
 /* Check for OOM
  */
@@ -41,12 +51,190 @@ typedef struct {
         }                                       \
     } while(0)
 
+/* When built with -DAIRSCAN_MEM_STATS, every block is accounted
+ * against its allocation site (the caller of __mem_alloc() or
+ * __mem_resize()), and mem_stats_dump() reports where memory
+ * goes. Otherwise, accounting costs nothing
+ */
+#ifdef AIRSCAN_MEM_STATS
+/* Maximum count of tracked allocation sites. Allocations from
+ * sites that don't fit into the table are accounted together
+ */
+#define MEM_SITES_MAX           4096
+
+/* Count of top sites, printed by mem_stats_dump()
+ */
+#define MEM_SITES_DUMP          20
+
+/* mem_site represents statistics of the single allocation site,
+ * identified by the caller's address
+ */
+struct mem_site {
+    const void *addr;       /* Caller address, NULL if slot is unused */
+    uint64_t   allocs;      /* Total count of allocations */
+    int64_t    blocks;      /* Count of live blocks */
+    int64_t    bytes;       /* Live bytes, including header and slack */
+    int64_t    slack;       /* Unused capacity of live blocks */
+    int64_t    peak;        /* Peak of bytes */
+};
+
+/* Static variables
+ */
+static pthread_mutex_t mem_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mem_site        mem_sites[MEM_SITES_MAX];
+static mem_site        mem_site_other;
+static mem_site        mem_total;
+static int64_t         mem_arena_blocks;
+static int64_t         mem_arena_headers;
+
+/* Lookup or create the mem_site. Must be called under the lock
+ */
+static mem_site*
+mem_site_lookup (const void *addr)
+{
+    size_t i = ((uintptr_t) addr >> 2) * 2654435761u % MEM_SITES_MAX;
+    int    n;
+
+    for (n = 0; n < MEM_SITES_MAX; n ++) {
+        mem_site *site = &mem_sites[i];
+
+        if (site->addr == addr) {
+            return site;
+        }
+
+        if (site->addr == NULL) {
+            site->addr = addr;
+            return site;
+        }
+
+        i = (i + 1) % MEM_SITES_MAX;
+    }
+
+    return &mem_site_other;
+}
+
+/* Apply changes to the mem_site counters
+ */
+static void
+mem_site_update (mem_site *site, int64_t blocks, int64_t bytes, int64_t slack)
+{
+    site->blocks += blocks;
+    site->bytes += bytes;
+    site->slack += slack;
+
+    if (site->bytes > site->peak) {
+        site->peak = site->bytes;
+    }
+}
+
+/* Account the block state change. Block header must contain
+ * the new state, `cap' and `len' is its previous state. `blocks'
+ * is +1 for the new block, -1 for released block and 0 otherwise
+ */
+static void
+mem_stats_update (mem_head *h, size_t cap, size_t len, int blocks)
+{
+    int64_t bytes = 0, slack = 0;
+
+    if (blocks >= 0) {
+        bytes += (int64_t) h->cap + sizeof(mem_head);
+        slack += (int64_t) h->cap - h->len;
+    }
+
+    if (blocks <= 0) {
+        bytes -= (int64_t) cap + sizeof(mem_head);
+        slack -= (int64_t) cap - len;
+    }
+
+    pthread_mutex_lock(&mem_stats_mutex);
+    mem_site_update(h->site, blocks, bytes, slack);
+    mem_site_update(&mem_total, blocks, bytes, slack);
+    pthread_mutex_unlock(&mem_stats_mutex);
+}
+
+/* Account newly allocated block
+ */
+static void
+mem_stats_alloc (mem_head *h, const void *caller)
+{
+    pthread_mutex_lock(&mem_stats_mutex);
+    h->site = mem_site_lookup(caller);
+    h->site->allocs ++;
+    mem_total.allocs ++;
+    pthread_mutex_unlock(&mem_stats_mutex);
+
+    mem_stats_update(h, 0, 0, 1);
+}
+
+/* Account arena block with `hdr' bytes of header and `size' bytes
+ * of data against the site, that created the arena. `blocks' is +1
+ * for the new block and -1 for the released block
+ */
+static void
+mem_stats_arena (const void *caller, int blocks, size_t hdr, size_t size)
+{
+    mem_site *site;
+    int64_t  bytes = blocks * (int64_t) (hdr + size);
+
+    pthread_mutex_lock(&mem_stats_mutex);
+    site = mem_site_lookup(caller);
+    if (blocks > 0) {
+        site->allocs ++;
+        mem_total.allocs ++;
+    }
+
+    mem_site_update(site, blocks, bytes, 0);
+    mem_site_update(&mem_total, blocks, bytes, 0);
+    mem_arena_blocks += blocks;
+    mem_arena_headers += blocks * (int64_t) hdr;
+    pthread_mutex_unlock(&mem_stats_mutex);
+}
+
+/* Compare mem_sites by live bytes, then by peak, for qsort
+ */
+static int
+mem_site_cmp (const void *p1, const void *p2)
+{
+    const mem_site *s1 = p1, *s2 = p2;
+
+    if (s1->bytes != s2->bytes) {
+        return s1->bytes > s2->bytes ? -1 : 1;
+    }
+
+    if (s1->peak != s2->peak) {
+        return s1->peak > s2->peak ? -1 : 1;
+    }
+
+    return s1->allocs > s2->allocs ? -1 : (s1->allocs < s2->allocs);
+}
+
+/* Format the allocation site name
+ */
+static void
+mem_site_name (const mem_site *site, char *buf, size_t size)
+{
+    if (site->addr == NULL) {
+        snprintf(buf, size, "(other)");
+    } else {
+        os_addr_name(site->addr, buf, size);
+    }
+}
+#else
+#define mem_stats_update(h,cap,len,blocks)      ((void) (cap), (void) (len))
+#define mem_stats_alloc(h,caller)               ((void) (caller))
+#define mem_stats_arena(caller,blocks,hdr,size) ((void) (caller))
+#endif
+
 /* Truncate the vector length, preserving previously allocated buffer
  */
 void
 mem_trunc (void *p)
 {
-    ((mem_head*) p)[-1].len = 0;
+    mem_head *h = ((mem_head*) p) - 1;
+    size_t   len = h->len;
+
+    h->len = 0;
+    mem_stats_update(h, h->cap, len, 0);
 }
 
 /* Free memory, previously obtained from mem_new()/mem_expand()
@@ -55,7 +243,10 @@ void
 mem_free (void *p)
 {
     if (p != NULL) {
-        free(((mem_head*) p) - 1);
+        mem_head *h = ((mem_head*) p) - 1;
+
+        mem_stats_update(h, h->cap, h->len, -1);
+        free(h);
     }
 }
 
@@ -100,10 +291,11 @@ mem_alloc_size(size_t len, size_t extra, size_t elsize)
     return sz;
 }
 
-/* Helper function: allocate new block of memory
+/* Allocate new block of memory on behalf of the caller
  */
-void*
-__mem_alloc (size_t len, size_t extra, size_t elsize, bool must)
+static void*
+mem_alloc_at (size_t len, size_t extra, size_t elsize, bool must,
+        const void *caller)
 {
     size_t   sz = mem_alloc_size(len, extra, elsize);
     mem_head *h = calloc(sz, 1);
@@ -115,27 +307,50 @@ __mem_alloc (size_t len, size_t extra, size_t elsize, bool must)
 
     h->len = len * elsize;
     h->cap = sz - (sizeof(mem_head));
+    mem_stats_alloc(h, caller);
 
     return h + 1;
 }
 
+/* Helper function: allocate new block of memory
+ */
+void*
+__mem_alloc (size_t len, size_t extra, size_t elsize, bool must)
+{
+    return mem_alloc_at(len, extra, elsize, must,
+        __builtin_return_address(0));
+}
+
 /* Helper function for memory allocation.
  * Allocated or resizes memory block
  */
 void*
 __mem_resize (void *p, size_t len, size_t extra, size_t elsize, bool must)
 {
-    size_t   sz;
+    return __mem_resize_at(p, len, extra, elsize, must,
+        __builtin_return_address(0));
+}
+
+/* Helper function for memory allocation.
+ * Allocated or resizes memory block on behalf of the caller
+ */
+void*
+__mem_resize_at (void *p, size_t len, size_t extra, size_t elsize, bool must,
+        const void *caller)
+{
+    size_t   sz, old_cap, old_len;
     mem_head *h;
 
-    /* If `p' is NULL, just call __mem_alloc() */
+    /* If `p' is NULL, just allocate the new block */
     if (p == NULL) {
-        return __mem_alloc(len, extra, elsize, must);
+        return mem_alloc_at(len, extra, elsize, must, caller);
     }
 
     /* Reallocate memory, if required */
     h = ((mem_head*) p) - 1;
     sz = mem_alloc_size(len, extra, elsize);
+    old_cap = h->cap;
+    old_len = h->len;
 
     if (h->cap + sizeof(mem_head) < sz) {
         h = realloc(h, sz);
@@ -143,6 +358,7 @@ __mem_resize (void *p, size_t len, size_t extra, size_t elsize, bool must)
             mem_check_oom(h, must);
             return NULL;
         }
+        h->cap = sz - (sizeof(mem_head));
     }
 
     /* Zero-fill newly added elements */
@@ -151,9 +367,11 @@ __mem_resize (void *p, size_t len, size_t extra, size_t elsize, bool must)
         memset((char*) (h + 1) + h->len, 0, len - h->len);
     }
 
-    /* Update control header and return a block */
+    /* Update control header and return a block. Note, capacity
+     * is only changed when block is actually reallocated
+     */
     h->len = len;
-    h->cap = sz - (sizeof(mem_head));
+    mem_stats_update(h, old_cap, old_len, 0);
 
     return h + 1;
 }
@@ -166,18 +384,362 @@ __mem_shrink (void *p, size_t len, size_t elsize)
 {
     mem_head *h = ((mem_head*) p) - 1;
 
+    size_t   old_len = h->len;
+
     len *= elsize;
     log_assert(NULL, len <= h->len);
     h->len = len;
+    mem_stats_update(h, h->cap, old_len, 0);
+}
+
+/* Get memory allocation statistics
+ */
+void
+mem_stats_get (mem_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+#ifdef AIRSCAN_MEM_STATS
+    pthread_mutex_lock(&mem_stats_mutex);
+    stats->enabled = true;
+    stats->allocs = mem_total.allocs;
+    stats->blocks = (uint64_t) mem_total.blocks;
+    stats->bytes = (uint64_t) mem_total.bytes;
+    stats->peak = (uint64_t) mem_total.peak;
+    stats->slack = (uint64_t) mem_total.slack;
+    stats->headers = (stats->blocks - mem_arena_blocks) * sizeof(mem_head) +
+                     mem_arena_headers;
+    pthread_mutex_unlock(&mem_stats_mutex);
+#endif
+}
+
+/* Dump memory allocation statistics to the log.
+ * Does nothing, if statistics is not available
+ */
+void
+mem_stats_dump (log_ctx *log)
+{
+#ifdef AIRSCAN_MEM_STATS
+    mem_site *sites;
+    mem_stats stats;
+    int       i, n = 0;
+
+    /* Snapshot sites. Note, sites table is copied by malloc(),
+     * bypassing the accounted allocator, to avoid recursion
+     * into the lock
+     */
+    sites = malloc(sizeof(mem_sites) + sizeof(mem_site));
+    if (sites == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&mem_stats_mutex);
+    for (i = 0; i < MEM_SITES_MAX; i ++) {
+        if (mem_sites[i].addr != NULL) {
+            sites[n ++] = mem_sites[i];
+        }
+    }
+    if (mem_site_other.allocs != 0) {
+        sites[n ++] = mem_site_other;
+    }
+    pthread_mutex_unlock(&mem_stats_mutex);
+
+    qsort(sites, n, sizeof(mem_site), mem_site_cmp);
+
+    /* Dump totals and top sites */
+    mem_stats_get(&stats);
+
+    log_debug(log, "memory: %llu allocs, %llu live blocks, %llu live bytes"
+        " (peak %llu)",
+        (unsigned long long) stats.allocs, (unsigned long long) stats.blocks,
+        (unsigned long long) stats.bytes, (unsigned long long) stats.peak);
+    log_debug(log, "memory: payload %llu, slack %llu, headers %llu bytes",
+        (unsigned long long) (stats.bytes - stats.slack - stats.headers),
+        (unsigned long long) stats.slack, (unsigned long long) stats.headers);
+
+    log_debug(log, "memory: %12s %8s %12s %12s %10s  %s",
+        "bytes", "blocks", "slack", "peak", "allocs", "site");
+
+    for (i = 0; i < n && i < MEM_SITES_DUMP; i ++) {
+        char name[256];
+
+        mem_site_name(&sites[i], name, sizeof(name));
+        log_debug(log, "memory: %12lld %8lld %12lld %12lld %10llu  %s",
+            (long long) sites[i].bytes, (long long) sites[i].blocks,
+            (long long) sites[i].slack, (long long) sites[i].peak,
+            (unsigned long long) sites[i].allocs, name);
+    }
+
+    free(sites);
+#else
+    (void) log;
+#endif
+}
+
+/******************** Arena allocator ********************/
+/* Arena is allocated by blocks of this size (including block header)
+ */
+#define ARENA_BLOCK_SIZE        4096
+
+/* Alignment of memory, returned by arena_alloc()
+ */
+#define ARENA_ALIGN             16
+
+/* Round size up to the ARENA_ALIGN boundary
+ */
+#define ARENA_ROUND(sz)         (((sz) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/* arena_block represents a single block of arena memory. Block
+ * data immediately follows the header
+ */
+typedef struct arena_block arena_block;
+struct arena_block {
+    arena_block *next;  /* Next block in the chain */
+    size_t      size;   /* Block capacity, in bytes, without header */
+    size_t      used;   /* Count of used bytes */
+};
+
+/* Size of arena_block header, rounded up for alignment
+ */
+#define ARENA_HDR_SIZE          ARENA_ROUND(sizeof(arena_block))
+
+/* The arena. It lives in its own first block, so creation
+ * of the new arena costs exactly one malloc()
+ *
+ * Arena blocks bypass mem_head, to keep ARENA_ALIGN, so with
+ * AIRSCAN_MEM_STATS they are accounted against the arena_new()
+ * caller explicitly
+ */
+struct arena {
+    arena_block *blocks;    /* Chain of blocks, current block first */
+    const void  *site;      /* arena_new() caller, for statistics */
+};
+
+/* Get pointer to block data
+ */
+static inline char*
+arena_block_data (arena_block *blk)
+{
+    return ((char*) blk) + ARENA_HDR_SIZE;
+}
+
+/* Allocate new arena block, capable to hold at least `size' bytes,
+ * and link it into the arena
+ *
+ * Big allocations receive a dedicated block, linked after the
+ * current one, so the tail of the current block is not wasted
+ */
+static arena_block*
+arena_block_new (arena *a, size_t size, const void *caller)
+{
+    size_t      sz = ARENA_BLOCK_SIZE - ARENA_HDR_SIZE;
+    bool        dedicated = size > sz / 4;
+    arena_block *blk;
+
+    if (dedicated) {
+        sz = size;
+    }
+
+    blk = malloc(ARENA_HDR_SIZE + sz);
+    mem_check_oom(blk, true);
+    mem_stats_arena(caller, 1, ARENA_HDR_SIZE, sz);
+
+    blk->size = sz;
+    blk->used = 0;
+
+    if (a == NULL) {
+        blk->next = NULL;
+    } else if (dedicated) {
+        blk->next = a->blocks->next;
+        a->blocks->next = blk;
+    } else {
+        blk->next = a->blocks;
+        a->blocks = blk;
+    }
+
+    return blk;
+}
+
+/* Create new arena
+ */
+arena*
+arena_new (void)
+{
+    const void  *caller = __builtin_return_address(0);
+    arena_block *blk = arena_block_new(NULL, 0, caller);
+    arena       *a = (arena*) arena_block_data(blk);
+
+    blk->used = sizeof(arena);
+    a->blocks = blk;
+    a->site = caller;
+
+    return a;
+}
+
+/* Destroy the arena and release all memory, allocated from it.
+ * `a' can be NULL
+ */
+void
+arena_free (arena *a)
+{
+    arena_block *blk, *next;
+    const void  *site;
+
+    if (a == NULL) {
+        return;
+    }
+
+    /* Note, the arena itself lives in the last block in chain */
+    site = a->site;
+    for (blk = a->blocks; blk != NULL; blk = next) {
+        next = blk->next;
+        mem_stats_arena(site, -1, ARENA_HDR_SIZE, blk->size);
+        free(blk);
+    }
+}
+
+/* Allocate `size' bytes of zero-filled memory from the arena
+ */
+void*
+arena_alloc (arena *a, size_t size)
+{
+    arena_block *blk = a->blocks;
+    size_t      off = ARENA_ROUND(blk->used);
+    char        *p;
+
+    if (off + size > blk->size) {
+        blk = arena_block_new(a, size, a->site);
+        off = 0;
+    }
+
+    p = arena_block_data(blk) + off;
+    blk->used = off + size;
+    memset(p, 0, size);
+
+    return p;
+}
+
+/* Append memory to the string, allocated from the arena:
+ *     s += data[:len]
+ *
+ * `s' may be NULL, which is the same as an empty string. If `s'
+ * is the last allocation in the arena, it is extended in place,
+ * otherwise it is copied. The new pointer is returned
+ */
+char*
+arena_append (arena *a, char *s, const char *data, size_t len)
+{
+    arena_block *blk = a->blocks;
+    size_t      l1;
+    char        *s2;
+
+    if (s == NULL) {
+        s2 = arena_alloc(a, len + 1);
+        memcpy(s2, data, len);
+        return s2;
+    }
+
+    l1 = strlen(s);
+    if (s + l1 + 1 == arena_block_data(blk) + blk->used &&
+        blk->used + len <= blk->size) {
+        memcpy(s + l1, data, len);
+        s[l1 + len] = '\0';
+        blk->used += len;
+        return s;
+    }
+
+    s2 = arena_alloc(a, l1 + len + 1);
+    memcpy(s2, s, l1);
+    memcpy(s2 + l1, data, len);
+
+    return s2;
+}
+
+/* Create new string in the arena as a copy of existent string
+ */
+char*
+arena_strdup (arena *a, const char *s)
+{
+    return arena_append(a, NULL, s, strlen(s));
+}
+
+/* Create new string in the arena and print to it
+ */
+char*
+arena_printf (arena *a, const char *format, ...)
+{
+    va_list ap, ap2;
+    char    *s;
+    int     n;
+
+    va_start(ap, format);
+    va_copy(ap2, ap);
+
+    n = vsnprintf(NULL, 0, format, ap);
+    s = arena_alloc(a, (size_t) n + 1);
+    vsnprintf(s, (size_t) n + 1, format, ap2);
+
+    va_end(ap2);
+    va_end(ap);
+
+    return s;
 }
 
 /******************** Strings ********************/
+/* Allocating string functions below account memory against their
+ * caller (see AIRSCAN_MEM_STATS), so they pass the caller's address
+ * down to these helpers instead of calling inline str_XXX functions
+ */
+
+/* Append memory to string on behalf of the caller
+ */
+static char*
+str_append_mem_at (char *s1, const char *s2, size_t l2, const void *caller)
+{
+    size_t l1 = str_len(s1);
+
+    s1 = __mem_resize_at(s1, l1 + l2, 1, 1, true, caller);
+    memcpy(s1 + l1, s2, l2);
+    s1[l1+l2] = '\0';
+
+    return s1;
+}
+
+/* Append formatted string to string on behalf of the caller
+ */
+static char*
+str_append_vprintf_at (char *s, const char *format, va_list ap,
+        const void *caller)
+{
+    char    buf[4096];
+    size_t  len, oldlen;
+    va_list ap2;
+
+    va_copy(ap2, ap);
+    len = vsnprintf(buf, sizeof(buf), format, ap2);
+    va_end(ap2);
+
+    if (len < sizeof(buf)) {
+        return str_append_mem_at(s, buf, len, caller);
+    }
+
+    oldlen = mem_len(s);
+    s = __mem_resize_at(s, oldlen + len, 1, 1, true, caller);
+
+    va_copy(ap2, ap);
+    vsnprintf(s + oldlen, len + 1, format, ap2);
+    va_end(ap2);
+
+    return s;
+}
+
 /* Create new string as a lowercase copy of existent string
  */
 char*
 str_dup_tolower (const char *s1)
 {
-    char   *s = str_dup(s1);
+    char   *s = str_append_mem_at(NULL, s1, strlen(s1),
+        __builtin_return_address(0));
     size_t i;
 
     for (i = 0; s[i]; i ++) {
@@ -196,7 +758,7 @@ str_printf (const char *format, ...)
     char    *s;
 
     va_start(ap, format);
-    s = str_append_vprintf(NULL, format, ap);
+    s = str_append_vprintf_at(NULL, format, ap, __builtin_return_address(0));
     va_end(ap);
 
     return s;
@@ -207,7 +769,8 @@ str_printf (const char *format, ...)
 char*
 str_vprintf (const char *format, va_list ap)
 {
-    return str_append_vprintf(NULL, format, ap);
+    return str_append_vprintf_at(NULL, format, ap,
+        __builtin_return_address(0));
 }
 
 /* Append formatted string to string
@@ -221,7 +784,7 @@ str_append_printf (char *s, const char *format, ...)
     va_list ap;
 
     va_start(ap, format);
-    s = str_append_vprintf(s, format, ap);
+    s = str_append_vprintf_at(s, format, ap, __builtin_return_address(0));
     va_end(ap);
 
     return s;
@@ -232,26 +795,7 @@ str_append_printf (char *s, const char *format, ...)
 char*
 str_append_vprintf (char *s, const char *format, va_list ap)
 {
-    char    buf[4096];
-    size_t  len, oldlen;
-    va_list ap2;
-
-    va_copy(ap2, ap);
-    len = vsnprintf(buf, sizeof(buf), format, ap2);
-    va_end(ap2);
-
-    if (len < sizeof(buf)) {
-        return str_append_mem(s, buf, len);
-    }
-
-    oldlen = mem_len(s);
-    s = mem_resize(s, oldlen + len, 1);
-
-    va_copy(ap2, ap);
-    vsnprintf(s + oldlen, len + 1, format, ap2);
-    va_end(ap2);
-
-    return s;
+    return str_append_vprintf_at(s, format, ap, __builtin_return_address(0));
 }
 
 /* Concatenate several strings. Last pointer must be NULL.
@@ -260,12 +804,13 @@ str_append_vprintf (char *s, const char *format, va_list ap)
 char*
 str_concat (const char *s, ...)
 {
-    va_list ap;
-    char    *ret = str_dup(s);
+    const void *caller = __builtin_return_address(0);
+    va_list    ap;
+    char       *ret = str_append_mem_at(NULL, s, strlen(s), caller);
 
     va_start(ap, s);
     while ((s = va_arg(ap, const char*)) != NULL) {
-        ret = str_append(ret, s);
+        ret = str_append_mem_at(ret, s, strlen(s), caller);
     }
     va_end(ap);
 
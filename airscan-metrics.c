@@ -0,0 +1,396 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Runtime metrics
+ */
+
+#include "airscan.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* Name of the metrics file, created in the conf.metrics_dir
+ */
+#define METRICS_FILE_NAME       "sane-airscan.prom"
+
+/* Histogram buckets upper bounds, in seconds
+ */
+static const double metric_buckets[] = {
+    0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60
+};
+
+#define METRIC_BUCKETS_NUM  \
+        ((int) (sizeof(metric_buckets) / sizeof(metric_buckets[0])))
+
+/* metric represents a single time series
+ */
+struct metric {
+    METRIC_TYPE type;                           /* Metric type */
+    const char  *name;                          /* Metric name */
+    const char  *help;                          /* Help string */
+    char        *labels;                        /* Labels, may be empty */
+    double      value;                          /* Value, histogram sum */
+    uint64_t    count;                          /* Histogram count */
+    uint64_t    buckets[METRIC_BUCKETS_NUM];    /* Histogram buckets */
+    metric      *next;                          /* Next metric in list */
+};
+
+/* Static variables
+ */
+static bool            metrics_enabled;
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static metric          *metrics_list;
+static eloop_timer     *metrics_timer;
+static char            *metrics_path;
+
+/* Lookup or create the metric
+ */
+metric*
+metric_get (METRIC_TYPE type, const char *name, const char *help,
+        const char *labels)
+{
+    metric *m, **pos;
+
+    if (!metrics_enabled) {
+        return NULL;
+    }
+
+    if (labels == NULL) {
+        labels = "";
+    }
+
+    pthread_mutex_lock(&metrics_mutex);
+
+    /* Lookup existent metric. Remember position after the last
+     * metric with the same name, so all time series of the same
+     * metric are kept together, as exposition format requires
+     */
+    pos = NULL;
+    for (m = metrics_list; m != NULL; m = m->next) {
+        if (!strcmp(m->name, name)) {
+            if (!strcmp(m->labels, labels)) {
+                goto DONE;
+            }
+            pos = &m->next;
+        }
+    }
+
+    if (pos == NULL) {
+        for (pos = &metrics_list; *pos != NULL; pos = &(*pos)->next)
+            ;
+    }
+
+    /* Create new metric */
+    m = mem_new(metric, 1);
+    m->type = type;
+    m->name = name;
+    m->help = help;
+    m->labels = str_dup(labels);
+    m->next = *pos;
+    *pos = m;
+
+DONE:
+    pthread_mutex_unlock(&metrics_mutex);
+    log_assert(NULL, m->type == type);
+
+    return m;
+}
+
+/* Add value to the counter or gauge
+ */
+void
+metric_add (metric *m, double v)
+{
+    if (m != NULL) {
+        pthread_mutex_lock(&metrics_mutex);
+        m->value += v;
+        pthread_mutex_unlock(&metrics_mutex);
+    }
+}
+
+/* Set value of the gauge
+ */
+void
+metric_set (metric *m, double v)
+{
+    if (m != NULL) {
+        pthread_mutex_lock(&metrics_mutex);
+        m->value = v;
+        pthread_mutex_unlock(&metrics_mutex);
+    }
+}
+
+/* Add observation to the histogram
+ */
+void
+metric_observe (metric *m, double v)
+{
+    int i;
+
+    if (m != NULL) {
+        pthread_mutex_lock(&metrics_mutex);
+
+        for (i = 0; i < METRIC_BUCKETS_NUM; i ++) {
+            if (v <= metric_buckets[i]) {
+                m->buckets[i] ++;
+            }
+        }
+
+        m->value += v;
+        m->count ++;
+
+        pthread_mutex_unlock(&metrics_mutex);
+    }
+}
+
+/* Append label to the labels string, properly quoting its value
+ */
+char*
+metric_label (char *labels, const char *name, const char *value)
+{
+    if (labels[0] != '\0') {
+        labels = str_append_c(labels, ',');
+    }
+
+    labels = str_append(labels, name);
+    labels = str_append(labels, "=\"");
+
+    for (; *value != '\0'; value ++) {
+        switch (*value) {
+        case '\\': labels = str_append(labels, "\\\\"); break;
+        case '"':  labels = str_append(labels, "\\\""); break;
+        case '\n': labels = str_append(labels, "\\n"); break;
+        default:   labels = str_append_c(labels, *value);
+        }
+    }
+
+    return str_append_c(labels, '"');
+}
+
+/* Format a single sample
+ */
+static char*
+metrics_format_sample (char *out, const char *name, const char *suffix,
+        const char *labels, const char *extra, double value)
+{
+    out = str_append_printf(out, "%s%s", name, suffix);
+
+    if (labels[0] != '\0' || extra != NULL) {
+        out = str_append_printf(out, "{%s%s%s}", labels,
+            labels[0] != '\0' && extra != NULL ? "," : "",
+            extra != NULL ? extra : "");
+    }
+
+    return str_append_printf(out, " %.15g\n", value);
+}
+
+/* Format memory allocation statistics, if available
+ */
+static char*
+metrics_format_mem (char *out)
+{
+    mem_stats  stats;
+    int        i;
+    static const struct {
+        const char *name, *help;
+        size_t     off;
+    } gauges[] = {
+        {"airscan_mem_live_bytes", "Live bytes, including overhead",
+            offsetof(mem_stats, bytes)},
+        {"airscan_mem_peak_bytes", "Peak of live bytes",
+            offsetof(mem_stats, peak)},
+        {"airscan_mem_slack_bytes", "Unused capacity of live blocks",
+            offsetof(mem_stats, slack)},
+        {"airscan_mem_header_bytes", "Overhead of block headers",
+            offsetof(mem_stats, headers)},
+        {"airscan_mem_live_blocks", "Count of live blocks",
+            offsetof(mem_stats, blocks)},
+    };
+
+    mem_stats_get(&stats);
+    if (!stats.enabled) {
+        return out;
+    }
+
+    out = str_append(out, "# HELP airscan_mem_allocs_total "
+        "Total count of allocations\n");
+    out = str_append(out, "# TYPE airscan_mem_allocs_total counter\n");
+    out = metrics_format_sample(out, "airscan_mem_allocs_total", "", "",
+        NULL, (double) stats.allocs);
+
+    for (i = 0; i < (int) (sizeof(gauges) / sizeof(gauges[0])); i ++) {
+        uint64_t v = *(uint64_t*) ((char*) &stats + gauges[i].off);
+
+        out = str_append_printf(out, "# HELP %s %s\n",
+            gauges[i].name, gauges[i].help);
+        out = str_append_printf(out, "# TYPE %s gauge\n", gauges[i].name);
+        out = metrics_format_sample(out, gauges[i].name, "", "", NULL,
+            (double) v);
+    }
+
+    return out;
+}
+
+/* Format all metrics in the text exposition format
+ */
+static char*
+metrics_format (void)
+{
+    char       *out = str_new();
+    const char *last_name = "";
+    metric     *m;
+    int        i;
+
+    pthread_mutex_lock(&metrics_mutex);
+
+    for (m = metrics_list; m != NULL; m = m->next) {
+        static const char *types[] = {"counter", "gauge", "histogram"};
+
+        if (strcmp(m->name, last_name)) {
+            out = str_append_printf(out, "# HELP %s %s\n", m->name, m->help);
+            out = str_append_printf(out, "# TYPE %s %s\n", m->name,
+                types[m->type]);
+            last_name = m->name;
+        }
+
+        if (m->type != METRIC_HISTOGRAM) {
+            out = metrics_format_sample(out, m->name, "", m->labels, NULL,
+                m->value);
+            continue;
+        }
+
+        for (i = 0; i < METRIC_BUCKETS_NUM; i ++) {
+            char le[64];
+
+            sprintf(le, "le=\"%g\"", metric_buckets[i]);
+            out = metrics_format_sample(out, m->name, "_bucket", m->labels,
+                le, (double) m->buckets[i]);
+        }
+
+        out = metrics_format_sample(out, m->name, "_bucket", m->labels,
+            "le=\"+Inf\"", (double) m->count);
+        out = metrics_format_sample(out, m->name, "_sum", m->labels, NULL,
+            m->value);
+        out = metrics_format_sample(out, m->name, "_count", m->labels, NULL,
+            (double) m->count);
+    }
+
+    pthread_mutex_unlock(&metrics_mutex);
+
+    return metrics_format_mem(out);
+}
+
+/* Write metrics file. The file is written under the temporary
+ * name and then atomically renamed, so collector never sees
+ * partially written file
+ */
+static void
+metrics_write (void)
+{
+    char *text, *tmp;
+    FILE *fp;
+    bool ok;
+
+    if (metrics_path == NULL) {
+        return;
+    }
+
+    text = metrics_format();
+    tmp = str_printf("%s.%d.tmp", metrics_path, (int) getpid());
+
+    fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        log_debug(NULL, "metrics: %s: %s", tmp, strerror(errno));
+        goto DONE;
+    }
+
+    ok = fwrite(text, 1, mem_len(text), fp) == mem_len(text);
+    ok = fclose(fp) == 0 && ok;
+
+    if (!ok || rename(tmp, metrics_path) < 0) {
+        log_debug(NULL, "metrics: %s: %s", metrics_path, strerror(errno));
+        unlink(tmp);
+    }
+
+DONE:
+    mem_free(tmp);
+    mem_free(text);
+}
+
+/* Periodic metrics write timer callback
+ */
+static void
+metrics_timer_callback (void *unused)
+{
+    (void) unused;
+
+    metrics_write();
+    metrics_timer = eloop_timer_new(conf.metrics_interval * 1000,
+        metrics_timer_callback, NULL);
+}
+
+/* Start/stop metrics export
+ */
+static void
+metrics_start_stop (bool start)
+{
+    if (start) {
+        metrics_timer = eloop_timer_new(conf.metrics_interval * 1000,
+            metrics_timer_callback, NULL);
+    } else {
+        if (metrics_timer != NULL) {
+            eloop_timer_cancel(metrics_timer);
+            metrics_timer = NULL;
+        }
+
+        metrics_write();
+    }
+}
+
+/* Initialize metrics
+ */
+SANE_Status
+metrics_init (void)
+{
+    metrics_enabled = conf.metrics_dir != NULL || conf.metrics_option;
+    if (!metrics_enabled) {
+        return SANE_STATUS_GOOD;
+    }
+
+    if (conf.metrics_dir != NULL) {
+        metrics_path = str_concat(conf.metrics_dir, METRICS_FILE_NAME, NULL);
+        eloop_add_start_stop_callback(metrics_start_stop);
+    }
+
+    log_debug(NULL, "metrics: file=%s interval=%d sane-option=%s",
+        metrics_path ? metrics_path : "-", conf.metrics_interval,
+        conf.metrics_option ? "enable" : "disable");
+
+    return SANE_STATUS_GOOD;
+}
+
+/* Cleanup metrics
+ */
+void
+metrics_cleanup (void)
+{
+    metric *m, *next;
+
+    for (m = metrics_list; m != NULL; m = next) {
+        next = m->next;
+        mem_free(m->labels);
+        mem_free(m);
+    }
+
+    metrics_list = NULL;
+    metrics_enabled = false;
+
+    mem_free(metrics_path);
+    metrics_path = NULL;
+}
+
+/* vim:ts=8:sw=4:et
+ */
@@ -6,8 +6,10 @@
  * OS Facilities
  */
 
+#define _GNU_SOURCE
 #include "airscan.h"
 
+#include <dlfcn.h>
 #include <errno.h>
 #include <limits.h>
 #include <pthread.h>
@@ -156,5 +158,26 @@ os_mkdir (const char *path, mode_t mode)
     return mkdir(p, mode);
 }
 
+/* Format the code address for logging, as symbol+offset, if symbol
+ * is known, or as library+offset otherwise
+ */
+void
+os_addr_name (const void *addr, char *buf, size_t size)
+{
+    Dl_info info;
+
+    if (dladdr(addr, &info) == 0) {
+        snprintf(buf, size, "%p", addr);
+    } else if (info.dli_sname != NULL) {
+        snprintf(buf, size, "%s+0x%lx", info.dli_sname,
+            (unsigned long) ((uintptr_t) addr - (uintptr_t) info.dli_saddr));
+    } else if (info.dli_fname != NULL) {
+        snprintf(buf, size, "%s+0x%lx", info.dli_fname,
+            (unsigned long) ((uintptr_t) addr - (uintptr_t) info.dli_fbase));
+    } else {
+        snprintf(buf, size, "%p", addr);
+    }
+}
+
 /* vim:ts=8:sw=4:et
  */
@@ -11,6 +11,12 @@
 #include <png.h>
 #include <setjmp.h>
 #include <string.h>
+#include <zlib.h>
+
+/* Size of strip buffer, used by the fast decoding path, in bytes.
+ * Strip holds as many whole filtered rows as fit
+ */
+#define IMAGE_DECODER_PNG_STRIP_SIZE    65536
 
 /* PNG image decoder
  */
@@ -26,6 +32,30 @@ typedef struct {
     int                   color_type;     /* PNG_COLOR_TYPE_XXX */
     int                   interlace_type; /* PNG_INTERLACE_XXX */
     unsigned int          num_lines;      /* Num of lines left to read */
+
+    /* Fast path for 8-bit gray/RGB non-interlaced images, which
+     * bypasses libpng for the image data: IDAT is inflated directly
+     * into the strip buffer, and rows are reconstructed in place
+     */
+    bool                  fast;           /* Fast path is active */
+    z_stream              zs;             /* Inflate state */
+    bool                  zs_inited;      /* zs is initialized */
+    const uint8_t         *chunks;        /* Next chunk to examine */
+    size_t                chunks_size;    /* Bytes left at chunks */
+    size_t                stride;         /* Bytes per row, w/o filter */
+    int                   bpp;            /* Bytes per pixel, 1 or 3 */
+    uint8_t               *strip;         /* Strip of filtered rows */
+    uint8_t               *prev;          /* Last row of previous strip */
+    size_t                *span_beg;      /* Per-row reconstruction start */
+    unsigned int          strip_rows;     /* Strip capacity, in rows */
+    unsigned int          strip_cnt;      /* Rows in the strip */
+    unsigned int          strip_pos;      /* Next row to hand out */
+    unsigned int          rows_left;      /* Rows left to inflate */
+    unsigned int          skip_lines;     /* Rows to skip at window top */
+    size_t                x_beg, x_end;   /* Window span within row, bytes */
+    bool                  check_end;      /* Check stream end after the
+                                             last row */
+    bool                  zs_end;         /* Inflate stream end reached */
 } image_decoder_png;
 
 /* Free PNG decoder
@@ -92,6 +122,370 @@ image_decoder_png_read_fn (png_struct *png_ptr, png_bytep data, size_t size)
     png->image_size -= size;
 }
 
+/* Read big-endian 32-bit integer
+ */
+static uint32_t
+image_decoder_png_be32 (const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+           ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+/* Feed the next non-empty IDAT chunk to the inflate stream.
+ * Returns false, if there are no more IDAT chunks
+ */
+static bool
+image_decoder_png_fast_next_idat (image_decoder_png *png)
+{
+    while (png->chunks_size >= 12) {
+        const uint8_t *chunk = png->chunks;
+        uint32_t      len = image_decoder_png_be32(chunk);
+
+        if (len > png->chunks_size - 12) {
+            return false;
+        }
+
+        png->chunks += len + 12;
+        png->chunks_size -= len + 12;
+
+        if (!memcmp(chunk + 4, "IDAT", 4) && len != 0) {
+            png->zs.next_in = (Bytef*) chunk + 8;
+            png->zs.avail_in = len;
+            return true;
+        }
+
+        if (!memcmp(chunk + 4, "IEND", 4)) {
+            break;
+        }
+    }
+
+    return false;
+}
+
+/* Check chunks structure and CRC of all IDAT chunks, before the
+ * fast path is taken. libpng verifies CRC of critical chunks, and
+ * the fast path must not be less strict. Returns false, if image
+ * is damaged; in this case libpng path is used and reports the error
+ */
+static bool
+image_decoder_png_fast_check (const uint8_t *chunks, size_t size)
+{
+    while (size >= 12) {
+        uint32_t len = image_decoder_png_be32(chunks);
+        uLong    crc;
+
+        if (len > size - 12) {
+            return false;
+        }
+
+        if (!memcmp(chunks + 4, "IDAT", 4)) {
+            crc = crc32(0L, chunks + 4, len + 4);
+            if (crc != image_decoder_png_be32(chunks + 8 + len)) {
+                return false;
+            }
+        }
+
+        if (!memcmp(chunks + 4, "IEND", 4)) {
+            return true;
+        }
+
+        chunks += len + 12;
+        size -= len + 12;
+    }
+
+    return false;
+}
+
+/* Consume the rest of the inflate stream, after the last row was
+ * inflated, and make sure the stream is complete
+ */
+static error
+image_decoder_png_fast_finish (image_decoder_png *png)
+{
+    uint8_t scratch[256];
+
+    if (png->zs_end) {
+        return NULL;
+    }
+
+    for (;;) {
+        int rc;
+
+        if (png->zs.avail_in == 0 && !image_decoder_png_fast_next_idat(png)) {
+            return ERROR("PNG: truncated image data");
+        }
+
+        png->zs.next_out = scratch;
+        png->zs.avail_out = sizeof(scratch);
+
+        rc = inflate(&png->zs, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END) {
+            return NULL;
+        }
+
+        if (rc != Z_OK) {
+            snprintf(png->error, sizeof(png->error), "PNG: %s",
+                png->zs.msg ? png->zs.msg : "inflate error");
+            return ERROR(png->error);
+        }
+    }
+}
+
+/* Paeth predictor
+ */
+static inline int
+image_decoder_png_paeth (int a, int b, int c)
+{
+    int pa = b - c, pb = a - c, pc = pa + pb;
+
+    pa = pa < 0 ? -pa : pa;
+    pb = pb < 0 ? -pb : pb;
+    pc = pc < 0 ? -pc : pc;
+
+    if (pb < pa) {
+        a = b;
+        pa = pb;
+    }
+
+    return pc < pa ? c : a;
+}
+
+/* Reconstruct bytes [beg...end) of the filtered row in place.
+ * Only the Up filter may start at non-zero beg, other filters
+ * depend on the left neighbour and always start at 0.
+ *
+ * bpp is a compile-time constant at every call site, so the inner
+ * per-pixel loops are unrolled, and the left neighbour of each byte
+ * is carried in a register instead of being reloaded from memory.
+ * The Up filter has no dependency between bytes and is vectorized
+ * by the compiler
+ */
+static inline void
+image_decoder_png_unfilter (uint8_t *restrict cur,
+        const uint8_t *restrict prev, size_t beg, size_t end,
+        int filter, int bpp)
+{
+    size_t i;
+    int    k, a[3], c[3];
+
+    switch (filter) {
+    case 0: /* None */
+        break;
+
+    case 1: /* Sub */
+        for (k = 0; k < bpp; k ++) {
+            a[k] = cur[k];
+        }
+        for (i = bpp; i < end; i += bpp) {
+            for (k = 0; k < bpp; k ++) {
+                a[k] = (uint8_t) (cur[i + k] + a[k]);
+                cur[i + k] = a[k];
+            }
+        }
+        break;
+
+    case 2: /* Up */
+        for (i = beg; i < end; i ++) {
+            cur[i] += prev[i];
+        }
+        break;
+
+    case 3: /* Average */
+        for (k = 0; k < bpp; k ++) {
+            a[k] = (uint8_t) (cur[k] + (prev[k] >> 1));
+            cur[k] = a[k];
+        }
+        for (i = bpp; i < end; i += bpp) {
+            for (k = 0; k < bpp; k ++) {
+                a[k] = (uint8_t) (cur[i + k] + ((a[k] + prev[i + k]) >> 1));
+                cur[i + k] = a[k];
+            }
+        }
+        break;
+
+    case 4: /* Paeth */
+        for (k = 0; k < bpp; k ++) {
+            c[k] = prev[k];
+            a[k] = (uint8_t) (cur[k] + c[k]);
+            cur[k] = a[k];
+        }
+        for (i = bpp; i < end; i += bpp) {
+            for (k = 0; k < bpp; k ++) {
+                int b = prev[i + k];
+
+                a[k] = (uint8_t) (cur[i + k] +
+                    image_decoder_png_paeth(a[k], b, c[k]));
+                c[k] = b;
+                cur[i + k] = a[k];
+            }
+        }
+        break;
+    }
+}
+
+/* Inflate and reconstruct the next strip of rows
+ *
+ * Only the bytes up to the right edge of the window are reconstructed,
+ * as no filter depends on bytes to the right. Bytes to the left of
+ * the window can be skipped for the None and Up rows, unless the next
+ * row needs them: the Average and Paeth filters use the whole left
+ * part of the previous row, and Up passes requirements of the next
+ * row up to its own previous row. So the start of each row is computed
+ * bottom-up, and the last row of the strip is reconstructed entirely,
+ * as the next strip is not known yet
+ */
+static error
+image_decoder_png_fast_fill (image_decoder_png *png)
+{
+    size_t        row_size = png->stride + 1;
+    unsigned int  rows = png->strip_rows, i;
+    size_t        beg;
+    uint8_t       *row;
+    const uint8_t *prev;
+
+    if (rows > png->rows_left) {
+        rows = png->rows_left;
+    }
+
+    /* Inflate as many rows, as fit the strip */
+    png->zs.next_out = png->strip;
+    png->zs.avail_out = rows * row_size;
+
+    while (png->zs.avail_out != 0) {
+        int rc;
+
+        if (png->zs.avail_in == 0 && !image_decoder_png_fast_next_idat(png)) {
+            return ERROR("PNG: unexpected EOF");
+        }
+
+        rc = inflate(&png->zs, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END) {
+            if (png->zs.avail_out != 0) {
+                return ERROR("PNG: not enough image data");
+            }
+            png->zs_end = true;
+        }
+
+        if (rc != Z_OK && rc != Z_STREAM_END) {
+            snprintf(png->error, sizeof(png->error), "PNG: %s",
+                png->zs.msg ? png->zs.msg : "inflate error");
+            return ERROR(png->error);
+        }
+    }
+
+    /* Compute reconstruction start of each row */
+    beg = 0;
+    for (i = rows; i > 0; i --) {
+        int filter = png->strip[(i - 1) * row_size];
+
+        switch (filter) {
+        case 0: /* None */
+        case 2: /* Up */
+            if (beg > png->x_beg) {
+                beg = png->x_beg;
+            }
+            png->span_beg[i - 1] = beg;
+            if (filter == 0) {
+                beg = png->x_beg;
+            }
+            break;
+
+        case 1: /* Sub */
+            png->span_beg[i - 1] = 0;
+            beg = png->x_beg;
+            break;
+
+        case 3: /* Average */
+        case 4: /* Paeth */
+            png->span_beg[i - 1] = 0;
+            beg = 0;
+            break;
+
+        default:
+            return ERROR("PNG: bad adaptive filter value");
+        }
+    }
+
+    /* Reconstruct rows */
+    prev = png->prev;
+    for (i = 0, row = png->strip; i < rows; i ++, row += row_size) {
+        if (png->bpp == 1) {
+            image_decoder_png_unfilter(row + 1, prev, png->span_beg[i],
+                png->x_end, row[0], 1);
+        } else {
+            image_decoder_png_unfilter(row + 1, prev, png->span_beg[i],
+                png->x_end, row[0], 3);
+        }
+
+        prev = row + 1;
+    }
+
+    memcpy(png->prev, prev, png->x_end);
+
+    png->rows_left -= rows;
+    png->strip_cnt = rows;
+    png->strip_pos = 0;
+
+    /* If image is decoded to the end, check that stream is complete */
+    if (png->rows_left == 0 && png->check_end) {
+        return image_decoder_png_fast_finish(png);
+    }
+
+    return NULL;
+}
+
+/* Setup the fast path, if image format allows it
+ */
+static void
+image_decoder_png_fast_setup (image_decoder_png *png, const void *data,
+        size_t size)
+{
+    if (png->bit_depth != 8 || png->interlace_type != PNG_INTERLACE_NONE) {
+        return;
+    }
+
+    switch (png->color_type) {
+    case PNG_COLOR_TYPE_GRAY:
+        png->bpp = 1;
+        break;
+
+    case PNG_COLOR_TYPE_RGB:
+        png->bpp = 3;
+        break;
+
+    default:
+        return;
+    }
+
+    if (size < 8 ||
+        !image_decoder_png_fast_check((const uint8_t*) data + 8, size - 8) ||
+        inflateInit(&png->zs) != Z_OK) {
+        return;
+    }
+
+    png->zs_inited = true;
+    png->chunks = (const uint8_t*) data + 8;
+    png->chunks_size = size - 8;
+
+    png->stride = (size_t) png->width * png->bpp;
+    png->strip_rows = IMAGE_DECODER_PNG_STRIP_SIZE / (png->stride + 1);
+    if (png->strip_rows == 0) {
+        png->strip_rows = 1;
+    }
+
+    png->strip = mem_new(uint8_t, png->strip_rows * (png->stride + 1));
+    png->prev = mem_new(uint8_t, png->stride);
+    png->span_beg = mem_new(size_t, png->strip_rows);
+    png->strip_cnt = png->strip_pos = 0;
+    png->rows_left = png->height;
+    png->skip_lines = 0;
+    png->x_beg = 0;
+    png->x_end = png->stride;
+    png->check_end = true;
+    png->zs_end = false;
+    png->fast = true;
+}
+
 /* Begin PNG decoding
  */
 static error
@@ -153,6 +547,8 @@ image_decoder_png_begin (image_decoder *decoder, const void *data,
         png_set_strip_alpha(png->png_ptr);
     }
 
+    image_decoder_png_fast_setup(png, data, size);
+
     return NULL;
 }
 
@@ -168,6 +564,18 @@ image_decoder_png_reset (image_decoder *decoder)
         png->png_ptr = NULL;
         png->info_ptr = NULL;
     }
+
+    if (png->zs_inited) {
+        inflateEnd(&png->zs);
+        png->zs_inited = false;
+    }
+
+    mem_free(png->strip);
+    mem_free(png->prev);
+    mem_free(png->span_beg);
+    png->strip = png->prev = NULL;
+    png->span_beg = NULL;
+    png->fast = false;
 }
 
 /* Get bytes count per pixel
@@ -207,12 +615,27 @@ image_decoder_png_get_params (image_decoder *decoder, SANE_Parameters *params)
 }
 
 /* Set clipping window
+ *
+ * The fast path honors the window: rows above it are reconstructed
+ * but not returned, rows below it are not decoded at all, and only
+ * the needed span of each row is handed out. libpng path always
+ * decodes the entire image
  */
 static error
 image_decoder_png_set_window (image_decoder *decoder, image_window *win)
 {
     image_decoder_png *png = (image_decoder_png*) decoder;
 
+    if (png->fast) {
+        png->x_beg = (size_t) win->x_off * png->bpp;
+        png->x_end = (size_t) (win->x_off + win->wid) * png->bpp;
+        png->skip_lines = win->y_off;
+        png->num_lines = win->hei;
+        png->rows_left = win->y_off + win->hei;
+        png->check_end = png->rows_left == png->height;
+        return NULL;
+    }
+
     win->x_off = win->y_off = 0;
     win->wid = png->width;
     win->hei = png->height;
@@ -230,6 +653,32 @@ image_decoder_png_read_line (image_decoder *decoder, void *buffer)
         return ERROR("PNG: end of file");
     }
 
+    if (png->fast) {
+        do {
+            if (png->strip_pos == png->strip_cnt) {
+                error err = image_decoder_png_fast_fill(png);
+                if (err != NULL) {
+                    return err;
+                }
+            }
+
+            if (png->skip_lines == 0) {
+                break;
+            }
+
+            png->strip_pos ++;
+            png->skip_lines --;
+        } while (true);
+
+        memcpy(buffer,
+            png->strip + png->strip_pos * (png->stride + 1) + 1 + png->x_beg,
+            png->x_end - png->x_beg);
+        png->strip_pos ++;
+        png->num_lines --;
+
+        return NULL;
+    }
+
     if (setjmp(png_jmpbuf(png->png_ptr))) {
         image_decoder_reset(decoder);
         return ERROR(png->error);
@@ -13,13 +13,52 @@
 #include <string.h>
 #include <unistd.h>
 
+/* Max amount of message bodies, queued for the trace writer
+ * thread, in bytes. When exceeded, new bodies are dropped
+ * from the trace, and only the note is written instead
+ */
+#define TRACE_BACKLOG_MAX       (128 * 1024 * 1024)
+
+/* trace_rec represents a single record, queued for the trace
+ * writer thread: a text for the log file, a message body or both
+ */
+typedef struct trace_rec trace_rec;
+struct trace_rec {
+    char      *text;               /* Text for the log file, or NULL */
+    http_data *ref;                /* Referenced body, or NULL */
+    http_data body;                /* Body to dump, if size != 0 */
+    bool      owned;               /* Body bytes are owned by record */
+    trace_rec *next;               /* Next record in the queue */
+};
+
 /* Trace file handle
+ *
+ * All trace output is formatted by the caller and queued to the
+ * writer thread, so file I/O doesn't block the event loop. Message
+ * bodies are queued by reference and written by the writer thread
+ * in order with the rest of the output
  */
 struct  trace {
     volatile unsigned int refcnt;  /* Reference count */
     FILE                  *log;    /* Log file */
     FILE                  *data;   /* Data file */
     unsigned int          index;   /* Message index */
+
+    /* Writer thread */
+    pthread_t             thread;      /* The thread */
+    bool                  threaded;    /* Thread is running */
+    pthread_mutex_t       lock;        /* Protects the queue */
+    pthread_cond_t        cond;        /* Signalled on queue changes */
+    trace_rec             *head;       /* Queue head */
+    trace_rec             **tail;      /* Queue tail */
+    bool                  stop;        /* Writer must exit */
+
+    /* Statistics, protected by lock */
+    size_t                backlog;     /* Queued bodies, bytes */
+    size_t                backlog_max; /* Max backlog seen */
+    unsigned long         records;     /* Records queued */
+    unsigned long         dropped;     /* Bodies dropped */
+    unsigned long long    dropped_bytes; /* Bytes dropped */
 };
 
 /* TAR file hader
@@ -52,6 +91,163 @@ static const char *trace_program;
  */
 static const char trace_zero_block[512];
 
+/* Forward declarations */
+static void
+trace_write_body (trace *t, http_data *data);
+
+/* Free the record
+ */
+static void
+trace_rec_free (trace_rec *rec)
+{
+    mem_free(rec->text);
+    if (rec->owned) {
+        mem_free((char*) rec->body.content_type);
+        mem_free((void*) rec->body.bytes);
+    }
+    http_data_unref(rec->ref);
+    mem_free(rec);
+}
+
+/* Write the record to the trace files
+ */
+static void
+trace_rec_write (trace *t, trace_rec *rec)
+{
+    if (rec->text != NULL) {
+        fwrite(rec->text, str_len(rec->text), 1, t->log);
+    }
+
+    if (rec->body.size != 0) {
+        trace_write_body(t, &rec->body);
+    }
+}
+
+/* The trace writer thread. Files are flushed each time
+ * the queue becomes empty
+ */
+static void*
+trace_writer_thread (void *arg)
+{
+    trace *t = arg;
+    bool  dirty = false;
+
+    pthread_mutex_lock(&t->lock);
+
+    for (;;) {
+        trace_rec *rec = t->head;
+
+        if (rec == NULL) {
+            if (dirty) {
+                pthread_mutex_unlock(&t->lock);
+                fflush(t->log);
+                fflush(t->data);
+                pthread_mutex_lock(&t->lock);
+                dirty = false;
+                continue;
+            }
+
+            if (t->stop) {
+                break;
+            }
+
+            pthread_cond_wait(&t->cond, &t->lock);
+            continue;
+        }
+
+        t->head = rec->next;
+        if (t->head == NULL) {
+            t->tail = &t->head;
+        }
+
+        pthread_mutex_unlock(&t->lock);
+        trace_rec_write(t, rec);
+        pthread_mutex_lock(&t->lock);
+
+        t->backlog -= rec->body.size;
+        dirty = true;
+
+        pthread_mutex_unlock(&t->lock);
+        trace_rec_free(rec);
+        pthread_mutex_lock(&t->lock);
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+}
+
+/* Queue the record. Takes ownership of the record. If the queue
+ * is full, the record body is replaced with the note
+ */
+static void
+trace_rec_queue (trace *t, trace_rec *rec)
+{
+    if (!t->threaded) {
+        trace_rec_write(t, rec);
+        fflush(t->log);
+        fflush(t->data);
+        trace_rec_free(rec);
+        return;
+    }
+
+    pthread_mutex_lock(&t->lock);
+
+    if (rec->body.size != 0 &&
+        t->backlog + rec->body.size > TRACE_BACKLOG_MAX) {
+        rec->text = str_append_printf(rec->text ? rec->text : str_new(),
+            "%lu bytes of data dropped, trace backlog is full\n\n",
+            (unsigned long) rec->body.size);
+
+        t->dropped ++;
+        t->dropped_bytes += rec->body.size;
+
+        rec->body.size = 0;
+    }
+
+    t->backlog += rec->body.size;
+    if (t->backlog > t->backlog_max) {
+        t->backlog_max = t->backlog;
+    }
+
+    t->records ++;
+
+    rec->next = NULL;
+    *t->tail = rec;
+    t->tail = &rec->next;
+
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+/* Queue text for the log file. Takes ownership of the string
+ */
+static void
+trace_queue_text (trace *t, char *text)
+{
+    trace_rec *rec = mem_new(trace_rec, 1);
+
+    rec->text = text;
+    trace_rec_queue(t, rec);
+}
+
+/* Queue the message body, referenced by the http_data
+ */
+static void
+trace_queue_body_ref (trace *t, http_data *data)
+{
+    trace_rec *rec;
+
+    if (data == NULL || data->size == 0) {
+        return;
+    }
+
+    rec = mem_new(trace_rec, 1);
+    rec->ref = http_data_ref(data);
+    rec->body = *data;
+    trace_rec_queue(t, rec);
+}
+
 /* Initialize protocol trace. Called at backend initialization
  */
 SANE_Status
@@ -80,6 +276,7 @@ trace_open (const char *device_name)
     trace  *t;
     char   *path;
     size_t len;
+    int    rc;
 
     if (conf.dbg_trace == NULL) {
         return NULL;
@@ -118,12 +315,26 @@ trace_open (const char *device_name)
 
     mem_free(path);
 
-    if (t->log != NULL && t->data != NULL) {
-        return t;
+    if (t->log == NULL || t->data == NULL) {
+        trace_unref(t);
+        return NULL;
     }
 
-    trace_unref(t);
-    return NULL;
+    /* Start the writer thread. If it fails, trace is written
+     * synchronously
+     */
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    t->tail = &t->head;
+
+    rc = pthread_create(&t->thread, NULL, trace_writer_thread, t);
+    if (rc == 0) {
+        t->threaded = true;
+    } else {
+        log_debug(NULL, "trace: writer thread: %s", strerror(rc));
+    }
+
+    return t;
 }
 
 /* Ref the trace
@@ -143,6 +354,25 @@ void
 trace_unref (trace *t)
 {
     if (t != NULL && (__sync_fetch_and_sub(&t->refcnt, 1) == 1)) {
+        if (t->threaded) {
+            pthread_mutex_lock(&t->lock);
+            t->stop = true;
+            pthread_cond_signal(&t->cond);
+            pthread_mutex_unlock(&t->lock);
+
+            pthread_join(t->thread, NULL);
+
+            log_debug(NULL, "trace: %lu records written, max backlog %lu "
+                "bytes, %lu bodies dropped (%llu bytes)",
+                t->records, (unsigned long) t->backlog_max,
+                t->dropped, t->dropped_bytes);
+        }
+
+        if (t->tail != NULL) {
+            pthread_cond_destroy(&t->cond);
+            pthread_mutex_destroy(&t->lock);
+        }
+
         if (t->log != NULL) {
             fclose(t->log);
         }
@@ -165,8 +395,8 @@ static void
 trace_message_headers_foreach_callback (const char *name, const char *value,
         void *ptr)
 {
-    trace *t = ptr;
-    fprintf(t->log, "%s: %s\n", name, value);
+    char **text = ptr;
+    *text = str_append_printf(*text, "%s: %s\n", name, value);
 }
 
 /* Dump binary data. The data saved as a file into a .TAR archive.
@@ -260,19 +490,11 @@ trace_dump_text (trace *t, http_data *data, bool xml)
     }
 }
 
-/* Dump message body
+/* Write message body to the trace files. Called by the writer thread
  */
-void
-trace_dump_body (trace *t, http_data *data)
+static void
+trace_write_body (trace *t, http_data *data)
 {
-    if (t == NULL) {
-        return;
-    }
-
-    if (data->size == 0) {
-        return;
-    }
-
     if (str_has_prefix(data->content_type, "text/") ||
         str_has_prefix(data->content_type, "application/xml") ||
         str_has_prefix(data->content_type, "application/soap+xml") ||
@@ -286,6 +508,28 @@ trace_dump_body (trace *t, http_data *data)
     putc('\n', t->log);
 }
 
+/* Dump message body. The data is copied, as caller may
+ * not own a reference to it
+ */
+void
+trace_dump_body (trace *t, http_data *data)
+{
+    trace_rec *rec;
+
+    if (t == NULL || data->size == 0) {
+        return;
+    }
+
+    rec = mem_new(trace_rec, 1);
+    rec->owned = true;
+    rec->body.content_type = str_dup(data->content_type);
+    rec->body.bytes = memcpy(mem_new(char, data->size), data->bytes,
+        data->size);
+    rec->body.size = data->size;
+
+    trace_rec_queue(t, rec);
+}
+
 /* Dump binary data (as hex dump)
  * Each line is prefixed with the `prefix` character
  */
@@ -305,7 +549,6 @@ trace_hexdump (trace *t, char prefix, const void *data, size_t size)
         size_t       av = size > 16 ? 16 : size;
         unsigned int i;
 
-        str_trunc(buf);
         buf = str_append_printf(buf, "%c %4.4x: ", prefix, off);
 
         for(i = 0; i < 16; i ++) {
@@ -331,49 +574,60 @@ trace_hexdump (trace *t, char prefix, const void *data, size_t size)
         }
 
         buf = str_append_c(buf, '\n');
-        fwrite(buf, str_len(buf), 1, t->log);
 
         off += av;
         dp += av;
         size -= av;
     }
 
-    mem_free(buf);
+    trace_queue_text(t, buf);
 }
 
-/* This hook is called on every http_query completion
+/* This hook is called on every http_query completion.
+ *
+ * Everything is formatted here, but bodies are only referenced and
+ * queued, so the writer thread saves them while event loop proceeds
  */
 void
 trace_http_query_hook (trace *t, http_query *q)
 {
     error err;
+    char  *text;
 
     if (t != NULL) {
-        fprintf(t->log, "==============================\n");
+        text = str_dup("==============================\n");
 
         /* Dump request */
-        fprintf(t->log, "%s %s\n", http_query_method(q),
+        text = str_append_printf(text, "%s %s\n", http_query_method(q),
                 http_uri_str(http_query_uri(q)));
         http_query_foreach_request_header(q,
-                trace_message_headers_foreach_callback, t);
-        fprintf(t->log, "\n");
-        trace_dump_body(t, http_query_get_request_data(q));
+                trace_message_headers_foreach_callback, &text);
+        text = str_append(text, "\n");
+        trace_queue_text(t, text);
+        trace_queue_body_ref(t, http_query_get_request_data(q));
+
+        /* Dump response. Query time is recorded, so trace
+         * replay can reproduce the device timing
+         */
+        text = str_printf("Time: %d ms\n",
+                (int) (timestamp_now() - http_query_timestamp(q)));
 
-        /* Dump response */
         err = http_query_transport_error(q);
         if (err != NULL) {
-            fprintf(t->log, "Error: %s\n", ESTRING(err));
+            text = str_append_printf(text, "Error: %s\n", ESTRING(err));
+            trace_queue_text(t, text);
         } else {
             int mp_count;
 
-            fprintf(t->log, "Status: %d %s\n", http_query_status(q),
-                    http_query_status_string(q));
+            text = str_append_printf(text, "Status: %d %s\n",
+                    http_query_status(q), http_query_status_string(q));
 
             http_query_foreach_response_header(q,
-                trace_message_headers_foreach_callback, t);
-            fprintf(t->log, "\n");
+                trace_message_headers_foreach_callback, &text);
+            text = str_append(text, "\n");
+            trace_queue_text(t, text);
 
-            trace_dump_body(t, http_query_get_response_data(q));
+            trace_queue_body_ref(t, http_query_get_response_data(q));
 
             mp_count = http_query_get_mp_response_count(q);
             if (mp_count != 0) {
@@ -381,15 +635,15 @@ trace_http_query_hook (trace *t, http_query *q)
 
                 for (i = 0; i < mp_count; i ++) {
                     http_data *part = http_query_get_mp_response_data(q, i);
-                    fprintf(t->log, "===== Part %d =====\n", i);
-                    fprintf(t->log, "Content-Type: %s\n", part->content_type);
-                    trace_dump_body(t, part);
+
+                    text = str_printf("===== Part %d =====\n", i);
+                    text = str_append_printf(text, "Content-Type: %s\n",
+                            part->content_type);
+                    trace_queue_text(t, text);
+                    trace_queue_body_ref(t, part);
                 }
             }
         }
-
-        fflush(t->log);
-        fflush(t->data);
     }
 }
 
@@ -400,11 +654,13 @@ trace_printf (trace *t, const char *fmt, ...)
 {
     if (t != NULL) {
         va_list ap;
+        char    *text;
+
         va_start(ap, fmt);
-        vfprintf(t->log, fmt, ap);
-        putc('\n', t->log);
-        fflush(t->log);
+        text = str_vprintf(fmt, ap);
         va_end(ap);
+
+        trace_queue_text(t, str_append_c(text, '\n'));
     }
 }
 
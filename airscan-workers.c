@@ -0,0 +1,195 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Worker pool for CPU-bound tasks
+ */
+
+#include "airscan.h"
+
+#include <unistd.h>
+
+/* Max count of worker threads
+ */
+#define WORKERS_MAX     8
+
+/* worker_task states
+ */
+enum {
+    WORKER_TASK_IDLE,           /* Not submitted or completed */
+    WORKER_TASK_QUEUED,         /* Waiting in the queue */
+    WORKER_TASK_RUNNING         /* Executed by a worker */
+};
+
+/* Static variables
+ */
+static pthread_mutex_t workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  workers_cond_queue = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  workers_cond_done = PTHREAD_COND_INITIALIZER;
+static pthread_t       workers_threads[WORKERS_MAX];
+static int             workers_num;
+static int             workers_started;
+static bool            workers_stop;
+static ll_head         workers_queue;
+
+/* Worker thread
+ */
+static void*
+workers_thread (void *unused)
+{
+    (void) unused;
+
+    pthread_mutex_lock(&workers_mutex);
+
+    for (;;) {
+        ll_node     *node;
+        worker_task *task;
+
+        while (!workers_stop && ll_empty(&workers_queue)) {
+            pthread_cond_wait(&workers_cond_queue, &workers_mutex);
+        }
+
+        if (workers_stop) {
+            break;
+        }
+
+        node = ll_pop_beg(&workers_queue);
+        task = OUTER_STRUCT(node, worker_task, chain);
+        task->state = WORKER_TASK_RUNNING;
+
+        pthread_mutex_unlock(&workers_mutex);
+        task->func(task->data);
+        pthread_mutex_lock(&workers_mutex);
+
+        task->state = WORKER_TASK_IDLE;
+        pthread_cond_broadcast(&workers_cond_done);
+    }
+
+    pthread_mutex_unlock(&workers_mutex);
+
+    return NULL;
+}
+
+/* Start worker threads, if not started yet
+ *
+ * Must be called under workers_mutex
+ */
+static void
+workers_start (void)
+{
+    while (workers_started < workers_num) {
+        int rc = pthread_create(&workers_threads[workers_started], NULL,
+            workers_thread, NULL);
+
+        if (rc != 0) {
+            log_debug(NULL, "workers: pthread_create: %s", strerror(rc));
+            workers_num = workers_started;
+            break;
+        }
+
+        workers_started ++;
+    }
+}
+
+/* Get count of worker threads. 0 means that tasks are
+ * executed inline, by the submitter
+ */
+int
+workers_count (void)
+{
+    return workers_num;
+}
+
+/* Submit the task for execution
+ */
+void
+worker_task_submit (worker_task *task)
+{
+    if (workers_num == 0) {
+        task->func(task->data);
+        return;
+    }
+
+    pthread_mutex_lock(&workers_mutex);
+    workers_start();
+    task->state = WORKER_TASK_QUEUED;
+    ll_push_end(&workers_queue, &task->chain);
+    pthread_cond_signal(&workers_cond_queue);
+    pthread_mutex_unlock(&workers_mutex);
+}
+
+/* Wait until the submitted task is completed
+ *
+ * If task is still in the queue, it is executed by the caller,
+ * rather than waiting for a free worker
+ */
+void
+worker_task_wait (worker_task *task)
+{
+    pthread_mutex_lock(&workers_mutex);
+
+    if (task->state == WORKER_TASK_QUEUED) {
+        ll_del(&task->chain);
+        task->state = WORKER_TASK_IDLE;
+        pthread_mutex_unlock(&workers_mutex);
+        task->func(task->data);
+        return;
+    }
+
+    while (task->state != WORKER_TASK_IDLE) {
+        pthread_cond_wait(&workers_cond_done, &workers_mutex);
+    }
+
+    pthread_mutex_unlock(&workers_mutex);
+}
+
+/* Initialize worker pool
+ *
+ * The caller of worker_task_submit() normally has its own work
+ * to do, so one core is left for it
+ */
+SANE_Status
+workers_init (void)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return workers_init_count((int) math_bound(cores - 1, 0, WORKERS_MAX));
+}
+
+/* Initialize worker pool with the specified count of threads
+ */
+SANE_Status
+workers_init_count (int num)
+{
+    ll_init(&workers_queue);
+    workers_stop = false;
+    workers_num = math_bound(num, 0, WORKERS_MAX);
+
+    log_debug(NULL, "workers: %d threads", workers_num);
+
+    return SANE_STATUS_GOOD;
+}
+
+/* Cleanup worker pool
+ */
+void
+workers_cleanup (void)
+{
+    int i;
+
+    pthread_mutex_lock(&workers_mutex);
+    workers_stop = true;
+    pthread_cond_broadcast(&workers_cond_queue);
+    pthread_mutex_unlock(&workers_mutex);
+
+    for (i = 0; i < workers_started; i ++) {
+        pthread_join(workers_threads[i], NULL);
+    }
+
+    workers_started = 0;
+    workers_num = 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
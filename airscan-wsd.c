@@ -882,8 +882,7 @@ wsd_scan_decode (const proto_ctx *ctx)
             err = xml_rd_node_value_uint(xml, &job_id);
         } else if (!strcmp(path, "s:Envelope/s:Body/scan:CreateScanJobResponse"
                 "/scan:JobToken")) {
-            mem_free(job_token);
-            job_token = str_dup(xml_rd_node_value(xml));
+            job_token = arena_strdup(ctx->arena, xml_rd_node_value(xml));
         }
 
         xml_rd_deep_next(xml, 0);
@@ -900,12 +899,12 @@ wsd_scan_decode (const proto_ctx *ctx)
     }
 
     result.next = PROTO_OP_LOAD;
-    result.data.location = str_printf("%u:%s", job_id, job_token);
+    result.data.location = arena_printf(ctx->arena, "%u:%s",
+            job_id, job_token);
 
     /* Cleanup and exit */
 DONE:
     xml_rd_finish(&xml);
-    mem_free(job_token);
 
     if (err != NULL) {
         result.err = eloop_eprintf("CreateScanJobResponse: %s", ESTRING(err));
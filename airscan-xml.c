@@ -13,6 +13,19 @@
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
+/******************** Initialization ********************/
+/* Initialize XML library
+ *
+ * libxml2 initializes its global state lazily, on a first use,
+ * and this is not thread-safe, while XML is parsed by multiple
+ * event loop threads. So do it in advance
+ */
+void
+xml_init (void)
+{
+    xmlInitParser();
+}
+
 /******************** XML reader ********************/
 /* XML reader
  */
@@ -809,6 +809,23 @@ zeroconf_find_static_by_ident (const char *ident)
 }
 
 /******************** Events from discovery providers *********************/
+/* Count the finding in metrics
+ */
+static void
+zeroconf_finding_metric_inc (zeroconf_finding *finding)
+{
+    char   *labels;
+    metric *m;
+
+    labels = metric_label(str_new(), "method",
+        zeroconf_method_name(finding->method));
+    m = metric_get(METRIC_COUNTER, "airscan_discovery_findings_total",
+        "Devices found, by discovery method", labels);
+    mem_free(labels);
+
+    metric_add(m, 1);
+}
+
 /* Publish the zeroconf_finding.
  */
 void
@@ -863,6 +880,8 @@ zeroconf_finding_publish (zeroconf_finding *finding)
     zeroconf_device_add_finding(device, finding);
     zeroconf_merge_recompute_buddies();
     pthread_cond_broadcast(&zeroconf_initscan_cond);
+
+    zeroconf_finding_metric_inc(finding);
 }
 
 /* Withdraw the finding
@@ -67,6 +67,7 @@ sane_get_devices (const SANE_Device ***device_list, SANE_Bool local_only)
         zeroconf_device_list_free(sane_device_list);
         sane_device_list = zeroconf_device_list_get();
         *device_list = sane_device_list;
+        devcache_prewarm(sane_device_list);
 
         eloop_mutex_unlock();
     }
@@ -98,10 +99,12 @@ sane_open (SANE_String_Const name, SANE_Handle *handle)
         }
     }
 
-    dev = device_open(name, &status);
-
     eloop_mutex_unlock();
 
+    /* Note, device_open() acquires needed locks by itself
+     */
+    dev = device_open(name, &status);
+
     if (dev != NULL) {
         *handle = (SANE_Handle) dev;
     }
@@ -123,9 +126,7 @@ sane_close (SANE_Handle handle)
 
     log_debug(device_log_ctx(dev), "API: sane_close(): called");
 
-    eloop_mutex_lock();
     device_close((device*) handle, "API: sane_close(): done");
-    eloop_mutex_unlock();
 }
 
 /* Get option descriptor
@@ -139,9 +140,9 @@ sane_get_option_descriptor (SANE_Handle handle, SANE_Int option)
 
     log_debug(log, "API: device_get_option_descriptor(): called");
 
-    eloop_mutex_lock();
+    device_lock(dev);
     desc = device_get_option_descriptor(dev, option);
-    eloop_mutex_unlock();
+    device_unlock(dev);
 
     log_debug(log, "API: device_get_option_descriptor(): done");
 
@@ -236,13 +237,13 @@ sane_control_option (SANE_Handle handle, SANE_Int option, SANE_Action action,
     const       SANE_Option_Descriptor *desc;
     log_ctx     *log = device_log_ctx(dev);
 
-    eloop_mutex_lock();
-
     /* Roughly validate arguments */
     if (dev == NULL || value == NULL) {
-        goto DONE;
+        return SANE_STATUS_INVAL;
     }
 
+    device_lock(dev);
+
     desc = device_get_option_descriptor(dev, option);
     if (desc == NULL) {
         goto DONE;
@@ -260,7 +261,7 @@ sane_control_option (SANE_Handle handle, SANE_Int option, SANE_Action action,
     }
 
 DONE:
-    eloop_mutex_unlock();
+    device_unlock(dev);
 
     if (status == SANE_STATUS_GOOD) {
         sane_control_option_log(log, desc, option, action, value,
@@ -282,9 +283,9 @@ sane_get_parameters (SANE_Handle handle, SANE_Parameters *params)
     log_debug(log, "API: sane_get_params(): called");
 
     if (params != NULL) {
-        eloop_mutex_lock();
+        device_lock(dev);
         status = device_get_parameters(dev, params);
-        eloop_mutex_unlock();
+        device_unlock(dev);
     }
 
     log_debug(log, "API: sane_get_params(): done");
@@ -303,9 +304,9 @@ sane_start (SANE_Handle handle)
 
     log_debug(log, "API: sane_start(): called");
 
-    eloop_mutex_lock();
+    device_lock(dev);
     status = device_start(dev);
-    eloop_mutex_unlock();
+    device_unlock(dev);
 
     log_debug(log, "API: sane_start(): %s", sane_strstatus(status));
 
@@ -321,9 +322,10 @@ sane_read (SANE_Handle handle, SANE_Byte *data, SANE_Int max_len, SANE_Int *len)
     device      *dev = (device*) handle;
     log_ctx     *log = device_log_ctx(dev);
 
-    eloop_mutex_lock();
+    /* Note, device_read() acquires the device's mutex by itself,
+     * only when needed
+     */
     status = device_read(dev, data, max_len, len);
-    eloop_mutex_unlock();
 
     /* Note, as a special exception, we don't log every successful
      * call of sane_read(), because during loading of image there
@@ -361,9 +363,9 @@ sane_set_io_mode (SANE_Handle handle, SANE_Bool non_blocking)
 
     log_debug(log, "API: sane_set_io_mode(%s): called", mode);
 
-    eloop_mutex_lock();
+    device_lock(dev);
     status = device_set_io_mode(dev, non_blocking);
-    eloop_mutex_unlock();
+    device_unlock(dev);
 
     log_debug(log, "API: sane_set_io_mode(%s): %s", mode,
         sane_strstatus(status));
@@ -382,9 +384,9 @@ sane_get_select_fd (SANE_Handle handle, SANE_Int *fd)
 
     log_debug(log, "API: sane_get_select_fd(): called");
 
-    eloop_mutex_lock();
+    device_lock(dev);
     status = device_get_select_fd(dev, fd);
-    eloop_mutex_unlock();
+    device_unlock(dev);
 
     if (status == SANE_STATUS_GOOD) {
         log_debug(log, "API: sane_get_select_fd(): fd = %d", *fd);
@@ -328,9 +328,90 @@ __mem_alloc (size_t len, size_t extra, size_t elsize, bool must);
 void* __attribute__ ((__warn_unused_result__))
 __mem_resize (void *p, size_t len, size_t cap, size_t elsize, bool must);
 
+/* Same as __mem_resize(), but with AIRSCAN_MEM_STATS new block is
+ * accounted against the specified caller, so allocating helpers
+ * may report their callers as the allocation site
+ */
+void* __attribute__ ((__warn_unused_result__))
+__mem_resize_at (void *p, size_t len, size_t cap, size_t elsize, bool must,
+        const void *caller);
+
 void
 __mem_shrink (void *p, size_t len, size_t elsize);
 
+/* Memory allocation statistics. Collected only if backend is
+ * built with -DAIRSCAN_MEM_STATS, otherwise all zeroes
+ */
+typedef struct {
+    bool     enabled;   /* Statistics is available */
+    uint64_t allocs;    /* Total count of allocations */
+    uint64_t blocks;    /* Count of live blocks */
+    uint64_t bytes;     /* Live bytes, including headers and slack */
+    uint64_t peak;      /* Peak of live bytes */
+    uint64_t slack;     /* Unused capacity of live blocks (cap - len) */
+    uint64_t headers;   /* Overhead of block headers */
+} mem_stats;
+
+/* Get memory allocation statistics
+ */
+void
+mem_stats_get (mem_stats *stats);
+
+/* Dump memory allocation statistics, including top allocation
+ * sites, to the log
+ */
+void
+mem_stats_dump (log_ctx *log);
+
+/******************** Arena allocator ********************/
+/* Type arena represents a region of memory, used for multiple
+ * short-living allocations that share the same lifetime (for
+ * example, all transient data of the single HTTP query). Memory
+ * is allocated from the arena by the cheap pointer bump and all
+ * of it is released at once by arena_free()
+ *
+ * Arena is not thread-safe. Memory allocated from the arena must
+ * never be passed to mem_free() or str_XXX() functions
+ */
+typedef struct arena arena;
+
+/* Create new arena
+ */
+arena*
+arena_new (void);
+
+/* Destroy the arena and release all memory, allocated from it.
+ * `a' can be NULL
+ */
+void
+arena_free (arena *a);
+
+/* Allocate `size' bytes of zero-filled memory from the arena.
+ * This function never returns NULL
+ */
+void*
+arena_alloc (arena *a, size_t size);
+
+/* Append memory to the string, allocated from the arena:
+ *     s += data[:len]
+ *
+ * `s' may be NULL, which is the same as an empty string. If `s'
+ * is the last allocation in the arena, it is extended in place,
+ * otherwise it is copied. The new pointer is returned
+ */
+char*
+arena_append (arena *a, char *s, const char *data, size_t len);
+
+/* Create new string in the arena as a copy of existent string
+ */
+char*
+arena_strdup (arena *a, const char *s);
+
+/* Create new string in the arena and print to it
+ */
+char*
+arena_printf (arena *a, const char *format, ...);
+
 /******************** Strings ********************/
 /* Create new string
  */
@@ -596,6 +677,7 @@ __ptr_array_del (void **a, int i)
  * has a particular features:
  *
  *   OS_HAVE_EVENTFD      - Linux-like eventfd (2)
+ *   OS_HAVE_EPOLL        - Linux-like epoll (7) and timerfd (2)
  *   OS_HAVE_RTNETLINK    - Linux-like rtnetlink (7)
  *   OS_HAVE_AF_ROUTE     - BSD-like AF_ROUTE
  *   OS_HAVE_LINUX_PROCFS - Linux-style procfs
@@ -605,6 +687,7 @@ __ptr_array_del (void **a, int i)
  */
 #ifdef  __linux__
 #   define OS_HAVE_EVENTFD              1
+#   define OS_HAVE_EPOLL                1
 #   define OS_HAVE_RTNETLINK            1
 #   define OS_HAVE_LINUX_PROCFS         1
 #   define OS_HAVE_IP_MREQN             1
@@ -641,6 +724,12 @@ os_progname (void);
 int
 os_mkdir (const char *path, mode_t mode);
 
+/* Format the code address for logging, as symbol+offset, if symbol
+ * is known, or as library+offset otherwise
+ */
+void
+os_addr_name (const void *addr, char *buf, size_t size);
+
 /******************** Error handling ********************/
 /* Type error represents an error. Its value either NULL,
  * which indicates "no error" condition, or some opaque
@@ -1329,6 +1418,8 @@ typedef struct {
     bool           dbg_enabled;      /* Debugging enabled */
     const char     *dbg_trace;       /* Trace directory */
     bool           dbg_hexdump;      /* Hexdump all traffic to the trace */
+    int            dbg_stall;        /* Event loop stall threshold, ms */
+    int            dbg_clock_warp;   /* Idle time before clock warp, ms */
     conf_device    *devices;         /* Manually configured devices */
     bool           discovery;        /* Scanners discovery enabled */
     bool           model_is_netname; /* Use network name instead of model */
@@ -1336,18 +1427,50 @@ typedef struct {
     WSDD_MODE      wsdd_mode;        /* WS-Discovery mode */
     const char     *socket_dir;      /* Directory for AF_UNIX sockets */
     conf_blacklist *blacklist;       /* Devices blacklisted for discovery */
+    int            io_threads;       /* Count of I/O threads */
+    const char     *metrics_dir;     /* Metrics file directory */
+    int            metrics_interval; /* Metrics file update interval, s */
+    bool           metrics_option;   /* Throughput as SANE option */
+    bool           warm_devices;     /* Background devices pre-probing */
+    int            status_cache;     /* Device status reuse window, ms */
+    bool           preconnect;       /* Connect for next request in advance */
+    int            adf_batch;        /* ADF reload wait in batch mode, s */
+    bool           emulate_res;      /* Emulate missed resolutions */
+    bool           blank_skip;       /* Skip blank ADF pages */
+    int            blank_ink;        /* Blank page max ink, 1/100 % */
+    int            blank_edges;      /* Blank page max edges, 1/100 % */
+    int            blank_max_size;   /* Max page size to check, MiB */
 } conf_data;
 
+/* Max count of I/O threads
+ */
+#define CONF_IO_THREADS_MAX     16
+
 #define CONF_INIT {                     \
         .dbg_enabled = false,           \
         .dbg_trace = NULL,              \
         .dbg_hexdump = false,           \
+        .dbg_stall = 0,                 \
+        .dbg_clock_warp = 0,            \
         .devices = NULL,                \
         .discovery = true,              \
         .model_is_netname = true,       \
         .proto_auto = true,             \
         .wsdd_mode = WSDD_FAST,         \
-        .socket_dir = NULL              \
+        .socket_dir = NULL,             \
+        .io_threads = 1,                \
+        .metrics_dir = NULL,            \
+        .metrics_interval = 10,         \
+        .metrics_option = false,        \
+        .warm_devices = false,          \
+        .status_cache = 0,              \
+        .preconnect = true,             \
+        .adf_batch = 0,                 \
+        .emulate_res = false,           \
+        .blank_skip = false,            \
+        .blank_ink = 10,                \
+        .blank_edges = 10,              \
+        .blank_max_size = 64            \
     }
 
 extern conf_data conf;
@@ -1410,6 +1533,12 @@ pollable_wait (pollable *p);
  */
 typedef int64_t timestamp;
 
+/* The virtual clock skew, added to the monotonic time by
+ * timestamp_now(). It grows only when the event loop warps
+ * the clock (see clock-warp in the [debug] section)
+ */
+extern timestamp timestamp_skew;
+
 /* timestamp_now() returns a current time as timestamp
  */
 static inline timestamp
@@ -1418,10 +1547,24 @@ timestamp_now (void)
     struct timespec t;
 
     clock_gettime(CLOCK_MONOTONIC, &t);
-    return (timestamp) t.tv_sec * 1000 + (timestamp) t.tv_nsec / 1000000;
+    return (timestamp) t.tv_sec * 1000 + (timestamp) t.tv_nsec / 1000000 +
+           __atomic_load_n(&timestamp_skew, __ATOMIC_RELAXED);
 }
 
 /******************** Event loop ********************/
+/* Type eloop_shard represents one of the event loop threads
+ *
+ * By default there is only one, the primary, event loop thread.
+ * If more I/O threads are configured, devices are distributed
+ * between them. The discovery always runs on the primary shard
+ *
+ * Each shard has its own mutex. Timers, fdpolls, events and
+ * eloop_call() are bound to the current shard, i.e. the shard,
+ * which mutex is held by the calling thread (or the primary
+ * shard, if none)
+ */
+typedef struct eloop_shard eloop_shard;
+
 /* Initialize event loop
  */
 SANE_Status
@@ -1464,10 +1607,47 @@ void
 eloop_mutex_unlock (void);
 
 /* Wait on conditional variable under the event loop mutex
+ *
+ * The mutex of the current shard is used
  */
 void
 eloop_cond_wait (pthread_cond_t *cond);
 
+/* Get the primary shard
+ */
+eloop_shard*
+eloop_shard_primary (void);
+
+/* Pick the least loaded shard for the new device
+ *
+ * The returned shard must be released by eloop_shard_release(),
+ * when device is destroyed
+ */
+eloop_shard*
+eloop_shard_pick (void);
+
+/* Release the shard, returned by eloop_shard_pick()
+ */
+void
+eloop_shard_release (eloop_shard *shard);
+
+/* Acquire the shard's mutex
+ *
+ * While the mutex is held, the shard becomes the current shard
+ * of the calling thread. eloop_mutex_lock() is equal to locking
+ * of the primary shard
+ *
+ * Lock order: the primary shard, then any other shard. Locks
+ * must be released in the reverse order
+ */
+void
+eloop_shard_lock (eloop_shard *shard);
+
+/* Release the shard's mutex
+ */
+void
+eloop_shard_unlock (eloop_shard *shard);
+
 /* Get AvahiPoll that runs in event loop thread
  */
 const AvahiPoll*
@@ -1476,10 +1656,21 @@ eloop_poll_get (void);
 /* Call function on a context of event loop thread
  * The returned value can be supplied as a `callid'
  * parameter for the eloop_call_cancel() function
+ *
+ * This function is lock-free and may be called from any
+ * thread, with or without the event loop mutex held
  */
 uint64_t
 eloop_call (void (*func)(void*), void *data);
 
+/* Call function on a context of the specified shard's thread
+ *
+ * Like eloop_call(), but the shard is specified explicitly,
+ * and callid is compatible with eloop_call_cancel()
+ */
+uint64_t
+eloop_call_shard (eloop_shard *shard, void (*func)(void*), void *data);
+
 /* Cancel pending eloop_call
  *
  * This is safe to cancel already finished call (at this
@@ -1787,6 +1978,14 @@ http_client_cancel_af_uintptr (http_client *client, int af, uintptr_t uintptr);
 bool
 http_client_has_pending (const http_client *client);
 
+/* Establish connection to the URI's host in advance, so the
+ * next query to this host will not wait for connect and TLS
+ * handshake. The client keeps at most one such connection;
+ * unused connection is closed after a while
+ */
+void
+http_client_preconnect (http_client *client, const http_uri *uri);
+
 /* Type http_query represents HTTP query (both request and response)
  */
 typedef struct http_query http_query;
@@ -1873,6 +2072,18 @@ http_query_submit (http_query *q, void (*callback)(void *ptr, http_query *q));
 timestamp
 http_query_timestamp (const http_query *q);
 
+/* Get timestamp, when connection was established and request
+ * sending started. Returns 0, if query was not connected
+ */
+timestamp
+http_query_time_connected (const http_query *q);
+
+/* Get timestamp, when the first byte of response was received.
+ * Returns 0, if nothing was received
+ */
+timestamp
+http_query_time_rxfirst (const http_query *q);
+
 /* Set uintptr_t parameter, associated with query.
  * Completion callback may later use http_query_get_uintptr()
  * to fetch this value
@@ -2091,6 +2302,64 @@ trace_dump_body (trace *t, http_data *data);
 void
 trace_hexdump (trace *t, char prefix, const void *data, size_t size);
 
+/******************** Runtime metrics ********************/
+/* METRIC_TYPE represents type of the metric
+ */
+typedef enum {
+    METRIC_COUNTER,     /* Monotonically growing value */
+    METRIC_GAUGE,       /* Arbitrary value */
+    METRIC_HISTOGRAM    /* Distribution of durations, in seconds */
+} METRIC_TYPE;
+
+/* Type metric represents a single time series, identified by
+ * the metric name and set of labels
+ */
+typedef struct metric metric;
+
+/* Initialize metrics. Called at backend initialization
+ */
+SANE_Status
+metrics_init (void);
+
+/* Cleanup metrics. Called at backend unload
+ */
+void
+metrics_cleanup (void);
+
+/* Lookup or create the metric. Metrics live until backend unload
+ *
+ * Name and help must be string constants. Labels are formatted
+ * with metric_label() and may be NULL
+ *
+ * If metrics are disabled, NULL is returned. All metric_xxx()
+ * functions silently ignore NULL metric
+ */
+metric*
+metric_get (METRIC_TYPE type, const char *name, const char *help,
+        const char *labels);
+
+/* Add value to the counter or gauge
+ */
+void
+metric_add (metric *m, double v);
+
+/* Set value of the gauge
+ */
+void
+metric_set (metric *m, double v);
+
+/* Add observation to the histogram
+ */
+void
+metric_observe (metric *m, double v);
+
+/* Append label to the labels string, properly quoting its value
+ *
+ * `labels' will be consumed and the new pointer will be returned
+ */
+char*
+metric_label (char *labels, const char *name, const char *value);
+
 /******************** SANE_Word/SANE_String arrays ********************/
 /* Create array of SANE_Word
  */
@@ -2229,6 +2498,11 @@ sane_device_array_append(const SANE_Device **a, SANE_Device *d)
 }
 
 /******************** XML utilities ********************/
+/* Initialize XML library
+ */
+void
+xml_init (void);
+
 /* xml_ns defines XML namespace.
  *
  * For XML writer namespaces are simply added to the root
@@ -2458,6 +2732,7 @@ enum {
     OPT_SCAN_TL_Y,
     OPT_SCAN_BR_X,
     OPT_SCAN_BR_Y,
+    OPT_SCAN_REGIONS,           /* Regions, cut from a single scan */
 
     /* Image enhancement group */
     OPT_GROUP_ENHANCEMENT,
@@ -2472,6 +2747,9 @@ enum {
     OPT_JUSTIFICATION_X,
     OPT_JUSTIFICATION_Y,
 
+    /* Read-only statistics */
+    OPT_THROUGHPUT,
+
     /* Total count of options, computed by compiler */
     NUM_OPTIONS
 };
@@ -2499,6 +2777,17 @@ enum {
 #define SANE_DESC_ADF_JUSTIFICATION_Y  \
         SANE_I18N("ADF height justification (top/bottom/center)")
 
+#define SANE_NAME_SCAN_REGIONS         "regions"
+#define SANE_TITLE_SCAN_REGIONS        SANE_I18N("Scan Regions")
+#define SANE_DESC_SCAN_REGIONS         \
+        SANE_I18N("Regions, cut from a single platen scan and returned "  \
+                  "as separate images: auto or tl-x,tl-y,br-x,br-y;... mm")
+
+#define SANE_NAME_THROUGHPUT           "throughput"
+#define SANE_TITLE_THROUGHPUT          SANE_I18N("Scan Throughput")
+#define SANE_DESC_THROUGHPUT           \
+        SANE_I18N("Throughput of the last scanned page, megapixels per second")
+
 /* Check if option belongs to image enhancement group
  */
 static inline bool
@@ -2635,6 +2924,21 @@ void
 devcaps_dump (log_ctx *log, devcaps *caps);
 
 /******************** Device options ********************/
+/* Max count of regions, cut from a single platen scan
+ */
+#define DEVOPT_REGIONS_MAX      8
+
+/* Max length of the regions option value, including terminating '\0'
+ */
+#define DEVOPT_REGIONS_LEN      256
+
+/* devopt_region represents a scan window, in millimeters
+ */
+typedef struct {
+    SANE_Fixed             tl_x, tl_y;        /* Top-left x/y */
+    SANE_Fixed             br_x, br_y;        /* Bottom-right x/y */
+} devopt_region;
+
 /* Scan options
  */
 typedef struct {
@@ -2644,6 +2948,8 @@ typedef struct {
     ID_COLORMODE           colormode_emul;    /* Current "emulated" color mode*/
     ID_COLORMODE           colormode_real;    /* Current real color mode*/
     SANE_Word              resolution;        /* Current resolution */
+    SANE_Word              resolution_real;   /* Current real resolution */
+    SANE_Word              *resolutions;      /* Real+emulated, discrete */
     SANE_Fixed             tl_x, tl_y;        /* Top-left x/y */
     SANE_Fixed             br_x, br_y;        /* Bottom-right x/y */
     SANE_Parameters        params;            /* Scan parameters */
@@ -2655,7 +2961,11 @@ typedef struct {
     SANE_Fixed             highlight;         /* 0.0 ... +100.0 */
     SANE_Fixed             gamma;             /* Small positive value */
     bool                   negative;          /* Flip black and white */
-
+    SANE_Fixed             throughput;        /* Last page, MPixel/s */
+    char                   regions_str[DEVOPT_REGIONS_LEN]; /* As set */
+    bool                   regions_auto;      /* Detect regions */
+    devopt_region          regions[DEVOPT_REGIONS_MAX]; /* Defined regions */
+    int                    regions_num;       /* Count of defined regions */
 } devopt;
 
 /* Initialize device options
@@ -2684,6 +2994,13 @@ devopt_set_option (devopt *opt, SANE_Int option, void *value, SANE_Word *info);
 SANE_Status
 devopt_get_option (devopt *opt, SANE_Int option, void *value);
 
+/* Compute scan parameters for the given window, using
+ * current resolution and color mode
+ */
+void
+devopt_region_params (const devopt *opt, const devopt_region *win,
+        SANE_Parameters *params);
+
 /******************** ZeroConf (device discovery) ********************/
 /* Common logging context for device discovery
  */
@@ -2897,16 +3214,35 @@ wsdd_cleanup (void);
 typedef struct device device;
 
 /* Open a device
+ *
+ * This function must be called without the event loop mutex held,
+ * it acquires needed locks by itself
  */
 device*
 device_open (const char *name, SANE_Status *status);
 
 /* Close the device
  * If log_msg is not NULL, it is written to the device log as late as possible
+ *
+ * This function must be called without the event loop mutex held,
+ * it acquires needed locks by itself
  */
 void
 device_close (device *dev, const char *log_msg);
 
+/* Acquire mutex of the device's event loop shard
+ *
+ * Other device_XXX functions, unless stated otherwise, must be
+ * called under this mutex
+ */
+void
+device_lock (device *dev);
+
+/* Release mutex of the device's event loop shard
+ */
+void
+device_unlock (device *dev);
+
 /* Get device's logging context
  */
 log_ctx*
@@ -2951,6 +3287,9 @@ SANE_Status
 device_get_select_fd (device *dev, SANE_Int *fd);
 
 /* Read scanned image
+ *
+ * Unlike other device_XXX functions, this function must be
+ * called without the device's mutex held
  */
 SANE_Status
 device_read (device *dev, SANE_Byte *data, SANE_Int max_len, SANE_Int *len);
@@ -2965,7 +3304,60 @@ device_management_init (void);
 void
 device_management_cleanup (void);
 
+/******************** Worker pool ********************/
+/* worker_task represents a task, executed by the worker pool.
+ * The task is owned by the caller and must remain valid until
+ * worker_task_wait() returns
+ */
+typedef struct {
+    void    (*func) (void *data);   /* Task function */
+    void    *data;                  /* Its argument */
+    int     state;                  /* Internal: task state */
+    ll_node chain;                  /* Internal: in the queue */
+} worker_task;
+
+/* Initialize worker pool
+ */
+SANE_Status
+workers_init (void);
+
+/* Initialize worker pool with the specified count of threads,
+ * regardless of the count of CPU cores. Used by tests
+ */
+SANE_Status
+workers_init_count (int num);
+
+/* Cleanup worker pool
+ */
+void
+workers_cleanup (void);
+
+/* Get count of worker threads. 0 means that tasks are
+ * executed inline, by the submitter
+ */
+int
+workers_count (void);
+
+/* Submit the task for execution
+ */
+void
+worker_task_submit (worker_task *task);
+
+/* Wait until the submitted task is completed
+ */
+void
+worker_task_wait (worker_task *task);
+
 /******************** Image filters ********************/
+/* The window withing the image
+ *
+ * Note, all sizes and coordinates are in pixels
+ */
+typedef struct {
+    int x_off, y_off;  /* Top-left corner offset */
+    int wid, hei;      /* Image width and height */
+} image_window;
+
 /* Type filter represents image filter
  */
 typedef struct filter filter;
@@ -3004,6 +3396,93 @@ filter_chain_dump (filter *chain, log_ctx *log);
 void
 filter_chain_apply (filter *chain, uint8_t *line, size_t size);
 
+/* Resample line of RGB24 pixels into Grayscale8, in place.
+ * The first wid bytes of line receive the result
+ */
+void
+filter_rgb24_to_gray8 (uint8_t *line, int wid);
+
+/* Type filter_downscale represents streaming area-average downscaler,
+ * used to emulate resolutions the device doesn't support. Input
+ * lines are wid pixels of bpp (1 or 3) bytes each; the image is
+ * scaled by num/den (num < den) in both directions
+ */
+typedef struct filter_downscale filter_downscale;
+
+/* Create new downscaler
+ */
+filter_downscale*
+filter_downscale_new (int wid, int bpp, int num, int den);
+
+/* Free the downscaler
+ */
+void
+filter_downscale_free (filter_downscale *ds);
+
+/* Get width of output lines, in pixels
+ */
+int
+filter_downscale_wid (const filter_downscale *ds);
+
+/* Get count of output lines, produced from the given count
+ * of input lines
+ */
+int
+filter_downscale_lines (const filter_downscale *ds, int lines);
+
+/* Push next input line. Returns true, if the next output line
+ * became ready and was written to out
+ */
+bool
+filter_downscale_push (filter_downscale *ds, const uint8_t *in, uint8_t *out);
+
+/* Type filter_pagestat accumulates per-page statistics, used to
+ * detect blank pages. Input lines are wid pixels of bpp (1 or 3)
+ * bytes each
+ */
+typedef struct filter_pagestat filter_pagestat;
+
+/* filter_pagestat_result represents page statistics. Ink coverage
+ * and edge density are in 1/100 of percent of the page area
+ */
+typedef struct {
+    int background;     /* Background luminance, 0...255 */
+    int ink;            /* Pixels that differ from the background */
+    int edges;          /* Pixels that differ from their neighbours */
+} filter_pagestat_result;
+
+/* Create new page statistics accumulator
+ */
+filter_pagestat*
+filter_pagestat_new (int wid, int bpp);
+
+/* Free page statistics accumulator
+ */
+void
+filter_pagestat_free (filter_pagestat *ps);
+
+/* Push next line of the page
+ */
+void
+filter_pagestat_push (filter_pagestat *ps, const uint8_t *line);
+
+/* Get statistics of the page, accumulated so far
+ */
+void
+filter_pagestat_get (const filter_pagestat *ps, filter_pagestat_result *res);
+
+/* Detect separate objects (i.e., photos), placed on a platen, in the
+ * image of wid x hei pixels of bpp (1 or 3) bytes each. The image is
+ * analyzed in cells of cell x cell pixels; objects smaller than
+ * min_cells cells in any direction are ignored.
+ *
+ * Up to max regions are saved in the reading order. Returns count
+ * of regions found
+ */
+int
+filter_regions_detect (const uint8_t *image, int wid, int hei, int bpp,
+        int cell, int min_cells, image_window *regions, int max);
+
 /******************** Scan Protocol handling ********************/
 /* PROTO_OP represents operation
  */
@@ -3045,7 +3524,8 @@ typedef struct {
     http_uri             *base_uri;       /* HTTP base URI for protocol */
     http_uri             *base_uri_nozone;/* base_uri without IPv6 zone */
     proto_scan_params    params;          /* Scan parameters */
-    const char           *location;       /* Image location */
+    arena                *arena;          /* Per-job arena */
+    const char           *location;       /* Image location, in arena */
     unsigned int         images_received; /* Total count of received images */
 
     /* Extra context for xxx_decode callbacks */
@@ -3089,12 +3569,17 @@ struct proto_handler {
      * These callback are optional, set to NULL, if
      * they are not implemented by the protocol
      * handler
+     *
+     * precheck_query may return NULL, if recently received
+     * device status can be used instead. precheck_decode
+     * is called with ctx->query set to NULL at this case
      */
     http_query*  (*precheck_query) (const proto_ctx *ctx);
     proto_result (*precheck_decode) (const proto_ctx *ctx);
 
     /* Initiate scanning and decode result.
-     * On success, scan_decode must set ctx->data.location
+     * On success, scan_decode must set ctx->data.location,
+     * allocated from ctx->arena
      */
     http_query*  (*scan_query) (const proto_ctx *ctx);
     proto_result (*scan_decode) (const proto_ctx *ctx);
@@ -3110,6 +3595,15 @@ struct proto_handler {
     http_query*  (*status_query) (const proto_ctx *ctx);
     proto_result (*status_decode) (const proto_ctx *ctx);
 
+    /* Decode ADF state from the status_query response. Returns
+     * SANE_STATUS_GOOD, if device is idle and ADF is loaded,
+     * SANE_STATUS_UNSUPPORTED, if device doesn't report ADF state
+     *
+     * This callback is optional. It is used by the ADF batch mode
+     * to detect ADF reloading
+     */
+    SANE_Status  (*adf_status_decode) (const proto_ctx *ctx);
+
     /* Cleanup after scan
      */
     http_query*  (*cleanup_query) (const proto_ctx *ctx);
@@ -3144,16 +3638,47 @@ proto_handler_new (ID_PROTO proto)
     }
 }
 
-/******************** Image decoding ********************/
-/* The window withing the image
+/******************** Device capabilities cache ********************/
+/* Initialize device capabilities cache
+ */
+SANE_Status
+devcache_init (void);
+
+/* Cleanup device capabilities cache
+ */
+void
+devcache_cleanup (void);
+
+/* Request background probing of the listed devices
  *
- * Note, all sizes and coordinates are in pixels
+ * Must be called under the event loop mutex
  */
-typedef struct {
-    int x_off, y_off;  /* Top-left corner offset */
-    int wid, hei;      /* Image width and height */
-} image_window;
+void
+devcache_prewarm (const SANE_Device **dev_list);
+
+/* Store the device state into the cache
+ *
+ * On success, the cache takes ownership of the protocol handler,
+ * both URIs and content of caps (which will be zeroed) and
+ * returns true. If cache is disabled, nothing happens and false
+ * is returned
+ */
+bool
+devcache_put (const char *ident, ID_PROTO proto_id, proto_handler *proto,
+        const http_uri *endpoint, const http_uri *base_uri, devcaps *caps);
 
+/* Take the device state from the cache
+ *
+ * On hit, the matching endpoint of the devinfo is returned and
+ * caller becomes owner of the protocol handler, base URI and
+ * capabilities, returned via output parameters. On miss, NULL
+ * is returned
+ */
+zeroconf_endpoint*
+devcache_take (const zeroconf_devinfo *devinfo, proto_handler **proto,
+        http_uri **base_uri, devcaps *caps);
+
+/******************** Image decoding ********************/
 /* Image decoder, with virtual methods
  */
 typedef struct image_decoder image_decoder;
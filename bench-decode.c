@@ -0,0 +1,929 @@
+/* sane-airscan image decoders throughput benchmark
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Measures the image processing pipeline stage by stage (decoding,
+ * 24->8 resampling and filtering) over the synthetic A4 pages at
+ * several resolutions and, optionally, over the real image files,
+ * and compares results against the stored baseline
+ */
+
+#include "airscan.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __GLIBC__
+#   include <malloc.h>
+#endif
+
+#include <jpeglib.h>
+#include <png.h>
+
+/******************** Constants *********************/
+#define BENCH_A4_WIDTH_MM       210     /* Synthetic page width */
+#define BENCH_A4_HEIGHT_MM      297     /* Synthetic page height */
+#define BENCH_RES_MAX           16      /* Max count of resolutions */
+#define BENCH_NAME_MAX          128     /* Max length of the result name */
+#define BENCH_RESULTS_MAX       1024    /* Max count of results */
+#define BENCH_PEAK_SLACK_KB     64      /* Ignore peak memory growth below */
+
+/******************** Types *********************/
+/* bench_image represents an encoded image under test
+ */
+typedef struct {
+    char          *name;                    /* Image name */
+    image_decoder *(*new) (void);           /* Decoder constructor */
+    char          *data;                    /* Image data */
+    size_t        size;                     /* Image size */
+} bench_image;
+
+/* bench_result represents the measurement of one stage
+ */
+typedef struct {
+    char          name[BENCH_NAME_MAX];     /* image/stage */
+    double        mpix_per_s;               /* Throughput, MPixel/s */
+    double        ns_per_line;              /* Time per line, ns */
+    long          allocs;                   /* Allocations per run, -1 if n/a */
+    long          peak_kb;                  /* Peak memory, KiB, -1 if n/a */
+} bench_result;
+
+/******************** Options and state *********************/
+static int          bench_res[BENCH_RES_MAX] = {150, 300};
+static int          bench_res_cnt = 2;
+static int          bench_rounds = 5;
+static double       bench_threshold = 10;
+static const char   *bench_output;
+static const char   *bench_baseline;
+
+static bench_result bench_results[BENCH_RESULTS_MAX];
+static int          bench_results_cnt;
+
+/* Print error message and exit
+ */
+static void __attribute__((noreturn))
+die (const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    vprintf(format, ap);
+    printf("\n");
+    va_end(ap);
+
+    exit(1);
+}
+
+/* Get current time, in nanoseconds, for the precise measurements
+ */
+static int64_t
+bench_now_ns (void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/******************** Allocations accounting *********************/
+/* With glibc, malloc and friends are interposed here, so allocations,
+ * made by the decoders and underlying libraries, are accounted.
+ * Elsewhere, allocation statistics is not available
+ */
+#ifdef __GLIBC__
+#define BENCH_ALLOC_STATS       1
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+
+static long    bench_alloc_count;       /* Count of allocations */
+static int64_t bench_alloc_bytes;       /* Currently allocated bytes */
+static int64_t bench_alloc_peak;        /* Peak of bench_alloc_bytes */
+
+/* Account allocated memory block
+ */
+static void
+bench_alloc_account (void *p)
+{
+    if (p != NULL) {
+        bench_alloc_count ++;
+        bench_alloc_bytes += malloc_usable_size(p);
+        if (bench_alloc_bytes > bench_alloc_peak) {
+            bench_alloc_peak = bench_alloc_bytes;
+        }
+    }
+}
+
+/* Interposed malloc
+ */
+void*
+malloc (size_t size)
+{
+    void *p = __libc_malloc(size);
+    bench_alloc_account(p);
+    return p;
+}
+
+/* Interposed calloc
+ */
+void*
+calloc (size_t nmemb, size_t size)
+{
+    void *p = __libc_calloc(nmemb, size);
+    bench_alloc_account(p);
+    return p;
+}
+
+/* Interposed realloc
+ */
+void*
+realloc (void *ptr, size_t size)
+{
+    size_t old = ptr != NULL ? malloc_usable_size(ptr) : 0;
+    void   *p = __libc_realloc(ptr, size);
+
+    if (p != NULL || size == 0) {
+        bench_alloc_bytes -= old;
+    }
+
+    bench_alloc_account(p);
+    return p;
+}
+
+/* Interposed free
+ */
+void
+free (void *ptr)
+{
+    if (ptr != NULL) {
+        bench_alloc_bytes -= malloc_usable_size(ptr);
+        __libc_free(ptr);
+    }
+}
+#else
+#define BENCH_ALLOC_STATS       0
+
+static long    bench_alloc_count;
+static int64_t bench_alloc_bytes;
+static int64_t bench_alloc_peak;
+#endif
+
+/* Start allocations accounting for the stage
+ */
+static void
+bench_alloc_start (long *count, int64_t *base)
+{
+    *count = bench_alloc_count;
+    *base = bench_alloc_bytes;
+    bench_alloc_peak = bench_alloc_bytes;
+}
+
+/******************** Synthetic pages *********************/
+/* Cheap integer hash, for the deterministic pseudo-random content
+ */
+static unsigned int
+bench_hash (unsigned int x, unsigned int y)
+{
+    unsigned int h = x * 0x9e3779b1u ^ y * 0x85ebca77u;
+
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+
+    return h;
+}
+
+/* Fill the row of the synthetic page. The page looks like a
+ * typical office document: the upper part is covered with text-like
+ * lines of "glyphs", the lower part contains a noisy photo-like
+ * gradient
+ */
+static void
+bench_image_row (uint8_t *row, int wid, int hei, int res, int y, bool color)
+{
+    int  x;
+    int  margin = res / 2;                  /* 1/2 inch margins */
+    int  line_hei = res / 6;                /* 12pt text lines */
+    int  cell = res / 40 + 1;               /* Glyph cell size */
+    int  photo_top = hei * 3 / 5;
+    bool text_line = y >= margin && y < photo_top &&
+                     (y % line_hei) > line_hei / 5 &&
+                     (y % line_hei) < line_hei * 4 / 5;
+
+    for (x = 0; x < wid; x ++) {
+        uint8_t r = 255, g = 255, b = 255;
+
+        if (x < margin || x >= wid - margin || y >= hei - margin) {
+            /* Margins are white */
+        } else if (y >= photo_top) {
+            unsigned int noise = bench_hash(x, y) & 0x1f;
+
+            r = (uint8_t) (x * 200 / wid + noise);
+            g = (uint8_t) ((y - photo_top) * 200 / (hei - photo_top) + noise);
+            b = (uint8_t) (((x + y) & 0xff) / 2 + noise);
+        } else if (text_line) {
+            unsigned int word = bench_hash(x / (cell * 6), y / line_hei);
+            unsigned int glyph = bench_hash(x / cell, y / cell);
+
+            if ((word & 7) != 0 && (glyph & 3) == 0) {
+                r = g = b = 16;
+            }
+        }
+
+        if (color) {
+            row[3 * x] = r;
+            row[3 * x + 1] = g;
+            row[3 * x + 2] = b;
+        } else {
+            row[x] = (uint8_t) ((r + g + b) / 3);
+        }
+    }
+}
+
+/* Encode the synthetic page as JPEG
+ */
+static char*
+bench_encode_jpeg (int wid, int hei, int res, bool color)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr       jerr;
+    unsigned char               *buf = NULL, *row;
+    unsigned long               size = 0;
+    char                        *data;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &buf, &size);
+
+    cinfo.image_width = wid;
+    cinfo.image_height = hei;
+    cinfo.input_components = color ? 3 : 1;
+    cinfo.in_color_space = color ? JCS_RGB : JCS_GRAYSCALE;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 90, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    row = mem_new(unsigned char, wid * 3);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        bench_image_row(row, wid, hei, res, (int) cinfo.next_scanline, color);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    mem_free(row);
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    data = str_append_mem(str_new(), (const char*) buf, size);
+    free(buf);
+
+    return data;
+}
+
+/* libpng write callback
+ */
+static void
+bench_png_write (png_struct *png_ptr, png_bytep data, size_t size)
+{
+    char **out = png_get_io_ptr(png_ptr);
+    *out = str_append_mem(*out, (const char*) data, size);
+}
+
+/* libpng flush callback
+ */
+static void
+bench_png_flush (png_struct *png_ptr)
+{
+    (void) png_ptr;
+}
+
+/* Encode the synthetic page as PNG
+ */
+static char*
+bench_encode_png (int wid, int hei, int res, bool color)
+{
+    png_struct    *png_ptr;
+    png_info      *info_ptr;
+    char          *data = str_new();
+    unsigned char *row;
+    int           y;
+
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+        NULL, NULL, NULL);
+    if (png_ptr == NULL) {
+        die("png_create_write_struct: failed");
+    }
+
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL) {
+        die("png_create_info_struct: failed");
+    }
+
+    png_set_write_fn(png_ptr, &data, bench_png_write, bench_png_flush);
+    png_set_IHDR(png_ptr, info_ptr, wid, hei, 8,
+        color ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_GRAY,
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr, info_ptr);
+
+    row = mem_new(unsigned char, wid * 3);
+    for (y = 0; y < hei; y ++) {
+        bench_image_row(row, wid, hei, res, y, color);
+        png_write_row(png_ptr, row);
+    }
+    mem_free(row);
+
+    png_write_end(png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+
+    return data;
+}
+
+/* Append little-endian integer to the string
+ */
+static char*
+bench_append_le (char *s, uint32_t v, int bytes)
+{
+    int i;
+
+    for (i = 0; i < bytes; i ++) {
+        char c = (char) (v >> (8 * i));
+        s = str_append_mem(s, &c, 1);
+    }
+
+    return s;
+}
+
+/* Encode the synthetic page as BMP. Grayscale images are
+ * encoded as 8-bit images with the grayscale palette
+ */
+static char*
+bench_encode_bmp (int wid, int hei, int res, bool color)
+{
+    int     bpp = color ? 3 : 1;
+    int     row_size = (wid * bpp + 3) & ~3;
+    int     palette = color ? 0 : 256;
+    int     off = 14 + 40 + palette * 4;
+    int     ppm = (int) (res * 10000 / 254);
+    char    *data = str_new();
+    uint8_t *row = mem_new(uint8_t, row_size);
+    int     i, y;
+
+    /* BITMAPFILEHEADER */
+    data = str_append(data, "BM");
+    data = bench_append_le(data, off + row_size * hei, 4);
+    data = bench_append_le(data, 0, 4);
+    data = bench_append_le(data, off, 4);
+
+    /* BITMAPINFOHEADER. Negative height means top-down image */
+    data = bench_append_le(data, 40, 4);
+    data = bench_append_le(data, wid, 4);
+    data = bench_append_le(data, (uint32_t) -hei, 4);
+    data = bench_append_le(data, 1, 2);
+    data = bench_append_le(data, bpp * 8, 2);
+    data = bench_append_le(data, 0, 4);
+    data = bench_append_le(data, row_size * hei, 4);
+    data = bench_append_le(data, ppm, 4);
+    data = bench_append_le(data, ppm, 4);
+    data = bench_append_le(data, palette, 4);
+    data = bench_append_le(data, 0, 4);
+
+    for (i = 0; i < palette; i ++) {
+        data = bench_append_le(data, i * 0x010101, 4);
+    }
+
+    /* Pixels. BMP stores colors in BGR order */
+    for (y = 0; y < hei; y ++) {
+        bench_image_row(row, wid, hei, res, y, color);
+        if (color) {
+            for (i = 0; i < wid; i ++) {
+                uint8_t t = row[3 * i];
+                row[3 * i] = row[3 * i + 2];
+                row[3 * i + 2] = t;
+            }
+        }
+        data = str_append_mem(data, (const char*) row, row_size);
+    }
+
+    mem_free(row);
+
+    return data;
+}
+
+/* Create synthetic image
+ */
+static bench_image*
+bench_image_synthetic (const char *fmt, int res, bool color)
+{
+    bench_image *image = mem_new(bench_image, 1);
+    int         wid = (int) ((double) BENCH_A4_WIDTH_MM * res / 25.4);
+    int         hei = (int) ((double) BENCH_A4_HEIGHT_MM * res / 25.4);
+
+    image->name = str_printf("%s-%s-%d", fmt, color ? "color" : "gray", res);
+
+    if (!strcmp(fmt, "jpeg")) {
+        image->new = image_decoder_jpeg_new;
+        image->data = bench_encode_jpeg(wid, hei, res, color);
+    } else if (!strcmp(fmt, "png")) {
+        image->new = image_decoder_png_new;
+        image->data = bench_encode_png(wid, hei, res, color);
+    } else {
+        image->new = image_decoder_bmp_new;
+        image->data = bench_encode_bmp(wid, hei, res, color);
+    }
+
+    image->size = mem_len(image->data);
+
+    return image;
+}
+
+/* Load image from file
+ */
+static bench_image*
+bench_image_load (const char *file)
+{
+    bench_image *image = mem_new(bench_image, 1);
+    const char  *ext = strrchr(file, '.');
+    const char  *base = strrchr(file, '/');
+    FILE        *fp;
+    char        buf[65536];
+    size_t      n;
+
+    ext = ext ? ext + 1 : "";
+    base = base ? base + 1 : file;
+
+    if (!strcmp(ext, "jpeg") || !strcmp(ext, "jpg")) {
+        image->new = image_decoder_jpeg_new;
+    } else if (!strcmp(ext, "png")) {
+        image->new = image_decoder_png_new;
+    } else if (!strcmp(ext, "bmp")) {
+        image->new = image_decoder_bmp_new;
+    } else {
+        die("%s: can't guess image format", file);
+    }
+
+    fp = fopen(file, "rb");
+    if (fp == NULL) {
+        die("%s: %s", file, strerror(errno));
+    }
+
+    image->data = str_new();
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        image->data = str_append_mem(image->data, buf, n);
+    }
+
+    if (ferror(fp)) {
+        die("%s: read error", file);
+    }
+
+    fclose(fp);
+
+    image->name = str_dup(base);
+    image->size = mem_len(image->data);
+
+    return image;
+}
+
+/* Free the image
+ */
+static void
+bench_image_free (bench_image *image)
+{
+    mem_free(image->name);
+    mem_free(image->data);
+    mem_free(image);
+}
+
+/******************** Measurements *********************/
+/* Add the result
+ */
+static void
+bench_result_add (const char *image, const char *stage, int64_t best_ns,
+        const SANE_Parameters *params, long allocs, int64_t peak)
+{
+    bench_result *r;
+    double       pixels = (double) params->pixels_per_line * params->lines;
+
+    if (bench_results_cnt == BENCH_RESULTS_MAX) {
+        die("too many results");
+    }
+
+    r = &bench_results[bench_results_cnt ++];
+    snprintf(r->name, sizeof(r->name), "%s/%s", image, stage);
+    r->mpix_per_s = pixels * 1000 / (double) best_ns;
+    r->ns_per_line = (double) best_ns / params->lines;
+    r->allocs = BENCH_ALLOC_STATS ? allocs : -1;
+    r->peak_kb = BENCH_ALLOC_STATS ? (long) ((peak + 1023) / 1024) : -1;
+}
+
+/* Decode the entire image into the buffer. Returns decoding time
+ */
+static int64_t
+bench_decode (image_decoder *decoder, const bench_image *image,
+        uint8_t *out, SANE_Parameters *params)
+{
+    int64_t      t = bench_now_ns();
+    error        err;
+    image_window win;
+    int          i;
+
+    err = image_decoder_begin(decoder, image->data, image->size);
+    if (err != NULL) {
+        die("%s: %s", image->name, ESTRING(err));
+    }
+
+    image_decoder_get_params(decoder, params);
+
+    /* Request the entire image, like device does for the full-page scan */
+    memset(&win, 0, sizeof(win));
+    win.wid = params->pixels_per_line;
+    win.hei = params->lines;
+    err = image_decoder_set_window(decoder, &win);
+    if (err != NULL) {
+        die("%s: %s", image->name, ESTRING(err));
+    }
+
+    if (out != NULL) {
+        for (i = 0; i < params->lines; i ++) {
+            err = image_decoder_read_line(decoder,
+                out + (size_t) i * params->bytes_per_line);
+            if (err != NULL) {
+                die("%s: line %d: %s", image->name, i, ESTRING(err));
+            }
+        }
+    }
+
+    image_decoder_reset(decoder);
+
+    return bench_now_ns() - t;
+}
+
+/* Run all stages over the image
+ */
+static void
+bench_image_run (const bench_image *image)
+{
+    image_decoder   *decoder = image->new();
+    SANE_Parameters params;
+    uint8_t         *pixels, *work;
+    size_t          size;
+    int64_t         best, t, base;
+    long            allocs;
+    int             round, i;
+    devopt          opt;
+    filter          *chain;
+
+    /* Obtain image parameters and allocate buffers */
+    bench_decode(decoder, image, NULL, &params);
+    size = (size_t) params.bytes_per_line * params.lines;
+    pixels = mem_new(uint8_t, size);
+    work = mem_new(uint8_t, size);
+
+    /* Decoding */
+    bench_alloc_start(&allocs, &base);
+    best = INT64_MAX;
+    for (round = 0; round < bench_rounds; round ++) {
+        t = bench_decode(decoder, image, pixels, &params);
+        best = t < best ? t : best;
+    }
+    bench_result_add(image->name, "decode", best, &params,
+        (bench_alloc_count - allocs) / bench_rounds, bench_alloc_peak - base);
+
+    /* 24->8 resampling */
+    if (params.format == SANE_FRAME_RGB) {
+        bench_alloc_start(&allocs, &base);
+        best = INT64_MAX;
+        for (round = 0; round < bench_rounds; round ++) {
+            memcpy(work, pixels, size);
+            t = bench_now_ns();
+            for (i = 0; i < params.lines; i ++) {
+                filter_rgb24_to_gray8(work + (size_t) i * params.bytes_per_line,
+                    params.pixels_per_line);
+            }
+            t = bench_now_ns() - t;
+            best = t < best ? t : best;
+        }
+        bench_result_add(image->name, "resample", best, &params,
+            (bench_alloc_count - allocs) / bench_rounds,
+            bench_alloc_peak - base);
+    }
+
+    /* Filter chain with all the image enhancement options in use */
+    memset(&opt, 0, sizeof(opt));
+    opt.brightness = SANE_FIX(10.0);
+    opt.contrast = SANE_FIX(20.0);
+    opt.shadow = SANE_FIX(0.0);
+    opt.highlight = SANE_FIX(100.0);
+    opt.gamma = SANE_FIX(1.2);
+
+    bench_alloc_start(&allocs, &base);
+    best = INT64_MAX;
+    for (round = 0; round < bench_rounds; round ++) {
+        memcpy(work, pixels, size);
+        t = bench_now_ns();
+        chain = filter_chain_push_xlat(NULL, &opt);
+        for (i = 0; i < params.lines; i ++) {
+            filter_chain_apply(chain, work + (size_t) i * params.bytes_per_line,
+                params.bytes_per_line);
+        }
+        filter_chain_free(chain);
+        t = bench_now_ns() - t;
+        best = t < best ? t : best;
+    }
+    bench_result_add(image->name, "filter", best, &params,
+        (bench_alloc_count - allocs) / bench_rounds, bench_alloc_peak - base);
+
+    mem_free(pixels);
+    mem_free(work);
+    image_decoder_free(decoder);
+}
+
+/******************** Reporting *********************/
+/* Print the results table
+ */
+static void
+bench_print (void)
+{
+    int i;
+
+    printf("%-36s %10s %10s %8s %10s\n",
+        "name", "MPix/s", "ns/line", "allocs", "peak KiB");
+
+    for (i = 0; i < bench_results_cnt; i ++) {
+        bench_result *r = &bench_results[i];
+
+        printf("%-36s %10.1f %10.0f", r->name, r->mpix_per_s, r->ns_per_line);
+        if (r->allocs >= 0) {
+            printf(" %8ld %10ld\n", r->allocs, r->peak_kb);
+        } else {
+            printf(" %8s %10s\n", "n/a", "n/a");
+        }
+    }
+}
+
+/* Save results as JSON. One result per line, so the file is
+ * both easy to diff and easy to parse back
+ */
+static void
+bench_save (const char *file)
+{
+    FILE *fp = fopen(file, "w");
+    int  i;
+
+    if (fp == NULL) {
+        die("%s: %s", file, strerror(errno));
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"rounds\": %d,\n", bench_rounds);
+    fprintf(fp, "  \"results\": [\n");
+
+    for (i = 0; i < bench_results_cnt; i ++) {
+        bench_result *r = &bench_results[i];
+
+        fprintf(fp, "    {\"name\": \"%s\", \"mpix_per_s\": %.2f, "
+            "\"ns_per_line\": %.0f, \"allocs\": %ld, \"peak_kb\": %ld}%s\n",
+            r->name, r->mpix_per_s, r->ns_per_line, r->allocs, r->peak_kb,
+            i + 1 < bench_results_cnt ? "," : "");
+    }
+
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+
+    if (fclose(fp) != 0) {
+        die("%s: %s", file, strerror(errno));
+    }
+}
+
+/* Compare results against the baseline, saved by bench_save().
+ * Returns count of regressions
+ */
+static int
+bench_compare (const char *file)
+{
+    FILE         *fp = fopen(file, "r");
+    char         line[1024];
+    int          i, regressions = 0, matched = 0;
+    bench_result b;
+
+    if (fp == NULL) {
+        die("%s: %s", file, strerror(errno));
+    }
+
+    printf("\nComparing against %s, threshold %.1f%%:\n", file,
+        bench_threshold);
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        bench_result *r = NULL;
+        const char   *what = NULL;
+        int          n;
+
+        n = sscanf(line, " {\"name\": \"%127[^\"]\", \"mpix_per_s\": %lf, "
+            "\"ns_per_line\": %lf, \"allocs\": %ld, \"peak_kb\": %ld}",
+            b.name, &b.mpix_per_s, &b.ns_per_line, &b.allocs, &b.peak_kb);
+        if (n != 5) {
+            continue;
+        }
+
+        for (i = 0; i < bench_results_cnt && r == NULL; i ++) {
+            if (!strcmp(bench_results[i].name, b.name)) {
+                r = &bench_results[i];
+            }
+        }
+
+        if (r == NULL) {
+            continue;
+        }
+
+        matched ++;
+
+        if (r->mpix_per_s < b.mpix_per_s * (1 - bench_threshold / 100)) {
+            what = "throughput";
+        } else if (r->peak_kb >= 0 && b.peak_kb >= 0 &&
+                   r->peak_kb > b.peak_kb * (1 + bench_threshold / 100) &&
+                   r->peak_kb > b.peak_kb + BENCH_PEAK_SLACK_KB) {
+            what = "peak memory";
+        } else if (r->allocs >= 0 && b.allocs >= 0 &&
+                   r->allocs > b.allocs * (1 + bench_threshold / 100) &&
+                   r->allocs > b.allocs + 1) {
+            what = "allocations";
+        }
+
+        if (what != NULL) {
+            printf("  REGRESSION %-36s %s: %.1f->%.1f MPix/s, "
+                "%ld->%ld allocs, %ld->%ld KiB\n",
+                r->name, what, b.mpix_per_s, r->mpix_per_s,
+                b.allocs, r->allocs, b.peak_kb, r->peak_kb);
+            regressions ++;
+        } else {
+            printf("  ok         %-36s %+.1f%%\n", r->name,
+                (r->mpix_per_s / b.mpix_per_s - 1) * 100);
+        }
+    }
+
+    fclose(fp);
+
+    if (matched == 0) {
+        die("%s: no matching results found", file);
+    }
+
+    printf("%d of %d results regressed\n", regressions, matched);
+
+    return regressions;
+}
+
+/* Print usage and exit
+ */
+static void
+usage (char **argv)
+{
+    printf("Usage:\n");
+    printf("    %s [options] [file...]\n", argv[0]);
+    printf("\n");
+    printf("Benchmarks synthetic A4 pages and, optionally, the image files\n");
+    printf("(.jpeg, .jpg, .png, .bmp)\n");
+    printf("\n");
+    printf("Options are:\n");
+    printf("    -r dpi[,dpi...]  resolutions of synthetic pages"
+                                 " (default 150,300)\n");
+    printf("    -r 0             don't use synthetic pages\n");
+    printf("    -n rounds        count of rounds, best is taken (default 5)\n");
+    printf("    -o file          save results as JSON\n");
+    printf("    -b file          compare against the baseline JSON\n");
+    printf("    -t percent       regression threshold (default 10)\n");
+    printf("    -h               print help page\n");
+
+    exit(0);
+}
+
+/* Print usage error end exit
+ */
+static void
+usage_error (char **argv, char *arg)
+{
+    printf("Invalid argument %s\n", arg);
+    printf("Try %s -h for more information\n", argv[0]);
+
+    exit(1);
+}
+
+/* Parse the list of resolutions
+ */
+static void
+parse_res (char **argv, char *val)
+{
+    char *s = val;
+
+    bench_res_cnt = 0;
+    if (!strcmp(val, "0")) {
+        return;
+    }
+
+    for (;;) {
+        char *end;
+        long res = strtol(s, &end, 10);
+
+        if (end == s || res < 25 || res > 1200 ||
+            bench_res_cnt == BENCH_RES_MAX) {
+            usage_error(argv, val);
+        }
+
+        bench_res[bench_res_cnt ++] = (int) res;
+
+        if (*end == '\0') {
+            return;
+        } else if (*end != ',') {
+            usage_error(argv, val);
+        }
+
+        s = end + 1;
+    }
+}
+
+/* The main function
+ */
+int
+main (int argc, char **argv)
+{
+    static const char *formats[] = {"jpeg", "png", "bmp"};
+    int               i, j, k, regressions = 0;
+
+    /* Parse command-line options */
+    for (i = 1; i < argc && argv[i][0] == '-'; i ++) {
+        char *arg = argv[i];
+        char *val = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (!strcmp(arg, "-h")) {
+            usage(argv);
+        } else if (val == NULL) {
+            usage_error(argv, arg);
+        } else if (!strcmp(arg, "-r")) {
+            parse_res(argv, val);
+        } else if (!strcmp(arg, "-n")) {
+            bench_rounds = atoi(val);
+            if (bench_rounds <= 0) {
+                usage_error(argv, val);
+            }
+        } else if (!strcmp(arg, "-o")) {
+            bench_output = val;
+        } else if (!strcmp(arg, "-b")) {
+            bench_baseline = val;
+        } else if (!strcmp(arg, "-t")) {
+            bench_threshold = atof(val);
+            if (bench_threshold <= 0) {
+                usage_error(argv, val);
+            }
+        } else {
+            usage_error(argv, arg);
+        }
+
+        i ++;
+    }
+
+    if (bench_res_cnt == 0 && i == argc) {
+        usage_error(argv, "(nothing to benchmark)");
+    }
+
+    /* Run the benchmark */
+    for (j = 0; j < bench_res_cnt; j ++) {
+        for (k = 0; k < (int) (sizeof(formats) / sizeof(formats[0])); k ++) {
+            bench_image *image;
+
+            image = bench_image_synthetic(formats[k], bench_res[j], true);
+            bench_image_run(image);
+            bench_image_free(image);
+
+            image = bench_image_synthetic(formats[k], bench_res[j], false);
+            bench_image_run(image);
+            bench_image_free(image);
+        }
+    }
+
+    for (; i < argc; i ++) {
+        bench_image *image = bench_image_load(argv[i]);
+        bench_image_run(image);
+        bench_image_free(image);
+    }
+
+    /* Report results */
+    bench_print();
+
+    if (bench_output != NULL) {
+        bench_save(bench_output);
+    }
+
+    if (bench_baseline != NULL) {
+        regressions = bench_compare(bench_baseline);
+    }
+
+    return regressions ? 1 : 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
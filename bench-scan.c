@@ -0,0 +1,539 @@
+/* sane-airscan end-to-end scan benchmark
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Scans N pages from the manually configured device (typically,
+ * the device simulator, see simulator.c) through the SANE API
+ * and reports throughput and resource usage
+ */
+
+#include <sane/sane.h>
+#include <sane/saneopts.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+
+#include "airscan.h"
+
+/* Allocations accounting. With glibc, malloc and friends are
+ * interposed here, so allocations made by the backend are counted.
+ * Elsewhere, allocation statistics is not available
+ */
+#ifdef __GLIBC__
+#define BENCH_ALLOC_STATS       1
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static long bench_alloc_count;
+
+/* Account allocated memory block. Backend allocates from
+ * multiple threads, so counter is updated atomically
+ */
+static void*
+bench_alloc_account (void *p)
+{
+    if (p != NULL) {
+        __atomic_add_fetch(&bench_alloc_count, 1, __ATOMIC_RELAXED);
+    }
+    return p;
+}
+
+/* Interposed malloc
+ */
+void*
+malloc (size_t size)
+{
+    return bench_alloc_account(__libc_malloc(size));
+}
+
+/* Interposed calloc
+ */
+void*
+calloc (size_t nmemb, size_t size)
+{
+    return bench_alloc_account(__libc_calloc(nmemb, size));
+}
+
+/* Interposed realloc
+ */
+void*
+realloc (void *ptr, size_t size)
+{
+    return bench_alloc_account(__libc_realloc(ptr, size));
+}
+
+/* Get count of allocations made so far
+ */
+static long
+bench_alloc_get (void)
+{
+    return __atomic_load_n(&bench_alloc_count, __ATOMIC_RELAXED);
+}
+#else
+#define BENCH_ALLOC_STATS       0
+
+/* Get count of allocations made so far
+ */
+static long
+bench_alloc_get (void)
+{
+    return 0;
+}
+#endif
+
+/* Benchmark options
+ */
+static const char *bench_url;
+static const char *bench_proto = "escl";
+static const char *bench_source = OPTVAL_SOURCE_PLATEN;
+static const char *bench_mode = SANE_VALUE_SCAN_MODE_COLOR;
+static const char *bench_socket_dir;
+static const char *bench_trace;
+static const char *bench_metrics;
+static const char *bench_regions;
+static int        bench_clock_warp;
+static int        bench_status_cache;
+static int        bench_adf_batch;
+static int        bench_pages = 10;
+static int        bench_res = 300;
+static bool       bench_debug;
+static bool       bench_warm;
+static bool       bench_blank_skip;
+
+/* Device name, used in the generated configuration
+ */
+#define BENCH_DEVICE_NAME       "bench-scan"
+
+/* Print error message and exit
+ */
+static void __attribute__((noreturn))
+die (const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    vprintf(format, ap);
+    printf("\n");
+    va_end(ap);
+
+    exit(1);
+}
+
+/* Check SANE status. Exit on error
+ */
+static void
+check (SANE_Status status, const char *operation)
+{
+    if (status != SANE_STATUS_GOOD) {
+        die("%s: %s", operation, sane_strstatus(status));
+    }
+}
+
+/* Temporary configuration directory and file
+ */
+static char bench_conf_dir[] = "/tmp/bench-scan-XXXXXX";
+static char bench_conf_path[sizeof(bench_conf_dir) + 32];
+
+/* Write temporary configuration and point backend to it
+ *
+ * Note, backend exports only SANE API, so airscan.h utilities,
+ * like str_concat(), are not available here
+ */
+static void
+bench_conf_write (void)
+{
+    FILE *fp;
+
+    if (mkdtemp(bench_conf_dir) == NULL) {
+        die("mkdtemp: %s", strerror(errno));
+    }
+
+    snprintf(bench_conf_path, sizeof(bench_conf_path), "%s/airscan.conf",
+        bench_conf_dir);
+
+    fp = fopen(bench_conf_path, "w");
+    if (fp == NULL) {
+        die("%s: %s", bench_conf_path, strerror(errno));
+    }
+
+    fprintf(fp, "[devices]\n");
+    fprintf(fp, "\"%s\" = %s, %s\n", BENCH_DEVICE_NAME, bench_url, bench_proto);
+    fprintf(fp, "\n");
+    fprintf(fp, "[options]\n");
+    fprintf(fp, "discovery = disable\n");
+    fprintf(fp, "ws-discovery = off\n");
+    if (bench_warm) {
+        fprintf(fp, "warm-devices = enable\n");
+    }
+    if (bench_status_cache > 0) {
+        fprintf(fp, "status-cache = %d\n", bench_status_cache);
+    }
+    if (bench_adf_batch > 0) {
+        fprintf(fp, "adf-batch = %d\n", bench_adf_batch);
+    }
+    if (bench_blank_skip) {
+        fprintf(fp, "blank-page = skip\n");
+    }
+    if (bench_socket_dir != NULL) {
+        fprintf(fp, "socket_dir = %s\n", bench_socket_dir);
+    }
+    if (bench_metrics != NULL) {
+        fprintf(fp, "\n");
+        fprintf(fp, "[metrics]\n");
+        fprintf(fp, "directory = %s\n", bench_metrics);
+        fprintf(fp, "interval = 1\n");
+        fprintf(fp, "sane-option = enable\n");
+    }
+    if (bench_debug || bench_trace != NULL || bench_clock_warp > 0) {
+        fprintf(fp, "\n");
+        fprintf(fp, "[debug]\n");
+        fprintf(fp, "enable = %s\n", bench_debug ? "true" : "false");
+        if (bench_trace != NULL) {
+            fprintf(fp, "trace = %s\n", bench_trace);
+        }
+        if (bench_clock_warp > 0) {
+            fprintf(fp, "clock-warp = %d\n", bench_clock_warp);
+        }
+    }
+
+    fclose(fp);
+
+    setenv(CONFIG_PATH_ENV, bench_conf_dir, 1);
+}
+
+/* Remove temporary configuration
+ */
+static void
+bench_conf_remove (void)
+{
+    unlink(bench_conf_path);
+    rmdir(bench_conf_dir);
+}
+
+/* Open the benchmark device
+ */
+static SANE_Handle
+bench_open (void)
+{
+    const SANE_Device **devices;
+    SANE_Handle       handle;
+    struct timespec   t0, t1;
+    int               i;
+
+    check(sane_get_devices(&devices, SANE_FALSE), "sane_get_devices");
+
+    /* Give background probing the time to complete */
+    if (bench_warm) {
+        sleep(2);
+    }
+
+    for (i = 0; devices[i] != NULL; i ++) {
+        if (!strcmp(devices[i]->model, BENCH_DEVICE_NAME)) {
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            check(sane_open(devices[i]->name, &handle), "sane_open");
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+
+            printf("open time:  %.1f ms\n",
+                (double) (t1.tv_sec - t0.tv_sec) * 1e3 +
+                (double) (t1.tv_nsec - t0.tv_nsec) / 1e6);
+
+            return handle;
+        }
+    }
+
+    die("%s: device not found", bench_url);
+}
+
+/* Set option by name
+ */
+static void
+bench_set (SANE_Handle handle, const char *name, void *value)
+{
+    SANE_Int                     i, count;
+    const SANE_Option_Descriptor *desc;
+
+    check(sane_control_option(handle, 0, SANE_ACTION_GET_VALUE,
+        &count, NULL), "sane_control_option");
+
+    for (i = 1; i < count; i ++) {
+        desc = sane_get_option_descriptor(handle, i);
+        if (desc != NULL && desc->name != NULL && !strcmp(desc->name, name)) {
+            check(sane_control_option(handle, i, SANE_ACTION_SET_VALUE,
+                value, NULL), name);
+            return;
+        }
+    }
+
+    die("%s: option not found", name);
+}
+
+/* Scan one page. Returns SANE_STATUS_GOOD if page was scanned,
+ * SANE_STATUS_NO_DOCS if there are no more pages in the job
+ */
+static SANE_Status
+bench_page (SANE_Handle handle, uint64_t *bytes)
+{
+    SANE_Status status;
+    SANE_Byte   buf[65536];
+    SANE_Int    len;
+    uint64_t    count = 0;
+
+    status = sane_start(handle);
+    if (status != SANE_STATUS_GOOD) {
+        return status;
+    }
+
+    for (;;) {
+        status = sane_read(handle, buf, sizeof(buf), &len);
+        if (status != SANE_STATUS_GOOD) {
+            break;
+        }
+
+        count += (uint64_t) len;
+    }
+
+    if (status != SANE_STATUS_EOF) {
+        check(status, "sane_read");
+    }
+
+    /* Backend may report the end of ADF job as an empty page */
+    if (count == 0) {
+        return SANE_STATUS_NO_DOCS;
+    }
+
+    *bytes += count;
+    return SANE_STATUS_GOOD;
+}
+
+/* Get CPU time used by the process, in seconds
+ */
+static double
+bench_cpu_time (struct rusage *ru)
+{
+    return (double) (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) +
+           (double) (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1e6;
+}
+
+/* Print usage and exit
+ */
+static void
+usage (char **argv)
+{
+    printf("Usage:\n");
+    printf("    %s [options] URL\n", argv[0]);
+    printf("\n");
+    printf("Options are:\n");
+    printf("    -p escl|wsd      protocol (default escl)\n");
+    printf("    -n pages         count of pages to scan (default 10)\n");
+    printf("    -s platen|adf    scan source (default platen)\n");
+    printf("    -r dpi           resolution (default 300)\n");
+    printf("    -m color|gray    scan mode (default color)\n");
+    printf("    -S dir           socket_dir for unix:// URLs\n");
+    printf("    -T dir           write protocol trace into dir\n");
+    printf("    -w ms            warp backend clock after ms of idle\n");
+    printf("    -M dir           write backend metrics into dir\n");
+    printf("    -W               enable background device probing\n");
+    printf("    -c ms            reuse device status for ms\n");
+    printf("    -B sec           ADF batch mode, wait sec for reload\n");
+    printf("    -K               skip blank ADF pages\n");
+    printf("    -R regions       cut regions from platen scan\n");
+    printf("    -d               enable backend debug\n");
+    printf("    -h               print help page\n");
+
+    exit(0);
+}
+
+/* Print usage error end exit
+ */
+static void
+usage_error (char **argv, char *arg)
+{
+    printf("Invalid argument %s\n", arg);
+    printf("Try %s -h for more information\n", argv[0]);
+
+    exit(1);
+}
+
+/* The main function
+ */
+int
+main (int argc, char **argv)
+{
+    int             i, pages = 0, adf_pages = 0;
+    SANE_Handle     handle;
+    SANE_Int        res;
+    SANE_Status     status;
+    uint64_t        bytes = 0;
+    struct timespec t0, t1;
+    struct rusage   ru0, ru1;
+    double          wall, cpu;
+    long            allocs;
+
+    /* Parse command-line options */
+    for (i = 1; i < argc; i ++) {
+        char *arg = argv[i];
+        char *val = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (!strcmp(arg, "-h")) {
+            usage(argv);
+        } else if (!strcmp(arg, "-d")) {
+            bench_debug = true;
+            continue;
+        } else if (!strcmp(arg, "-W")) {
+            bench_warm = true;
+            continue;
+        } else if (!strcmp(arg, "-K")) {
+            bench_blank_skip = true;
+            continue;
+        } else if (arg[0] != '-') {
+            if (bench_url != NULL) {
+                usage_error(argv, arg);
+            }
+            bench_url = arg;
+            continue;
+        } else if (val == NULL) {
+            usage_error(argv, arg);
+        } else if (!strcmp(arg, "-p")) {
+            if (strcmp(val, "escl") && strcmp(val, "wsd")) {
+                usage_error(argv, val);
+            }
+            bench_proto = val;
+        } else if (!strcmp(arg, "-n")) {
+            bench_pages = atoi(val);
+            if (bench_pages <= 0) {
+                usage_error(argv, val);
+            }
+        } else if (!strcmp(arg, "-s")) {
+            if (!strcmp(val, "platen")) {
+                bench_source = OPTVAL_SOURCE_PLATEN;
+            } else if (!strcmp(val, "adf")) {
+                bench_source = OPTVAL_SOURCE_ADF_SIMPLEX;
+            } else {
+                usage_error(argv, val);
+            }
+        } else if (!strcmp(arg, "-r")) {
+            bench_res = atoi(val);
+            if (bench_res <= 0) {
+                usage_error(argv, val);
+            }
+        } else if (!strcmp(arg, "-m")) {
+            if (!strcmp(val, "color")) {
+                bench_mode = SANE_VALUE_SCAN_MODE_COLOR;
+            } else if (!strcmp(val, "gray")) {
+                bench_mode = SANE_VALUE_SCAN_MODE_GRAY;
+            } else {
+                usage_error(argv, val);
+            }
+        } else if (!strcmp(arg, "-S")) {
+            bench_socket_dir = val;
+        } else if (!strcmp(arg, "-T")) {
+            bench_trace = val;
+        } else if (!strcmp(arg, "-M")) {
+            bench_metrics = val;
+        } else if (!strcmp(arg, "-R")) {
+            bench_regions = val;
+        } else if (!strcmp(arg, "-c")) {
+            bench_status_cache = atoi(val);
+            if (bench_status_cache <= 0) {
+                usage_error(argv, val);
+            }
+        } else if (!strcmp(arg, "-B")) {
+            bench_adf_batch = atoi(val);
+            if (bench_adf_batch <= 0) {
+                usage_error(argv, val);
+            }
+        } else if (!strcmp(arg, "-w")) {
+            bench_clock_warp = atoi(val);
+            if (bench_clock_warp <= 0) {
+                usage_error(argv, val);
+            }
+        } else {
+            usage_error(argv, arg);
+        }
+
+        i ++;
+    }
+
+    if (bench_url == NULL) {
+        usage_error(argv, "(missed URL)");
+    }
+
+    /* Initialize backend and open the device */
+    bench_conf_write();
+    check(sane_init(NULL, NULL), "sane_init");
+    handle = bench_open();
+
+    bench_set(handle, SANE_NAME_SCAN_SOURCE, (void*) bench_source);
+    bench_set(handle, SANE_NAME_SCAN_MODE, (void*) bench_mode);
+    res = bench_res;
+    bench_set(handle, SANE_NAME_SCAN_RESOLUTION, &res);
+    if (bench_regions != NULL) {
+        bench_set(handle, SANE_NAME_SCAN_REGIONS, (void*) bench_regions);
+    }
+
+    /* Run the benchmark */
+    getrusage(RUSAGE_SELF, &ru0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    allocs = bench_alloc_get();
+
+    while (pages < bench_pages) {
+        status = bench_page(handle, &bytes);
+        if (status == SANE_STATUS_GOOD) {
+            pages ++;
+            adf_pages ++;
+        } else if (status != SANE_STATUS_NO_DOCS || adf_pages == 0) {
+            check(status, "sane_start");
+        }
+
+        /* Platen job always has one page, unless cut into regions,
+         * ADF job ends with NO_DOCS, next sane_start() starts the new job
+         */
+        if (status != SANE_STATUS_GOOD ||
+            (!strcmp(bench_source, OPTVAL_SOURCE_PLATEN) &&
+             bench_regions == NULL)) {
+            sane_cancel(handle);
+            adf_pages = 0;
+        }
+    }
+
+    sane_cancel(handle);
+
+    allocs = bench_alloc_get() - allocs;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    getrusage(RUSAGE_SELF, &ru1);
+
+    sane_close(handle);
+    sane_exit();
+    bench_conf_remove();
+
+    /* Report results */
+    wall = (double) (t1.tv_sec - t0.tv_sec) +
+           (double) (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    cpu = bench_cpu_time(&ru1) - bench_cpu_time(&ru0);
+
+    printf("pages:      %d\n", pages);
+    printf("bytes:      %llu\n", (unsigned long long) bytes);
+    printf("wall time:  %.3f s\n", wall);
+    printf("pages/s:    %.2f\n", pages / wall);
+    printf("MB/s:       %.2f\n", (double) bytes / wall / 1e6);
+    printf("CPU time:   %.3f s (%.1f%%)\n", cpu, cpu * 100 / wall);
+    printf("peak RSS:   %ld KiB\n", ru1.ru_maxrss);
+    if (BENCH_ALLOC_STATS) {
+        printf("allocs:     %ld (%ld/page)\n", allocs, allocs / pages);
+    }
+
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
@@ -0,0 +1,232 @@
+/* sane-airscan event loop timers benchmark
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ */
+
+#include "airscan.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_TIMERS            50000   /* Count of timers */
+#define BENCH_ROUNDS            10      /* Rounds of arm/cancel test */
+#define BENCH_ARM_MAX_TIMEOUT   600000  /* Max timeout for arm/cancel test */
+#define BENCH_FIRE_MAX_TIMEOUT  2000    /* Max timeout for expiration test */
+#define BENCH_FIRE_LATE_MAX     50      /* Max allowed lateness, ms */
+
+/* bench_timer represents a single timer in the expiration test
+ */
+typedef struct {
+    eloop_timer *timer;     /* Underlying timer */
+    timestamp   deadline;   /* Expected expiration time */
+    timestamp   fired;      /* Actual expiration time, 0 if not yet */
+    bool        cancelled;  /* Timer was cancelled */
+} bench_timer;
+
+static bench_timer      bench_timers[BENCH_TIMERS];
+static int              bench_pending;
+static pthread_cond_t   bench_cond = PTHREAD_COND_INITIALIZER;
+
+/* Print error message and exit
+ */
+void __attribute__((noreturn))
+die (const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    vprintf(format, ap);
+    printf("\n");
+    va_end(ap);
+
+    exit(1);
+}
+
+/* Get current time, in nanoseconds, for the precise measurements
+ */
+static int64_t
+bench_now_ns (void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* Dummy timer callback for the arm/cancel test
+ */
+static void
+bench_arm_callback (void *data)
+{
+    (void) data;
+    die("arm/cancel test: unexpected timer expiration");
+}
+
+/* Measure the cost of timer arm and cancel
+ */
+static void
+bench_arm_cancel (void)
+{
+    static eloop_timer *timers[BENCH_TIMERS];
+    int64_t            arm_ns = 0, cancel_ns = 0, t;
+    int                round, i;
+
+    for (round = 0; round < BENCH_ROUNDS; round ++) {
+        eloop_mutex_lock();
+
+        t = bench_now_ns();
+        for (i = 0; i < BENCH_TIMERS; i ++) {
+            int timeout = 1000 + math_rand_max(BENCH_ARM_MAX_TIMEOUT);
+            timers[i] = eloop_timer_new(timeout, bench_arm_callback, NULL);
+        }
+        arm_ns += bench_now_ns() - t;
+
+        /* Cancel in the random order */
+        for (i = BENCH_TIMERS - 1; i > 0; i --) {
+            int         j = math_rand_max(i);
+            eloop_timer *tmp = timers[i];
+            timers[i] = timers[j];
+            timers[j] = tmp;
+        }
+
+        t = bench_now_ns();
+        for (i = 0; i < BENCH_TIMERS; i ++) {
+            eloop_timer_cancel(timers[i]);
+        }
+        cancel_ns += bench_now_ns() - t;
+
+        eloop_mutex_unlock();
+    }
+
+    printf("arm:    %d timers x %d rounds, %.1f ns/timer\n",
+        BENCH_TIMERS, BENCH_ROUNDS,
+        (double) arm_ns / (BENCH_TIMERS * BENCH_ROUNDS));
+    printf("cancel: %d timers x %d rounds, %.1f ns/timer\n",
+        BENCH_TIMERS, BENCH_ROUNDS,
+        (double) cancel_ns / (BENCH_TIMERS * BENCH_ROUNDS));
+}
+
+/* Timer callback for the expiration test
+ */
+static void
+bench_fire_callback (void *data)
+{
+    bench_timer *bt = data;
+
+    if (bt->cancelled) {
+        die("fire test: cancelled timer expired");
+    }
+
+    if (bt->fired != 0) {
+        die("fire test: timer expired twice");
+    }
+
+    bt->fired = timestamp_now();
+    bt->timer = NULL;
+
+    bench_pending --;
+    if (bench_pending == 0) {
+        pthread_cond_signal(&bench_cond);
+    }
+}
+
+/* Check that timers expire in time, and cancelled timers
+ * don't expire at all
+ */
+static void
+bench_fire (void)
+{
+    int       i, fired = 0;
+    int64_t   late_sum = 0;
+    timestamp late_max = 0;
+    int64_t   t;
+
+    eloop_mutex_lock();
+
+    for (i = 0; i < BENCH_TIMERS; i ++) {
+        bench_timer *bt = &bench_timers[i];
+        int         timeout = math_rand_max(BENCH_FIRE_MAX_TIMEOUT);
+
+        bt->deadline = timestamp_now() + timeout;
+        bt->timer = eloop_timer_new(timeout, bench_fire_callback, bt);
+    }
+
+    bench_pending = BENCH_TIMERS;
+
+    /* Cancel every third timer */
+    for (i = 0; i < BENCH_TIMERS; i += 3) {
+        bench_timer *bt = &bench_timers[i];
+
+        if (bt->timer != NULL) {
+            eloop_timer_cancel(bt->timer);
+            bt->timer = NULL;
+            bt->cancelled = true;
+            bench_pending --;
+        }
+    }
+
+    t = bench_now_ns();
+    while (bench_pending != 0) {
+        eloop_cond_wait(&bench_cond);
+    }
+    t = bench_now_ns() - t;
+
+    eloop_mutex_unlock();
+
+    for (i = 0; i < BENCH_TIMERS; i ++) {
+        bench_timer *bt = &bench_timers[i];
+        timestamp   late;
+
+        if (bt->cancelled) {
+            continue;
+        }
+
+        if (bt->fired < bt->deadline) {
+            die("fire test: timer expired %d ms early",
+                (int) (bt->deadline - bt->fired));
+        }
+
+        late = bt->fired - bt->deadline;
+        late_sum += late;
+        if (late > late_max) {
+            late_max = late;
+        }
+
+        fired ++;
+    }
+
+    printf("fire:   %d timers expired in %.1f ms, lateness avg %.2f ms,"
+        " max %d ms\n",
+        fired, (double) t / 1000000, (double) late_sum / fired, (int) late_max);
+
+    if (late_max > BENCH_FIRE_LATE_MAX) {
+        die("fire test: timer expired %d ms late", (int) late_max);
+    }
+}
+
+/* The main function
+ */
+int
+main (void)
+{
+    conf.discovery = false;
+
+    airscan_init(AIRSCAN_INIT_NO_CONF | AIRSCAN_INIT_NO_THREAD,
+        "bench-timer");
+    eloop_thread_start();
+
+    bench_arm_cancel();
+    bench_fire();
+
+    eloop_thread_stop();
+    airscan_cleanup(NULL);
+
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
@@ -11,6 +11,49 @@
 #include <stdarg.h>
 #include <string.h>
 
+/* HTTP timeout of endpoint probe, in milliseconds
+ */
+#define DISCOVER_PROBE_TIMEOUT          5000
+
+/* Default count of endpoints, probed in parallel
+ */
+#define DISCOVER_PROBE_PARALLEL         8
+
+/* discover_probe represents a probe of a single endpoint
+ */
+typedef struct {
+    const zeroconf_devinfo  *devinfo;   /* Device the endpoint belongs to */
+    const zeroconf_endpoint *endpoint;  /* Endpoint being probed */
+    bool                    preferred;  /* Endpoint is tried first */
+    proto_ctx               ctx;        /* Protocol context */
+    devcaps                 caps;       /* Capabilities being decoded */
+    int                     connect;    /* Connect time, ms, -1 if none */
+    int                     ttfb;       /* Time to first byte, ms, -1 if
+                                           none */
+    int                     total;      /* Total time, ms */
+    char                    *err;       /* Error message, NULL if OK */
+} discover_probe;
+
+/* Static variables
+ *
+ * Probing runs on the event loop thread, and its state is
+ * protected by the event loop mutex
+ */
+static log_ctx          *discover_log;
+static http_client      *discover_http;
+static discover_probe   *discover_probes;
+static int              discover_probes_num;
+static int              discover_probes_next;
+static int              discover_probes_running;
+static int              discover_probes_done;
+static int              discover_parallel = DISCOVER_PROBE_PARALLEL;
+static pthread_cond_t   discover_cond = PTHREAD_COND_INITIALIZER;
+
+/* Forward declarations
+ */
+static void
+discover_probe_start (void *unused);
+
 /* Print usage and exit
  */
 static void
@@ -22,6 +65,10 @@ usage (char **argv)
     printf("Options are:\n");
     printf("    -d   enable debug mode\n");
     printf("    -t   enable protocol trace\n");
+    printf("    -p   probe all endpoints and measure latency\n");
+    printf("    -j   print probe results as JSON (implies -p)\n");
+    printf("    -n N probe up to N endpoints in parallel (default %d)\n",
+        DISCOVER_PROBE_PARALLEL);
     printf("    -h   print help page\n");
 
     exit(0);
@@ -53,6 +100,293 @@ die (const char *format, ...)
     exit(1);
 }
 
+/* Endpoint probe HTTP callback
+ */
+static void
+discover_probe_callback (void *ptr, http_query *q)
+{
+    discover_probe *probe = &discover_probes[http_query_get_uintptr(q)];
+    timestamp      start = http_query_timestamp(q);
+    error          err;
+
+    (void) ptr;
+
+    if (http_query_time_connected(q) != 0) {
+        probe->connect = (int) (http_query_time_connected(q) - start);
+    }
+
+    if (http_query_time_rxfirst(q) != 0) {
+        probe->ttfb = (int) (http_query_time_rxfirst(q) - start);
+    }
+
+    probe->total = (int) (timestamp_now() - start);
+
+    probe->ctx.query = q;
+    err = http_query_error(q);
+    if (err == NULL) {
+        err = probe->ctx.proto->devcaps_decode(&probe->ctx, &probe->caps);
+    }
+    probe->ctx.query = NULL;
+
+    if (err != NULL) {
+        probe->err = str_dup(ESTRING(err));
+    }
+
+    log_debug(discover_log, "%s: %s: %s", probe->devinfo->ident,
+        http_uri_str(probe->endpoint->uri), err ? ESTRING(err) : "OK");
+
+    probe->ctx.proto->free(probe->ctx.proto);
+    probe->ctx.proto = NULL;
+    devcaps_cleanup(&probe->caps);
+
+    discover_probes_running --;
+    discover_probes_done ++;
+
+    if (discover_probes_done == discover_probes_num) {
+        pthread_cond_signal(&discover_cond);
+    } else {
+        discover_probe_start(NULL);
+    }
+}
+
+/* Start probes, until parallelism limit is reached
+ *
+ * Runs on a context of the event loop thread
+ */
+static void
+discover_probe_start (void *unused)
+{
+    (void) unused;
+
+    while (discover_probes_running < discover_parallel &&
+           discover_probes_next < discover_probes_num) {
+        int            i = discover_probes_next ++;
+        discover_probe *probe = &discover_probes[i];
+        http_query     *q;
+
+        probe->ctx.log = discover_log;
+        probe->ctx.http = discover_http;
+        probe->ctx.devcaps = &probe->caps;
+        probe->ctx.proto = proto_handler_new(probe->endpoint->proto);
+        probe->ctx.base_uri = http_uri_clone(probe->endpoint->uri);
+        probe->ctx.base_uri_nozone = http_uri_clone(probe->endpoint->uri);
+        http_uri_strip_zone_suffux(probe->ctx.base_uri_nozone);
+        devcaps_init(&probe->caps);
+
+        q = probe->ctx.proto->devcaps_query(&probe->ctx);
+        http_query_set_uintptr(q, (uintptr_t) i);
+        http_query_timeout(q, DISCOVER_PROBE_TIMEOUT);
+        http_query_submit(q, discover_probe_callback);
+
+        discover_probes_running ++;
+    }
+}
+
+/* Print JSON string, properly escaped
+ */
+static void
+discover_json_str (const char *s)
+{
+    putchar('"');
+
+    for (; *s != '\0'; s ++) {
+        unsigned char c = (unsigned char) *s;
+
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20) {
+            printf("\\u%4.4x", c);
+        } else {
+            putchar(c);
+        }
+    }
+
+    putchar('"');
+}
+
+/* Print probe results in human-readable form
+ *
+ * The endpoint, marked by '*', is the one tried first
+ * when device is opened
+ */
+static void
+discover_print_text (void)
+{
+    int i;
+
+    for (i = 0; i < discover_probes_num; i ++) {
+        discover_probe *probe = &discover_probes[i];
+
+        if (i == 0 || probe->devinfo != discover_probes[i - 1].devinfo) {
+            printf("%s%s (%s)\n", i ? "\n" : "",
+                probe->devinfo->name, probe->devinfo->ident);
+        }
+
+        printf("  %c %s, %s: ", probe->preferred ? '*' : ' ',
+            http_uri_str(probe->endpoint->uri),
+            id_proto_name(probe->endpoint->proto));
+
+        if (probe->connect >= 0) {
+            printf("connect %d ms, ", probe->connect);
+        }
+
+        if (probe->ttfb >= 0) {
+            printf("ttfb %d ms, ", probe->ttfb);
+        }
+
+        printf("total %d ms", probe->total);
+
+        if (probe->err != NULL) {
+            printf(", error: %s", probe->err);
+        }
+
+        printf("\n");
+    }
+}
+
+/* Print probe results as JSON
+ */
+static void
+discover_print_json (void)
+{
+    int i;
+
+    printf("{\n");
+    printf("  \"devices\": [");
+
+    for (i = 0; i < discover_probes_num; i ++) {
+        discover_probe *probe = &discover_probes[i];
+        bool           last;
+
+        if (i == 0 || probe->devinfo != discover_probes[i - 1].devinfo) {
+            printf("%s\n    {\"name\": ", i ? "," : "");
+            discover_json_str(probe->devinfo->name);
+            printf(", \"ident\": ");
+            discover_json_str(probe->devinfo->ident);
+            printf(", \"endpoints\": [\n");
+        }
+
+        printf("      {\"uri\": ");
+        discover_json_str(http_uri_str(probe->endpoint->uri));
+        printf(", \"proto\": ");
+        discover_json_str(id_proto_name(probe->endpoint->proto));
+        printf(", \"preferred\": %s", probe->preferred ? "true" : "false");
+
+        if (probe->connect >= 0) {
+            printf(", \"connect_ms\": %d", probe->connect);
+        }
+
+        if (probe->ttfb >= 0) {
+            printf(", \"ttfb_ms\": %d", probe->ttfb);
+        }
+
+        printf(", \"total_ms\": %d, \"error\": ", probe->total);
+        if (probe->err != NULL) {
+            discover_json_str(probe->err);
+        } else {
+            printf("null");
+        }
+
+        last = i + 1 == discover_probes_num ||
+               discover_probes[i + 1].devinfo != probe->devinfo;
+        printf("}%s\n", last ? "" : ",");
+
+        if (last) {
+            printf("    ]}");
+        }
+    }
+
+    printf("\n  ]\n");
+    printf("}\n");
+}
+
+/* Probe all endpoints of all devices and print results
+ */
+static void
+discover_probe_all (const SANE_Device **devices, bool json)
+{
+    zeroconf_devinfo **devinfos;
+    int              i, devices_num;
+
+    for (devices_num = 0; devices[devices_num] != NULL; devices_num ++)
+        ;
+
+    /* Build list of probes, one per endpoint */
+    devinfos = mem_new(zeroconf_devinfo*, devices_num);
+    discover_probes = mem_new(discover_probe, 0);
+
+    for (i = 0; i < devices_num; i ++) {
+        zeroconf_endpoint *endpoint;
+
+        eloop_mutex_lock();
+        devinfos[i] = zeroconf_devinfo_lookup(devices[i]->name);
+        eloop_mutex_unlock();
+
+        if (devinfos[i] == NULL) {
+            continue;
+        }
+
+        /* Endpoints are tried in the sorted order */
+        devinfos[i]->endpoints =
+            zeroconf_endpoint_list_sort(devinfos[i]->endpoints);
+
+        for (endpoint = devinfos[i]->endpoints; endpoint != NULL;
+             endpoint = endpoint->next) {
+            discover_probe *probe;
+
+            discover_probes = mem_resize(discover_probes,
+                discover_probes_num + 1, 0);
+            probe = &discover_probes[discover_probes_num ++];
+
+            memset(probe, 0, sizeof(*probe));
+            probe->devinfo = devinfos[i];
+            probe->endpoint = endpoint;
+            probe->preferred = endpoint == devinfos[i]->endpoints;
+            probe->connect = probe->ttfb = -1;
+        }
+    }
+
+    /* Run probes and wait for completion */
+    discover_log = log_ctx_new("discover", NULL);
+
+    eloop_mutex_lock();
+    discover_http = http_client_new(discover_log, NULL);
+
+    if (discover_probes_num != 0) {
+        eloop_call(discover_probe_start, NULL);
+        while (discover_probes_done != discover_probes_num) {
+            eloop_cond_wait(&discover_cond);
+        }
+    }
+
+    http_client_free(discover_http);
+    eloop_mutex_unlock();
+
+    /* Print results */
+    if (json) {
+        discover_print_json();
+    } else {
+        discover_print_text();
+    }
+
+    /* Cleanup */
+    for (i = 0; i < discover_probes_num; i ++) {
+        http_uri_free(discover_probes[i].ctx.base_uri);
+        http_uri_free(discover_probes[i].ctx.base_uri_nozone);
+        mem_free(discover_probes[i].err);
+    }
+
+    for (i = 0; i < devices_num; i ++) {
+        if (devinfos[i] != NULL) {
+            zeroconf_devinfo_free(devinfos[i]);
+        }
+    }
+
+    mem_free(discover_probes);
+    mem_free(devinfos);
+    log_ctx_free(discover_log);
+}
+
 /* The main function
  */
 int
@@ -60,6 +394,7 @@ main (int argc, char **argv)
 {
     int               i;
     const SANE_Device **devices;
+    bool              probe = false, json = false;
 
     /* Enforce some configuration parameters */
     conf.proto_auto = false;
@@ -71,6 +406,15 @@ main (int argc, char **argv)
             conf.dbg_enabled = true;
         } else if (!strcmp(argv[i], "-t")) {
             conf.dbg_trace = str_dup("./");
+        } else if (!strcmp(argv[i], "-p")) {
+            probe = true;
+        } else if (!strcmp(argv[i], "-j")) {
+            probe = json = true;
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            discover_parallel = atoi(argv[++ i]);
+            if (discover_parallel <= 0) {
+                usage_error(argv, argv[i]);
+            }
         } else if (!strcmp(argv[i], "-h")) {
             usage(argv);
         } else {
@@ -86,6 +430,12 @@ main (int argc, char **argv)
     devices = zeroconf_device_list_get();
     eloop_mutex_unlock();
 
+    /* Probe devices, if requested */
+    if (probe) {
+        discover_probe_all(devices, json);
+        goto DONE;
+    }
+
     /* Print list of devices */
     printf("[devices]\n");
     for (i = 0; devices[i] != NULL; i ++) {
@@ -104,6 +454,7 @@ main (int argc, char **argv)
         }
     }
 
+DONE:
     zeroconf_device_list_free(devices);
 
     eloop_thread_stop();
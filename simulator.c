@@ -0,0 +1,2121 @@
+/* sane-airscan device simulator
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Serves eSCL and WSD scan protocols over the TCP loopback or
+ * UNIX socket, so backend can be tested and benchmarked end to
+ * end without physical hardware. See bench-scan.c for the
+ * benchmark driver
+ *
+ * In the replay mode, answers requests with the responses,
+ * recorded in the protocol trace, and reports where the live
+ * request sequence diverges from the recorded one
+ */
+
+#define NO_HTTP_STATUS
+
+#include "airscan.h"
+#include "http_parser.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/un.h>
+
+#include <jpeglib.h>
+#include <png.h>
+
+/******************** Constants *********************/
+/* Protocol constants
+ */
+#define SIM_WSD_ACTION_BASE     \
+        "http://schemas.microsoft.com/windows/2006/08/wdp/scan/"
+#define SIM_WSD_ACTION_FAULT    \
+        "http://schemas.xmlsoap.org/ws/2004/08/addressing/fault"
+#define SIM_MP_BOUNDARY         "sane-airscan-simulator-boundary"
+
+/* Resolutions, supported by simulated device
+ */
+static const int sim_resolutions[] = {75, 150, 200, 300, 600};
+
+/* eSCL XML namespaces
+ */
+static const xml_ns sim_escl_ns[] = {
+    {"pwg",  "http://www.pwg.org/schemas/2010/12/sm"},
+    {"scan", "http://schemas.hp.com/imaging/escl/2011/05/03"},
+    {NULL, NULL}
+};
+
+/* WSD XML namespaces for reader
+ */
+static const xml_ns sim_wsd_ns_rd[] = {
+    {"s",    "http*://schemas.xmlsoap.org/soap/envelope"},
+    {"s",    "http*://www.w3.org/2003/05/soap-envelope"},
+    {"a",    "http*://schemas.xmlsoap.org/ws/2004/08/addressing"},
+    {"scan", "http*://schemas.microsoft.com/windows/2006/08/wdp/scan"},
+    {NULL, NULL}
+};
+
+/* WSD XML namespaces for writer
+ */
+static const xml_ns sim_wsd_ns_wr[] = {
+    {"soap", "http://www.w3.org/2003/05/soap-envelope"},
+    {"wsa",  "http://schemas.xmlsoap.org/ws/2004/08/addressing"},
+    {"sca",  "http://schemas.microsoft.com/windows/2006/08/wdp/scan"},
+    {NULL, NULL}
+};
+
+/******************** Types *********************/
+/* sim_options represents simulator options
+ */
+typedef struct {
+    int          port;       /* TCP port on loopback */
+    const char   *unix_path; /* UNIX socket path, NULL for TCP */
+    int          wid_mm;     /* Page width, millimeters */
+    int          hei_mm;     /* Page height, millimeters */
+    ID_FORMAT    format;     /* Image format */
+    int          adf_pages;  /* Pages per ADF job */
+    int          delay;      /* Per-page delay, milliseconds */
+    int          bandwidth;  /* Bandwidth limit, KiB/s, 0 if unlimited */
+    int          fail_every; /* Answer each Nth image request with 503 */
+    int          blank_every; /* Make each Nth ADF page blank */
+    const char   *replay;    /* Protocol trace to replay, NULL if none */
+    bool         replay_timing; /* Replay with the recorded timing */
+} sim_options;
+
+/* sim_image represents encoded image, shared between jobs
+ */
+typedef struct {
+    int        refcnt;        /* Reference count */
+    int        wid, hei;      /* Image size, in pixels */
+    bool       color;         /* RGB or grayscale */
+    bool       blank;         /* Blank page */
+    char       *data;         /* Encoded image */
+} sim_image;
+
+/* sim_job represents the scan job
+ */
+typedef struct {
+    unsigned int id;           /* Job ID */
+    int          pages_left;   /* Count of pages left */
+    int          pages_done;   /* Count of pages served */
+    bool         platen;       /* Scan from platen */
+    sim_image    *image;       /* Image, served for each page */
+    sim_image    *blank;       /* Blank image, NULL if not used */
+    ll_node      chain;        /* In sim_jobs */
+} sim_job;
+
+/* sim_scan_params represents scan parameters, requested by client
+ */
+typedef struct {
+    bool platen;              /* Scan from platen */
+    bool color;               /* RGB or grayscale */
+    int  res;                 /* Resolution, DPI */
+    int  wid, hei;            /* Scan region, in protocol units */
+} sim_scan_params;
+
+/* sim_request represents received HTTP request
+ */
+typedef struct {
+    http_parser parser;       /* HTTP parser */
+    char        *url;         /* Request URL */
+    char        *body;        /* Request body */
+    bool        done;         /* Request is complete */
+    bool        keep_alive;   /* Keep connection alive */
+} sim_request;
+
+/******************** Static variables *********************/
+static sim_options sim_opt = {
+    .port = 8080,
+    .wid_mm = 210,
+    .hei_mm = 297,
+    .format = ID_FORMAT_JPEG,
+    .adf_pages = 5,
+};
+
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ll_head sim_jobs;
+static unsigned int sim_job_last_id;
+static sim_image *sim_image_cache;
+static sim_image *sim_blank_cache;
+static unsigned int sim_image_requests;
+static bool sim_wsd_calibrating;
+
+/******************** Utility functions *********************/
+/* Print error message and exit
+ */
+static void __attribute__((noreturn))
+die (const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    vprintf(format, ap);
+    printf("\n");
+    va_end(ap);
+
+    exit(1);
+}
+
+/* Get image MIME type
+ */
+static const char*
+sim_image_mime (void)
+{
+    return id_format_mime_name(sim_opt.format);
+}
+
+/* Write data to the socket
+ *
+ * If throttle is true, data is written with the configured
+ * bandwidth limit
+ */
+static bool
+sim_write (int fd, const void *data, size_t size, bool throttle)
+{
+    const char *p = data;
+    size_t     chunk = size, done = 0;
+    timestamp  start = timestamp_now();
+
+    if (throttle && sim_opt.bandwidth > 0) {
+        /* 50 chunks per second */
+        chunk = math_max(1, sim_opt.bandwidth * 1024 / 50);
+    }
+
+    while (done < size) {
+        size_t  len = size - done < chunk ? size - done : chunk;
+        ssize_t rc = write(fd, p + done, len);
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        done += rc;
+
+        if (chunk != size) {
+            timestamp expected = (timestamp) (done * 1000 /
+                ((size_t) sim_opt.bandwidth * 1024));
+            timestamp elapsed = timestamp_now() - start;
+
+            if (expected > elapsed) {
+                usleep((useconds_t) (expected - elapsed) * 1000);
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Send HTTP response
+ */
+static bool
+sim_respond (int fd, int status, const char *content_type,
+        const char *extra_headers, const char *body, size_t size,
+        bool throttle)
+{
+    char *hdr = str_printf("HTTP/1.1 %d %s\r\n"
+        "Content-Length: %zu\r\n", status, http_status_str(status), size);
+    bool ok;
+
+    if (content_type != NULL) {
+        hdr = str_append_printf(hdr, "Content-Type: %s\r\n", content_type);
+    }
+
+    if (extra_headers != NULL) {
+        hdr = str_append(hdr, extra_headers);
+    }
+
+    hdr = str_append(hdr, "\r\n");
+
+    ok = sim_write(fd, hdr, str_len(hdr), false) &&
+         sim_write(fd, body, size, throttle);
+
+    mem_free(hdr);
+    return ok;
+}
+
+/* Send HTTP response with XML body. The body string is consumed
+ */
+static bool
+sim_respond_xml (int fd, int status, const char *content_type, char *xml)
+{
+    bool ok = sim_respond(fd, status, content_type, NULL,
+        xml, str_len(xml), false);
+
+    mem_free(xml);
+    return ok;
+}
+
+/* Check if the image request must fail with the HTTP 503 error
+ */
+static bool
+sim_inject_failure (void)
+{
+    unsigned int n;
+
+    if (sim_opt.fail_every <= 0) {
+        return false;
+    }
+
+    n = __atomic_add_fetch(&sim_image_requests, 1, __ATOMIC_SEQ_CST);
+    return n % (unsigned int) sim_opt.fail_every == 0;
+}
+
+/******************** Images *********************/
+/* Encode image row by row
+ */
+typedef struct {
+    char *data;               /* Output buffer */
+} sim_png_out;
+
+/* libpng write callback
+ */
+static void
+sim_png_write (png_struct *png_ptr, png_bytep data, size_t size)
+{
+    sim_png_out *out = png_get_io_ptr(png_ptr);
+    out->data = str_append_mem(out->data, (const char*) data, size);
+}
+
+/* libpng flush callback
+ */
+static void
+sim_png_flush (png_struct *png_ptr)
+{
+    (void) png_ptr;
+}
+
+/* Fill the image row with test pattern
+ */
+static void
+sim_image_row (unsigned char *row, int wid, int hei, int y, bool color,
+        bool blank)
+{
+    int x;
+
+    if (blank) {
+        memset(row, 0xff, color ? wid * 3 : wid);
+        return;
+    }
+
+    for (x = 0; x < wid; x ++) {
+        unsigned char r = (unsigned char) (x * 255 / wid);
+        unsigned char g = (unsigned char) (y * 255 / hei);
+        unsigned char b = (unsigned char) ((x ^ y) & 0xff);
+
+        if (color) {
+            row[3 * x] = r;
+            row[3 * x + 1] = g;
+            row[3 * x + 2] = b;
+        } else {
+            row[x] = (unsigned char) ((r + g + b) / 3);
+        }
+    }
+}
+
+/* Encode the test image as JPEG
+ */
+static char*
+sim_image_encode_jpeg (int wid, int hei, bool color, bool blank)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr       jerr;
+    unsigned char               *buf = NULL, *row;
+    unsigned long               size = 0;
+    char                        *data;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &buf, &size);
+
+    cinfo.image_width = wid;
+    cinfo.image_height = hei;
+    cinfo.input_components = color ? 3 : 1;
+    cinfo.in_color_space = color ? JCS_RGB : JCS_GRAYSCALE;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 90, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    row = mem_new(unsigned char, wid * 3);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        sim_image_row(row, wid, hei, (int) cinfo.next_scanline, color,
+            blank);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    mem_free(row);
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    data = str_append_mem(str_new(), (const char*) buf, size);
+    free(buf);
+
+    return data;
+}
+
+/* Encode the test image as PNG
+ */
+static char*
+sim_image_encode_png (int wid, int hei, bool color, bool blank)
+{
+    png_struct    *png_ptr;
+    png_info      *info_ptr;
+    sim_png_out   out = {str_new()};
+    unsigned char *row;
+    int           y;
+
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+        NULL, NULL, NULL);
+    if (png_ptr == NULL) {
+        die("png_create_write_struct: failed");
+    }
+
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL) {
+        die("png_create_info_struct: failed");
+    }
+
+    png_set_write_fn(png_ptr, &out, sim_png_write, sim_png_flush);
+    png_set_IHDR(png_ptr, info_ptr, wid, hei, 8,
+        color ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_GRAY,
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr, info_ptr);
+
+    row = mem_new(unsigned char, wid * 3);
+    for (y = 0; y < hei; y ++) {
+        sim_image_row(row, wid, hei, y, color, blank);
+        png_write_row(png_ptr, row);
+    }
+    mem_free(row);
+
+    png_write_end(png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+
+    return out.data;
+}
+
+/* Get the test image of the specified size. Images are cached,
+ * so subsequent jobs with the same parameters don't pay for
+ * encoding. Blank images are cached separately
+ *
+ * Must be called with sim_mutex held
+ */
+static sim_image*
+sim_image_get (int wid, int hei, bool color, bool blank)
+{
+    sim_image **cache = blank ? &sim_blank_cache : &sim_image_cache;
+    sim_image *image = *cache;
+
+    if (image == NULL || image->wid != wid || image->hei != hei ||
+        image->color != color) {
+
+        if (image != NULL && -- image->refcnt == 0) {
+            mem_free(image->data);
+            mem_free(image);
+        }
+
+        image = mem_new(sim_image, 1);
+        image->refcnt = 1;
+        image->wid = wid;
+        image->hei = hei;
+        image->color = color;
+        image->blank = blank;
+
+        if (sim_opt.format == ID_FORMAT_PNG) {
+            image->data = sim_image_encode_png(wid, hei, color, blank);
+        } else {
+            image->data = sim_image_encode_jpeg(wid, hei, color, blank);
+        }
+
+        *cache = image;
+    }
+
+    image->refcnt ++;
+    return image;
+}
+
+/* Release the image
+ *
+ * Must be called with sim_mutex held
+ */
+static void
+sim_image_unref (sim_image *image)
+{
+    if (-- image->refcnt == 0) {
+        mem_free(image->data);
+        mem_free(image);
+    }
+}
+
+/******************** Scan jobs *********************/
+/* Create new scan job. Scan region is in units per inch
+ */
+static sim_job*
+sim_job_new (const sim_scan_params *params, int units)
+{
+    sim_job *job = mem_new(sim_job, 1);
+    int     wid = (int) ((int64_t) params->wid * params->res / units);
+    int     hei = (int) ((int64_t) params->hei * params->res / units);
+
+    wid = math_max(wid, 1);
+    hei = math_max(hei, 1);
+
+    pthread_mutex_lock(&sim_mutex);
+    job->id = ++ sim_job_last_id;
+    job->platen = params->platen;
+    job->pages_left = params->platen ? 1 : sim_opt.adf_pages;
+    job->image = sim_image_get(wid, hei, params->color, false);
+    if (!params->platen && sim_opt.blank_every > 0) {
+        job->blank = sim_image_get(wid, hei, params->color, true);
+    }
+    ll_push_end(&sim_jobs, &job->chain);
+    pthread_mutex_unlock(&sim_mutex);
+
+    return job;
+}
+
+/* Find the job by ID
+ *
+ * Must be called with sim_mutex held
+ */
+static sim_job*
+sim_job_find (unsigned int id)
+{
+    ll_node *node;
+
+    for (LL_FOR_EACH(node, &sim_jobs)) {
+        sim_job *job = OUTER_STRUCT(node, sim_job, chain);
+        if (job->id == id) {
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+/* Delete the job
+ *
+ * Must be called with sim_mutex held
+ */
+static void
+sim_job_free (sim_job *job)
+{
+    ll_del(&job->chain);
+    sim_image_unref(job->image);
+    if (job->blank != NULL) {
+        sim_image_unref(job->blank);
+    }
+    mem_free(job);
+}
+
+/* Take next page of the job. If there is a page, returns
+ * referenced image, NULL otherwise
+ *
+ * If job is completed, it is deleted, unless keep is true
+ */
+static sim_image*
+sim_job_next_page (unsigned int id, bool keep)
+{
+    sim_job   *job;
+    sim_image *image = NULL;
+
+    pthread_mutex_lock(&sim_mutex);
+    job = sim_job_find(id);
+
+    if (job != NULL && job->pages_left > 0) {
+        job->pages_left --;
+        job->pages_done ++;
+
+        image = job->image;
+        if (job->blank != NULL &&
+            job->pages_done % sim_opt.blank_every == 0) {
+            image = job->blank;
+        }
+
+        image->refcnt ++;
+    }
+
+    if (job != NULL && job->pages_left == 0 && !keep) {
+        sim_job_free(job);
+    }
+
+    pthread_mutex_unlock(&sim_mutex);
+
+    return image;
+}
+
+/* Delete the job by ID
+ */
+static void
+sim_job_cancel (unsigned int id)
+{
+    sim_job *job;
+
+    pthread_mutex_lock(&sim_mutex);
+    job = sim_job_find(id);
+    if (job != NULL) {
+        sim_job_free(job);
+    }
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+/* Send the page image, with the per-page delay and the bandwidth
+ * throttling. The image reference is consumed
+ */
+static bool
+sim_send_page (int fd, const char *content_type, const char *prefix,
+        sim_image *image, const char *suffix)
+{
+    char *body = str_dup(prefix);
+    bool ok;
+
+    body = str_append_mem(body, image->data, str_len(image->data));
+    body = str_append(body, suffix);
+
+    pthread_mutex_lock(&sim_mutex);
+    sim_image_unref(image);
+    pthread_mutex_unlock(&sim_mutex);
+
+    if (sim_opt.delay > 0) {
+        usleep((useconds_t) sim_opt.delay * 1000);
+    }
+
+    ok = sim_respond(fd, HTTP_STATUS_OK, content_type, NULL,
+        body, str_len(body), true);
+
+    mem_free(body);
+    return ok;
+}
+
+/******************** eSCL *********************/
+/* Write eSCL source capabilities
+ */
+static void
+sim_escl_source_caps (xml_wr *xml)
+{
+    size_t i;
+    const char *mime = sim_image_mime();
+
+    xml_wr_add_uint(xml, "scan:MinWidth", 16);
+    xml_wr_add_uint(xml, "scan:MaxWidth",
+        (unsigned int) (sim_opt.wid_mm * 3000 / 254));
+    xml_wr_add_uint(xml, "scan:MinHeight", 16);
+    xml_wr_add_uint(xml, "scan:MaxHeight",
+        (unsigned int) (sim_opt.hei_mm * 3000 / 254));
+
+    xml_wr_enter(xml, "scan:SettingProfiles");
+    xml_wr_enter(xml, "scan:SettingProfile");
+
+    xml_wr_enter(xml, "scan:ColorModes");
+    xml_wr_add_text(xml, "scan:ColorMode", "RGB24");
+    xml_wr_add_text(xml, "scan:ColorMode", "Grayscale8");
+    xml_wr_leave(xml);
+
+    xml_wr_enter(xml, "scan:DocumentFormats");
+    xml_wr_add_text(xml, "pwg:DocumentFormat", mime);
+    xml_wr_add_text(xml, "scan:DocumentFormatExt", mime);
+    xml_wr_leave(xml);
+
+    xml_wr_enter(xml, "scan:SupportedResolutions");
+    xml_wr_enter(xml, "scan:DiscreteResolutions");
+    for (i = 0; i < sizeof(sim_resolutions) / sizeof(sim_resolutions[0]);
+         i ++) {
+        xml_wr_enter(xml, "scan:DiscreteResolution");
+        xml_wr_add_uint(xml, "scan:XResolution", sim_resolutions[i]);
+        xml_wr_add_uint(xml, "scan:YResolution", sim_resolutions[i]);
+        xml_wr_leave(xml);
+    }
+    xml_wr_leave(xml);
+    xml_wr_leave(xml);
+
+    xml_wr_leave(xml);
+    xml_wr_leave(xml);
+}
+
+/* GET /eSCL/ScannerCapabilities
+ */
+static bool
+sim_escl_caps (int fd)
+{
+    xml_wr *xml = xml_wr_begin("scan:ScannerCapabilities", sim_escl_ns);
+
+    xml_wr_add_text(xml, "pwg:Version", "2.63");
+    xml_wr_add_text(xml, "pwg:MakeAndModel", "sane-airscan simulator");
+    xml_wr_add_text(xml, "scan:Manufacturer", "sane-airscan");
+
+    xml_wr_enter(xml, "scan:Platen");
+    xml_wr_enter(xml, "scan:PlatenInputCaps");
+    sim_escl_source_caps(xml);
+    xml_wr_leave(xml);
+    xml_wr_leave(xml);
+
+    xml_wr_enter(xml, "scan:Adf");
+    xml_wr_enter(xml, "scan:AdfSimplexInputCaps");
+    sim_escl_source_caps(xml);
+    xml_wr_leave(xml);
+    xml_wr_leave(xml);
+
+    return sim_respond_xml(fd, HTTP_STATUS_OK, "text/xml",
+        xml_wr_finish(xml));
+}
+
+/* GET /eSCL/ScannerStatus
+ */
+static bool
+sim_escl_status (int fd)
+{
+    xml_wr *xml = xml_wr_begin("scan:ScannerStatus", sim_escl_ns);
+
+    xml_wr_add_text(xml, "pwg:Version", "2.63");
+    xml_wr_add_text(xml, "pwg:State", "Idle");
+    xml_wr_add_text(xml, "scan:AdfState", "ScannerAdfLoaded");
+
+    return sim_respond_xml(fd, HTTP_STATUS_OK, "text/xml",
+        xml_wr_finish(xml));
+}
+
+/* POST /eSCL/ScanJobs
+ */
+static bool
+sim_escl_scan (int fd, const char *body)
+{
+    xml_rd          *xml;
+    sim_scan_params params = {true, true, 300, 0, 0};
+    sim_job         *job;
+    char            *location;
+    bool            ok;
+
+    if (xml_rd_begin(&xml, body, str_len(body), sim_escl_ns) != NULL) {
+        return sim_respond(fd, HTTP_STATUS_BAD_REQUEST, NULL, NULL,
+            "", 0, false);
+    }
+
+    while (!xml_rd_end(xml)) {
+        const char *name = xml_rd_node_name(xml);
+        const char *val = xml_rd_node_value(xml);
+
+        if (!strcmp(name, "pwg:InputSource")) {
+            params.platen = strcmp(val, "Feeder") != 0;
+        } else if (!strcmp(name, "scan:ColorMode")) {
+            params.color = !strcmp(val, "RGB24");
+        } else if (!strcmp(name, "scan:XResolution")) {
+            params.res = atoi(val);
+        } else if (!strcmp(name, "pwg:Width")) {
+            params.wid = atoi(val);
+        } else if (!strcmp(name, "pwg:Height")) {
+            params.hei = atoi(val);
+        }
+
+        xml_rd_deep_next(xml, 0);
+    }
+
+    xml_rd_finish(&xml);
+
+    job = sim_job_new(&params, 300);
+    location = str_printf("Location: /eSCL/ScanJobs/%u\r\n", job->id);
+    ok = sim_respond(fd, HTTP_STATUS_CREATED, NULL, location, "", 0, false);
+    mem_free(location);
+
+    return ok;
+}
+
+/* GET /eSCL/ScanJobs/{id}/NextDocument
+ */
+static bool
+sim_escl_load (int fd, unsigned int id)
+{
+    sim_image *image;
+
+    if (sim_inject_failure()) {
+        return sim_respond(fd, HTTP_STATUS_SERVICE_UNAVAILABLE,
+            NULL, NULL, "", 0, false);
+    }
+
+    image = sim_job_next_page(id, true);
+    if (image == NULL) {
+        return sim_respond(fd, HTTP_STATUS_NOT_FOUND, NULL, NULL,
+            "", 0, false);
+    }
+
+    return sim_send_page(fd, sim_image_mime(), "", image, "");
+}
+
+/* Dispatch eSCL request
+ */
+static bool
+sim_escl_dispatch (int fd, const char *method, const char *path,
+        const char *body)
+{
+    unsigned int id;
+    int          off = 0;
+
+    if (!strcmp(method, "GET") && !strcmp(path, "ScannerCapabilities")) {
+        return sim_escl_caps(fd);
+    }
+
+    if (!strcmp(method, "GET") && !strcmp(path, "ScannerStatus")) {
+        return sim_escl_status(fd);
+    }
+
+    if (!strcmp(method, "POST") && !strcmp(path, "ScanJobs")) {
+        return sim_escl_scan(fd, body);
+    }
+
+    if (sscanf(path, "ScanJobs/%u%n", &id, &off) == 1) {
+        path += off;
+
+        if (!strcmp(method, "GET") && !strcmp(path, "/NextDocument")) {
+            return sim_escl_load(fd, id);
+        }
+
+        if (!strcmp(method, "DELETE") && *path == '\0') {
+            sim_job_cancel(id);
+            return sim_respond(fd, HTTP_STATUS_OK, NULL, NULL,
+                "", 0, false);
+        }
+    }
+
+    return sim_respond(fd, HTTP_STATUS_NOT_FOUND, NULL, NULL, "", 0, false);
+}
+
+/******************** WSD *********************/
+/* Begin WSD response envelope
+ */
+static xml_wr*
+sim_wsd_begin (const char *action)
+{
+    xml_wr *xml = xml_wr_begin("soap:Envelope", sim_wsd_ns_wr);
+    uuid   u = uuid_rand();
+
+    xml_wr_enter(xml, "soap:Header");
+    xml_wr_add_text(xml, "wsa:MessageID", u.text);
+    xml_wr_add_text(xml, "wsa:Action", action);
+    xml_wr_leave(xml);
+
+    xml_wr_enter(xml, "soap:Body");
+
+    return xml;
+}
+
+/* Send WSD fault response
+ */
+static bool
+sim_wsd_fault (int fd, int status, const char *subcode)
+{
+    xml_wr *xml = sim_wsd_begin(SIM_WSD_ACTION_FAULT);
+    char   *value = str_concat("sca:", subcode, NULL);
+
+    xml_wr_enter(xml, "soap:Fault");
+    xml_wr_enter(xml, "soap:Code");
+    xml_wr_add_text(xml, "soap:Value", "soap:Sender");
+    xml_wr_enter(xml, "soap:Subcode");
+    xml_wr_add_text(xml, "soap:Value", value);
+    xml_wr_leave(xml);
+    xml_wr_leave(xml);
+    xml_wr_leave(xml);
+
+    mem_free(value);
+
+    return sim_respond_xml(fd, status, "application/soap+xml",
+        xml_wr_finish_compact(xml));
+}
+
+/* Write WSD source configuration
+ */
+static void
+sim_wsd_source_conf (xml_wr *xml, const char *prefix)
+{
+    char   name[64];
+    size_t i;
+
+    snprintf(name, sizeof(name), "sca:%sColor", prefix);
+    xml_wr_enter(xml, name);
+    xml_wr_add_text(xml, "sca:ColorEntry", "RGB24");
+    xml_wr_add_text(xml, "sca:ColorEntry", "Grayscale8");
+    xml_wr_leave(xml);
+
+    snprintf(name, sizeof(name), "sca:%sMinimumSize", prefix);
+    xml_wr_enter(xml, name);
+    xml_wr_add_uint(xml, "sca:Width", 100);
+    xml_wr_add_uint(xml, "sca:Height", 100);
+    xml_wr_leave(xml);
+
+    snprintf(name, sizeof(name), "sca:%sMaximumSize", prefix);
+    xml_wr_enter(xml, name);
+    xml_wr_add_uint(xml, "sca:Width",
+        (unsigned int) (sim_opt.wid_mm * 10000 / 254));
+    xml_wr_add_uint(xml, "sca:Height",
+        (unsigned int) (sim_opt.hei_mm * 10000 / 254));
+    xml_wr_leave(xml);
+
+    snprintf(name, sizeof(name), "sca:%sResolutions", prefix);
+    xml_wr_enter(xml, name);
+    xml_wr_enter(xml, "sca:Widths");
+    for (i = 0; i < sizeof(sim_resolutions) / sizeof(sim_resolutions[0]);
+         i ++) {
+        xml_wr_add_uint(xml, "sca:Width", sim_resolutions[i]);
+    }
+    xml_wr_leave(xml);
+    xml_wr_enter(xml, "sca:Heights");
+    for (i = 0; i < sizeof(sim_resolutions) / sizeof(sim_resolutions[0]);
+         i ++) {
+        xml_wr_add_uint(xml, "sca:Height", sim_resolutions[i]);
+    }
+    xml_wr_leave(xml);
+    xml_wr_leave(xml);
+}
+
+/* GetScannerElements request
+ */
+static bool
+sim_wsd_elements (int fd, bool configuration)
+{
+    xml_wr       *xml;
+    xml_attr     attrs[] = {{"Name", NULL}, {"Valid", "true"}, {NULL, NULL}};
+
+    xml = sim_wsd_begin(SIM_WSD_ACTION_BASE "GetScannerElementsResponse");
+    xml_wr_enter(xml, "sca:GetScannerElementsResponse");
+    xml_wr_enter(xml, "sca:ScannerElements");
+
+    if (configuration) {
+        attrs[0].value = "sca:ScannerConfiguration";
+        xml_wr_enter_attr(xml, "sca:ElementData", attrs);
+        xml_wr_enter(xml, "sca:ScannerConfiguration");
+
+        xml_wr_enter(xml, "sca:DeviceSettings");
+        xml_wr_enter(xml, "sca:FormatsSupported");
+        xml_wr_add_text(xml, "sca:FormatValue",
+            sim_opt.format == ID_FORMAT_PNG ? "png" : "jfif");
+        xml_wr_leave(xml);
+        xml_wr_leave(xml);
+
+        xml_wr_enter(xml, "sca:Platen");
+        sim_wsd_source_conf(xml, "Platen");
+        xml_wr_leave(xml);
+
+        xml_wr_enter(xml, "sca:ADF");
+        xml_wr_add_text(xml, "sca:ADFSupportsDuplex", "false");
+        xml_wr_enter(xml, "sca:ADFFront");
+        sim_wsd_source_conf(xml, "ADF");
+        xml_wr_leave(xml);
+        xml_wr_leave(xml);
+
+        xml_wr_leave(xml);
+        xml_wr_leave(xml);
+    } else {
+        bool calibrating;
+
+        calibrating = __atomic_exchange_n(&sim_wsd_calibrating, false,
+            __ATOMIC_SEQ_CST);
+
+        attrs[0].value = "sca:ScannerStatus";
+        xml_wr_enter_attr(xml, "sca:ElementData", attrs);
+        xml_wr_enter(xml, "sca:ScannerStatus");
+        xml_wr_add_text(xml, "sca:ScannerState", "Idle");
+        if (calibrating) {
+            xml_wr_enter(xml, "sca:ScannerStateReasons");
+            xml_wr_add_text(xml, "sca:ScannerStateReason", "Calibrating");
+            xml_wr_leave(xml);
+        }
+        xml_wr_leave(xml);
+        xml_wr_leave(xml);
+    }
+
+    xml_wr_leave(xml);
+    xml_wr_leave(xml);
+    xml_wr_leave(xml);
+
+    return sim_respond_xml(fd, HTTP_STATUS_OK, "application/soap+xml",
+        xml_wr_finish_compact(xml));
+}
+
+/* CreateScanJob request
+ *
+ * The injected failure is reported as ServerErrorNotAcceptingJobs
+ * fault, and the subsequent ScannerStatus reports the Calibrating
+ * reason, so backend retries
+ */
+static bool
+sim_wsd_scan (int fd, const sim_scan_params *params)
+{
+    xml_wr  *xml;
+    sim_job *job;
+    char    token[32];
+
+    if (sim_inject_failure()) {
+        __atomic_store_n(&sim_wsd_calibrating, true, __ATOMIC_SEQ_CST);
+        return sim_wsd_fault(fd, HTTP_STATUS_SERVICE_UNAVAILABLE,
+            "ServerErrorNotAcceptingJobs");
+    }
+
+    job = sim_job_new(params, 1000);
+    snprintf(token, sizeof(token), "token-%u", job->id);
+
+    xml = sim_wsd_begin(SIM_WSD_ACTION_BASE "CreateScanJobResponse");
+    xml_wr_enter(xml, "sca:CreateScanJobResponse");
+    xml_wr_add_uint(xml, "sca:JobId", job->id);
+    xml_wr_add_text(xml, "sca:JobToken", token);
+    xml_wr_leave(xml);
+    xml_wr_leave(xml);
+
+    return sim_respond_xml(fd, HTTP_STATUS_OK, "application/soap+xml",
+        xml_wr_finish_compact(xml));
+}
+
+/* RetrieveImage request
+ */
+static bool
+sim_wsd_load (int fd, unsigned int id)
+{
+    sim_image *image = sim_job_next_page(id, false);
+    xml_wr    *xml;
+    char      *soap, *prefix, *suffix;
+    bool      ok;
+
+    if (image == NULL) {
+        sim_job_cancel(id);
+        return sim_wsd_fault(fd, HTTP_STATUS_BAD_REQUEST,
+            "ClientErrorNoImagesAvailable");
+    }
+
+    xml = sim_wsd_begin(SIM_WSD_ACTION_BASE "RetrieveImageResponse");
+    xml_wr_enter(xml, "sca:RetrieveImageResponse");
+    xml_wr_enter(xml, "sca:ScanData");
+    xml_wr_add_text(xml, "sca:Include", "cid:image");
+    xml_wr_leave(xml);
+    xml_wr_leave(xml);
+    xml_wr_leave(xml);
+    soap = xml_wr_finish_compact(xml);
+
+    prefix = str_printf("--" SIM_MP_BOUNDARY "\r\n"
+        "Content-Type: application/xop+xml; charset=UTF-8; "
+        "type=\"application/soap+xml\"\r\n"
+        "Content-ID: <soap>\r\n"
+        "\r\n"
+        "%s\r\n"
+        "--" SIM_MP_BOUNDARY "\r\n"
+        "Content-Type: %s\r\n"
+        "Content-ID: <image>\r\n"
+        "\r\n", soap, sim_image_mime());
+    suffix = str_dup("\r\n--" SIM_MP_BOUNDARY "--\r\n");
+
+    ok = sim_send_page(fd, "multipart/related; "
+        "boundary=" SIM_MP_BOUNDARY "; type=\"application/xop+xml\"",
+        prefix, image, suffix);
+
+    mem_free(soap);
+    mem_free(prefix);
+    mem_free(suffix);
+
+    return ok;
+}
+
+/* Dispatch WSD request
+ */
+static bool
+sim_wsd_dispatch (int fd, const char *method, const char *body)
+{
+    xml_rd          *xml;
+    const char      *action = NULL;
+    char            *action_buf = NULL;
+    bool            configuration = false;
+    unsigned int    id = 0;
+    sim_scan_params params = {true, true, 300, 0, 0};
+    bool            ok;
+
+    if (strcmp(method, "POST") ||
+        xml_rd_begin(&xml, body, str_len(body), sim_wsd_ns_rd) != NULL) {
+        return sim_wsd_fault(fd, HTTP_STATUS_BAD_REQUEST,
+            "ClientErrorInvalidArgs");
+    }
+
+    while (!xml_rd_end(xml)) {
+        const char *path = xml_rd_node_path(xml);
+        const char *name = xml_rd_node_name(xml);
+        const char *val = xml_rd_node_value(xml);
+
+        if (!strcmp(path, "s:Envelope/s:Header/a:Action")) {
+            mem_free(action_buf);
+            action_buf = str_dup(val);
+        } else if (!strcmp(name, "scan:Name")) {
+            configuration = strstr(val, "ScannerConfiguration") != NULL;
+        } else if (!strcmp(name, "scan:JobId")) {
+            id = (unsigned int) atoi(val);
+        } else if (!strcmp(name, "scan:InputSource")) {
+            params.platen = !strcmp(val, "Platen");
+        } else if (!strcmp(name, "scan:ColorProcessing")) {
+            params.color = !strcmp(val, "RGB24");
+        } else if (!strcmp(path, "s:Envelope/s:Body/scan:CreateScanJobRequest/"
+                "scan:ScanTicket/scan:DocumentParameters/scan:MediaSides/"
+                "scan:MediaFront/scan:Resolution/scan:Width")) {
+            params.res = atoi(val);
+        } else if (!strcmp(name, "scan:ScanRegionWidth")) {
+            params.wid = atoi(val);
+        } else if (!strcmp(name, "scan:ScanRegionHeight")) {
+            params.hei = atoi(val);
+        }
+
+        xml_rd_deep_next(xml, 0);
+    }
+
+    xml_rd_finish(&xml);
+
+    if (action_buf != NULL && str_has_prefix(action_buf, SIM_WSD_ACTION_BASE)) {
+        action = action_buf + strlen(SIM_WSD_ACTION_BASE);
+    }
+
+    if (action == NULL) {
+        ok = sim_wsd_fault(fd, HTTP_STATUS_BAD_REQUEST,
+            "ClientErrorInvalidArgs");
+    } else if (!strcmp(action, "GetScannerElements")) {
+        ok = sim_wsd_elements(fd, configuration);
+    } else if (!strcmp(action, "CreateScanJob")) {
+        ok = sim_wsd_scan(fd, &params);
+    } else if (!strcmp(action, "RetrieveImage")) {
+        ok = sim_wsd_load(fd, id);
+    } else if (!strcmp(action, "CancelJob")) {
+        xml_wr *rsp;
+
+        sim_job_cancel(id);
+        rsp = sim_wsd_begin(SIM_WSD_ACTION_BASE "CancelJobResponse");
+        xml_wr_enter(rsp, "sca:CancelJobResponse");
+        xml_wr_leave(rsp);
+        xml_wr_leave(rsp);
+        ok = sim_respond_xml(fd, HTTP_STATUS_OK, "application/soap+xml",
+            xml_wr_finish_compact(rsp));
+    } else {
+        ok = sim_wsd_fault(fd, HTTP_STATUS_BAD_REQUEST,
+            "ClientErrorInvalidArgs");
+    }
+
+    mem_free(action_buf);
+
+    return ok;
+}
+
+/******************** Trace replay *********************/
+/* sim_replay_entry represents HTTP query, recorded in the
+ * protocol trace (see airscan-trace.c)
+ */
+typedef struct {
+    unsigned int line;        /* Line in the trace log, for reports */
+    char         *method;     /* Request method */
+    char         *path;       /* Request path */
+    char         *action;     /* SOAP action, NULL if none */
+    char         *request;    /* Request body, see sim_request_norm() */
+    int          time;        /* Recorded query time, ms, -1 if unknown */
+    bool         error;       /* Transport error was recorded */
+    int          status;      /* HTTP status */
+    char         *headers;    /* Response headers, ready to send */
+    char         *body;       /* Response body */
+    bool         used;        /* Entry was replayed */
+} sim_replay_entry;
+
+/* Trace replay state
+ */
+static sim_replay_entry **sim_replay;
+static size_t           sim_replay_next;     /* First unused entry */
+static unsigned int     sim_replay_live;     /* Count of live requests */
+static unsigned int     sim_replay_diverged; /* Count of divergences */
+
+/* Read entire file into memory. Returns NULL on error
+ */
+static char*
+sim_read_file (const char *path)
+{
+    FILE   *fp = fopen(path, "rb");
+    char   *data, buf[65536];
+    size_t n;
+
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    data = str_new();
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data = str_append_mem(data, buf, n);
+    }
+
+    fclose(fp);
+    return data;
+}
+
+/* Find file in the tar archive, written by the protocol trace.
+ * Returns file content (str) or NULL, if not found
+ */
+static char*
+sim_tar_find (const char *tar, const char *name)
+{
+    size_t off = 0, len = str_len(tar);
+
+    while (off + 512 <= len && tar[off] != '\0') {
+        const char *hdr = tar + off;
+        size_t     size = (size_t) strtoul(hdr + 124, NULL, 8);
+
+        off += 512;
+        if (off + size > len) {
+            break;
+        }
+
+        if (!strncmp(hdr, name, 100)) {
+            return str_append_mem(str_new(), tar + off, size);
+        }
+
+        off += (size + 511) & ~(size_t) 511;
+    }
+
+    return NULL;
+}
+
+/* Get SOAP action of the request. Returns NULL if body is not
+ * a SOAP message
+ */
+static char*
+sim_soap_action (const char *body)
+{
+    xml_rd *xml;
+    char   *action = NULL;
+
+    if (xml_rd_begin(&xml, body, strlen(body), sim_wsd_ns_rd) != NULL) {
+        return NULL;
+    }
+
+    while (!xml_rd_end(xml) && action == NULL) {
+        if (!strcmp(xml_rd_node_path(xml), "s:Envelope/s:Header/a:Action")) {
+            action = str_dup(xml_rd_node_value(xml));
+        }
+        xml_rd_deep_next(xml, 0);
+    }
+
+    xml_rd_finish(&xml);
+    return action;
+}
+
+/* Normalize request body for comparison
+ *
+ * The trace reformats XML bodies, so XML is compared by content:
+ * it is flattened into "path: value" lines, one per leaf node.
+ * SOAP header is skipped, as it carries the per-message MessageID
+ * and addresses, and action is matched separately. Other bodies
+ * are compared as is
+ */
+static char*
+sim_request_norm (const char *body)
+{
+    xml_rd       *xml;
+    char         *out, *path = NULL, *value = NULL;
+    unsigned int depth = 0;
+
+    if (xml_rd_begin(&xml, body, strlen(body), sim_wsd_ns_rd) != NULL) {
+        return str_dup(body);
+    }
+
+    out = str_new();
+    while (!xml_rd_end(xml)) {
+        const char *p = xml_rd_node_path(xml);
+
+        /* Previous node is a leaf, unless we went deeper */
+        if (path != NULL && xml_rd_depth(xml) <= depth) {
+            out = str_append_printf(out, "%s: %s\n", path, value);
+        }
+
+        mem_free(path);
+        mem_free(value);
+        path = value = NULL;
+
+        if (!str_has_prefix(p, "s:Envelope/s:Header")) {
+            path = str_dup(p);
+            value = str_dup(xml_rd_node_value(xml));
+            depth = xml_rd_depth(xml);
+        }
+
+        xml_rd_deep_next(xml, 0);
+    }
+
+    if (path != NULL) {
+        out = str_append_printf(out, "%s: %s\n", path, value);
+    }
+
+    mem_free(path);
+    mem_free(value);
+    xml_rd_finish(&xml);
+
+    return out;
+}
+
+/* Compare normalized request bodies. Returns NULL if they are
+ * equal, otherwise the description of the first difference
+ */
+static char*
+sim_request_diff (const char *expected, const char *got)
+{
+    unsigned int line = 1;
+    size_t       n1, n2;
+
+    for (;;) {
+        n1 = strcspn(expected, "\n");
+        n2 = strcspn(got, "\n");
+
+        if (n1 != n2 || memcmp(expected, got, n1)) {
+            break;
+        }
+
+        if (expected[n1] == '\0' || got[n2] == '\0') {
+            if (expected[n1] == got[n2]) {
+                return NULL;
+            }
+            break;
+        }
+
+        expected += n1 + 1;
+        got += n2 + 1;
+        line ++;
+    }
+
+    return str_printf("line %u: expected \"%.*s\", got \"%.*s\"", line,
+        (int) math_min(n1, 200), expected, (int) math_min(n2, 200), got);
+}
+
+/* Get path part of the request URI
+ */
+static const char*
+sim_uri_path (const char *uri)
+{
+    const char *s = strstr(uri, "://");
+
+    if (s != NULL) {
+        s = strchr(s + 3, '/');
+        return s != NULL ? s : "/";
+    }
+
+    return uri;
+}
+
+/* Check if trace log line terminates the message body. Besides
+ * the HTTP queries, trace log contains device log messages,
+ * prefixed with "hh:mm:ss.mmm: " timestamp, and hex dumps
+ */
+static bool
+sim_trace_body_end (const char *line)
+{
+    unsigned int hh, mm, ss, ms;
+    char         c;
+
+    return str_has_prefix(line, "==============================") ||
+           str_has_prefix(line, "===== Part ") ||
+           sscanf(line, "%2u:%2u:%2u.%3u%c", &hh, &mm, &ss, &ms, &c) == 5 ||
+           ((line[0] == '<' || line[0] == '>') && line[1] == ' ' &&
+            sscanf(line + 2, "%4x%c", &hh, &c) == 2 && c == ':');
+}
+
+/* Check if trace log line terminates the request body
+ */
+static bool
+sim_trace_request_end (const char *line)
+{
+    int n;
+
+    return sim_trace_body_end(line) ||
+           sscanf(line, "Time: %d ms", &n) == 1 ||
+           sscanf(line, "Status: %d", &n) == 1 ||
+           str_has_prefix(line, "Error: ");
+}
+
+/* Load message body from the trace. Body is either inlined into
+ * the log, or saved into the tar archive
+ */
+static char*
+sim_trace_body (char **lines, size_t *i, const char *tar,
+        bool (*end)(const char *line))
+{
+    size_t     first = *i, last, j;
+    char       *body = str_new();
+    char       name[101];
+    unsigned long size;
+
+    while (lines[*i] != NULL && !end(lines[*i])) {
+        (*i) ++;
+    }
+
+    /* Drop the empty line, appended by trace after the body */
+    last = *i;
+    if (last > first && lines[last - 1][0] == '\0') {
+        last --;
+    }
+
+    if (last == first + 1 &&
+        sscanf(lines[first], "%lu bytes of data saved as %100s",
+            &size, name) == 2) {
+        char *data = sim_tar_find(tar, name);
+        if (data != NULL) {
+            mem_free(body);
+            return data;
+        }
+    }
+
+    for (j = first; j < last; j ++) {
+        body = str_append(body, lines[j]);
+        body = str_append_c(body, '\n');
+    }
+
+    return body;
+}
+
+/* Load one query from the trace. *i points to the request line
+ */
+static sim_replay_entry*
+sim_trace_entry (char **lines, size_t *i, const char *tar)
+{
+    sim_replay_entry *ent = mem_new(sim_replay_entry, 1);
+    char             *s, *body;
+
+    ent->line = (unsigned int) *i + 1;
+    ent->time = -1;
+    ent->headers = str_new();
+
+    /* Parse request line and skip request headers */
+    s = strchr(lines[*i], ' ');
+    if (s == NULL) {
+        ent->method = str_dup(lines[*i]);
+        ent->path = str_dup("/");
+    } else {
+        ent->method = str_append_mem(str_new(), lines[*i], s - lines[*i]);
+        ent->path = str_dup(sim_uri_path(s + 1));
+    }
+
+    for ((*i) ++; lines[*i] != NULL && lines[*i][0] != '\0'; (*i) ++)
+        ;
+    if (lines[*i] != NULL) {
+        (*i) ++;
+    }
+
+    body = sim_trace_body(lines, i, tar, sim_trace_request_end);
+    ent->action = sim_soap_action(body);
+    ent->request = sim_request_norm(body);
+    mem_free(body);
+
+    /* Parse response */
+    if (lines[*i] != NULL && sscanf(lines[*i], "Time: %d ms", &ent->time) == 1) {
+        (*i) ++;
+    }
+
+    if (lines[*i] == NULL || str_has_prefix(lines[*i], "Error: ")) {
+        ent->error = true;
+        ent->body = str_new();
+        return ent;
+    }
+
+    if (sscanf(lines[*i], "Status: %d", &ent->status) != 1) {
+        ent->error = true;
+        ent->body = str_new();
+        return ent;
+    }
+
+    for ((*i) ++; lines[*i] != NULL && lines[*i][0] != '\0'; (*i) ++) {
+        const char *hdr = lines[*i];
+
+        /* Framing headers are regenerated */
+        if (!strncasecmp(hdr, "Content-Length:", 15) ||
+            !strncasecmp(hdr, "Transfer-Encoding:", 18) ||
+            !strncasecmp(hdr, "Content-Encoding:", 17) ||
+            !strncasecmp(hdr, "Connection:", 11)) {
+            continue;
+        }
+
+        /* Location must point to us, not to the original device */
+        if (!strncasecmp(hdr, "Location:", 9)) {
+            const char *loc = hdr + 9;
+            while (*loc == ' ') {
+                loc ++;
+            }
+            ent->headers = str_append_printf(ent->headers,
+                "Location: %s\r\n", sim_uri_path(loc));
+            continue;
+        }
+
+        ent->headers = str_append(ent->headers, hdr);
+        ent->headers = str_append(ent->headers, "\r\n");
+    }
+
+    if (lines[*i] != NULL) {
+        (*i) ++;
+    }
+
+    ent->body = sim_trace_body(lines, i, tar, sim_trace_body_end);
+
+    return ent;
+}
+
+/* Load protocol trace for replay. The path may refer either to
+ * .log or .tar file, the other one is found by the file extension
+ */
+static void
+sim_replay_load (const char *path)
+{
+    char   *log_path = str_dup(path), *tar_path;
+    char   *log, *tar;
+    char   **lines = ptr_array_new(char*);
+    char   *s;
+    size_t i;
+
+    if (str_has_suffix(log_path, ".tar")) {
+        log_path = str_resize(log_path, str_len(log_path) - 4);
+        log_path = str_append(log_path, ".log");
+    }
+
+    tar_path = str_dup(log_path);
+    if (str_has_suffix(tar_path, ".log")) {
+        tar_path = str_resize(tar_path, str_len(tar_path) - 4);
+    }
+    tar_path = str_append(tar_path, ".tar");
+
+    log = sim_read_file(log_path);
+    if (log == NULL) {
+        die("%s: %s", log_path, strerror(errno));
+    }
+
+    tar = sim_read_file(tar_path);
+    if (tar == NULL) {
+        printf("%s: %s, binary bodies will be empty\n",
+            tar_path, strerror(errno));
+        tar = str_new();
+    }
+
+    /* Split log into lines */
+    for (s = log; *s != '\0'; ) {
+        char *end = strchr(s, '\n');
+
+        lines = ptr_array_append(lines, s);
+        if (end == NULL) {
+            break;
+        }
+
+        *end = '\0';
+        s = end + 1;
+    }
+    lines = ptr_array_append(lines, NULL);
+
+    /* Load queries */
+    sim_replay = ptr_array_new(sim_replay_entry*);
+    for (i = 0; lines[i] != NULL; ) {
+        if (!strcmp(lines[i], "==============================") &&
+            lines[i + 1] != NULL) {
+            i ++;
+            sim_replay = ptr_array_append(sim_replay,
+                sim_trace_entry(lines, &i, tar));
+        } else {
+            i ++;
+        }
+    }
+
+    if (mem_len(sim_replay) == 0) {
+        die("%s: no HTTP queries found", log_path);
+    }
+
+    printf("%s: %d queries loaded\n", log_path, (int) mem_len(sim_replay));
+
+    mem_free(lines);
+    mem_free(log);
+    mem_free(tar);
+    mem_free(log_path);
+    mem_free(tar_path);
+}
+
+/* Format request for report
+ */
+static char*
+sim_replay_fmt (char *buf, const char *method, const char *path,
+        const char *action)
+{
+    buf = str_append_printf(buf, "%s %s", method, path);
+    if (action != NULL) {
+        const char *s = strrchr(action, '/');
+        buf = str_append_printf(buf, " (%s)", s != NULL ? s + 1 : action);
+    }
+
+    return buf;
+}
+
+/* Report divergence of the live requests from the trace
+ *
+ * Must be called with sim_mutex held
+ */
+static void
+sim_replay_report (unsigned int live, const char *method, const char *path,
+        const char *action, const char *fmt, ...)
+{
+    char    *msg = str_printf("replay: request #%u ", live);
+    char    buf[1024];
+    va_list ap;
+
+    msg = sim_replay_fmt(msg, method, path, action);
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    printf("%s: %s\n", msg, buf);
+    fflush(stdout);
+
+    sim_replay_diverged ++;
+    mem_free(msg);
+}
+
+/* Check if live request matches the recorded one
+ */
+static bool
+sim_replay_match (const sim_replay_entry *ent, const char *method,
+        const char *path, const char *action)
+{
+    if (strcmp(ent->method, method) || strcmp(ent->path, path)) {
+        return false;
+    }
+
+    if (ent->action == NULL || action == NULL) {
+        return ent->action == action;
+    }
+
+    return !strcmp(ent->action, action);
+}
+
+/* Print replay summary
+ */
+static void
+sim_replay_summary (void)
+{
+    size_t i, unused = 0;
+
+    pthread_mutex_lock(&sim_mutex);
+
+    for (i = 0; i < mem_len(sim_replay); i ++) {
+        if (!sim_replay[i]->used) {
+            if (unused ++ == 0) {
+                char *msg = sim_replay_fmt(str_new(), sim_replay[i]->method,
+                    sim_replay[i]->path, sim_replay[i]->action);
+                printf("replay: first unused query at line %u: %s\n",
+                    sim_replay[i]->line, msg);
+                mem_free(msg);
+            }
+        }
+    }
+
+    printf("replay: %u live requests, %d of %d recorded queries replayed, "
+        "%u divergences\n", sim_replay_live,
+        (int) (mem_len(sim_replay) - unused), (int) mem_len(sim_replay),
+        sim_replay_diverged);
+    fflush(stdout);
+
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+/* Dispatch request in the trace replay mode
+ *
+ * Live request is matched against the first unused recorded query.
+ * If it doesn't match, the nearest unused matching query is used
+ * (requests from concurrent connections may come out of order),
+ * and if all matching queries are already used, the last of them
+ * is repeated. Queries with the same request body are preferred.
+ * Each such case is reported as a divergence, as well as the
+ * request body that differs from the recorded one
+ */
+static bool
+sim_replay_dispatch (int fd, const char *method, const char *path,
+        const char *body)
+{
+    char             *action = sim_soap_action(body);
+    char             *request = sim_request_norm(body), *diff;
+    sim_replay_entry *ent = NULL, *last = NULL;
+    unsigned int     live;
+    size_t           i;
+    bool             same = false, ok;
+
+    pthread_mutex_lock(&sim_mutex);
+
+    live = ++ sim_replay_live;
+
+    for (i = 0; i < mem_len(sim_replay) && !same; i ++) {
+        sim_replay_entry *e = sim_replay[i];
+
+        if (sim_replay_match(e, method, path, action)) {
+            bool eq = !strcmp(e->request, request);
+
+            if (!e->used) {
+                if (ent == NULL || eq) {
+                    ent = e;
+                    same = eq;
+                }
+            } else if (last == NULL || eq || strcmp(last->request, request)) {
+                last = e;
+            }
+        }
+    }
+
+    if (ent != NULL) {
+        if (ent != sim_replay[sim_replay_next]) {
+            char *exp = sim_replay_fmt(str_new(),
+                sim_replay[sim_replay_next]->method,
+                sim_replay[sim_replay_next]->path,
+                sim_replay[sim_replay_next]->action);
+
+            sim_replay_report(live, method, path, action,
+                "out of order, matches line %u, expected line %u: %s",
+                ent->line, sim_replay[sim_replay_next]->line, exp);
+            mem_free(exp);
+        }
+
+        ent->used = true;
+        while (sim_replay_next < mem_len(sim_replay) &&
+               sim_replay[sim_replay_next]->used) {
+            sim_replay_next ++;
+        }
+    } else if (last != NULL) {
+        sim_replay_report(live, method, path, action,
+            "extra request, repeating line %u", last->line);
+        ent = last;
+    } else {
+        sim_replay_report(live, method, path, action, "not in trace");
+    }
+
+    if (ent != NULL) {
+        diff = sim_request_diff(ent->request, request);
+        if (diff != NULL) {
+            sim_replay_report(live, method, path, action,
+                "body differs from line %u, %s", ent->line, diff);
+            mem_free(diff);
+        }
+    }
+
+    if (sim_replay_next == mem_len(sim_replay) && ent != NULL &&
+        ent != last) {
+        printf("replay: all recorded queries replayed\n");
+        fflush(stdout);
+    }
+
+    pthread_mutex_unlock(&sim_mutex);
+
+    mem_free(action);
+    mem_free(request);
+
+    if (ent == NULL) {
+        return sim_respond(fd, HTTP_STATUS_NOT_FOUND, NULL, NULL,
+            "", 0, false);
+    }
+
+    if (sim_opt.replay_timing && ent->time > 0) {
+        usleep((useconds_t) ent->time * 1000);
+    }
+
+    if (ent->error) {
+        /* Transport error: drop connection without response */
+        return false;
+    }
+
+    ok = sim_respond(fd, ent->status, NULL, ent->headers,
+        ent->body, str_len(ent->body), false);
+
+    return ok;
+}
+
+/* Signal handling thread: prints replay summary on SIGINT or SIGTERM
+ */
+static void*
+sim_replay_signal_thread (void *data)
+{
+    sigset_t *set = data;
+    int      sig;
+
+    sigwait(set, &sig);
+    sim_replay_summary();
+    exit(0);
+
+    return NULL;
+}
+
+/* Setup signal handling for the trace replay. Must be called before
+ * any other thread is created, so signals are blocked in all threads
+ */
+static void
+sim_replay_signals (void)
+{
+    static sigset_t set;
+    pthread_t       thread;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (pthread_create(&thread, NULL, sim_replay_signal_thread, &set) != 0) {
+        die("pthread_create: %s", strerror(errno));
+    }
+}
+
+/******************** HTTP server *********************/
+/* http_parser on_url callback
+ */
+static int
+sim_on_url (http_parser *parser, const char *data, size_t size)
+{
+    sim_request *rq = parser->data;
+    rq->url = str_append_mem(rq->url, data, size);
+    return 0;
+}
+
+/* http_parser on_body callback
+ */
+static int
+sim_on_body (http_parser *parser, const char *data, size_t size)
+{
+    sim_request *rq = parser->data;
+    rq->body = str_append_mem(rq->body, data, size);
+    return 0;
+}
+
+/* http_parser on_message_complete callback
+ *
+ * Parser is paused here, so request can be handled before
+ * the next pipelined request is parsed
+ */
+static int
+sim_on_message_complete (http_parser *parser)
+{
+    sim_request *rq = parser->data;
+
+    rq->done = true;
+    rq->keep_alive = http_should_keep_alive(parser) != 0;
+    http_parser_pause(parser, 1);
+
+    return 0;
+}
+
+/* http_parser callbacks
+ */
+static const http_parser_settings sim_parser_settings = {
+    .on_url = sim_on_url,
+    .on_body = sim_on_body,
+    .on_message_complete = sim_on_message_complete
+};
+
+/* Dispatch HTTP request
+ */
+static bool
+sim_dispatch (int fd, sim_request *rq)
+{
+    const char *method = http_method_str(rq->parser.method);
+    const char *path = rq->url;
+
+    /* Strip absolute URL, if any, to path */
+    if (str_has_prefix(path, "http://")) {
+        path = strchr(path + 7, '/');
+        if (path == NULL) {
+            path = "/";
+        }
+    }
+
+    if (sim_replay != NULL) {
+        return sim_replay_dispatch(fd, method, path, rq->body);
+    }
+
+    if (str_has_prefix(path, "/eSCL/")) {
+        return sim_escl_dispatch(fd, method, path + 6, rq->body);
+    }
+
+    return sim_wsd_dispatch(fd, method, rq->body);
+}
+
+/* Connection thread
+ */
+static void*
+sim_conn_thread (void *data)
+{
+    int         fd = (int) (intptr_t) data;
+    sim_request rq;
+    char        buf[16384];
+    bool        ok = true;
+
+    memset(&rq, 0, sizeof(rq));
+    http_parser_init(&rq.parser, HTTP_REQUEST);
+    rq.parser.data = &rq;
+    rq.url = str_new();
+    rq.body = str_new();
+
+    while (ok) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        size_t  off = 0;
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            break;
+        }
+
+        while (ok && off < (size_t) n) {
+            off += http_parser_execute(&rq.parser, &sim_parser_settings,
+                buf + off, (size_t) n - off);
+
+            if (rq.done) {
+                ok = sim_dispatch(fd, &rq) && rq.keep_alive;
+                rq.done = false;
+                str_trunc(rq.url);
+                str_trunc(rq.body);
+                http_parser_pause(&rq.parser, 0);
+            } else if (HTTP_PARSER_ERRNO(&rq.parser) != HPE_OK) {
+                ok = false;
+            }
+        }
+    }
+
+    close(fd);
+    mem_free(rq.url);
+    mem_free(rq.body);
+
+    return NULL;
+}
+
+/* Create listening socket
+ */
+static int
+sim_listen (void)
+{
+    int fd, yes = 1;
+
+    if (sim_opt.unix_path != NULL) {
+        struct sockaddr_un addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(sim_opt.unix_path) >= sizeof(addr.sun_path)) {
+            die("%s: path too long", sim_opt.unix_path);
+        }
+        strcpy(addr.sun_path, sim_opt.unix_path);
+
+        unlink(sim_opt.unix_path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+            die("%s: %s", sim_opt.unix_path, strerror(errno));
+        }
+    } else {
+        struct sockaddr_in addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t) sim_opt.port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        }
+        if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+            die("127.0.0.1:%d: %s", sim_opt.port, strerror(errno));
+        }
+    }
+
+    if (listen(fd, 16) < 0) {
+        die("listen: %s", strerror(errno));
+    }
+
+    return fd;
+}
+
+/******************** Command line *********************/
+/* Print usage and exit
+ */
+static void
+usage (char **argv)
+{
+    printf("Usage:\n");
+    printf("    %s [options]\n", argv[0]);
+    printf("\n");
+    printf("Options are:\n");
+    printf("    -p port      TCP port on 127.0.0.1 (default 8080)\n");
+    printf("    -u path      listen on UNIX socket instead of TCP\n");
+    printf("    -s WxH       page size, in millimeters (default 210x297)\n");
+    printf("    -f format    image format: jpeg or png (default jpeg)\n");
+    printf("    -n pages     pages per ADF job (default 5)\n");
+    printf("    -d ms        per-page delay, in milliseconds\n");
+    printf("    -b KiB/s     bandwidth limit for image transfer\n");
+    printf("    -e N         answer each Nth image request with HTTP 503\n");
+    printf("    -k N         make each Nth ADF page blank\n");
+    printf("    -r trace     replay protocol trace (.log/.tar pair)\n");
+    printf("    -t           replay with the recorded query times\n");
+    printf("    -h           print help page\n");
+    printf("\n");
+    printf("Device URLs are:\n");
+    printf("    eSCL: http://127.0.0.1:port/eSCL/\n");
+    printf("    WSD:  http://127.0.0.1:port/WSD/Scan\n");
+
+    exit(0);
+}
+
+/* Print usage error end exit
+ */
+static void
+usage_error (char **argv, char *arg)
+{
+    printf("Invalid argument %s\n", arg);
+    printf("Try %s -h for more information\n", argv[0]);
+
+    exit(1);
+}
+
+/* Parse integer option
+ */
+static int
+parse_int (char **argv, char *arg, int min)
+{
+    char *end;
+    long v;
+
+    if (arg == NULL) {
+        usage_error(argv, "(missed option value)");
+    }
+
+    v = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || v < min || v > 1000000) {
+        usage_error(argv, arg);
+    }
+
+    return (int) v;
+}
+
+/* The main function
+ */
+int
+main (int argc, char **argv)
+{
+    int i, fd;
+
+    /* Parse command-line options */
+    for (i = 1; i < argc; i ++) {
+        char *arg = argv[i];
+        char *val = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (!strcmp(arg, "-h")) {
+            usage(argv);
+        } else if (!strcmp(arg, "-p")) {
+            sim_opt.port = parse_int(argv, val, 1);
+        } else if (!strcmp(arg, "-u") && val != NULL) {
+            sim_opt.unix_path = val;
+        } else if (!strcmp(arg, "-s") && val != NULL) {
+            if (sscanf(val, "%dx%d", &sim_opt.wid_mm, &sim_opt.hei_mm) != 2 ||
+                sim_opt.wid_mm <= 0 || sim_opt.hei_mm <= 0) {
+                usage_error(argv, val);
+            }
+        } else if (!strcmp(arg, "-f") && val != NULL) {
+            if (!strcmp(val, "jpeg")) {
+                sim_opt.format = ID_FORMAT_JPEG;
+            } else if (!strcmp(val, "png")) {
+                sim_opt.format = ID_FORMAT_PNG;
+            } else {
+                usage_error(argv, val);
+            }
+        } else if (!strcmp(arg, "-n")) {
+            sim_opt.adf_pages = parse_int(argv, val, 1);
+        } else if (!strcmp(arg, "-d")) {
+            sim_opt.delay = parse_int(argv, val, 0);
+        } else if (!strcmp(arg, "-b")) {
+            sim_opt.bandwidth = parse_int(argv, val, 0);
+        } else if (!strcmp(arg, "-e")) {
+            sim_opt.fail_every = parse_int(argv, val, 0);
+        } else if (!strcmp(arg, "-k")) {
+            sim_opt.blank_every = parse_int(argv, val, 0);
+        } else if (!strcmp(arg, "-r") && val != NULL) {
+            sim_opt.replay = val;
+        } else if (!strcmp(arg, "-t")) {
+            sim_opt.replay_timing = true;
+            continue;
+        } else {
+            usage_error(argv, arg);
+        }
+
+        if (strcmp(arg, "-h")) {
+            i ++;
+        }
+    }
+
+    /* Initialize things */
+    signal(SIGPIPE, SIG_IGN);
+    log_init();
+    if (rand_init() != SANE_STATUS_GOOD) {
+        die("rand_init: failed");
+    }
+    ll_init(&sim_jobs);
+
+    if (sim_opt.replay != NULL) {
+        sim_replay_load(sim_opt.replay);
+        sim_replay_signals();
+    }
+
+    fd = sim_listen();
+    if (sim_opt.unix_path != NULL) {
+        printf("listening on %s\n", sim_opt.unix_path);
+    } else {
+        printf("listening on 127.0.0.1:%d\n", sim_opt.port);
+    }
+
+    if (sim_replay != NULL) {
+        const sim_replay_entry *first = sim_replay[0];
+        const char             *proto = first->action ? "wsd" : "escl";
+        char                   *url;
+
+        /* eSCL URL is the base of the first request path */
+        if (sim_opt.unix_path != NULL) {
+            const char *s = strrchr(sim_opt.unix_path, '/');
+            url = str_printf("unix://%s%s",
+                s != NULL ? s + 1 : sim_opt.unix_path, first->path);
+        } else {
+            url = str_printf("http://127.0.0.1:%d%s", sim_opt.port,
+                first->path);
+        }
+
+        if (first->action == NULL) {
+            url = str_resize(url, strrchr(url, '/') - url + 1);
+        }
+
+        printf("device URL: %s, %s\n", url, proto);
+        mem_free(url);
+    }
+
+    fflush(stdout);
+
+    /* Serve connections */
+    for (;;) {
+        pthread_t      thread;
+        pthread_attr_t attr;
+        int            conn = accept(fd, NULL, NULL);
+
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("accept: %s", strerror(errno));
+        }
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, sim_conn_thread,
+                (void*) (intptr_t) conn) != 0) {
+            close(conn);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
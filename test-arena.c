@@ -0,0 +1,190 @@
+/* Arena allocator test
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ */
+
+#include "airscan.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void
+fail (const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    putchar('\n');
+    exit(1);
+}
+
+/* Check that memory is zero-filled
+ */
+static void
+test_zero (const char *name, const char *p, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i ++) {
+        if (p[i] != 0) {
+            fail("%s: memory not zeroed at %zu", name, i);
+        }
+    }
+}
+
+/* Test arena_alloc(): alignment, zero filling and independence of
+ * allocations, both small and big, within and across the blocks
+ */
+static void
+test_alloc (void)
+{
+    static const size_t sizes[] = {1, 3, 16, 17, 100, 1000, 5000, 100000};
+    arena               *a = arena_new();
+    char                *ptrs[300];
+    size_t              lens[300];
+    int                 i, j;
+
+    for (i = 0; i < 300; i ++) {
+        size_t sz = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+
+        ptrs[i] = arena_alloc(a, sz);
+        lens[i] = sz;
+
+        if (((uintptr_t) ptrs[i]) % 16 != 0) {
+            fail("arena_alloc(%zu): %p not aligned", sz, ptrs[i]);
+        }
+
+        test_zero("arena_alloc", ptrs[i], sz);
+        memset(ptrs[i], i & 0xff, sz);
+    }
+
+    for (i = 0; i < 300; i ++) {
+        for (j = 0; j < (int) lens[i]; j ++) {
+            if ((unsigned char) ptrs[i][j] != (i & 0xff)) {
+                fail("arena_alloc: allocation #%d overwritten", i);
+            }
+        }
+    }
+
+    /* Zero-sized allocation is valid */
+    arena_alloc(a, 0);
+
+    arena_free(a);
+}
+
+/* Test arena_append()
+ */
+static void
+test_append (void)
+{
+    arena *a = arena_new();
+    char  *s, *s2, *big;
+    char  expected[8192];
+    int   i;
+
+    /* NULL is the same as empty string */
+    s = arena_append(a, NULL, "abc", 3);
+    if (strcmp(s, "abc")) {
+        fail("arena_append(NULL): \"%s\"", s);
+    }
+
+    /* The last allocation is extended in place */
+    s2 = arena_append(a, s, "def", 3);
+    if (s2 != s || strcmp(s2, "abcdef")) {
+        fail("arena_append: \"%s\" not extended in place", s2);
+    }
+
+    /* Not the last allocation is copied; the original remains */
+    arena_strdup(a, "xyz");
+    s2 = arena_append(a, s, "ghi", 3);
+    if (s2 == s || strcmp(s2, "abcdefghi") || strcmp(s, "abcdef")) {
+        fail("arena_append: \"%s\" \"%s\" not copied", s, s2);
+    }
+
+    /* Grow string across the block boundary */
+    s = NULL;
+    expected[0] = '\0';
+    for (i = 0; i < 1000; i ++) {
+        char buf[16];
+        int  n = snprintf(buf, sizeof(buf), "%d,", i);
+
+        s = arena_append(a, s, buf, n);
+        strcat(expected, buf);
+    }
+
+    if (strcmp(s, expected)) {
+        fail("arena_append: long string mismatch");
+    }
+
+    /* Big string lives in a dedicated block; appending to it must
+     * not disturb allocations, made after it */
+    big = arena_append(a, NULL, expected, 3000);
+    s = arena_strdup(a, "tail");
+    big = arena_append(a, big, "!", 1);
+    if (strlen(big) != 3001 || big[3000] != '!' ||
+        memcmp(big, expected, 3000) || strcmp(s, "tail")) {
+        fail("arena_append: big string mismatch");
+    }
+
+    /* Append of zero bytes */
+    s = arena_append(a, s, "", 0);
+    if (strcmp(s, "tail")) {
+        fail("arena_append: \"%s\" after empty append", s);
+    }
+
+    arena_free(a);
+}
+
+/* Test arena_strdup() and arena_printf()
+ */
+static void
+test_strings (void)
+{
+    arena *a = arena_new();
+    char  *s, *s2;
+    char  long_str[10000];
+
+    s = arena_strdup(a, "");
+    if (strcmp(s, "")) {
+        fail("arena_strdup(\"\"): \"%s\"", s);
+    }
+
+    s = arena_printf(a, "%s-%d-%x", "abc", 42, 255);
+    if (strcmp(s, "abc-42-ff")) {
+        fail("arena_printf: \"%s\"", s);
+    }
+
+    memset(long_str, 'x', sizeof(long_str) - 1);
+    long_str[sizeof(long_str) - 1] = '\0';
+
+    s2 = arena_printf(a, "<%s>", long_str);
+    if (strlen(s2) != sizeof(long_str) + 1 || s2[0] != '<' ||
+        s2[sizeof(long_str)] != '>' || strcmp(s, "abc-42-ff")) {
+        fail("arena_printf: long string mismatch");
+    }
+
+    s = arena_strdup(a, long_str);
+    if (strcmp(s, long_str)) {
+        fail("arena_strdup: long string mismatch");
+    }
+
+    arena_free(a);
+    arena_free(NULL);
+}
+
+/* The main function
+ */
+int
+main (void)
+{
+    test_alloc();
+    test_append();
+    test_strings();
+
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
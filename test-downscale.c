@@ -0,0 +1,159 @@
+/* Area-average downscaler test
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ */
+
+#include "airscan.h"
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Test image dimensions
+ */
+#define TEST_WIDTH      101
+#define TEST_HEIGHT     59
+
+static void
+fail (const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    putchar('\n');
+    exit(1);
+}
+
+/* Get pixel value of the test image. If flat >= 0, image is
+ * filled with that value
+ */
+static uint8_t
+test_pixel (int x, int y, int c, int flat)
+{
+    if (flat >= 0) {
+        return (uint8_t) flat;
+    }
+
+    return (uint8_t) (x * 5 + y * 11 + c * 83 + ((x ^ y) & 3) * 29);
+}
+
+/* Get overlap of input pixel i with output pixel o in one
+ * dimension. Input pixel covers [i*num, (i+1)*num), output
+ * pixel covers [o*den, (o+1)*den)
+ */
+static double
+test_overlap (int i, int o, int num, int den)
+{
+    long long beg = math_max((long long) i * num, (long long) o * den);
+    long long end = math_min((long long) (i + 1) * num,
+        (long long) (o + 1) * den);
+
+    return end > beg ? (double) (end - beg) : 0.0;
+}
+
+/* Compute reference value of the output pixel
+ */
+static double
+test_reference (int ox, int oy, int c, int num, int den, int flat)
+{
+    double sum = 0;
+    int    x, y;
+
+    for (y = oy * den / num; y <= (oy + 1) * den / num; y ++) {
+        double wy = y < TEST_HEIGHT ? test_overlap(y, oy, num, den) : 0;
+
+        for (x = ox * den / num; x <= (ox + 1) * den / num; x ++) {
+            double wx = x < TEST_WIDTH ? test_overlap(x, ox, num, den) : 0;
+
+            sum += wx * wy * test_pixel(x, y, c, flat);
+        }
+    }
+
+    return sum / ((double) den * den);
+}
+
+/* Downscale the test image by num/den and compare the result
+ * with the reference
+ */
+static void
+test_downscale (int bpp, int num, int den, int flat)
+{
+    filter_downscale *ds = filter_downscale_new(TEST_WIDTH, bpp, num, den);
+    int              owid = filter_downscale_wid(ds);
+    int              ohei = filter_downscale_lines(ds, TEST_HEIGHT);
+    uint8_t          *in = mem_new(uint8_t, TEST_WIDTH * bpp);
+    uint8_t          *out = mem_new(uint8_t, owid * bpp);
+    int              x, y, oy = 0;
+
+    if (owid != TEST_WIDTH * num / den) {
+        fail("%d/%d bpp=%d: width %d, expected %d", num, den, bpp,
+            owid, TEST_WIDTH * num / den);
+    }
+
+    for (y = 0; y < TEST_HEIGHT; y ++) {
+        for (x = 0; x < TEST_WIDTH * bpp; x ++) {
+            in[x] = test_pixel(x / bpp, y, x % bpp, flat);
+        }
+
+        if (!filter_downscale_push(ds, in, out)) {
+            continue;
+        }
+
+        if (oy >= ohei) {
+            fail("%d/%d bpp=%d: extra output line %d", num, den, bpp, oy);
+        }
+
+        for (x = 0; x < owid * bpp; x ++) {
+            double ref = test_reference(x / bpp, oy, x % bpp, num, den, flat);
+
+            if (flat >= 0 ? out[x] != flat : fabs(out[x] - ref) > 1.0) {
+                fail("%d/%d bpp=%d flat=%d: pixel %d,%d: %d, expected %.2f",
+                    num, den, bpp, flat, x / bpp, oy, out[x], ref);
+            }
+        }
+
+        oy ++;
+    }
+
+    if (oy != ohei) {
+        fail("%d/%d bpp=%d: %d output lines, expected %d", num, den, bpp,
+            oy, ohei);
+    }
+
+    mem_free(in);
+    mem_free(out);
+    filter_downscale_free(ds);
+}
+
+/* The main function
+ */
+int
+main (void)
+{
+    static const int ratios[][2] = {
+        {1, 2}, {1, 3}, {1, 4}, {1, 8},         /* Integer factors */
+        {2, 3}, {3, 4}, {3, 8}, {5, 6},         /* Fractional */
+        {75, 300}, {100, 300}, {150, 200},      /* Reducible */
+        {200, 300}, {240, 600}, {300, 400}
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(ratios) / sizeof(ratios[0]); i ++) {
+        int num = ratios[i][0], den = ratios[i][1];
+
+        test_downscale(1, num, den, -1);
+        test_downscale(3, num, den, -1);
+
+        /* Flat images must remain exactly flat */
+        test_downscale(1, num, den, 0);
+        test_downscale(3, num, den, 255);
+        test_downscale(3, num, den, 128);
+    }
+
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
@@ -0,0 +1,179 @@
+/* Page statistics (blank page detection) test
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ */
+
+#include "airscan.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Test page dimensions
+ */
+#define TEST_WIDTH      200
+#define TEST_HEIGHT     100
+
+/* Test page: background with a single solid block
+ */
+typedef struct {
+    int     bpp;            /* Bytes per pixel */
+    uint8_t bg[3];          /* Background color */
+    uint8_t fg[3];          /* Block color */
+    int     x, y, w, h;     /* Block position and size */
+    int     noise;          /* Background noise amplitude */
+} test_page;
+
+static void
+fail (const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    putchar('\n');
+    exit(1);
+}
+
+/* Render line of the test page
+ */
+static void
+test_page_line (const test_page *page, int y, uint8_t *line)
+{
+    int x, c;
+
+    for (x = 0; x < TEST_WIDTH; x ++) {
+        bool in = x >= page->x && x < page->x + page->w &&
+                  y >= page->y && y < page->y + page->h;
+        int  n = page->noise ? ((x * 7 + y * 13) % (2 * page->noise + 1)) -
+                               page->noise : 0;
+
+        for (c = 0; c < page->bpp; c ++) {
+            int v = in ? page->fg[c] : page->bg[c] + n;
+            line[x * page->bpp + c] = (uint8_t) math_bound(v, 0, 255);
+        }
+    }
+}
+
+/* Compute statistics of the first `lines' lines of the test page
+ */
+static void
+test_page_stat (const test_page *page, int lines,
+        filter_pagestat_result *res)
+{
+    filter_pagestat *ps = filter_pagestat_new(TEST_WIDTH, page->bpp);
+    uint8_t         *line = mem_new(uint8_t, TEST_WIDTH * page->bpp);
+    int             y;
+
+    for (y = 0; y < lines; y ++) {
+        test_page_line(page, y, line);
+        filter_pagestat_push(ps, line);
+    }
+
+    filter_pagestat_get(ps, res);
+
+    mem_free(line);
+    filter_pagestat_free(ps);
+}
+
+/* Check statistics of the test page. If background is negative,
+ * it is not checked
+ */
+static void
+test_check (const char *name, const test_page *page, int lines,
+        int background, int ink, int edges)
+{
+    filter_pagestat_result res;
+
+    test_page_stat(page, lines, &res);
+
+    if (background < 0) {
+        background = res.background;
+    }
+
+    if (res.background != background || res.ink != ink ||
+        res.edges != edges) {
+        fail("%s: background=%d ink=%d edges=%d, expected %d %d %d", name,
+            res.background, res.ink, res.edges, background, ink, edges);
+    }
+}
+
+/* The main function
+ */
+int
+main (void)
+{
+    test_page page;
+
+    /* Blank white page */
+    memset(&page, 0, sizeof(page));
+    page.bpp = 1;
+    page.bg[0] = 255;
+    test_check("white", &page, TEST_HEIGHT, 255, 0, 0);
+
+    /* Nothing pushed yet */
+    test_check("empty", &page, 0, 0, 0, 0);
+
+    /* Paper texture is neither ink nor edges */
+    page.bg[0] = 200;
+    page.noise = 10;
+    test_check("noise", &page, TEST_HEIGHT, -1, 0, 0);
+    page.noise = 0;
+
+    /* Black 20x10 block on white covers 1% of the page. Edges are
+     * its top row and left column (29 pixels), and the pixels right
+     * and below it (30 pixels), 0.295% in total
+     */
+    page.bg[0] = 255;
+    page.fg[0] = 0;
+    page.x = 50;
+    page.y = 40;
+    page.w = 20;
+    page.h = 10;
+    test_check("gray block", &page, TEST_HEIGHT, 255, 100, 30);
+
+    /* Statistics accumulated so far: 45 lines, 5 of them with
+     * the block: 100 block pixels and 20 + 5 - 1 + 5 edges
+     */
+    test_check("gray partial", &page, 45, 255, 111, 32);
+
+    /* Same in RGB: pure red is dark enough to be ink */
+    page.bpp = 3;
+    page.bg[0] = page.bg[1] = page.bg[2] = 255;
+    page.fg[0] = 255;
+    page.fg[1] = page.fg[2] = 0;
+    test_check("rgb block", &page, TEST_HEIGHT, 255, 100, 30);
+
+    /* Light block differs from the background by exactly the
+     * edge threshold: neither ink nor edges
+     */
+    page.bpp = 1;
+    page.bg[0] = 255;
+    page.fg[0] = 255 - 48;
+    test_check("light block", &page, TEST_HEIGHT, 255, 0, 0);
+
+    /* Slightly darker: edges, but not ink yet */
+    page.fg[0] = 255 - 49;
+    test_check("edge block", &page, TEST_HEIGHT, 255, 0, 30);
+
+    page.fg[0] = 255 - 65;
+    test_check("ink block", &page, TEST_HEIGHT, 255, 100, 30);
+
+    /* Inverted page: white block on black */
+    page.bg[0] = 0;
+    page.fg[0] = 255;
+    test_check("inverted", &page, TEST_HEIGHT, 0, 100, 30);
+
+    /* Block covering most of the page becomes the background,
+     * and the page margins become ink
+     */
+    page.x = page.y = 0;
+    page.w = 150;
+    page.h = 100;
+    test_check("dark page", &page, TEST_HEIGHT, 255, 2500, 50);
+
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
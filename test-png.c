@@ -0,0 +1,287 @@
+/* PNG decoder test
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ */
+
+#include "airscan.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+/* Test image dimensions
+ */
+#define TEST_WIDTH      37
+#define TEST_HEIGHT     23
+
+/* Test PNG image, built in memory
+ */
+typedef struct {
+    uint8_t     *data;      /* Image data */
+    size_t      size;       /* Image size */
+} test_png;
+
+static void
+fail (const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    putchar('\n');
+    exit(1);
+}
+
+/* Get pixel value of the test image
+ */
+static uint8_t
+test_pixel (int x, int y, int c)
+{
+    return (uint8_t) (x * 7 + y * 13 + c * 71 + ((x ^ y) & 5) * 17);
+}
+
+/* Append bytes to the test image
+ */
+static void
+test_png_append (test_png *png, const void *data, size_t size)
+{
+    png->data = mem_resize(png->data, png->size + size, 0);
+    memcpy(png->data + png->size, data, size);
+    png->size += size;
+}
+
+/* Append big-endian 32-bit value to the test image
+ */
+static void
+test_png_append_be32 (test_png *png, uint32_t v)
+{
+    uint8_t b[4] = {v >> 24, v >> 16, v >> 8, v};
+    test_png_append(png, b, sizeof(b));
+}
+
+/* Append chunk to the test image
+ */
+static void
+test_png_chunk (test_png *png, const char *type, const void *data,
+        size_t size, bool bad_crc)
+{
+    uLong crc = crc32(0L, (const Bytef*) type, 4);
+
+    crc = crc32(crc, data, size);
+    if (bad_crc) {
+        crc ^= 1;
+    }
+
+    test_png_append_be32(png, size);
+    test_png_append(png, type, 4);
+    test_png_append(png, data, size);
+    test_png_append_be32(png, crc);
+}
+
+/* Build the test image
+ *
+ * Rows use all PNG filter types in turn. Compressed data is split
+ * into IDAT chunks of idat_size bytes; if empty is true, zero-length
+ * IDAT chunks are inserted before each of them. If bad_crc is true,
+ * CRC of the second IDAT chunk is damaged. If truncate is true,
+ * zlib stream is cut before its trailer
+ */
+static test_png
+test_png_build (int bpp, size_t idat_size, bool empty, bool bad_crc,
+        bool truncate)
+{
+    static const uint8_t sig[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    test_png png = {mem_new(uint8_t, 0), 0};
+    uint8_t  ihdr[13];
+    size_t   stride = TEST_WIDTH * bpp;
+    uint8_t  *raw = mem_new(uint8_t, (stride + 1) * TEST_HEIGHT);
+    uint8_t  *prev = mem_new(uint8_t, stride);
+    uint8_t  *cur = mem_new(uint8_t, stride);
+    uLongf   zsize = compressBound((stride + 1) * TEST_HEIGHT);
+    uint8_t  *z = mem_new(uint8_t, zsize);
+    size_t   off;
+    int      x, y, cnt = 0;
+
+    /* Filter rows */
+    for (y = 0; y < TEST_HEIGHT; y ++) {
+        int     filter = y % 5;
+        uint8_t *out = raw + y * (stride + 1);
+
+        for (x = 0; x < (int) stride; x ++) {
+            cur[x] = test_pixel(x / bpp, y, x % bpp);
+        }
+
+        out[0] = filter;
+        for (x = 0; x < (int) stride; x ++) {
+            int a = x >= bpp ? cur[x - bpp] : 0;
+            int b = prev[x];
+            int c = x >= bpp ? prev[x - bpp] : 0;
+            int p = a + b - c, pa = abs(p - a), pb = abs(p - b),
+                pc = abs(p - c);
+            int pred = 0;
+
+            switch (filter) {
+            case 1: pred = a; break;
+            case 2: pred = b; break;
+            case 3: pred = (a + b) / 2; break;
+            case 4: pred = pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+            }
+
+            out[x + 1] = (uint8_t) (cur[x] - pred);
+        }
+
+        memcpy(prev, cur, stride);
+    }
+
+    if (compress(z, &zsize, raw, (stride + 1) * TEST_HEIGHT) != Z_OK) {
+        fail("compress() failed");
+    }
+
+    if (truncate) {
+        zsize -= 4;
+    }
+
+    /* Build the image */
+    test_png_append(&png, sig, sizeof(sig));
+
+    ihdr[0] = ihdr[1] = ihdr[2] = 0;
+    ihdr[3] = TEST_WIDTH;
+    ihdr[4] = ihdr[5] = ihdr[6] = 0;
+    ihdr[7] = TEST_HEIGHT;
+    ihdr[8] = 8;
+    ihdr[9] = bpp == 3 ? 2 : 0;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    test_png_chunk(&png, "IHDR", ihdr, sizeof(ihdr), false);
+
+    for (off = 0; off < zsize; off += idat_size) {
+        size_t sz = math_min(idat_size, zsize - off);
+
+        if (empty) {
+            test_png_chunk(&png, "IDAT", "", 0, false);
+        }
+
+        test_png_chunk(&png, "IDAT", z + off, sz, bad_crc && cnt == 1);
+        cnt ++;
+    }
+
+    test_png_chunk(&png, "IEND", "", 0, false);
+
+    mem_free(raw);
+    mem_free(prev);
+    mem_free(cur);
+    mem_free(z);
+
+    return png;
+}
+
+/* Decode the test image and compare it against the expected pixels
+ *
+ * If win is not NULL, only the window is decoded. Returns decoding
+ * error, if any
+ */
+static error
+test_png_decode (const char *name, test_png *png, int bpp, image_window *win)
+{
+    image_decoder   *decoder = image_decoder_png_new();
+    SANE_Parameters params;
+    image_window    full = {0, 0, TEST_WIDTH, TEST_HEIGHT};
+    uint8_t         *line;
+    error           err;
+    int             x, y;
+
+    err = image_decoder_begin(decoder, png->data, png->size);
+    if (err != NULL) {
+        goto DONE;
+    }
+
+    image_decoder_get_params(decoder, &params);
+    if (params.pixels_per_line != TEST_WIDTH || params.lines != TEST_HEIGHT) {
+        fail("%s: wrong image size %dx%d", name,
+            params.pixels_per_line, params.lines);
+    }
+
+    if (win == NULL) {
+        win = &full;
+    }
+
+    err = image_decoder_set_window(decoder, win);
+    if (err != NULL) {
+        goto DONE;
+    }
+
+    line = mem_new(uint8_t, TEST_WIDTH * bpp);
+    for (y = 0; y < win->hei && err == NULL; y ++) {
+        err = image_decoder_read_line(decoder, line);
+        for (x = 0; x < win->wid * bpp && err == NULL; x ++) {
+            uint8_t expected = test_pixel(win->x_off + x / bpp,
+                win->y_off + y, x % bpp);
+
+            if (line[x] != expected) {
+                fail("%s: pixel mismatch at %d,%d", name,
+                    win->x_off + x / bpp, win->y_off + y);
+            }
+        }
+    }
+    mem_free(line);
+
+DONE:
+    image_decoder_free(decoder);
+    return err;
+}
+
+/* Test that the image decodes correctly
+ */
+static void
+test_good (const char *name, int bpp, size_t idat_size, bool empty,
+        image_window *win)
+{
+    test_png png = test_png_build(bpp, idat_size, empty, false, false);
+    error    err = test_png_decode(name, &png, bpp, win);
+
+    if (err != NULL) {
+        fail("%s: %s", name, ESTRING(err));
+    }
+
+    mem_free(png.data);
+}
+
+/* Test that the damaged image is rejected
+ */
+static void
+test_bad (const char *name, int bpp, bool bad_crc, bool truncate)
+{
+    test_png png = test_png_build(bpp, 64, false, bad_crc, truncate);
+    error    err = test_png_decode(name, &png, bpp, NULL);
+
+    if (err == NULL) {
+        fail("%s: damaged image accepted", name);
+    }
+
+    mem_free(png.data);
+}
+
+/* The main function
+ */
+int
+main (void)
+{
+    image_window win = {5, 3, 17, 11};
+
+    test_good("rgb",            3, 65536, false, NULL);
+    test_good("gray",           1, 65536, false, NULL);
+    test_good("rgb split",      3, 7,     false, NULL);
+    test_good("rgb empty IDAT", 3, 7,     true,  NULL);
+    test_good("gray empty IDAT",1, 1,     true,  NULL);
+    test_good("rgb window",     3, 64,    true,  &win);
+
+    test_bad("rgb bad CRC",     3, true,  false);
+    test_bad("rgb truncated",   3, false, true);
+    test_bad("gray truncated",  1, false, true);
+
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
@@ -0,0 +1,354 @@
+/* Scan regions test: parsing of the regions option and automatic
+ * regions detection
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ */
+
+#include "airscan.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Test image dimensions and detection parameters
+ */
+#define TEST_WIDTH      400
+#define TEST_HEIGHT     300
+#define TEST_CELL       10
+#define TEST_MIN_CELLS  3
+
+static void
+fail (const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    putchar('\n');
+    exit(1);
+}
+
+/******************** Option parsing ********************/
+/* Create device options for the A4 platen
+ */
+static void
+test_devopt_init (devopt *opt)
+{
+    devcaps_source *src = devcaps_source_new();
+
+    src->flags = DEVCAPS_SOURCE_RES_DISCRETE;
+    src->colormodes = (1 << ID_COLORMODE_COLOR) |
+                      (1 << ID_COLORMODE_GRAYSCALE);
+    src->formats = 1 << ID_FORMAT_PNG;
+    src->resolutions = sane_word_array_append(src->resolutions, 150);
+    src->resolutions = sane_word_array_append(src->resolutions, 300);
+    src->max_wid_px = 2550;
+    src->max_hei_px = 3508;
+    src->win_x_range_mm.max = SANE_FIX(215.9);
+    src->win_y_range_mm.max = SANE_FIX(297);
+
+    devopt_init(opt);
+    opt->caps.src[ID_SOURCE_PLATEN] = src;
+    devopt_set_defaults(opt);
+}
+
+/* Set the regions option
+ */
+static SANE_Status
+test_set (devopt *opt, const char *value)
+{
+    char buf[DEVOPT_REGIONS_LEN * 2];
+
+    strcpy(buf, value);
+    return devopt_set_option(opt, OPT_SCAN_REGIONS, buf, NULL);
+}
+
+/* Test that the regions option is accepted and parsed as expected.
+ * Expected regions are given as 4 doubles per region, in mm
+ */
+static void
+test_good (devopt *opt, const char *value, bool is_auto, int num, ...)
+{
+    char        buf[DEVOPT_REGIONS_LEN];
+    SANE_Status status = test_set(opt, value);
+    va_list     ap;
+    int         i;
+
+    if (status != SANE_STATUS_GOOD) {
+        fail("regions \"%s\": %s", value, sane_strstatus(status));
+    }
+
+    if (opt->regions_auto != is_auto || opt->regions_num != num) {
+        fail("regions \"%s\": auto=%d num=%d, expected %d %d", value,
+            opt->regions_auto, opt->regions_num, is_auto, num);
+    }
+
+    va_start(ap, num);
+    for (i = 0; i < num; i ++) {
+        const devopt_region *r = &opt->regions[i];
+        SANE_Fixed          v[4] = {r->tl_x, r->tl_y, r->br_x, r->br_y};
+        int                 j;
+
+        for (j = 0; j < 4; j ++) {
+            SANE_Fixed expected = SANE_FIX(va_arg(ap, double));
+
+            if (v[j] != expected) {
+                fail("regions \"%s\": region %d value %d: %g, expected %g",
+                    value, i, j, SANE_UNFIX(v[j]), SANE_UNFIX(expected));
+            }
+        }
+    }
+    va_end(ap);
+
+    devopt_get_option(opt, OPT_SCAN_REGIONS, buf);
+    if (strcmp(buf, value)) {
+        fail("regions \"%s\": read back as \"%s\"", value, buf);
+    }
+}
+
+/* Test that the regions option is rejected and the previous
+ * value remains in effect
+ */
+static void
+test_bad (devopt *opt, const char *value)
+{
+    char        prev[DEVOPT_REGIONS_LEN], buf[DEVOPT_REGIONS_LEN];
+    int         num = opt->regions_num;
+    SANE_Status status;
+
+    devopt_get_option(opt, OPT_SCAN_REGIONS, prev);
+    status = test_set(opt, value);
+
+    if (status != SANE_STATUS_INVAL) {
+        fail("regions \"%s\": %s, expected %s", value,
+            sane_strstatus(status), sane_strstatus(SANE_STATUS_INVAL));
+    }
+
+    devopt_get_option(opt, OPT_SCAN_REGIONS, buf);
+    if (strcmp(buf, prev) || opt->regions_num != num) {
+        fail("regions \"%s\": previous value \"%s\" lost", value, prev);
+    }
+}
+
+/* Test parsing of the regions option
+ */
+static void
+test_parse (void)
+{
+    devopt opt;
+    char   long_value[DEVOPT_REGIONS_LEN + 16];
+    size_t i;
+
+    static const char *bad[] = {
+        "10,20,30",                     /* Too few numbers */
+        "10,20,30,40,50",               /* Too many numbers */
+        "10;20;30;40",                  /* Wrong separators */
+        "10,20,30,40;;",                /* Empty region */
+        ";10,20,30,40",
+        ",10,20,30,40",
+        "10,20,30,40x",                 /* Garbage after number */
+        "a,b,c,d",                      /* Not a numbers */
+        "10,,30,40",
+        "-1,0,10,10",                   /* Negative */
+        "30,0,10,10",                   /* Empty or inverted */
+        "0,10,10,10",
+        "0,0,300,10",                   /* Outside of the platen */
+        "0,0,10,400",
+        "nan,0,10,10",                  /* Not finite */
+        "0,0,inf,10",
+        "1e99,0,10,10",                 /* Doesn't fit SANE_Fixed */
+        "0,0,10,1e10",
+        "auto;0,0,10,10",
+        "1,1,2,2;1,1,2,2;1,1,2,2;1,1,2,2;"     /* Too many regions */
+            "1,1,2,2;1,1,2,2;1,1,2,2;1,1,2,2;1,1,2,2",
+    };
+
+    test_devopt_init(&opt);
+
+    test_good(&opt, "", false, 0);
+    test_good(&opt, "auto", true, 0);
+    test_good(&opt, "AUTO", true, 0);
+    test_good(&opt, "10,20,30,40", false, 1, 10.0, 20.0, 30.0, 40.0);
+    test_good(&opt, " 10 , 20 ,30.5, 40 ", false, 1, 10.0, 20.0, 30.5, 40.0);
+    test_good(&opt, "0,0,100,50;100,150.25,215.9,297", false, 2,
+        0.0, 0.0, 100.0, 50.0, 100.0, 150.25, 215.9, 297.0);
+    test_good(&opt, "10,20,30,40;", false, 1, 10.0, 20.0, 30.0, 40.0);
+    test_good(&opt, "1,1,2,2;1,1,2,2;1,1,2,2;1,1,2,2;"
+        "1,1,2,2;1,1,2,2;1,1,2,2;1,1,2,2", false, DEVOPT_REGIONS_MAX,
+        1.0, 1.0, 2.0, 2.0, 1.0, 1.0, 2.0, 2.0,
+        1.0, 1.0, 2.0, 2.0, 1.0, 1.0, 2.0, 2.0,
+        1.0, 1.0, 2.0, 2.0, 1.0, 1.0, 2.0, 2.0,
+        1.0, 1.0, 2.0, 2.0, 1.0, 1.0, 2.0, 2.0);
+
+    test_good(&opt, "10,20,30,40", false, 1, 10.0, 20.0, 30.0, 40.0);
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i ++) {
+        test_bad(&opt, bad[i]);
+    }
+
+    /* Too long value */
+    memset(long_value, ' ', sizeof(long_value));
+    strcpy(long_value + DEVOPT_REGIONS_LEN - 4, "1,1,2,2");
+    test_bad(&opt, long_value);
+
+    devopt_cleanup(&opt);
+}
+
+/******************** Regions detection ********************/
+/* Test image
+ */
+typedef struct {
+    int     bpp;        /* Bytes per pixel */
+    uint8_t bg;         /* Background luminance */
+    uint8_t *pixels;    /* Image pixels */
+} test_image;
+
+/* Create test image, filled with the background and slight noise
+ */
+static void
+test_image_init (test_image *img, int bpp, uint8_t bg)
+{
+    int i;
+
+    img->bpp = bpp;
+    img->bg = bg;
+    img->pixels = mem_new(uint8_t, TEST_WIDTH * TEST_HEIGHT * bpp);
+
+    for (i = 0; i < TEST_WIDTH * TEST_HEIGHT * bpp; i ++) {
+        int noise = (i * 7) % 5 - 2;
+        img->pixels[i] = (uint8_t) math_bound(bg + noise, 0, 255);
+    }
+}
+
+/* Draw object on the test image. Objects are textured, like
+ * photos, so they never dominate the luminance histogram
+ */
+static void
+test_image_object (test_image *img, int x, int y, int w, int h, uint8_t v)
+{
+    int i, j;
+
+    for (j = y; j < y + h; j ++) {
+        for (i = x; i < x + w; i ++) {
+            uint8_t *px = img->pixels + (j * TEST_WIDTH + i) * img->bpp;
+
+            memset(px, v + (i + j) % 32, img->bpp);
+        }
+    }
+}
+
+/* Check that the detected region matches the object, drawn at the
+ * given position, up to the cell size
+ */
+static void
+test_region_check (const char *name, const image_window *r, int n,
+        int x, int y, int w, int h)
+{
+    if (r->x_off > x || r->x_off + TEST_CELL <= x ||
+        r->y_off > y || r->y_off + TEST_CELL <= y ||
+        r->x_off + r->wid < x + w || r->x_off + r->wid >= x + w + TEST_CELL ||
+        r->y_off + r->hei < y + h || r->y_off + r->hei >= y + h + TEST_CELL) {
+        fail("%s: region %d is %d,%d %dx%d, expected %d,%d %dx%d", name, n,
+            r->x_off, r->y_off, r->wid, r->hei, x, y, w, h);
+    }
+}
+
+/* Run detection on the test image
+ */
+static int
+test_detect (const char *name, test_image *img, image_window *regions,
+        int max, int expected)
+{
+    int n = filter_regions_detect(img->pixels, TEST_WIDTH, TEST_HEIGHT,
+        img->bpp, TEST_CELL, TEST_MIN_CELLS, regions, max);
+
+    if (n != expected) {
+        fail("%s: %d regions found, expected %d", name, n, expected);
+    }
+
+    return n;
+}
+
+/* Test regions detection
+ */
+static void
+test_detection (void)
+{
+    test_image   img;
+    image_window r[DEVOPT_REGIONS_MAX];
+    int          bpp;
+
+    for (bpp = 1; bpp <= 3; bpp += 2) {
+        const char *name = bpp == 1 ? "gray" : "rgb";
+
+        /* Blank page */
+        test_image_init(&img, bpp, 240);
+        test_detect(name, &img, r, DEVOPT_REGIONS_MAX, 0);
+
+        /* Three photos, returned in the reading order, and
+         * a speck, which is ignored */
+        test_image_object(&img, 220, 30, 150, 100, 40);
+        test_image_object(&img, 15, 35, 120, 90, 90);
+        test_image_object(&img, 40, 180, 300, 95, 10);
+        test_image_object(&img, 370, 285, 12, 12, 0);
+
+        test_detect(name, &img, r, DEVOPT_REGIONS_MAX, 3);
+        test_region_check(name, &r[0], 0, 15, 35, 120, 90);
+        test_region_check(name, &r[1], 1, 220, 30, 150, 100);
+        test_region_check(name, &r[2], 2, 40, 180, 300, 95);
+
+        /* Count of regions is limited */
+        test_detect(name, &img, r, 2, 2);
+
+        /* Objects, separated by less than a cell, are merged */
+        test_image_object(&img, 140, 40, 70, 80, 60);
+        test_detect(name, &img, r, DEVOPT_REGIONS_MAX, 2);
+        test_region_check(name, &r[0], 0, 15, 30, 355, 100);
+
+        mem_free(img.pixels);
+
+        /* Light objects on the dark background. Objects touch
+         * the image edges, which are not multiple of cells */
+        test_image_init(&img, bpp, 20);
+        test_image_object(&img, 0, 0, 100, 100, 200);
+        test_image_object(&img, 305, 205, 95, 95, 180);
+
+        test_detect(name, &img, r, DEVOPT_REGIONS_MAX, 2);
+        test_region_check(name, &r[0], 0, 0, 0, 100, 100);
+        test_region_check(name, &r[1], 1, 305, 205, 95, 95);
+
+        mem_free(img.pixels);
+    }
+
+    /* Degenerate images: blank, smaller than a cell, and empty */
+    test_image_init(&img, 1, 255);
+    if (filter_regions_detect(img.pixels, 5, 3, 1, TEST_CELL, 1,
+            r, DEVOPT_REGIONS_MAX) != 0 ||
+        filter_regions_detect(img.pixels, 0, 0, 1, TEST_CELL, 1,
+            r, DEVOPT_REGIONS_MAX) != 0) {
+        fail("degenerate image: regions found");
+    }
+
+    /* Single dark pixel of 1x2 image fills enough of the cell */
+    img.pixels[0] = 0;
+    if (filter_regions_detect(img.pixels, 1, 2, 1, TEST_CELL, 1,
+            r, DEVOPT_REGIONS_MAX) != 1 ||
+        r[0].x_off != 0 || r[0].y_off != 0 ||
+        r[0].wid != 1 || r[0].hei != 2) {
+        fail("1x2 image: wrong region");
+    }
+    mem_free(img.pixels);
+}
+
+/* The main function
+ */
+int
+main (void)
+{
+    test_parse();
+    test_detection();
+
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
@@ -0,0 +1,230 @@
+/* Worker pool test
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ */
+
+#include "airscan.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Count of tasks in the batch test
+ */
+#define TEST_TASKS      64
+
+/* Test task data
+ */
+typedef struct {
+    worker_task task;       /* The task */
+    int         input;      /* Task input */
+    uint64_t    output;     /* Task output */
+    pthread_t   thread;     /* Thread that executed the task */
+    int         runs;       /* Count of executions */
+    volatile int *gate;     /* If not NULL, wait until *gate != 0 */
+    volatile int started;   /* Task started */
+} test_task;
+
+static void
+fail (const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    putchar('\n');
+    exit(1);
+}
+
+/* Task function: computes something CPU-bound
+ */
+static void
+test_task_func (void *data)
+{
+    test_task *t = data;
+    uint64_t  v = (uint64_t) t->input;
+    int       i;
+
+    __atomic_store_n(&t->started, 1, __ATOMIC_SEQ_CST);
+    t->thread = pthread_self();
+    t->runs ++;
+
+    while (t->gate != NULL && !__atomic_load_n(t->gate, __ATOMIC_SEQ_CST)) {
+        usleep(1000);
+    }
+
+    for (i = 0; i < 10000; i ++) {
+        v = v * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+
+    t->output = v;
+}
+
+/* Compute the expected task output
+ */
+static uint64_t
+test_task_expected (int input)
+{
+    test_task t;
+
+    memset(&t, 0, sizeof(t));
+    t.input = input;
+    test_task_func(&t);
+
+    return t.output;
+}
+
+/* Initialize the test task
+ */
+static void
+test_task_init (test_task *t, int input, volatile int *gate)
+{
+    memset(t, 0, sizeof(*t));
+    t->task.func = test_task_func;
+    t->task.data = t;
+    t->input = input;
+    t->gate = gate;
+}
+
+/* Wait until task is started by a worker. Fails on timeout
+ */
+static void
+test_task_wait_started (const char *name, test_task *t)
+{
+    int i;
+
+    for (i = 0; i < 5000; i ++) {
+        if (__atomic_load_n(&t->started, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+        usleep(1000);
+    }
+
+    fail("%s: task not started by worker", name);
+}
+
+/* Submit batch of tasks and wait for all of them
+ */
+static void
+test_batch (int workers)
+{
+    static test_task tasks[TEST_TASKS];
+    int              i;
+
+    for (i = 0; i < TEST_TASKS; i ++) {
+        test_task_init(&tasks[i], i, NULL);
+        worker_task_submit(&tasks[i].task);
+    }
+
+    for (i = 0; i < TEST_TASKS; i ++) {
+        worker_task_wait(&tasks[i].task);
+    }
+
+    for (i = 0; i < TEST_TASKS; i ++) {
+        if (tasks[i].runs != 1) {
+            fail("batch (%d workers): task %d executed %d times",
+                workers, i, tasks[i].runs);
+        }
+
+        if (tasks[i].output != test_task_expected(i)) {
+            fail("batch (%d workers): task %d wrong output", workers, i);
+        }
+
+        /* Wait for completed task returns immediately */
+        worker_task_wait(&tasks[i].task);
+    }
+}
+
+/* Without workers, tasks are executed inline by submitter
+ */
+static void
+test_inline (void)
+{
+    test_task t;
+
+    test_task_init(&t, 1, NULL);
+    worker_task_submit(&t.task);
+
+    if (t.runs != 1 || !pthread_equal(t.thread, pthread_self())) {
+        fail("inline: task not executed by submitter");
+    }
+
+    worker_task_wait(&t.task);
+    if (t.runs != 1) {
+        fail("inline: task executed %d times", t.runs);
+    }
+}
+
+/* With a single busy worker, the queued task is executed
+ * by the waiter, and the running task is waited for
+ */
+static void
+test_steal (void)
+{
+    volatile int gate = 0;
+    test_task    busy, queued;
+
+    test_task_init(&busy, 1, &gate);
+    test_task_init(&queued, 2, NULL);
+
+    worker_task_submit(&busy.task);
+    test_task_wait_started("steal", &busy);
+
+    worker_task_submit(&queued.task);
+    worker_task_wait(&queued.task);
+
+    if (queued.runs != 1 || !pthread_equal(queued.thread, pthread_self())) {
+        fail("steal: queued task not executed by waiter");
+    }
+
+    if (busy.output != 0) {
+        fail("steal: busy task finished too early");
+    }
+
+    __atomic_store_n(&gate, 1, __ATOMIC_SEQ_CST);
+    worker_task_wait(&busy.task);
+
+    if (busy.runs != 1 || pthread_equal(busy.thread, pthread_self()) ||
+        busy.output != test_task_expected(1)) {
+        fail("steal: busy task not executed by worker");
+    }
+}
+
+/* The main function
+ */
+int
+main (void)
+{
+    int workers;
+
+    /* Without workers */
+    workers_init_count(0);
+    if (workers_count() != 0) {
+        fail("workers_count: %d, expected 0", workers_count());
+    }
+    test_inline();
+    test_batch(0);
+    workers_cleanup();
+
+    /* Single worker */
+    workers_init_count(1);
+    test_steal();
+    test_batch(1);
+    workers_cleanup();
+
+    /* Several workers; pool must survive restart */
+    for (workers = 2; workers <= 4; workers ++) {
+        workers_init_count(workers);
+        if (workers_count() != workers) {
+            fail("workers_count: %d, expected %d", workers_count(), workers);
+        }
+        test_batch(workers);
+        workers_cleanup();
+    }
+
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */